@@ -35,6 +35,10 @@
 #ifdef _WIN32
 #define _CRT_SECURE_NO_WARNINGS
 #define _CRT_NONSTDC_NO_WARNINGS
+#elif !defined(_GNU_SOURCE)
+// glibc only declares POSIX_SPAWN_SETSID for _GNU_SOURCE; this has to come before the first
+// system header, and without it josh spawns pty children with fork() instead
+#define _GNU_SOURCE
 #endif
 
 #include <stdlib.h>
@@ -43,6 +47,7 @@
 #include <stdio.h>
 #include <assert.h>
 #include <time.h>
+#include <stdint.h>
 
 #define JB_IS_MACOS   0
 #define JB_IS_LINUX   0
@@ -81,15 +86,77 @@
 #define JB_DEFAULT_ARCH JB_ENUM(ARM64)
 #endif
 
-// Builds and runs a build.josh
+// Builds and runs a build.josh; if a `josh daemon` serves it, the build runs there instead
 void josh_build(const char *path, const char *exec_name, char *args[]);
 
+// Builds the runner for a build.josh and turns it into a daemon that serves josh_build()
+// for the same workspace from memory: the stat cache and build databases stay loaded
+// between builds and inotify keeps them current. Exits once the build file changes.
+// Never returns. Linux only.
+void josh_daemon(const char *path, const char *exec_name);
+
+// Builds a build.josh with args, then rebuilds whenever a source or header the last build
+// used changes. Bursts of changes are debounced ($JOSH_WATCH_DEBOUNCE milliseconds, 100 by
+// default) into one build, and a build whose inputs change while it runs is cancelled and
+// started over. Restarts itself when the build file changes. Never returns. Linux only.
+void josh_watch(const char *path, const char *exec_name, char *args[]);
+
 // Parsers argv arguments and applies built-in options for recoginized switches.
 // Returns a string-array with remaining arguments that we not consumed.
 char **josh_parse_arguments(int argc, char *argv[]);
 
 #define JOSH_BUILD(path, exec_name, ...) josh_build(path, exec_name, (char *[]){ __VA_ARGS__ __VA_OPT__(,) NULL })
 
+// Sets how many commands (compiles, dependency scans) josh may run at the same time.
+// A value <= 0 restores the default: $JOSH_JOBS if set, otherwise the number of online CPUs.
+// josh_parse_arguments() calls this for the `-j N`, `-jN` and `--jobs=N` switches.
+void jb_set_job_count(int jobs);
+int jb_job_count();
+
+// When enabled, an object whose inputs have newer timestamps is only rebuilt if their
+// contents actually changed (eg. after a checkout that touched and restored files).
+// Content hashes are kept in the build folder and only recomputed for files whose size
+// or mtime changed. josh_parse_arguments() enables this for the `--content-hash` switch.
+void jb_set_content_hashing(int enabled);
+
+// When enabled, C, C++ and Objective-C compiles go through a compile cache shared by all
+// build folders and worktrees on this machine: a compile whose preprocessed source,
+// command line and compiler match an earlier one restores that object instead of running
+// the compiler. The cache lives in $JOSH_CACHE_DIR, $XDG_CACHE_HOME/josh or ~/.cache/josh
+// and is kept under $JOSH_CACHE_SIZE megabytes (default 5120) by evicting the least
+// recently used objects. Defaults to $JOSH_CACHE; josh_parse_arguments() enables it for
+// the `--cache` switch. Not available with MSVC.
+void jb_set_compile_cache(int enabled);
+
+// Also looks up and uploads compiled objects in a remote cache at url
+// (http://host[:port][/prefix]) speaking bazel-remote's HTTP protocol, so machines share
+// what they compiled. Enables the local compile cache, which remote hits are copied into.
+// Lookups give up after $JOSH_REMOTE_CACHE_TIMEOUT milliseconds (default 2000) and fall
+// back to compiling; after the first unreachable request the remote is skipped for the
+// rest of the build. Uploads run in the background and are finished before josh exits.
+// Defaults to $JOSH_REMOTE_CACHE; josh_parse_arguments() sets it for `--remote-cache=URL`.
+void jb_set_remote_cache(const char *url);
+
+// Spreads C-family compiles over `josh worker` processes as well as the local jobs.
+// workers is a comma-separated list of host:port and unix:/path/to/socket addresses.
+// Sources are preprocessed locally; workers need the same compiler (same --version) under
+// the same name. A worker that doesn't answer within $JOSH_WORKER_TIMEOUT milliseconds
+// (default 120000) or fails is dropped for the rest of the build and its compiles run
+// locally. Defaults to $JOSH_WORKERS; josh_parse_arguments() sets it for `--workers=LIST`.
+// Not available with MSVC.
+void jb_set_workers(const char *workers);
+
+// After each build, lists the headers most of a target's objects include (from the
+// dependencies josh recorded), ranked by how much parsing a precompiled header of them
+// would save. Headers from system include paths aren't recorded, so they aren't listed.
+// josh_parse_arguments() enables this for the `--suggest-pch` switch.
+void jb_set_suggest_precompiled_header(int enabled);
+
+// Serves compiles for other machines' builds on address (host:port or unix:/path), running
+// jb_job_count() at a time. Never returns. Anyone who can connect can run the compilers
+// installed here, so only listen where trusted clients can reach.
+void jb_worker_serve(const char *address);
+
 #define JB_ENUM(x) JBEnum_ ## x
 
 enum JBArch {
@@ -115,6 +182,34 @@ enum JBRuntime {
     JB_ENUM(ELF), // freestanding elf target
 };
 
+enum JBLTO {
+    JB_ENUM(NoLTO),
+    JB_ENUM(FullLTO),
+    JB_ENUM(ThinLTO), // clang only; gcc does its usual (partitioned, parallel) LTO
+};
+
+enum JBLinker {
+    JB_ENUM(DefaultLinker), // the compiler driver's own, except lld for clang
+    JB_ENUM(AutoLinker), // the fastest one installed: mold, lld, gold, then the default
+    JB_ENUM(BFD),
+    JB_ENUM(Gold),
+    JB_ENUM(LLD),
+    JB_ENUM(Mold),
+};
+
+// When the output of a job is written, see jb_set_output_order()
+enum JBOutputOrder {
+    JB_ENUM(OutputCompletion), // as soon as it finishes
+    JB_ENUM(OutputSubmission), // once every job queued before it has been written
+};
+
+// When jb_build_exe_pgo() collects a new profile
+enum JBProfileMode {
+    JB_ENUM(ProfileAuto), // when there's none, or the sources it was collected from changed
+    JB_ENUM(ProfileTrain), // every build
+    JB_ENUM(ProfileReuse), // only when there's none; an out of date profile is still used
+};
+
 typedef struct {
     enum JBArch arch;
     enum JBVendor vendor;
@@ -136,6 +231,8 @@ typedef struct {
     char *clang;
 
     char *sysroot;
+
+    enum JBLinker linker; // for targets that don't pick one
 } JBToolchain;
 
 void jb_set_toolchain_directory(const char *path);
@@ -148,6 +245,23 @@ char *jb_get_triple(JBToolchain *toolchain);
 // Find a tool in the target toolchains directory
 char *jb_toolchain_find_tool(JBToolchain *toolchain, const char *tool);
 
+// debug_info flags; ignored with MSVC, which keeps debug info in a PDB. Any of them compiles
+// C and C++ sources with -g.
+#define JB_DEBUG_INFO (1 << 0)
+
+// -gsplit-dwarf: each compile writes most of its DWARF to a .dwo next to its object, so the
+// linker doesn't copy it into the output.
+#define JB_DEBUG_SPLIT_DWARF (1 << 1)
+
+// compresses debug sections in linked outputs, and in objects unless they're split
+// (-gz=zstd, or zlib where the toolchain can't do zstd)
+#define JB_DEBUG_COMPRESS (1 << 2)
+
+// with JB_DEBUG_SPLIT_DWARF: after an executable or shared library is linked, its .dwo files
+// are packaged into <output>.dwp (with dwp, or llvm-dwp for clang) in the background. josh
+// waits for it before exiting.
+#define JB_DEBUG_PACKAGE (1 << 3)
+
 #define _JB_TARGET_HEADER_COMMON \
     const char *name; \
     const char *build_folder; \
@@ -160,7 +274,22 @@ char *jb_toolchain_find_tool(JBToolchain *toolchain, const char *tool);
     const char **frameworks; /* only applies to apple targets */ \
     const char **system_libraries; \
     struct JBLibrary **libraries; \
-    JBToolchain *toolchain
+    JBToolchain *toolchain; \
+    /* unity builds: C and C++ sources are compiled in batches of about this many files, */ \
+    /* and/or about this many bytes of source. Both 0 (the default) compiles each on its own. */ \
+    int unity_batch_size; \
+    size_t unity_batch_bytes; \
+    const char **unity_exclude; /* sources that are never batched */ \
+    /* compiled once per language and flag set, then included ahead of every C and C++ source */ \
+    const char *precompiled_header; \
+    /* scan C++ sources for C++20 named modules; interfaces are built before their importers */ \
+    int cxx_modules; \
+    enum JBLinker linker; /* overrides the toolchain's; ignored for static libraries */ \
+    enum JBLTO lto; /* link-time optimization of this target's objects when it's linked */ \
+    int debug_info; /* JB_DEBUG_* flags */ \
+    /* profile-guided optimization: C and C++ sources are optimized with the profile in this */ \
+    /* folder (a .gcda per object for gcc, <name>.profdata for clang) and rebuilt when it changes */ \
+    const char *profile_folder
 
 typedef struct JBTarget {
     _JB_TARGET_HEADER_COMMON;
@@ -177,6 +306,16 @@ typedef struct JBTarget {
 // internal
 #define _JB_LIBRARY_JUST_BUILT (1 << 2) // if flagged, we just built this library, so skip some dependency checks
 
+// static libraries only, ignored with MSVC: the archive references the object files
+// instead of holding copies of them (ar T), so it stays small and is quick to rewrite.
+// The object files have to stay in place for the archive to be usable.
+#define JB_LIBRARY_THIN_ARCHIVE (1 << 3)
+
+// static libraries only, ignored with MSVC: when the set of objects is unchanged, only
+// the objects that changed are replaced in the existing archive instead of rebuilding it
+// from every object.
+#define JB_LIBRARY_INCREMENTAL_ARCHIVE (1 << 4)
+
 typedef struct JBLibrary {
     _JB_TARGET_HEADER_COMMON;
 
@@ -193,6 +332,26 @@ typedef struct {
 
 void jb_build_exe(JBExecutable *exec);
 
+// Profile-guided optimization: builds an instrumented copy of exec in
+// <build_folder>/pgo-instrumented, then runs the train command (like JB_RUN(), with
+// $JOSH_PGO_EXE set to the instrumented executable) and merges the profile it wrote into
+// exec->profile_folder (default <build_folder>/pgo-profile). Then builds exec optimized with
+// that profile. The profile folder remembers what it was collected from; whether it's
+// collected again is up to jb_set_profile_mode(). Libraries aren't instrumented. Not
+// available with MSVC, where exec is built without a profile.
+void jb_build_exe_pgo(JBExecutable *exec, const char *train);
+
+// Defaults to $JOSH_PGO (auto, train or reuse), otherwise ProfileAuto.
+// josh_parse_arguments() sets it for the `--pgo=MODE` switch.
+void jb_set_profile_mode(enum JBProfileMode mode);
+
+// Commands run concurrently keep their output to themselves: everything a job prints is
+// collected and written in one piece once it finishes, either as jobs finish or in the
+// order they were queued. On a terminal, a status line shows what's still running.
+// Defaults to $JOSH_OUTPUT_ORDER (completion or submission), otherwise OutputCompletion.
+// josh_parse_arguments() sets it for the `--output-order=ORDER` switch.
+void jb_set_output_order(enum JBOutputOrder order);
+
 void jb_compile_c(JBTarget *target, JBToolchain *tc, const char *source, const char *output);
 void jb_compile_cxx(JBTarget *target, JBToolchain *tc, const char *source, const char *output);
 void jb_compile_asm(JBTarget *target, JBToolchain *tc, const char *source, const char *output);
@@ -377,6 +536,10 @@ void jb_va_log(const char *fmt, va_list args);
 void jb_log(const char *fmt, ...);
 void jb_log_print(const char *fmt, ...);
 
+// The log file is written in batches rather than per message. Writes out what's buffered and
+// syncs the log file to disk; happens on its own when josh exits, JB_FAIL() included.
+void jb_log_flush();
+
 #define JB_LOG(fmt, ...) jb_log_print("[jb] " fmt __VA_OPT__(,) __VA_ARGS__)
 
 #ifdef JOSH_BUILD_IMPL
@@ -400,13 +563,32 @@ void jb_log_print(const char *fmt, ...);
 #endif
 
 #include <poll.h>
+#include <spawn.h>
+#include <sys/ioctl.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <dlfcn.h>
+#include <dirent.h>
+#include <netdb.h>
+#include <strings.h>
 
 #include <sys/wait.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/param.h>
 #include <sys/stat.h>
 #include <sys/errno.h>
 
+#if JB_IS_LINUX
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#include <linux/fs.h> // FICLONE
+#endif
+
+extern char **environ;
+
 #endif // JB_IS_WINDOWS
 
 int _jb_log_print_only = 0;
@@ -419,10 +601,202 @@ int _jb_log_fd = -1;
 // retains josh_runner and build.josh.c files
 int _jb_debug_runner = 0;
 
-// experimental: enable/disable psuedo-terminal mode;
-// performs additional filtering when writing to log file to remove control sequences
-// enables pretty, colored text in terminal output.
-int _jb_use_pty = 1;
+// experimental: enable/disable psuedo-terminal mode; runs every command in a pty so tools
+// that only color their output on a terminal do. Off by default: compilers and linkers are
+// asked for color with flags instead (see _jb_color_diagnostics()), which is cheaper than a
+// pty per command.
+int _jb_use_pty = 0;
+
+// -1 until decided by $JOSH_TERMINAL or whether stdout is a terminal
+int _jb_terminal = -1;
+
+// 1 to start commands with fork() and exec instead of posix_spawn(); -1 until decided by
+// $JOSH_SPAWN (fork or posix_spawn)
+int _jb_spawn_with_fork = -1;
+
+// 0 until decided by jb_set_job_count() or the first call to jb_job_count()
+int _jb_job_count = 0;
+
+// set by jb_set_content_hashing()
+int _jb_content_hashing = 0;
+
+// -1 until decided by jb_set_compile_cache() or $JOSH_CACHE
+int _jb_use_compile_cache = -1;
+
+// set by jb_set_remote_cache(); falls back to $JOSH_REMOTE_CACHE
+const char *_jb_remote_cache_url = NULL;
+
+// set by jb_set_workers(); falls back to $JOSH_WORKERS
+const char *_jb_workers = NULL;
+
+// set by jb_set_suggest_precompiled_header()
+int _jb_suggest_pch = 0;
+
+// -1 until decided by jb_set_profile_mode() or $JOSH_PGO
+int _jb_profile_mode = -1;
+
+// -1 until decided by jb_set_output_order() or $JOSH_OUTPUT_ORDER
+int _jb_output_order = -1;
+
+#if JB_IS_WINDOWS
+
+typedef SRWLOCK _JBMutex;
+#define _JB_MUTEX_INITIALIZER SRWLOCK_INIT
+typedef CONDITION_VARIABLE _JBCond;
+typedef HANDLE _JBThread;
+
+#define _JB_THREAD_LOCAL __declspec(thread)
+
+void _jb_mutex_init(_JBMutex *m) { InitializeSRWLock(m); }
+void _jb_mutex_lock(_JBMutex *m) { AcquireSRWLockExclusive(m); }
+void _jb_mutex_unlock(_JBMutex *m) { ReleaseSRWLockExclusive(m); }
+
+void _jb_cond_init(_JBCond *c) { InitializeConditionVariable(c); }
+void _jb_cond_wait(_JBCond *c, _JBMutex *m) { SleepConditionVariableSRW(c, m, INFINITE, 0); }
+void _jb_cond_wait_ms(_JBCond *c, _JBMutex *m, int ms) { SleepConditionVariableSRW(c, m, ms, 0); }
+void _jb_cond_broadcast(_JBCond *c) { WakeAllConditionVariable(c); }
+
+_JBThread _jb_thread_start(DWORD (WINAPI *fn)(void *), void *ctx) {
+    HANDLE thread = CreateThread(NULL, 0, fn, ctx, 0, NULL);
+    JB_ASSERT(thread, "could not create thread");
+    return thread;
+}
+
+#define _JB_THREAD_PROC(name, arg) DWORD WINAPI name(void *arg)
+#define _JB_THREAD_RETURN return 0
+
+#else
+
+typedef pthread_mutex_t _JBMutex;
+#define _JB_MUTEX_INITIALIZER PTHREAD_MUTEX_INITIALIZER
+typedef pthread_cond_t _JBCond;
+typedef pthread_t _JBThread;
+
+#define _JB_THREAD_LOCAL __thread
+
+void _jb_mutex_init(_JBMutex *m) { pthread_mutex_init(m, NULL); }
+void _jb_mutex_lock(_JBMutex *m) { pthread_mutex_lock(m); }
+void _jb_mutex_unlock(_JBMutex *m) { pthread_mutex_unlock(m); }
+
+void _jb_cond_init(_JBCond *c) { pthread_cond_init(c, NULL); }
+void _jb_cond_wait(_JBCond *c, _JBMutex *m) { pthread_cond_wait(c, m); }
+
+void _jb_cond_wait_ms(_JBCond *c, _JBMutex *m, int ms) {
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+
+    until.tv_sec += ms / 1000;
+    until.tv_nsec += (long)(ms % 1000) * 1000000;
+
+    if (until.tv_nsec >= 1000000000) {
+        until.tv_sec += 1;
+        until.tv_nsec -= 1000000000;
+    }
+
+    pthread_cond_timedwait(c, m, &until);
+}
+void _jb_cond_broadcast(_JBCond *c) { pthread_cond_broadcast(c); }
+
+_JBThread _jb_thread_start(void *(*fn)(void *), void *ctx) {
+    pthread_t thread;
+    JB_ASSERT(pthread_create(&thread, NULL, fn, ctx) == 0, "could not create thread");
+    return thread;
+}
+
+#define _JB_THREAD_PROC(name, arg) void *name(void *arg)
+#define _JB_THREAD_RETURN return NULL
+
+#endif // JB_IS_WINDOWS
+
+// Log messages are collected in pending and written a batch (_JB_LOG_BATCH bytes) at a time:
+// by a background thread once the job pool started one, otherwise by whoever fills the batch.
+// The background thread also writes whatever is pending every _JB_LOG_INTERVAL_MS, so a
+// quiet build's log doesn't sit in memory. Nothing waits on the disk to log, and the log
+// file is only synced by jb_log_flush().
+#define _JB_LOG_BATCH (64 * 1024)
+#define _JB_LOG_INTERVAL_MS 200
+
+typedef struct {
+    char *data;
+    size_t count;
+    size_t capacity;
+} _JBLogBuffer;
+
+static struct {
+    _JBMutex mutex; // guards pending
+    _JBMutex write_mutex; // held while a batch is written, so batches land in order
+    _JBCond cond; // signaled when pending holds a batch
+    _JBLogBuffer pending;
+    _JBLogBuffer writing;
+    int writer; // set once the background writer runs
+} _jb_log_sink = { .mutex = _JB_MUTEX_INITIALIZER, .write_mutex = _JB_MUTEX_INITIALIZER };
+
+// Writes what's pending to the log file; also syncs it to disk when sync is set.
+void _jb_log_drain(int sync) {
+    _jb_mutex_lock(&_jb_log_sink.write_mutex);
+
+    _jb_mutex_lock(&_jb_log_sink.mutex);
+    _JBLogBuffer batch = _jb_log_sink.pending;
+    _jb_log_sink.pending = _jb_log_sink.writing;
+    _jb_log_sink.writing = batch;
+    _jb_mutex_unlock(&_jb_log_sink.mutex);
+
+    size_t written = 0;
+
+    while (_jb_log_fd >= 0 && written < batch.count) {
+        ssize_t bytes = write(_jb_log_fd, batch.data + written, batch.count - written);
+
+        if (bytes <= 0)
+            break;
+
+        written += bytes;
+    }
+
+    _jb_log_sink.writing.count = 0;
+
+    if (sync && _jb_log_fd >= 0) {
+#if JB_IS_WINDOWS
+        _commit(_jb_log_fd);
+#else
+        fsync(_jb_log_fd);
+#endif
+    }
+
+    _jb_mutex_unlock(&_jb_log_sink.write_mutex);
+}
+
+void jb_log_flush() {
+    _jb_log_drain(1);
+}
+
+_JB_THREAD_PROC(_jb_log_writer, arg) {
+    _jb_mutex_lock(&_jb_log_sink.mutex);
+
+    while (1) {
+        if (_jb_log_sink.pending.count < _JB_LOG_BATCH)
+            _jb_cond_wait_ms(&_jb_log_sink.cond, &_jb_log_sink.mutex, _JB_LOG_INTERVAL_MS);
+
+        if (_jb_log_sink.pending.count == 0)
+            continue;
+
+        _jb_mutex_unlock(&_jb_log_sink.mutex);
+        _jb_log_drain(0);
+        _jb_mutex_lock(&_jb_log_sink.mutex);
+    }
+
+    _jb_mutex_unlock(&_jb_log_sink.mutex);
+    _JB_THREAD_RETURN;
+}
+
+// Hands writing the log over to a background thread.
+void _jb_log_start_writer() {
+    if (_jb_log_sink.writer)
+        return;
+
+    _jb_cond_init(&_jb_log_sink.cond);
+    _jb_log_sink.writer = 1;
+    _jb_thread_start(_jb_log_writer, NULL);
+}
 
 void jb_log_set_file(const char *path) {
     int fd = open(path, O_CREAT | O_TRUNC | O_RDWR, 0777);
@@ -435,26 +809,44 @@ void jb_log_set_file(const char *path) {
         exit(1);
     }
 
-    if (_jb_log_fd >= 0)
+    if (_jb_log_fd >= 0) {
+        // what's pending belongs to the old file
+        _jb_log_drain(0);
         close(_jb_log_fd);
+    }
+    else {
+        atexit(jb_log_flush);
+    }
 
     _jb_log_fd = fd;
 }
 
-void jb_va_log(const char *fmt, va_list args) {
-    if (_jb_log_print_only)
-        return;
-
+// Writes out to the log file, without terminal control sequences (colored diagnostics, a
+// pty's output, the status line). Most of what's logged has none and is written as is.
+void _jb_log_write(const char *out) {
     if (_jb_log_fd == -1) {
         jb_log_set_file("josh.log");
     }
 
-    char *out = jb_va_format_string(fmt, args);
+    size_t length = strlen(out);
 
-    if (_jb_use_pty) {
-        char *filtered = malloc(strlen(out)+1);
-        size_t bytes = 0;
+    if (!length)
+        return;
+
+    _jb_mutex_lock(&_jb_log_sink.mutex);
+
+    _JBLogBuffer *pending = &_jb_log_sink.pending;
+
+    if (pending->count + length > pending->capacity) {
+        pending->capacity = (pending->count + length) * 2;
+        pending->data = realloc(pending->data, pending->capacity);
+    }
+
+    // (filtering only ever drops characters, so out's length is enough)
+    char *filtered = pending->data + pending->count;
+    size_t bytes = 0;
 
+    if (strpbrk(out, "\x1b\r")) {
         // General escape codes
         // https://gist.github.com/machinamentum/b20cb3fbe4b4afa62fc9f6ffaba821e3
 
@@ -462,7 +854,7 @@ void jb_va_log(const char *fmt, va_list args) {
         // https://gist.github.com/machinamentum/184f4f073924972325a6a0e2d63bdd2a
         const char ESC = '\x1b';
         const char BEL = '\x07';
-        char *c = out;
+        const char *c = out;
         while (*c) {
             if (*c == ESC) {
                 c += 1;
@@ -534,6 +926,13 @@ void jb_va_log(const char *fmt, va_list args) {
                 if (*c)
                     c += 1;
             }
+            else if (*c == '\r' && *(c+1) != '\n') {
+                // a line redrawn in place, like the status line; only what's written over it is kept
+                while (bytes && filtered[bytes-1] != '\n')
+                    bytes -= 1;
+
+                c += 1;
+            }
             else {
                 filtered[bytes] = *c;
                 c += 1;
@@ -541,1642 +940,9678 @@ void jb_va_log(const char *fmt, va_list args) {
             }
         }
 
-        write(_jb_log_fd, filtered, bytes);
-        free(filtered);
     }
     else {
-        write(_jb_log_fd, out, strlen(out));
-        free(out);
+        memcpy(filtered, out, length);
+        bytes = length;
     }
 
+    pending->count += bytes;
+
+    int full = pending->count >= _JB_LOG_BATCH;
+    int writer = _jb_log_sink.writer;
+
+    if (full && writer)
+        _jb_cond_broadcast(&_jb_log_sink.cond);
+
+    _jb_mutex_unlock(&_jb_log_sink.mutex);
+
+    if (full && !writer)
+        _jb_log_drain(0);
+}
+
+// What a job printed while it ran, written in one piece once it finishes. Buffers are
+// reused from a free list, so a build doesn't allocate one per job.
+typedef struct _JBJobOutput {
+    _JBMutex lock; // guards print and log, only contended when josh exits mid-build
+    JBStringBuilder print; // for stdout
+    JBStringBuilder log; // for the log file
+    char status[128]; // its last [jb] line, shown on the status line while it runs
+    size_t sequence; // position in submission order
+    struct _JBJobOutput *next_free;
+} _JBJobOutput;
+
+// Collecting output only takes the buffer's own lock; the mutex is held to hand out buffers,
+// write a finished job's output and redraw the status line.
+static struct {
+    _JBMutex mutex;
+    _JBJobOutput *free;
+    JBVector(_JBJobOutput *) running; // in the order they started
+    JBVector(_JBJobOutput *) held; // finished, waiting for an earlier job (OutputSubmission)
+    size_t submitted;
+    size_t written; // jobs whose output has been written
+    int status_line; // -1 until decided by _jb_status_line_enabled()
+    int status_shown;
+} _jb_job_outputs = { .mutex = _JB_MUTEX_INITIALIZER, .status_line = -1 };
+
+// set while the calling thread runs a job
+static _JB_THREAD_LOCAL _JBJobOutput *_jb_job_output = NULL;
+
+// Whether what josh prints ends up on a terminal. A runner started by josh_build() prints
+// into a pipe that josh passes on, so it's told through $JOSH_TERMINAL.
+int _jb_stdout_is_terminal() {
+    if (_jb_terminal < 0) {
+        const char *env = getenv("JOSH_TERMINAL");
+
+        if (env && *env) {
+            _jb_terminal = strcmp(env, "0") != 0;
+        }
+        else {
 #if JB_IS_WINDOWS
-    _commit(_jb_log_fd);
+            _jb_terminal = 0;
 #else
-    fsync(_jb_log_fd);
+            const char *term = getenv("TERM");
+            _jb_terminal = isatty(STDOUT_FILENO) && !(term && strcmp(term, "dumb") == 0);
 #endif
+        }
+    }
+
+    return _jb_terminal;
 }
 
-void jb_log(const char *fmt, ...) {
-    va_list args;
-    va_start(args, fmt);
-    jb_va_log(fmt, args);
-    va_end(args);
+// Whether compilers and linkers should color their diagnostics. Without a pty they can't
+// tell they end up on a terminal, so josh asks for it (unless $NO_COLOR is set).
+int _jb_color_diagnostics() {
+    return !_jb_use_pty && _jb_stdout_is_terminal() && !getenv("NO_COLOR");
 }
 
-void jb_log_print(const char *fmt, ...) {
-    {
-        va_list args;
-        va_start(args, fmt);
-        vprintf(fmt, args);
-        va_end(args);
-        // Required in the event that we are running in a josh_builder; since our parent process would be a .josh, printf will not flush stdout since
-        // we are not writing to a tty. We could use forkpty() instead of fork() in _jb_run_internal but that may have additional performance overhead
-        // to measure and consider.
-        fflush(stdout);
+int _jb_status_line_enabled() {
+    // expects _jb_job_outputs.mutex to be held
+    if (_jb_job_outputs.status_line < 0) {
+#if JB_IS_WINDOWS
+        _jb_job_outputs.status_line = 0;
+#else
+        _jb_job_outputs.status_line = _jb_stdout_is_terminal();
+#endif
     }
 
-    {
-        va_list args;
-        va_start(args, fmt);
-        jb_va_log(fmt, args);
-        va_end(args);
-    }
+    return _jb_job_outputs.status_line;
 }
 
-char *_jb_read_file(const char *path, size_t *out_len) {
-    FILE *f = fopen(path, "rb");
-
-    if (!f)
-        return NULL;
+int _jb_terminal_width() {
+#if !JB_IS_WINDOWS
+    struct winsize size;
 
-    fseek(f, 0, SEEK_END);
-    long len = ftell(f);
-    fseek(f, 0, SEEK_SET);
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_col > 0)
+        return size.ws_col;
+#endif
 
-    char *out = malloc(len + 1);
+    return 80;
+}
 
-    size_t read = fread(out, 1, len, f);
+// Shows "[jb] [written/submitted] <what each running job is doing>" on the current line.
+// The cursor is left at its start, so the next output (after erasing it) replaces it.
+void _jb_status_line_draw() {
+    // expects _jb_job_outputs.mutex to be held
+    if (!_jb_status_line_enabled())
+        return;
 
-    if (read != len)
-        return NULL;
+    if (!_jb_job_outputs.running.count) {
+        if (_jb_job_outputs.status_shown)
+            fputs("\x1b[K", stdout);
 
-    out[len] = 0;
+        _jb_job_outputs.status_shown = 0;
+        fflush(stdout);
+        return;
+    }
 
-    if (out_len)
-        *out_len = len;
+    int width = _jb_terminal_width() - 1;
 
-    return out;
-}
+    JBStringBuilder sb;
+    jb_sb_init(&sb);
 
-extern const char _jb_josh_build_src[];
+    char *progress = jb_format_string("[jb] [%zu/%zu]", _jb_job_outputs.written, _jb_job_outputs.submitted);
+    jb_sb_puts(&sb, progress);
+    free(progress);
 
-void josh_build(const char *path, const char *exec_name, char *args[]) {
-    const char *build_folder = "build";
-    jb_mkdir(build_folder);
+    JBArrayForEach(&_jb_job_outputs.running) {
+        if (!(*it)->status[0])
+            continue;
 
-    char *josh_builder_file = jb_format_string("%s/%s.c", build_folder, jb_filename(path));
+        jb_sb_puts(&sb, " | ");
+        jb_sb_puts(&sb, (*it)->status);
+    }
 
-    JBExecutable josh = {exec_name};
-    josh.build_folder = build_folder;
-    josh.sources = JB_STRING_ARRAY(josh_builder_file);
+    char *line = jb_sb_to_string(&sb);
+    jb_sb_free(&sb);
 
-    char *josh_builder_exe = jb_format_string("%s/%s", build_folder, josh.name);
+    if ((int)strlen(line) > width)
+        line[width > 0 ? width : 0] = 0;
 
-    if (jb_file_is_newer(path, josh_builder_exe)) {
-        char *build_source = _jb_read_file(path, NULL);
+    printf("%s\x1b[K\r", line);
+    fflush(stdout);
 
-        JB_ASSERT(build_source, "could not read file: %s", path);
+    free(line);
+    _jb_job_outputs.status_shown = 1;
+}
 
-        FILE *out = fopen(josh_builder_file, "wb");
-        JB_ASSERT(out, "could not generate josh-builder file %s\n", josh_builder_file);
+void _jb_status_line_erase() {
+    // expects _jb_job_outputs.mutex to be held
+    if (_jb_job_outputs.status_shown)
+        fputs("\x1b[K", stdout);
 
-        const char *preamble = "#define JOSH_BUILD_IMPL\n";
-        fputs(preamble, out);
+    _jb_job_outputs.status_shown = 0;
+}
 
-        fprintf(out, "#define JB_BUILD_JOSH_PATH \"%s\"\n", path);
+// Prints out (and logs it, unless log is NULL) in front of the status line.
+void _jb_output_write(const char *out, const char *log) {
+    _jb_mutex_lock(&_jb_job_outputs.mutex);
 
-        if (!_jb_debug_runner)
-            fputs("#line 1 \"josh_build.h\"\n", out);
+    _jb_status_line_erase();
 
-        fwrite(_jb_josh_build_src, 1, strlen(_jb_josh_build_src), out);
-        fputc('\n', out);
+    fputs(out, stdout);
+    // Required in the event that we are running in a josh_builder; since our parent process would be a .josh, printf will not flush stdout since
+    // we are not writing to a tty.
+    fflush(stdout);
 
-        {
-            fputs("#ifdef JOSH_BUILD_IMPL\n", out);
-            fputs("const char _jb_josh_build_src[] = {\n", out);
+    if (log && !_jb_log_print_only)
+        _jb_log_write(log);
 
-            const char *text = _jb_josh_build_src;
-            while (*text) {
-                fprintf(out, "0x%X", *text);
+    _jb_status_line_draw();
 
-                text += 1;
-                if (*text)
-                    fprintf(out, ", ");
-            }
-            fputs("\n    , 0\n", out);
+    _jb_mutex_unlock(&_jb_job_outputs.mutex);
+}
 
-            fputs("};\n", out);
-            fputs("#endif // JOSH_BUILD_IMPL\n", out);
-        }
+void _jb_sb_write(JBStringBuilder *sb, FILE *f) {
+    JBArrayForEach(&sb->arenas) {
+        fwrite(it->mem, 1, it->current, f);
+    }
+}
 
-        if (!_jb_debug_runner)
-            fputs("#line 1 \"build.josh.c\"\n", out);
+// Empties sb, keeping its first arena for the next job.
+void _jb_sb_reset(JBStringBuilder *sb) {
+    for (size_t i = 1; i < sb->arenas.count; i++)
+        free(sb->arenas.data[i].mem);
 
-        fwrite(build_source, 1, strlen(build_source), out);
-        fclose(out);
+    sb->arenas.count = 1;
+    sb->arenas.data[0].current = 0;
+}
 
-        char *fullpath = jb_file_fullpath(path);
-        char *folder_path = fullpath ? jb_drop_last_path_component(fullpath) : NULL;
-        josh.cflags = JB_STRING_ARRAY(JB_IS_WINDOWS ? "/std:c11" : NULL);
-        josh.include_paths = JB_STRING_ARRAY(folder_path);
+size_t _jb_job_output_sequence() {
+    _jb_mutex_lock(&_jb_job_outputs.mutex);
+    size_t sequence = _jb_job_outputs.submitted++;
+    _jb_mutex_unlock(&_jb_job_outputs.mutex);
 
-        if (_jb_debug_runner)
-            josh.cflags = JB_STRING_ARRAY("-g");
+    return sequence;
+}
 
-        jb_build_exe(&josh);
+void _jb_job_output_write(_JBJobOutput *output) {
+    // expects _jb_job_outputs.mutex to be held
+    _jb_sb_write(&output->print, stdout);
 
-        free(fullpath);
-        free(folder_path);
+    if (!_jb_log_print_only) {
+        char *log = jb_sb_to_string(&output->log);
+        _jb_log_write(log);
+        free(log);
     }
 
-    {
-        JB_LOG("run %s\n", josh_builder_exe);
-        JBVector(char *) cmds = {0};
-        JBVectorPush(&cmds, josh_builder_exe);
+    _jb_sb_reset(&output->print);
+    _jb_sb_reset(&output->log);
 
-        JBNullArrayFor(args) {
-            JBVectorPush(&cmds, (char *)args[index]);
-        }
+    output->next_free = _jb_job_outputs.free;
+    _jb_job_outputs.free = output;
+    _jb_job_outputs.written += 1;
+}
 
-        JBVectorPush(&cmds, NULL);
+// Starts collecting what the calling thread prints for the job queued at sequence.
+// Returns the buffer it replaced, for _jb_job_output_end().
+_JBJobOutput *_jb_job_output_begin(size_t sequence) {
+    _jb_mutex_lock(&_jb_job_outputs.mutex);
 
-        jb_run(cmds.data, __FILE__, __LINE__);
+    _JBJobOutput *output = _jb_job_outputs.free;
 
-        free(cmds.data);
+    if (output) {
+        _jb_job_outputs.free = output->next_free;
     }
-
-    if (!_jb_debug_runner) {
-        remove(josh_builder_file);
-        // remove(josh_builder_exe);
+    else {
+        output = malloc(sizeof(_JBJobOutput));
+        _jb_mutex_init(&output->lock);
+        jb_sb_init(&output->print);
+        jb_sb_init(&output->log);
     }
 
-    free(josh_builder_file);
-    free(josh_builder_exe);
+    output->status[0] = 0;
+    output->sequence = sequence;
+    output->next_free = NULL;
+
+    JBVectorPush(&_jb_job_outputs.running, output);
+
+    _jb_mutex_unlock(&_jb_job_outputs.mutex);
+
+    _JBJobOutput *previous = _jb_job_output;
+    _jb_job_output = output;
+    return previous;
 }
 
-char **josh_parse_arguments(int argc, char *argv[]) {
+enum JBOutputOrder _jb_output_order_get();
 
-    JBVector(char *) out = {0};
+// Writes the output of the calling thread's job, or holds it back until the jobs queued
+// before it have been written.
+void _jb_job_output_end(_JBJobOutput *previous) {
+    _JBJobOutput *output = _jb_job_output;
+    _jb_job_output = previous;
 
-    const char *log_switch = "--log=";
-    const char *log_level_none = "none";
-    const char *log_level_default = "default";
-    const char *log_level_verbose = "verbose";
+    int in_order = _jb_output_order_get() == JB_ENUM(OutputSubmission);
 
-    const char *verbose_switch = "--verbose"; // same as --log=verbose
+    _jb_mutex_lock(&_jb_job_outputs.mutex);
 
-    for (int i = 0; i < argc; i++) {
-        if (strncmp(argv[i], log_switch, strlen(log_switch)) == 0) {
-            const char *level = argv[i] + strlen(log_switch);
+    JBArrayForEach(&_jb_job_outputs.running) {
+        if (*it == output) {
+            size_t index = it - _jb_job_outputs.running.data;
+            memmove(it, it + 1, (_jb_job_outputs.running.count - index - 1) * sizeof(*it));
+            _jb_job_outputs.running.count -= 1;
+            break;
+        }
+    }
 
-            if (strcmp(level, log_level_verbose) == 0) {
-                _jb_verbose_show_commands = 1;
-            }
-            else if (strcmp(level, log_level_default) == 0) {
-                // no-op
-            }
-            else if (strcmp(level, log_level_none) == 0) {
-                _jb_log_print_only = 1;
-            }
-            else {
-                JB_FAIL("unrecognized log level: %s", level);
+    _jb_status_line_erase();
+
+    if (!in_order) {
+        _jb_job_output_write(output);
+    }
+    else {
+        JBVectorPush(&_jb_job_outputs.held, output);
+
+        // write every held output that's next in line
+        for (size_t i = 0; i < _jb_job_outputs.held.count; ) {
+            _JBJobOutput *next = _jb_job_outputs.held.data[i];
+
+            if (next->sequence != _jb_job_outputs.written) {
+                i++;
+                continue;
             }
-        }
-        else if (strcmp(argv[i], verbose_switch) == 0) {
-            _jb_verbose_show_commands = 1;
-        }
-        else {
-            JBVectorPush(&out, argv[i]);
+
+            _jb_job_outputs.held.data[i] = _jb_job_outputs.held.data[--_jb_job_outputs.held.count];
+            _jb_job_output_write(next);
+            i = 0;
         }
     }
 
-    JBVectorPush(&out, NULL);
-    return out.data;
-}
-
-typedef void (*_JBDrainPipeFn)(void *ctx, const char *str);
+    fflush(stdout);
+    _jb_status_line_draw();
 
-void _jb_pipe_drain_log_proxy(void *context, const char *str) {
-    jb_log_print("%s", str);
+    _jb_mutex_unlock(&_jb_job_outputs.mutex);
 }
 
-void _jb_pipe_drain_sb_proxy(void *context, const char *str) {
-    jb_sb_puts((JBStringBuilder *)context, str);
-}
+// When josh exits in the middle of a build (a failed command, JB_FAIL()), the output of
+// finished jobs is still in its buffers, and so is the message explaining the failure.
+void _jb_job_output_exit() {
+    _jb_mutex_lock(&_jb_job_outputs.mutex);
 
-#if JB_IS_WINDOWS
+    _jb_status_line_erase();
 
-int _jb_pipe_read_would_not_block(HANDLE fd) {
-    DWORD bytes_available = 0;
-    BOOL result = PeekNamedPipe(fd, NULL, 0, NULL, &bytes_available, NULL);
+    while (_jb_job_outputs.held.count) {
+        size_t first = 0;
 
-    if (!result) {
-        jb_log_print("could not peek pipe\n");
-        return 0;
-    }
+        for (size_t i = 1; i < _jb_job_outputs.held.count; i++) {
+            if (_jb_job_outputs.held.data[i]->sequence < _jb_job_outputs.held.data[first]->sequence)
+                first = i;
+        }
 
-    return bytes_available > 0;
-}
+        _JBJobOutput *output = _jb_job_outputs.held.data[first];
+        _jb_job_outputs.held.data[first] = _jb_job_outputs.held.data[--_jb_job_outputs.held.count];
+        _jb_job_output_write(output);
+    }
 
-int _jb_pipe_has_data(HANDLE fd) {
-    if (!_jb_pipe_read_would_not_block(fd))
-        return 0;
+    if (_jb_job_output) {
+        _jb_job_output_write(_jb_job_output);
+        _jb_job_output = NULL;
+    }
 
-    char c;
-    DWORD bytes = 0;
-    return ReadFile(fd, &c, 1, &bytes, NULL) && bytes > 0;
-}
+    // Jobs still running keep going until the process ends. What they printed so far stays
+    // off the terminal, which would only show a few of them cut off in the middle, but the
+    // log keeps it. (The calling thread's job is among them, already written and empty.)
+    if (!_jb_log_print_only) {
+        JBArrayForEach(&_jb_job_outputs.running) {
+            _JBJobOutput *output = *it;
 
-void _jb_drain_pipe(HANDLE fd, void *context, _JBDrainPipeFn fn) {
-    enum { buffer_size = 4096*2 };
-    char buffer[buffer_size];
+            _jb_mutex_lock(&output->lock);
 
-    while (_jb_pipe_read_would_not_block(fd)) {
-        DWORD bytes = 0;
-        BOOL result = ReadFile(fd, buffer, buffer_size-1, &bytes, NULL);
+            char *log = jb_sb_to_string(&output->log);
 
-        if (!result)
-            break;
+            if (log[0]) {
+                _jb_log_write("[jb] output of a job that was still running:\n");
+                _jb_log_write(log);
+            }
 
-        if (bytes <= 0)
-            break;
+            free(log);
 
-        if (bytes > 0) {
-            buffer[bytes] = 0;
-            fn(context, buffer);
+            _jb_mutex_unlock(&output->lock);
         }
     }
-}
 
-int _jb_run_internal(char *const argv[], void *print_ctx, _JBDrainPipeFn print_fn, const char *file, int line) {
-    if (_jb_verbose_show_commands) {
-        JBNullArrayFor(argv) {
-            jb_log_print("%s ", argv[index]);
-        }
+    // other jobs may still be running
+    _jb_job_outputs.status_line = 0;
+    fflush(stdout);
 
-        jb_log_print("\n");
-    }
+    _jb_mutex_unlock(&_jb_job_outputs.mutex);
 
-    char *cmdline = NULL;
-    {
-        JBStringBuilder sb = {};
-        jb_sb_init(&sb);
+    jb_log_flush();
+}
 
-        JBNullArrayFor(argv) {
-            jb_sb_puts(&sb, argv[index]);
-            jb_sb_putchar(&sb, ' ');
-        }
+void jb_va_log(const char *fmt, va_list args) {
+    if (_jb_log_print_only)
+        return;
 
-        cmdline = jb_sb_to_string(&sb);
+    char *out = jb_va_format_string(fmt, args);
 
-        jb_sb_free(&sb);
-    }
+    _JBJobOutput *output = _jb_job_output;
 
-    int pty = _jb_use_pty;
-    // TODO see if ConPTY is needed for some things
-    // On mac/Linux, pty mode is needed to get the child process to output colored text controls
-    // since if it cannot detect a terminal, it assumes output is redirected to a file
-    SECURITY_ATTRIBUTES security_attr = {};
-    security_attr.nLength = sizeof(SECURITY_ATTRIBUTES);
-    security_attr.bInheritHandle = TRUE;
+    if (output) {
+        _jb_mutex_lock(&output->lock);
+        jb_sb_puts(&output->log, out);
+        _jb_mutex_unlock(&output->lock);
+    }
+    else {
+        _jb_log_write(out);
+    }
 
-    HANDLE output_read = NULL;
-    HANDLE output_write = NULL;
+    free(out);
+}
 
-    HANDLE input_read = NULL;
-    HANDLE input_write = NULL;
+void jb_log(const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    jb_va_log(fmt, args);
+    va_end(args);
+}
 
-    if (!CreatePipe(&output_read, &output_write, &security_attr, 0)) {
-        jb_log_print("could not create output pipe for %s\n", argv[0]);
-        return 1;
-    }
+void jb_log_print(const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    char *out = jb_va_format_string(fmt, args);
+    va_end(args);
 
-    if (!SetHandleInformation(output_read, HANDLE_FLAG_INHERIT, 0)) {
-        jb_log_print("could not set output pipe flag for %s\n", argv[0]);
-        return 1;
-    }
+    _JBJobOutput *output = _jb_job_output;
 
-    if (!CreatePipe(&input_read, &input_write, &security_attr, 0)) {
-        jb_log_print("could not create input pipe for %s\n", argv[0]);
-        return 1;
+    if (!output) {
+        _jb_output_write(out, out);
+        free(out);
+        return;
     }
 
-     if (!SetHandleInformation(input_write, HANDLE_FLAG_INHERIT, 0)) {
-        jb_log_print("could not set input pipe flag for %s\n", argv[0]);
-        return 1;
-    }
+    _jb_mutex_lock(&output->lock);
 
-    STARTUPINFOA startup_info = {};
-    startup_info.cb = sizeof(STARTUPINFOA);
-    startup_info.dwFlags |= STARTF_USESTDHANDLES;
-    startup_info.hStdInput = input_read;
-    startup_info.hStdOutput = output_write;
-    startup_info.hStdError = output_write;
+    jb_sb_puts(&output->print, out);
 
-    PROCESS_INFORMATION process_info = {};
+    if (!_jb_log_print_only)
+        jb_sb_puts(&output->log, out);
 
-    if (!CreateProcessA(NULL, cmdline, NULL, NULL,
-                        TRUE, NORMAL_PRIORITY_CLASS, NULL, NULL,
-                        &startup_info, &process_info)) {
-        // TODO call GetLastError and report
-        jb_log_print("Could not run %s, error ID 0x%X\n", argv[0], GetLastError());
-        free(cmdline);
-        return 1;
-    }
+    _jb_mutex_unlock(&output->lock);
 
-    free(cmdline);
+    if (strncmp(out, "[jb] ", 5) == 0) {
+        const char *status = out + 5;
+        int length = (int)strcspn(status, "\r\n");
 
-    do {
-        _jb_drain_pipe(output_read, print_ctx, print_fn);
-    } while (WaitForSingleObject(process_info.hProcess, 0) != WAIT_OBJECT_0);
+        _jb_mutex_lock(&_jb_job_outputs.mutex);
 
-    _jb_drain_pipe(output_read, print_ctx, print_fn);
-    JB_ASSERT(!_jb_pipe_has_data(output_read), "data still in pipe");
+        snprintf(output->status, sizeof(output->status), "%.*s", length, status);
+        _jb_status_line_draw();
 
-    DWORD exit_code = 0;
-    if (!GetExitCodeProcess(process_info.hProcess, &exit_code)) {
-        jb_log_print("Could not get process exit code for %s\n", argv[0]);
-        return 1;
+        _jb_mutex_unlock(&_jb_job_outputs.mutex);
     }
 
-    CloseHandle(process_info.hProcess);
-    CloseHandle(process_info.hThread);
-
-    CloseHandle(output_write);
-    CloseHandle(input_read);
-    return exit_code;
+    free(out);
 }
 
-#else
+char *_jb_read_file(const char *path, size_t *out_len) {
+    FILE *f = fopen(path, "rb");
 
-int _jb_pipe_read_would_not_block(int fd) {
-    struct pollfd pfd = { .fd = fd, .events = POLLIN };
-    pfd.fd = fd;
-    pfd.events = POLLIN;
+    if (!f)
+        return NULL;
 
-    int result = poll(&pfd, 1, 0);
-    return result > 0 && (pfd.revents & (POLLERR | POLLNVAL)) == 0;
-}
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    fseek(f, 0, SEEK_SET);
 
-int _jb_pipe_has_data(int fd) {
-    if (!_jb_pipe_read_would_not_block(fd))
-        return 0;
+    char *out = malloc(len + 1);
 
-    char c;
-    return read(fd, &c, 1) > 0;
-}
+    size_t read = fread(out, 1, len, f);
+    fclose(f);
 
-void _jb_drain_pipe(int fd, void *context, _JBDrainPipeFn fn) {
-    enum { buffer_size = 4096*2 };
-    char buffer[buffer_size];
+    if (read != len) {
+        free(out);
+        return NULL;
+    }
 
-    while (_jb_pipe_read_would_not_block(fd)) {
-        ssize_t bytes = read(fd, buffer, buffer_size-1);
+    out[len] = 0;
 
-        if (bytes <= 0)
-            break;
+    if (out_len)
+        *out_len = len;
 
-        if (bytes > 0) {
-            buffer[bytes] = 0;
-            fn(context, buffer);
-        }
-    }
+    return out;
 }
 
-int _jb_run_internal(char *const argv[], void *print_ctx, _JBDrainPipeFn print_fn, const char *file, int line) {
-    if (_jb_verbose_show_commands) {
-        JBNullArrayFor(argv) {
-            jb_log_print("%s ", argv[index]);
-        }
+extern const char _jb_josh_build_src[];
 
-        jb_log_print("\n");
-    }
+// Generates build/<name>.c from the build file at path and compiles it into the runner
+// build/<exec_name> if path changed since, or always if force is set. Returns the runner's
+// path.
+char *_jb_build_runner(const char *path, const char *exec_name, int force) {
+    const char *build_folder = "build";
+    jb_mkdir(build_folder);
 
-    int pty = _jb_use_pty;
+    char *josh_builder_file = jb_format_string("%s/%s.c", build_folder, jb_filename(path));
 
-    int pipefd[2];
-    if (!pty)
-        JB_ASSERT(pipe(pipefd) == 0, "could not open pipe");
+    JBExecutable josh = {exec_name};
+    josh.build_folder = build_folder;
+    josh.sources = JB_STRING_ARRAY(josh_builder_file);
 
-    // fcntl(pipefd[0], F_SETFL, O_NONBLOCK);
-    // fcntl(pipefd[1], F_SETFL, O_NONBLOCK);
-    pid_t pid = pty ? forkpty(&pipefd[0], NULL, NULL, NULL) : fork();
-    JB_ASSERT(pid >= 0, "could not fork() process to execute %s\n", argv[0]);
+    char *josh_builder_exe = jb_format_string("%s/%s", build_folder, josh.name);
 
-    if (pid) {
-        // parent
+    if (force || jb_file_is_newer(path, josh_builder_exe)) {
+        char *build_source = _jb_read_file(path, NULL);
 
-        // close write pipe
-        if (!pty)
-            close(pipefd[1]);
+        JB_ASSERT(build_source, "could not read file: %s", path);
 
-        int wstatus;
-        pid_t w;
-        
-        errno = 0;
-        do {
+        FILE *out = fopen(josh_builder_file, "wb");
+        JB_ASSERT(out, "could not generate josh-builder file %s\n", josh_builder_file);
+
+        const char *preamble = "#define JOSH_BUILD_IMPL\n";
+        fputs(preamble, out);
 
-            w = waitpid(pid, &wstatus, WNOHANG);
+        fprintf(out, "#define JB_BUILD_JOSH_PATH \"%s\"\n", path);
 
-            if (w == -1) {
-                jb_log_print("WAIT FAILED %s\n", strerror(errno));
-                // JB_FAIL("wait failed");
-                return 0;
+        if (!_jb_debug_runner)
+            fputs("#line 1 \"josh_build.h\"\n", out);
+
+        fwrite(_jb_josh_build_src, 1, strlen(_jb_josh_build_src), out);
+        fputc('\n', out);
+
+        {
+            fputs("#ifdef JOSH_BUILD_IMPL\n", out);
+            fputs("const char _jb_josh_build_src[] = {\n", out);
+
+            const char *text = _jb_josh_build_src;
+            while (*text) {
+                fprintf(out, "0x%X", *text);
+
+                text += 1;
+                if (*text)
+                    fprintf(out, ", ");
             }
+            fputs("\n    , 0\n", out);
 
-            _jb_drain_pipe(pipefd[0], print_ctx, print_fn);
+            fputs("};\n", out);
+            fputs("#endif // JOSH_BUILD_IMPL\n", out);
+        }
 
-            // skip status checks if 0 because the child hasn't changed state.
-            if (w > 0 && (WIFEXITED(wstatus) || WIFSIGNALED(wstatus)))
-                break;
+        // The build file's main is renamed so the runner can also serve it as `josh daemon`
+        fputs("#define main _jb_build_josh_main\n", out);
 
-        } while (1);
+        if (!_jb_debug_runner)
+            fputs("#line 1 \"build.josh.c\"\n", out);
 
-        JB_ASSERT(!_jb_pipe_has_data(pipefd[0]), "data still in pipe");
+        fwrite(build_source, 1, strlen(build_source), out);
 
-        close(pipefd[0]);
+        // cast since build files may declare main without parameters
+        fputs("\n#undef main\n", out);
+        fputs("int main(int argc, char *argv[]) {\n", out);
+        fputs("    return _jb_runner_main(argc, argv, (int (*)(int, char **))_jb_build_josh_main);\n", out);
+        fputs("}\n", out);
+        fclose(out);
 
-        if (WIFSIGNALED(wstatus)) {
-            jb_log("%s:%d: %s: %s\n", file, line, argv[0], strsignal(WTERMSIG(wstatus)));
-            return 1;
-        }
+        char *fullpath = jb_file_fullpath(path);
+        char *folder_path = fullpath ? jb_drop_last_path_component(fullpath) : NULL;
+        josh.cflags = JB_STRING_ARRAY(JB_IS_WINDOWS ? "/std:c11" : NULL);
+        josh.include_paths = JB_STRING_ARRAY(folder_path);
+        josh.system_libraries = JB_IS_WINDOWS ? NULL : JB_STRING_ARRAY("pthread", "dl");
+
+        if (_jb_debug_runner)
+            josh.cflags = JB_STRING_ARRAY("-g");
+
+        jb_build_exe(&josh);
+
+        free(fullpath);
+        free(folder_path);
+    }
+
+    if (!_jb_debug_runner)
+        remove(josh_builder_file);
+
+    free(josh_builder_file);
+    return josh_builder_exe;
+}
+
+// Runs a build through the `josh daemon` listening on socket_path, forwarding its output.
+// Returns the build's exit code, or -1 if no daemon is running there or it can't serve
+// this build.
+int _jb_daemon_request(const char *socket_path, char *args[]);
+
+void josh_build(const char *path, const char *exec_name, char *args[]) {
+#if !JB_IS_WINDOWS
+    // The runner (or a daemon's build) prints into a pipe that ends up on our stdout.
+    if (_jb_stdout_is_terminal())
+        setenv("JOSH_TERMINAL", "1", 1);
+#endif
+
+    char *socket_path = jb_format_string("build/%s.sock", exec_name);
+    int result = _jb_daemon_request(socket_path, args);
+    free(socket_path);
+
+    if (result >= 0) {
+        if (result)
+            exit(1);
+
+        return;
+    }
+
+    char *josh_builder_exe = _jb_build_runner(path, exec_name, 0);
+
+    {
+        JB_LOG("run %s\n", josh_builder_exe);
+        JBVector(char *) cmds = {0};
+        JBVectorPush(&cmds, josh_builder_exe);
+
+        JBNullArrayFor(args) {
+            JBVectorPush(&cmds, (char *)args[index]);
+        }
+
+        JBVectorPush(&cmds, NULL);
+
+        jb_run(cmds.data, __FILE__, __LINE__);
+
+        free(cmds.data);
+    }
+
+    free(josh_builder_exe);
+}
+
+// Exit code of a daemon or watching runner that stopped because its build file changed.
+#define _JB_RUNNER_RESTART 75
+
+void josh_daemon(const char *path, const char *exec_name) {
+#if JB_IS_LINUX
+    // always regenerated so the runner has daemon support from this version of josh
+    char *josh_builder_exe = _jb_build_runner(path, exec_name, 1);
+    char *socket_switch = jb_format_string("--josh-daemon=build/%s.sock", exec_name);
+
+    char *argv[] = { josh_builder_exe, socket_switch, NULL };
+    execv(josh_builder_exe, argv);
+
+    JB_FAIL("could not run %s: %s", josh_builder_exe, strerror(errno));
+#else
+    JB_FAIL("josh daemon needs inotify and is only supported on Linux");
+#endif
+}
+
+void josh_watch(const char *path, const char *exec_name, char *args[]) {
+#if JB_IS_LINUX
+    // regenerated the first time so the runner can watch with this version of josh
+    int force = 1;
+
+    while (1) {
+        char *josh_builder_exe = _jb_build_runner(path, exec_name, force);
+        force = 0;
+
+        JBVector(char *) cmds = {0};
+        JBVectorPush(&cmds, josh_builder_exe);
+        JBVectorPush(&cmds, "--josh-watch");
+
+        JBNullArrayFor(args) {
+            JBVectorPush(&cmds, (char *)args[index]);
+        }
+
+        JBVectorPush(&cmds, NULL);
+
+        fflush(stdout);
+        pid_t pid = fork();
+        JB_ASSERT(pid >= 0, "fork failed: %s", strerror(errno));
+
+        if (pid == 0) {
+            execv(josh_builder_exe, cmds.data);
+            jb_log_print("Could not run %s\n", josh_builder_exe);
+            _exit(1);
+        }
+
+        int wstatus = 0;
+
+        while (waitpid(pid, &wstatus, 0) < 0 && errno == EINTR)
+            ;
+
+        free(cmds.data);
+        free(josh_builder_exe);
+
+        if (!WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != _JB_RUNNER_RESTART)
+            exit(WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : 1);
+
+        JB_LOG("%s changed; restarting\n", path);
+    }
+#else
+    JB_FAIL("josh watch needs inotify and is only supported on Linux");
+#endif
+}
+
+int _jb_online_cpu_count() {
+#if JB_IS_WINDOWS
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int)count : 1;
+#endif
+}
+
+void jb_set_job_count(int jobs) {
+    _jb_job_count = jobs > 0 ? jobs : 0;
+}
+
+int jb_job_count() {
+    if (_jb_job_count > 0)
+        return _jb_job_count;
+
+    const char *env = getenv("JOSH_JOBS");
+    if (env && atoi(env) > 0)
+        _jb_job_count = atoi(env);
+    else
+        _jb_job_count = _jb_online_cpu_count();
+
+    return _jb_job_count;
+}
+
+void jb_set_content_hashing(int enabled) {
+    _jb_content_hashing = enabled;
+}
+
+void jb_set_compile_cache(int enabled) {
+    _jb_use_compile_cache = enabled != 0;
+}
+
+void jb_set_workers(const char *workers) {
+    _jb_workers = workers;
+}
+
+void jb_set_suggest_precompiled_header(int enabled) {
+    _jb_suggest_pch = enabled;
+}
+
+void jb_set_remote_cache(const char *url) {
+    _jb_remote_cache_url = url;
+
+    if (url)
+        jb_set_compile_cache(1);
+}
+
+void jb_set_profile_mode(enum JBProfileMode mode) {
+    _jb_profile_mode = mode;
+}
+
+enum JBProfileMode _jb_parse_profile_mode(const char *str) {
+    if (strcmp(str, "auto") == 0)
+        return JB_ENUM(ProfileAuto);
+    else if (strcmp(str, "train") == 0)
+        return JB_ENUM(ProfileTrain);
+    else if (strcmp(str, "reuse") == 0)
+        return JB_ENUM(ProfileReuse);
+
+    JB_FAIL("unrecognized profile mode: %s (expected auto, train or reuse)", str);
+}
+
+enum JBProfileMode _jb_profile_mode_get() {
+    if (_jb_profile_mode < 0) {
+        const char *env = getenv("JOSH_PGO");
+        _jb_profile_mode = env && *env ? _jb_parse_profile_mode(env) : JB_ENUM(ProfileAuto);
+    }
+
+    return (enum JBProfileMode)_jb_profile_mode;
+}
+
+void jb_set_output_order(enum JBOutputOrder order) {
+    _jb_output_order = order;
+}
+
+enum JBOutputOrder _jb_parse_output_order(const char *str) {
+    if (strcmp(str, "completion") == 0)
+        return JB_ENUM(OutputCompletion);
+    else if (strcmp(str, "submission") == 0)
+        return JB_ENUM(OutputSubmission);
+
+    JB_FAIL("unrecognized output order: %s (expected completion or submission)", str);
+}
+
+enum JBOutputOrder _jb_output_order_get() {
+    if (_jb_output_order < 0) {
+        const char *env = getenv("JOSH_OUTPUT_ORDER");
+        _jb_output_order = env && *env ? _jb_parse_output_order(env) : JB_ENUM(OutputCompletion);
+    }
+
+    return (enum JBOutputOrder)_jb_output_order;
+}
+
+int _jb_parse_job_count(const char *str) {
+    char *end = NULL;
+    long jobs = str ? strtol(str, &end, 10) : 0;
+
+    if (!str || *str == 0 || *end != 0 || jobs <= 0)
+        JB_FAIL("invalid job count: %s", str ? str : "(none)");
+
+    return (int)jobs;
+}
+
+char **josh_parse_arguments(int argc, char *argv[]) {
+
+    JBVector(char *) out = {0};
+
+    const char *jobs_switch = "--jobs=";
+    const char *content_hash_switch = "--content-hash";
+    const char *cache_switch = "--cache";
+    const char *remote_cache_switch = "--remote-cache=";
+    const char *workers_switch = "--workers=";
+    const char *suggest_pch_switch = "--suggest-pch";
+    const char *pgo_switch = "--pgo=";
+    const char *output_order_switch = "--output-order=";
+
+    const char *log_switch = "--log=";
+    const char *log_level_none = "none";
+    const char *log_level_default = "default";
+    const char *log_level_verbose = "verbose";
+
+    const char *verbose_switch = "--verbose"; // same as --log=verbose
+
+    for (int i = 0; i < argc; i++) {
+        if (strncmp(argv[i], log_switch, strlen(log_switch)) == 0) {
+            const char *level = argv[i] + strlen(log_switch);
+
+            if (strcmp(level, log_level_verbose) == 0) {
+                _jb_verbose_show_commands = 1;
+            }
+            else if (strcmp(level, log_level_default) == 0) {
+                // no-op
+            }
+            else if (strcmp(level, log_level_none) == 0) {
+                _jb_log_print_only = 1;
+            }
+            else {
+                JB_FAIL("unrecognized log level: %s", level);
+            }
+        }
+        else if (strcmp(argv[i], verbose_switch) == 0) {
+            _jb_verbose_show_commands = 1;
+        }
+        else if (strcmp(argv[i], content_hash_switch) == 0) {
+            jb_set_content_hashing(1);
+        }
+        else if (strcmp(argv[i], cache_switch) == 0) {
+            jb_set_compile_cache(1);
+        }
+        else if (strncmp(argv[i], remote_cache_switch, strlen(remote_cache_switch)) == 0) {
+            jb_set_remote_cache(argv[i] + strlen(remote_cache_switch));
+        }
+        else if (strncmp(argv[i], workers_switch, strlen(workers_switch)) == 0) {
+            jb_set_workers(argv[i] + strlen(workers_switch));
+        }
+        else if (strcmp(argv[i], suggest_pch_switch) == 0) {
+            jb_set_suggest_precompiled_header(1);
+        }
+        else if (strncmp(argv[i], pgo_switch, strlen(pgo_switch)) == 0) {
+            jb_set_profile_mode(_jb_parse_profile_mode(argv[i] + strlen(pgo_switch)));
+        }
+        else if (strncmp(argv[i], output_order_switch, strlen(output_order_switch)) == 0) {
+            jb_set_output_order(_jb_parse_output_order(argv[i] + strlen(output_order_switch)));
+        }
+        else if (strncmp(argv[i], jobs_switch, strlen(jobs_switch)) == 0) {
+            jb_set_job_count(_jb_parse_job_count(argv[i] + strlen(jobs_switch)));
+        }
+        else if (strcmp(argv[i], "-j") == 0) {
+            i += 1;
+            jb_set_job_count(_jb_parse_job_count(i < argc ? argv[i] : NULL));
+        }
+        else if (strncmp(argv[i], "-j", 2) == 0 && jb_isnumber(argv[i][2])) {
+            jb_set_job_count(_jb_parse_job_count(argv[i] + 2));
+        }
+        else {
+            JBVectorPush(&out, argv[i]);
+        }
+    }
+
+    JBVectorPush(&out, NULL);
+    return out.data;
+}
+
+typedef void (*_JBDrainPipeFn)(void *ctx, const char *str);
+
+void _jb_pipe_drain_log_proxy(void *context, const char *str) {
+    jb_log_print("%s", str);
+}
+
+void _jb_pipe_drain_sb_proxy(void *context, const char *str) {
+    jb_sb_puts((JBStringBuilder *)context, str);
+}
+
+#if JB_IS_WINDOWS
+
+int _jb_pipe_read_would_not_block(HANDLE fd) {
+    DWORD bytes_available = 0;
+    BOOL result = PeekNamedPipe(fd, NULL, 0, NULL, &bytes_available, NULL);
+
+    if (!result) {
+        jb_log_print("could not peek pipe\n");
+        return 0;
+    }
+
+    return bytes_available > 0;
+}
+
+int _jb_pipe_has_data(HANDLE fd) {
+    if (!_jb_pipe_read_would_not_block(fd))
+        return 0;
+
+    char c;
+    DWORD bytes = 0;
+    return ReadFile(fd, &c, 1, &bytes, NULL) && bytes > 0;
+}
+
+void _jb_drain_pipe(HANDLE fd, void *context, _JBDrainPipeFn fn) {
+    enum { buffer_size = 4096*2 };
+    char buffer[buffer_size];
+
+    while (_jb_pipe_read_would_not_block(fd)) {
+        DWORD bytes = 0;
+        BOOL result = ReadFile(fd, buffer, buffer_size-1, &bytes, NULL);
+
+        if (!result)
+            break;
+
+        if (bytes <= 0)
+            break;
+
+        if (bytes > 0) {
+            buffer[bytes] = 0;
+            fn(context, buffer);
+        }
+    }
+}
+
+int _jb_run_internal(char *const argv[], void *print_ctx, _JBDrainPipeFn print_fn, const char *file, int line) {
+    if (_jb_verbose_show_commands) {
+        // print the whole command at once so commands from concurrent jobs don't interleave
+        JBStringBuilder sb;
+        jb_sb_init(&sb);
+
+        JBNullArrayFor(argv) {
+            jb_sb_puts(&sb, argv[index]);
+            jb_sb_putchar(&sb, ' ');
+        }
+
+        char *cmdline = jb_sb_to_string(&sb);
+        jb_sb_free(&sb);
+
+        jb_log_print("%s\n", cmdline);
+        free(cmdline);
+    }
+
+    char *cmdline = NULL;
+    {
+        JBStringBuilder sb = {};
+        jb_sb_init(&sb);
+
+        JBNullArrayFor(argv) {
+            jb_sb_puts(&sb, argv[index]);
+            jb_sb_putchar(&sb, ' ');
+        }
+
+        cmdline = jb_sb_to_string(&sb);
+
+        jb_sb_free(&sb);
+    }
+
+    int pty = _jb_use_pty;
+    // TODO see if ConPTY is needed for some things
+    // On mac/Linux, pty mode is needed to get the child process to output colored text controls
+    // since if it cannot detect a terminal, it assumes output is redirected to a file
+    SECURITY_ATTRIBUTES security_attr = {};
+    security_attr.nLength = sizeof(SECURITY_ATTRIBUTES);
+    security_attr.bInheritHandle = TRUE;
+
+    HANDLE output_read = NULL;
+    HANDLE output_write = NULL;
+
+    HANDLE input_read = NULL;
+    HANDLE input_write = NULL;
+
+    if (!CreatePipe(&output_read, &output_write, &security_attr, 0)) {
+        jb_log_print("could not create output pipe for %s\n", argv[0]);
+        return 1;
+    }
+
+    if (!SetHandleInformation(output_read, HANDLE_FLAG_INHERIT, 0)) {
+        jb_log_print("could not set output pipe flag for %s\n", argv[0]);
+        return 1;
+    }
+
+    if (!CreatePipe(&input_read, &input_write, &security_attr, 0)) {
+        jb_log_print("could not create input pipe for %s\n", argv[0]);
+        return 1;
+    }
+
+     if (!SetHandleInformation(input_write, HANDLE_FLAG_INHERIT, 0)) {
+        jb_log_print("could not set input pipe flag for %s\n", argv[0]);
+        return 1;
+    }
+
+    STARTUPINFOA startup_info = {};
+    startup_info.cb = sizeof(STARTUPINFOA);
+    startup_info.dwFlags |= STARTF_USESTDHANDLES;
+    startup_info.hStdInput = input_read;
+    startup_info.hStdOutput = output_write;
+    startup_info.hStdError = output_write;
+
+    PROCESS_INFORMATION process_info = {};
+
+    if (!CreateProcessA(NULL, cmdline, NULL, NULL,
+                        TRUE, NORMAL_PRIORITY_CLASS, NULL, NULL,
+                        &startup_info, &process_info)) {
+        // TODO call GetLastError and report
+        jb_log_print("Could not run %s, error ID 0x%X\n", argv[0], GetLastError());
+        free(cmdline);
+        return 1;
+    }
+
+    free(cmdline);
+
+    do {
+        _jb_drain_pipe(output_read, print_ctx, print_fn);
+    } while (WaitForSingleObject(process_info.hProcess, 0) != WAIT_OBJECT_0);
+
+    _jb_drain_pipe(output_read, print_ctx, print_fn);
+    JB_ASSERT(!_jb_pipe_has_data(output_read), "data still in pipe");
+
+    DWORD exit_code = 0;
+    if (!GetExitCodeProcess(process_info.hProcess, &exit_code)) {
+        jb_log_print("Could not get process exit code for %s\n", argv[0]);
+        return 1;
+    }
+
+    CloseHandle(process_info.hProcess);
+    CloseHandle(process_info.hThread);
+
+    CloseHandle(output_write);
+    CloseHandle(input_read);
+    return exit_code;
+}
+
+#else
+
+int _jb_pipe_read_would_not_block(int fd) {
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+
+    int result = poll(&pfd, 1, 0);
+    return result > 0 && (pfd.revents & (POLLERR | POLLNVAL)) == 0;
+}
+
+int _jb_pipe_has_data(int fd) {
+    if (!_jb_pipe_read_would_not_block(fd))
+        return 0;
+
+    char c;
+    return read(fd, &c, 1) > 0;
+}
+
+void _jb_drain_pipe(int fd, void *context, _JBDrainPipeFn fn) {
+    enum { buffer_size = 4096*2 };
+    char buffer[buffer_size];
+
+    while (_jb_pipe_read_would_not_block(fd)) {
+        ssize_t bytes = read(fd, buffer, buffer_size-1);
+
+        if (bytes <= 0)
+            break;
+
+        if (bytes > 0) {
+            buffer[bytes] = 0;
+            fn(context, buffer);
+        }
+    }
+}
+
+// A child started by _jb_process_start(). Its stdout and stderr go to output, a pipe or pty.
+typedef struct {
+    pid_t pid;
+    int output; // -1 once it's closed
+    int pidfd; // becomes readable when the child exits; -1 where pidfd_open() isn't available
+    int exited;
+    int status; // from waitpid(), once exited
+
+    void *print_ctx;
+    _JBDrainPipeFn print_fn;
+} _JBProcess;
+
+// A descriptor that polls readable once pid exits (Linux 5.3 and later), or -1.
+int _jb_pidfd_open(pid_t pid) {
+#if JB_IS_LINUX && defined(SYS_pidfd_open)
+    int fd = (int)syscall(SYS_pidfd_open, pid, 0);
+
+    if (fd >= 0)
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    return fd;
+#else
+    return -1;
+#endif
+}
+
+// Our ends of a command's pipe or pty are close-on-exec from the moment they exist: commands
+// start from several threads, and one that inherited another command's pipe would hold it
+// open until it exits. Linux creates them that way atomically; elsewhere creating them and
+// starting a command exclude each other instead.
+#if JB_IS_LINUX && defined(SYS_pipe2) && defined(O_CLOEXEC) && defined(TIOCGPTN)
+#define _JB_ATOMIC_CLOEXEC 1
+#else
+#define _JB_ATOMIC_CLOEXEC 0
+static _JBMutex _jb_spawn_mutex = _JB_MUTEX_INITIALIZER;
+#endif
+
+void _jb_spawn_lock() {
+#if !_JB_ATOMIC_CLOEXEC
+    _jb_mutex_lock(&_jb_spawn_mutex);
+#endif
+}
+
+void _jb_spawn_unlock() {
+#if !_JB_ATOMIC_CLOEXEC
+    _jb_mutex_unlock(&_jb_spawn_mutex);
+#endif
+}
+
+// pipe() with both ends close-on-exec. dup2() in a child clears the flag.
+int _jb_pipe(int fds[2]) {
+#if _JB_ATOMIC_CLOEXEC
+    return (int)syscall(SYS_pipe2, fds, O_CLOEXEC);
+#else
+    _jb_spawn_lock();
+
+    int result = pipe(fds);
+
+    if (result == 0) {
+        fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+        fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    }
+
+    _jb_spawn_unlock();
+    return result;
+#endif
+}
+
+// Opens a new pty and returns its close-on-exec master, or -1. The path of the other end,
+// which the child opens, goes in name.
+int _jb_pty_open(char *name, size_t size) {
+#if _JB_ATOMIC_CLOEXEC
+    // what posix_openpt(), unlockpt() and ptsname() do, without needing _XOPEN_SOURCE
+    int master = open("/dev/ptmx", O_RDWR | O_NOCTTY | O_CLOEXEC);
+    int unlock = 0;
+    unsigned int number = 0;
+
+    if (master < 0)
+        return -1;
+
+    if (ioctl(master, TIOCSPTLCK, &unlock) != 0 || ioctl(master, TIOCGPTN, &number) != 0) {
+        close(master);
+        return -1;
+    }
+
+    snprintf(name, size, "/dev/pts/%u", number);
+    return master;
+#else
+    int master, slave;
+
+    _jb_spawn_lock();
+
+    int result = openpty(&master, &slave, name, NULL, NULL);
+
+    if (result == 0) {
+        fcntl(master, F_SETFD, FD_CLOEXEC);
+        close(slave);
+    }
+
+    _jb_spawn_unlock();
+    return result == 0 ? master : -1;
+#endif
+}
+
+int _jb_spawn_uses_fork() {
+    if (_jb_spawn_with_fork < 0) {
+        const char *env = getenv("JOSH_SPAWN");
+        _jb_spawn_with_fork = env && strcmp(env, "fork") == 0;
+    }
+
+    return _jb_spawn_with_fork;
+}
+
+// Starts argv with posix_spawnp(), writing to a new pipe or pty returned in output. glibc
+// and macOS start the child without copying the parent's page tables, so unlike fork() the
+// cost doesn't grow with a large runner's memory. Returns 0, an errno when argv couldn't be
+// started, or -1 when a pty can't be set up this way.
+int _jb_spawn(char *const argv[], int pty, int *output, pid_t *pid) {
+#ifndef POSIX_SPAWN_SETSID
+    if (pty)
+        return -1;
+#endif
+
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+
+    posix_spawn_file_actions_init(&actions);
+    posix_spawnattr_init(&attr);
+
+    int fds[2] = { -1, -1 };
+    char name[256];
+
+    if (pty) {
+        fds[0] = _jb_pty_open(name, sizeof(name));
+        JB_ASSERT(fds[0] >= 0, "could not open pty");
+
+#ifdef POSIX_SPAWN_SETSID
+        // like forkpty(): a new session, whose controlling terminal is the pty once its
+        // leader opens it
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSID);
+#endif
+        posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, name, O_RDWR, 0);
+        posix_spawn_file_actions_adddup2(&actions, STDIN_FILENO, STDOUT_FILENO);
+        posix_spawn_file_actions_adddup2(&actions, STDIN_FILENO, STDERR_FILENO);
+    }
+    else {
+        JB_ASSERT(_jb_pipe(fds) == 0, "could not open pipe");
+
+        posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+        posix_spawn_file_actions_adddup2(&actions, fds[1], STDERR_FILENO);
+    }
+
+    _jb_spawn_lock();
+    int error = posix_spawnp(pid, argv[0], &actions, &attr, argv, environ);
+    _jb_spawn_unlock();
+
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+
+    if (fds[1] >= 0)
+        close(fds[1]);
+
+    if (error) {
+        close(fds[0]);
+        return error;
+    }
+
+    *output = fds[0];
+    return 0;
+}
+
+// Starts argv with fork() and exec, writing to a new pipe or pty returned in output.
+pid_t _jb_fork_exec(char *const argv[], int pty, int *output) {
+    int pipefd[2] = { -1, -1 };
+    char name[256];
+
+    if (pty) {
+        pipefd[0] = _jb_pty_open(name, sizeof(name));
+        JB_ASSERT(pipefd[0] >= 0, "could not open pty");
+    }
+    else {
+        JB_ASSERT(_jb_pipe(pipefd) == 0, "could not open pipe");
+    }
+
+    _jb_spawn_lock();
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        // child
+
+        if (pty) {
+            // what forkpty() does: a new session, whose controlling terminal is the pty
+            setsid();
+            int tty = open(name, O_RDWR);
+#ifdef TIOCSCTTY
+            ioctl(tty, TIOCSCTTY, 0);
+#endif
+            dup2(tty, STDIN_FILENO);
+            dup2(tty, STDOUT_FILENO);
+            dup2(tty, STDERR_FILENO);
+
+            if (tty > STDERR_FILENO)
+                close(tty);
+        }
+        else {
+            // Map stdout and stderr to the pipe
+            dup2(pipefd[1], STDOUT_FILENO);
+            dup2(pipefd[1], STDERR_FILENO);
+        }
+
+        execvp(argv[0], argv);
+
+        // (only async-signal-safe calls from here: another thread may have held a lock
+        // when we forked, and exit() would flush the parent's buffers a second time)
+        const char *message[] = { "Could not run ", argv[0], "\n" };
+
+        for (int i = 0; i < 3; i++) {
+            if (write(STDOUT_FILENO, message[i], strlen(message[i])) < 0)
+                break;
+        }
+
+        _exit(1);
+    }
+
+    // parent
+    _jb_spawn_unlock();
+
+    JB_ASSERT(pid >= 0, "could not fork() process to execute %s\n", argv[0]);
+
+    // close write pipe
+    if (!pty)
+        close(pipefd[1]);
+
+    *output = pipefd[0];
+    return pid;
+}
+
+// Starts argv, in a pty when _jb_use_pty is set. A command that can't be started is
+// reported and looks like it exited with 1.
+void _jb_process_start(char *const argv[], void *print_ctx, _JBDrainPipeFn print_fn, _JBProcess *process) {
+    memset(process, 0, sizeof(_JBProcess));
+    process->print_ctx = print_ctx;
+    process->print_fn = print_fn;
+    process->output = -1;
+    process->pidfd = -1;
+
+    int pty = _jb_use_pty;
+    int error = _jb_spawn_uses_fork() ? -1 : _jb_spawn(argv, pty, &process->output, &process->pid);
+
+    if (error > 0) {
+        jb_log_print("Could not run %s\n", argv[0]);
+        process->exited = 1;
+        process->status = 1 << 8; // as waitpid() reports exit(1)
+        return;
+    }
+
+    if (error < 0)
+        process->pid = _jb_fork_exec(argv, pty, &process->output);
+
+    process->pidfd = _jb_pidfd_open(process->pid);
+}
+
+// Reaps process if it exited. Once it has, whatever it wrote is passed on and its output is
+// closed; a background child it left behind may still hold the pipe open.
+void _jb_process_reap(_JBProcess *process) {
+    pid_t w;
+
+    while ((w = waitpid(process->pid, &process->status, WNOHANG)) < 0 && errno == EINTR)
+        ;
+
+    if (w == 0)
+        return;
+
+    if (w < 0) {
+        jb_log_print("WAIT FAILED %s\n", strerror(errno));
+        process->status = 0;
+    }
+
+    process->exited = 1;
+
+    if (process->output >= 0) {
+        _jb_drain_pipe(process->output, process->print_ctx, process->print_fn);
+        JB_ASSERT(!_jb_pipe_has_data(process->output), "data still in pipe");
+
+        close(process->output);
+        process->output = -1;
+    }
+
+    if (process->pidfd >= 0) {
+        close(process->pidfd);
+        process->pidfd = -1;
+    }
+}
+
+// Waits until every process in processes exited, passing on their output as it arrives.
+// Sleeps in poll() until a child writes or exits. Where there's no pidfd to say a child
+// exited, that's noticed when it closes its output, or otherwise by checking every 50ms.
+void _jb_process_wait(_JBProcess *processes, size_t count) {
+    enum { buffer_size = 4096*2 };
+    char buffer[buffer_size];
+
+    struct pollfd *fds = malloc(sizeof(struct pollfd) * count * 2);
+    _JBProcess **owners = malloc(sizeof(_JBProcess *) * count * 2);
+
+    while (1) {
+        size_t fd_count = 0;
+        int timeout = -1;
+        int running = 0;
+
+        for (size_t i = 0; i < count; i++) {
+            _JBProcess *process = &processes[i];
+
+            if (process->exited)
+                continue;
+
+            running = 1;
+
+            if (process->output >= 0) {
+                fds[fd_count] = (struct pollfd){ .fd = process->output, .events = POLLIN };
+                owners[fd_count++] = process;
+            }
+
+            if (process->pidfd >= 0) {
+                fds[fd_count] = (struct pollfd){ .fd = process->pidfd, .events = POLLIN };
+                owners[fd_count++] = process;
+            }
+            else {
+                timeout = 50;
+            }
+        }
+
+        if (!running)
+            break;
+
+        if (poll(fds, fd_count, timeout) < 0 && errno != EINTR) {
+            jb_log_print("POLL FAILED %s\n", strerror(errno));
+            break;
+        }
+
+        for (size_t i = 0; i < fd_count; i++) {
+            _JBProcess *process = owners[i];
+
+            if (!fds[i].revents)
+                continue;
+
+            // (a process's output comes before its pidfd, so it's read before being reaped)
+            if (fds[i].fd == process->pidfd) {
+                _jb_process_reap(process);
+                continue;
+            }
+
+            // one read per wakeup, so a chatty child doesn't hold up the others
+            ssize_t bytes = read(process->output, buffer, buffer_size-1);
+
+            if (bytes > 0) {
+                buffer[bytes] = 0;
+                process->print_fn(process->print_ctx, buffer);
+            }
+            else if (bytes == 0 || errno != EINTR) {
+                // end of output (a pty reports EIO once the child is gone)
+                close(process->output);
+                process->output = -1;
+            }
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            _JBProcess *process = &processes[i];
+
+            if (process->exited || process->pidfd >= 0)
+                continue;
+
+            _jb_process_reap(process);
+
+            // a child that closed its output is most likely exiting
+            if (!process->exited && process->output < 0) {
+                while (waitpid(process->pid, &process->status, 0) < 0 && errno == EINTR)
+                    ;
+
+                process->exited = 1;
+            }
+        }
+    }
+
+    free(owners);
+    free(fds);
+}
+
+int _jb_run_internal(char *const argv[], void *print_ctx, _JBDrainPipeFn print_fn, const char *file, int line) {
+    if (_jb_verbose_show_commands) {
+        // print the whole command at once so commands from concurrent jobs don't interleave
+        JBStringBuilder sb;
+        jb_sb_init(&sb);
+
+        JBNullArrayFor(argv) {
+            jb_sb_puts(&sb, argv[index]);
+            jb_sb_putchar(&sb, ' ');
+        }
+
+        char *cmdline = jb_sb_to_string(&sb);
+        jb_sb_free(&sb);
+
+        jb_log_print("%s\n", cmdline);
+        free(cmdline);
+    }
+
+    _JBProcess process;
+    _jb_process_start(argv, print_ctx, print_fn, &process);
+    _jb_process_wait(&process, 1);
+
+    int wstatus = process.status;
+
+    if (WIFSIGNALED(wstatus)) {
+        jb_log("%s:%d: %s: %s\n", file, line, argv[0], strsignal(WTERMSIG(wstatus)));
+        return 1;
+    }
+
+    if (WEXITSTATUS(wstatus) != 0) {
+        jb_log("%s:%d: %s: exit %d\n", file, line, argv[0], WEXITSTATUS(wstatus));
+        return WEXITSTATUS(wstatus);
+    }
+
+    return WEXITSTATUS(wstatus);
+}
+
+#endif // JB_IS_WINDOWS
+
+void jb_run(char *const argv[], const char *file, int line) {
+    int result = _jb_run_internal(argv, NULL, _jb_pipe_drain_log_proxy, file, line);
+
+    if (result)
+        exit(1);
+}
+
+struct JBRunResult jb_run_get_output(char *const argv[], const char *file, int line) {
+    JBStringBuilder sb;
+    jb_sb_init(&sb);
+
+    int result = _jb_run_internal(argv, &sb, _jb_pipe_drain_sb_proxy, file, line);
+
+    char *output = jb_sb_to_string(&sb);
+
+    jb_sb_free(&sb);
+
+    jb_log("%s", output);
+
+    struct JBRunResult out;
+    out.exit_code = result;
+    out.output = output;
+
+    return out;
+}
+
+typedef void (*_JBJobFn)(void *ctx);
+
+typedef struct _JBJob {
+    _JBJobFn fn;
+    void *ctx;
+
+    int waiting_on; // unfinished jobs this job depends on
+    size_t sequence; // position in submission order, for OutputSubmission
+    int submitted;
+    int finished;
+    JBVector(struct _JBJob *) dependents;
+} _JBJob;
+
+// Runs jobs on jb_job_count()-1 worker threads; the thread that waits on the pool
+// executes jobs as well, so a job count of 1 runs everything in submission order
+// on the calling thread.
+// A job only becomes ready once every job it depends on has finished.
+typedef struct {
+    _JBMutex mutex;
+    _JBCond cond; // signaled when a job becomes ready or finishes
+
+    JBVector(_JBJob *) jobs; // every job created since the last wait
+    JBVector(_JBJob *) ready;
+    size_t next; // index of the next job in ready to hand out
+    size_t unfinished; // submitted jobs that have not finished
+
+    JBVector(_JBThread) threads;
+} _JBJobPool;
+
+static _JBJobPool *_jb_job_pool = NULL;
+
+void _jb_job_pool_make_ready(_JBJobPool *pool, _JBJob *job) {
+    // expects pool->mutex to be held
+    JBVectorPush(&pool->ready, job);
+    _jb_cond_broadcast(&pool->cond);
+}
+
+int _jb_job_pool_run_one(_JBJobPool *pool) {
+    // expects pool->mutex to be held
+    if (pool->next >= pool->ready.count)
+        return 0;
+
+    _JBJob *job = pool->ready.data[pool->next];
+    pool->next += 1;
+
+    _jb_mutex_unlock(&pool->mutex);
+
+    _JBJobOutput *previous = _jb_job_output_begin(job->sequence);
+    job->fn(job->ctx);
+    _jb_job_output_end(previous);
+
+    _jb_mutex_lock(&pool->mutex);
+
+    job->finished = 1;
+    pool->unfinished -= 1;
+
+    JBArrayForEach(&job->dependents) {
+        _JBJob *dependent = *it;
+        dependent->waiting_on -= 1;
+
+        if (dependent->waiting_on == 0 && dependent->submitted)
+            _jb_job_pool_make_ready(pool, dependent);
+    }
+
+    _jb_cond_broadcast(&pool->cond);
+    return 1;
+}
+
+_JB_THREAD_PROC(_jb_job_pool_worker, arg) {
+    _JBJobPool *pool = (_JBJobPool *)arg;
+
+    _jb_mutex_lock(&pool->mutex);
+
+    while (1) {
+        if (!_jb_job_pool_run_one(pool))
+            _jb_cond_wait(&pool->cond, &pool->mutex);
+    }
+
+    _jb_mutex_unlock(&pool->mutex);
+    _JB_THREAD_RETURN;
+}
+
+int _jb_worker_slots();
+
+_JBJobPool *_jb_get_job_pool() {
+    if (_jb_job_pool)
+        return _jb_job_pool;
+
+    // Open the log file before there are threads that could race to open it.
+    if (!_jb_log_print_only && _jb_log_fd == -1)
+        jb_log_set_file("josh.log");
+
+    if (_jb_log_fd >= 0)
+        _jb_log_start_writer();
+
+    // Anything buffered for jobs is written if a job ends josh.
+    atexit(_jb_job_output_exit);
+
+    _JBJobPool *pool = malloc(sizeof(_JBJobPool));
+    memset(pool, 0, sizeof(_JBJobPool));
+
+    _jb_mutex_init(&pool->mutex);
+    _jb_cond_init(&pool->cond);
+
+    // Compiles that go to workers mostly wait on the network, so they get threads on top
+    // of the local jobs.
+    int threads = jb_job_count() + _jb_worker_slots();
+
+    for (int i = 1; i < threads; i++) {
+        JBVectorPush(&pool->threads, _jb_thread_start(_jb_job_pool_worker, pool));
+    }
+
+    _jb_job_pool = pool;
+    return pool;
+}
+
+// Creates a job that does not run until it is given to _jb_job_submit().
+// Jobs are owned by the pool and freed by _jb_job_pool_wait().
+_JBJob *_jb_job_create(_JBJobPool *pool, _JBJobFn fn, void *ctx) {
+    _JBJob *job = malloc(sizeof(_JBJob));
+    memset(job, 0, sizeof(_JBJob));
+    job->fn = fn;
+    job->ctx = ctx;
+
+    _jb_mutex_lock(&pool->mutex);
+    JBVectorPush(&pool->jobs, job);
+    _jb_mutex_unlock(&pool->mutex);
+
+    return job;
+}
+
+// job will not start before dependency has finished. Must be called before job is submitted.
+void _jb_job_depends_on(_JBJobPool *pool, _JBJob *job, _JBJob *dependency) {
+    if (!dependency)
+        return;
+
+    _jb_mutex_lock(&pool->mutex);
+
+    assert(!job->submitted);
+
+    if (!dependency->finished) {
+        job->waiting_on += 1;
+        JBVectorPush(&dependency->dependents, job);
+    }
+
+    _jb_mutex_unlock(&pool->mutex);
+}
+
+void _jb_job_submit(_JBJobPool *pool, _JBJob *job) {
+    _jb_mutex_lock(&pool->mutex);
+
+    job->submitted = 1;
+    job->sequence = _jb_job_output_sequence();
+    pool->unfinished += 1;
+
+    if (job->waiting_on == 0)
+        _jb_job_pool_make_ready(pool, job);
+
+    _jb_mutex_unlock(&pool->mutex);
+}
+
+_JBJob *_jb_job_pool_submit(_JBJobPool *pool, _JBJobFn fn, void *ctx) {
+    _JBJob *job = _jb_job_create(pool, fn, ctx);
+    _jb_job_submit(pool, job);
+    return job;
+}
+
+// Runs ready jobs on the calling thread until every submitted job has finished.
+void _jb_job_pool_wait(_JBJobPool *pool) {
+    _jb_mutex_lock(&pool->mutex);
+
+    while (pool->unfinished) {
+        if (!_jb_job_pool_run_one(pool))
+            _jb_cond_wait(&pool->cond, &pool->mutex);
+    }
+
+    JBArrayForEach(&pool->jobs) {
+        free((*it)->dependents.data);
+        free(*it);
+    }
+
+    pool->jobs.count = 0;
+    pool->ready.count = 0;
+    pool->next = 0;
+
+    _jb_mutex_unlock(&pool->mutex);
+}
+
+int jb_iswhitespace(int c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v';
+}
+
+int jb_isalpha(int c) {
+    c |= 0x20;
+    return c >= 'a' && c <= 'z';
+}
+
+int jb_isnumber(int c) {
+    return c >= '0' && c <= '9';
+}
+
+int jb_isalphanumeric(int c) {
+    return jb_isalpha(c) || jb_isnumber(c);
+}
+
+void jb_run_string(const char *cmd, char *const extra[], const char *file, int line) {
+    JBVector(char *) args = {0};
+
+    const char *start = cmd;
+
+    while (*start && jb_iswhitespace(*start))
+        start += 1;
+
+    const char *end = start;
+
+    while (*start) {
+        end += 1;
+
+        if ((jb_iswhitespace(*end) || *end == 0) && start != end) {
+            size_t len = end-start;
+            char *out = malloc(len+1);
+
+            memcpy(out, start, len);
+            out[len] = 0;
+
+            JBVectorPush(&args, out);
+
+            while (*end && jb_iswhitespace(*end))
+                end += 1;
+
+            start = end;
+        }
+    }
+
+    JBStringBuilder sb;
+    jb_sb_init(&sb);
+
+    JBArrayFor(&args) {
+        char *start = args.data[index];
+        char *input = start;
+
+        while (*input) {
+            if (*input == '$') {
+                input += 1;
+                char *env_start = input;
+
+                while (*input && (jb_isalphanumeric(*input) || *input == '_')) {
+                    input += 1;
+                }
+
+                char *env = jb_format_string("%.*s", input-env_start, env_start);
+
+                char *value = getenv(env);
+
+                while (value && *value) {
+                    jb_sb_putchar(&sb, *value);
+                    value += 1;
+                }
+
+                free(env);
+                continue;
+            }
+
+            jb_sb_putchar(&sb, *input);
+            input += 1;
+        }
+
+        free(start);
+        args.data[index] = jb_sb_to_string(&sb);
+
+        jb_sb_free(&sb);
+        jb_sb_init(&sb);
+    }
+
+    jb_sb_free(&sb);
+
+    size_t allocated_end = args.count;
+
+    JBNullArrayFor(extra) {
+        JBVectorPush(&args, extra[index]);
+    }
+
+    JBVectorPush(&args, NULL);
+    jb_run(args.data, file, line);
+
+    for (size_t i = 0; i < allocated_end; i++) {
+        free(args.data[i]);
+    }
+
+    free(args.data);
+}
+
+int jb_string_array_count(char **array) {
+    int i = 0;
+    while (array && array[i])
+        i += 1;
+
+    return i;
+}
+
+char *jb_concat(const char *lhs, const char *rhs) {
+    size_t l = strlen(lhs);
+    size_t r = strlen(rhs);
+
+    char *out = malloc(l+r+1);
+    memcpy(out, lhs, l);
+    memcpy(out+l, rhs, r);
+    out[l+r] = 0;
+    return out;
+}
+
+char *jb_copy_string(const char *str) {
+    size_t l = strlen(str);
+
+    char *out = malloc(l+1);
+    memcpy(out, str, l+1);
+    return out;
+}
+
+char *jb_va_format_string(const char *fmt, va_list args) {
+    size_t size = 4096;
+
+    char *buf = malloc(size);
+
+    int result;
+
+    {
+        va_list args_copy;
+        va_copy(args_copy, args);
+
+        result = vsnprintf(buf, size, fmt, args_copy);
+
+        va_end(args_copy);
+    }
+
+    if (result < 0) {
+        free(buf);
+        return NULL;
+    }
+
+    if (result < size)
+        return buf;
+
+    size = result+1;
+    buf = realloc(buf, size);
+
+    {
+        va_list args_copy;
+        va_copy(args_copy, args);
+
+        result = vsnprintf(buf, size, fmt, args_copy);
+
+        va_end(args_copy);
+    }
+
+    if (result < 0) {
+        free(buf);
+        return NULL;
+    }
+
+    return buf;
+}
+
+char *jb_format_string(const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    char *out = jb_va_format_string(fmt, args);
+    va_end(args);
+    return out;
+}
+
+const char *jb_filename(const char *path) {
+    char *slash = strrchr(path, JB_PATH_SEPARATOR);
+
+    if (slash) {
+        char *out = slash+1;
+
+        if (strlen(out) == 0)
+            return NULL;
+
+        return out;
+    }
+
+    return path;
+}
+
+const char *jb_extension(const char *path) {
+    const char *filename = jb_filename(path);
+
+    const char *ext = strrchr(filename, '.');
+
+    if (ext)
+        ext += 1;
+
+    return ext;
+}
+
+char *jb_drop_last_path_component(const char *path) {
+    char *slash = strrchr(path, JB_PATH_SEPARATOR);
+
+    if (slash) {
+        char *end = slash;
+
+        if (strlen(end) == 0)
+            return jb_copy_string(path);
+
+        size_t len = end-path;
+        char *out = malloc(len+1);
+        memcpy(out, path, len);
+        out[len] = 0;
+        return out;
+    }
+
+    return jb_copy_string(path);
+}
+
+const char *_jb_arch_string(enum JBArch arch) {
+    switch (arch) {
+    case JB_ENUM(X86_64):
+        return "x86_64";
+    case JB_ENUM(X86):
+        return "x86";
+    case JB_ENUM(ARM64):
+        return "arm64";
+    case JB_ENUM(INVALID_ARCH):
+    default:
+        return NULL;
+    }
+}
+
+enum JBArch _jb_arch(const char *str) {
+    if (strcmp(str, "x86_64") == 0)
+        return JB_ENUM(X86_64);
+    if (strcmp(str, "x86") == 0 || strcmp(str, "i386") == 0 || strcmp(str, "i686") == 0)
+        return JB_ENUM(X86);
+    if (strcmp(str, "arm64") == 0)
+        return JB_ENUM(ARM64);
+    if (strcmp(str, "aarch64") == 0)
+        return JB_ENUM(ARM64);
+
+    return JB_ENUM(INVALID_ARCH);
+}
+
+const char *_jb_vendor_string(enum JBVendor vendor) {
+    switch (vendor) {
+    case JB_ENUM(Apple):
+        return "apple";
+    case JB_ENUM(Linux):
+        return "linux";
+    case JB_ENUM(Windows):
+        return "windows";
+    case JB_ENUM(UNKNOWN_VENDOR):
+        return "unknown";
+    case JB_ENUM(INVALID_VENDOR):
+    default:
+        return NULL;
+    }
+}
+
+enum JBVendor _jb_vendor(const char *str) {
+    if (!str)
+        return JB_ENUM(UNKNOWN_VENDOR);
+
+    if (strcmp(str, "apple") == 0)
+        return JB_ENUM(Apple);
+    if (strcmp(str, "linux") == 0)
+        return JB_ENUM(Linux);
+    if (strcmp(str, "windows") == 0)
+        return JB_ENUM(Windows);
+
+    return JB_ENUM(UNKNOWN_VENDOR);
+}
+
+const char *_jb_runtime_string(enum JBRuntime runtime) {
+    switch (runtime) {
+    case JB_ENUM(Darwin):
+        return "darwin";
+    case JB_ENUM(GNU):
+        return "gnu";
+    case JB_ENUM(MSVC):
+        return "msvc";
+    case JB_ENUM(ELF):
+        return "elf";
+    case JB_ENUM(INVALID_RUNTIME):
+    default:
+        return NULL;
+    }
+}
+
+enum JBRuntime _jb_runtime(const char *str) {
+    if (strcmp(str, "darwin") == 0)
+        return JB_ENUM(Darwin);
+    if (strcmp(str, "gnu") == 0)
+        return JB_ENUM(GNU);
+    if (strcmp(str, "msvc") == 0)
+        return JB_ENUM(MSVC);
+    if (strcmp(str, "elf") == 0)
+        return JB_ENUM(ELF);
+
+    return JB_ENUM(INVALID_RUNTIME);
+}
+
+int _jb_is_objc_ext(const char *ext) {
+    return strcmp(ext, "m") == 0 || strcmp(ext, "mm") == 0;
+}
+
+typedef JBVector(char *) _JBCommandVector;
+
+// Returns a copy of the compile command cmd to run, asking the compiler to color its
+// diagnostics when they end up on a terminal. The flag doesn't change the object, so it's
+// left out of the command's signature and compile cache key.
+char **_jb_color_command(char **cmd, int is_msvc) {
+    _JBCommandVector out = {0};
+
+    JBNullArrayFor(cmd) {
+        JBVectorPush(&out, cmd[index]);
+
+        if (index == 0 && !is_msvc && _jb_color_diagnostics()) {
+            JBVectorPush(&out, "-fdiagnostics-color=always");
+        }
+    }
+
+    JBVectorPush(&out, NULL);
+    return out.data;
+}
+
+void _jb_add_common_c_options(JBToolchain *tc, _JBCommandVector *cmd, const char *tool, const char **cflags, const char **include_paths) {
+    char *triplet = jb_get_triple(tc);
+    int is_msvc = (tc->triple.vendor == JB_ENUM(Windows));
+
+    if (is_msvc) {
+        JBVectorPush(cmd, "/nologo");
+    }
+
+    if (triplet && strstr(tool, "clang") != NULL) {
+        JBVectorPush(cmd, "-target");
+        JBVectorPush(cmd, triplet);
+
+        // JBVectorPush(cmd, "--rtlib=compiler-rt");
+    }
+
+
+    if (tc->sysroot) {
+        // TODO check if Apple LD or GNU LD
+        // JBVectorPush(cmd, "-syslibroot");
+        JBVectorPush(cmd, "--sysroot");
+        JBVectorPush(cmd, tc->sysroot);
+    }
+
+    JBNullArrayFor(cflags) {
+        JBVectorPush(cmd, (char *)cflags[index]);
+    }
+
+    JBNullArrayFor(include_paths) {
+        if (is_msvc) {
+            JBVectorPush(cmd, "/I");
+        }
+        else {
+            JBVectorPush(cmd, "-I");
+        }
+        JBVectorPush(cmd, (char *)include_paths[index]);
+    }
+
+    if (is_msvc) {
+        JBVectorPush(cmd, "/c");
+    }
+    else {
+        JBVectorPush(cmd, "-c");
+    }
+}
+
+uint64_t _jb_hash_string(const char *str) {
+    // FNV-1a
+    uint64_t hash = 0xcbf29ce484222325ull;
+
+    while (*str) {
+        hash ^= (unsigned char)*str;
+        hash *= 0x100000001b3ull;
+        str += 1;
+    }
+
+    return hash;
+}
+
+// Open-addressing map from strings to pointers. Keys are not copied; they must
+// outlive the map.
+typedef struct {
+    const char **keys;
+    void **values;
+    size_t capacity; // always a power of two
+    size_t count;
+} _JBStringMap;
+
+void *_jb_string_map_get(_JBStringMap *map, const char *key) {
+    if (!map->capacity)
+        return NULL;
+
+    size_t mask = map->capacity - 1;
+
+    for (size_t i = _jb_hash_string(key) & mask; map->keys[i]; i = (i + 1) & mask) {
+        if (strcmp(map->keys[i], key) == 0)
+            return map->values[i];
+    }
+
+    return NULL;
+}
+
+void _jb_string_map_put(_JBStringMap *map, const char *key, void *value) {
+    if ((map->count + 1) * 4 > map->capacity * 3) {
+        _JBStringMap grown = {0};
+        grown.capacity = map->capacity ? map->capacity * 2 : 64;
+        grown.keys = calloc(grown.capacity, sizeof(char *));
+        grown.values = calloc(grown.capacity, sizeof(void *));
+
+        for (size_t i = 0; i < map->capacity; i++) {
+            if (map->keys[i])
+                _jb_string_map_put(&grown, map->keys[i], map->values[i]);
+        }
+
+        free(map->keys);
+        free(map->values);
+        *map = grown;
+    }
+
+    size_t mask = map->capacity - 1;
+    size_t i = _jb_hash_string(key) & mask;
+
+    for (; map->keys[i]; i = (i + 1) & mask) {
+        if (strcmp(map->keys[i], key) == 0) {
+            map->values[i] = value;
+            return;
+        }
+    }
+
+    map->keys[i] = key;
+    map->values[i] = value;
+    map->count += 1;
+}
+
+void _jb_string_map_free(_JBStringMap *map) {
+    free(map->keys);
+    free(map->values);
+    memset(map, 0, sizeof(_JBStringMap));
+}
+
+typedef struct {
+    int exists;
+    uint64_t mtime; // nanoseconds on POSIX, FILETIME ticks on Windows; only compared with each other
+    uint64_t size;
+} _JBFileStat;
+
+// One stat()/GetFileAttributesEx() call; see _jb_file_stat for the cached version.
+_JBFileStat _jb_stat_uncached(const char *path);
+
+// While a target graph is being built, results of _jb_file_stat are cached per path so
+// headers shared by many objects are only stat'ed once. josh invalidates entries for
+// the files it writes; everything else is assumed not to change during the build.
+#define _JB_STAT_CACHE_SHARDS 16
+
+typedef struct {
+    _JBMutex mutex;
+    _JBStringMap entries; // canonical path -> _JBFileStat *
+} _JBStatCacheShard;
+
+static _JBStatCacheShard _jb_stat_cache[_JB_STAT_CACHE_SHARDS];
+static int _jb_stat_cache_depth = 0;
+
+// Lexically canonicalizes path into out (at least strlen(path)+1 bytes): drops "./"
+// components and repeated separators. ".." is kept since it can't be resolved without
+// looking at symlinks.
+void _jb_canonical_path(const char *path, char *out) {
+    char *o = out;
+
+    while (path[0] == '.' && path[1] == JB_PATH_SEPARATOR)
+        path += 2;
+
+    while (*path) {
+        if (*path == JB_PATH_SEPARATOR) {
+            while (path[1] == JB_PATH_SEPARATOR)
+                path += 1;
+
+            if (path[1] == '.' && (path[2] == JB_PATH_SEPARATOR || path[2] == 0) && o != out) {
+                path += 2;
+                continue;
+            }
+        }
+
+        *o++ = *path++;
+    }
+
+    *o = 0;
+}
+
+// In a build served by `josh daemon`, refreshes the entries the daemon saw change since
+// the build started; see _jb_daemon_serve.
+void _jb_daemon_sync();
+
+void _jb_stat_cache_begin() {
+    if (_jb_stat_cache_depth == 0) {
+        for (int i = 0; i < _JB_STAT_CACHE_SHARDS; i++)
+            _jb_mutex_init(&_jb_stat_cache[i].mutex);
+    }
+
+    _jb_stat_cache_depth += 1;
+
+    if (_jb_stat_cache_depth == 1)
+        _jb_daemon_sync();
+}
+
+void _jb_stat_cache_clear() {
+    for (int i = 0; i < _JB_STAT_CACHE_SHARDS; i++) {
+        _JBStringMap *entries = &_jb_stat_cache[i].entries;
+
+        for (size_t k = 0; k < entries->capacity; k++) {
+            if (entries->keys[k]) {
+                free((char *)entries->keys[k]);
+                free(entries->values[k]);
+            }
+        }
+
+        _jb_string_map_free(entries);
+    }
+}
+
+void _jb_stat_cache_end() {
+    _jb_stat_cache_depth -= 1;
+
+    if (_jb_stat_cache_depth == 0)
+        _jb_stat_cache_clear();
+}
+
+_JBFileStat _jb_file_stat(const char *path) {
+    if (!_jb_stat_cache_depth)
+        return _jb_stat_uncached(path);
+
+    size_t len = strlen(path);
+    char stack_buffer[512];
+    char *key = len < sizeof(stack_buffer) ? stack_buffer : malloc(len + 1);
+    _jb_canonical_path(path, key);
+
+    _JBStatCacheShard *shard = &_jb_stat_cache[_jb_hash_string(key) % _JB_STAT_CACHE_SHARDS];
+
+    _jb_mutex_lock(&shard->mutex);
+    _JBFileStat *entry = _jb_string_map_get(&shard->entries, key);
+    _JBFileStat out = entry ? *entry : (_JBFileStat){0};
+    _jb_mutex_unlock(&shard->mutex);
+
+    if (!entry) {
+        // stat without holding the lock; racing threads store the same result
+        out = _jb_stat_uncached(key);
+
+        _jb_mutex_lock(&shard->mutex);
+        entry = _jb_string_map_get(&shard->entries, key);
+
+        if (!entry) {
+            entry = malloc(sizeof(_JBFileStat));
+            _jb_string_map_put(&shard->entries, jb_copy_string(key), entry);
+        }
+
+        *entry = out;
+        _jb_mutex_unlock(&shard->mutex);
+    }
+
+    if (key != stack_buffer)
+        free(key);
+
+    return out;
+}
+
+// Called after josh writes path so the next _jb_file_stat sees the new file.
+void _jb_stat_invalidate(const char *path) {
+    if (!_jb_stat_cache_depth)
+        return;
+
+    _JBFileStat st = _jb_stat_uncached(path);
+
+    size_t len = strlen(path);
+    char *key = malloc(len + 1);
+    _jb_canonical_path(path, key);
+
+    _JBStatCacheShard *shard = &_jb_stat_cache[_jb_hash_string(key) % _JB_STAT_CACHE_SHARDS];
+
+    _jb_mutex_lock(&shard->mutex);
+    _JBFileStat *entry = _jb_string_map_get(&shard->entries, key);
+
+    if (entry) {
+        *entry = st;
+        free(key);
+    }
+    else {
+        entry = malloc(sizeof(_JBFileStat));
+        *entry = st;
+        _jb_string_map_put(&shard->entries, key, entry);
+    }
+
+    _jb_mutex_unlock(&shard->mutex);
+}
+
+// Re-stats path if the cache has an entry for it; unlike _jb_stat_invalidate, paths the
+// cache doesn't know stay unknown. Returns 1 if there was an entry.
+int _jb_stat_refresh(const char *path) {
+    if (!_jb_stat_cache_depth)
+        return 0;
+
+    size_t len = strlen(path);
+    char *key = malloc(len + 1);
+    _jb_canonical_path(path, key);
+
+    _JBStatCacheShard *shard = &_jb_stat_cache[_jb_hash_string(key) % _JB_STAT_CACHE_SHARDS];
+
+    _jb_mutex_lock(&shard->mutex);
+    int known = _jb_string_map_get(&shard->entries, key) != NULL;
+    _jb_mutex_unlock(&shard->mutex);
+
+    if (known) {
+        _JBFileStat st = _jb_stat_uncached(key);
+
+        _jb_mutex_lock(&shard->mutex);
+        *(_JBFileStat *)_jb_string_map_get(&shard->entries, key) = st;
+        _jb_mutex_unlock(&shard->mutex);
+    }
+
+    free(key);
+    return known;
+}
+
+// Writes text to path unless it already holds exactly that, so regenerating an unchanged
+// file doesn't make it look newer than its object.
+void _jb_write_file_if_changed(const char *path, const char *text) {
+    size_t len = 0;
+    char *current = _jb_read_file(path, &len);
+    int same = current && len == strlen(text) && memcmp(current, text, len) == 0;
+    free(current);
+
+    if (same)
+        return;
+
+    FILE *file = fopen(path, "wb");
+    JB_ASSERT(file, "could not write %s", path);
+
+    fwrite(text, 1, strlen(text), file);
+    fclose(file);
+
+    _jb_stat_invalidate(path);
+}
+
+int jb_file_is_newer(const char *source, const char *dest) {
+    _JBFileStat s = _jb_file_stat(source);
+    JB_ASSERT(s.exists, "file not found: %s", source);
+
+    _JBFileStat d = _jb_file_stat(dest);
+
+    return s.mtime > d.mtime;
+}
+
+#define _JB_XXH_PRIME64_1 0x9E3779B185EBCA87ull
+#define _JB_XXH_PRIME64_2 0xC2B2AE3D27D4EB4Full
+#define _JB_XXH_PRIME64_3 0x165667B19E3779F9ull
+#define _JB_XXH_PRIME64_4 0x85EBCA77C2B2AE63ull
+#define _JB_XXH_PRIME64_5 0x27D4EB2F165667C5ull
+
+uint64_t _jb_rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+uint64_t _jb_read64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+uint32_t _jb_read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+uint64_t _jb_xxh64_round(uint64_t acc, uint64_t input) {
+    acc += input * _JB_XXH_PRIME64_2;
+    acc = _jb_rotl64(acc, 31);
+    return acc * _JB_XXH_PRIME64_1;
+}
+
+uint64_t _jb_xxh64_merge_round(uint64_t acc, uint64_t val) {
+    acc ^= _jb_xxh64_round(0, val);
+    return acc * _JB_XXH_PRIME64_1 + _JB_XXH_PRIME64_4;
+}
+
+// XXH64; see https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md
+uint64_t _jb_hash_bytes(const void *data, size_t len, uint64_t seed) {
+    const unsigned char *p = (const unsigned char *)data;
+    const unsigned char *end = p + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        uint64_t v1 = seed + _JB_XXH_PRIME64_1 + _JB_XXH_PRIME64_2;
+        uint64_t v2 = seed + _JB_XXH_PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - _JB_XXH_PRIME64_1;
+
+        do {
+            v1 = _jb_xxh64_round(v1, _jb_read64(p)); p += 8;
+            v2 = _jb_xxh64_round(v2, _jb_read64(p)); p += 8;
+            v3 = _jb_xxh64_round(v3, _jb_read64(p)); p += 8;
+            v4 = _jb_xxh64_round(v4, _jb_read64(p)); p += 8;
+        } while (p + 32 <= end);
+
+        h = _jb_rotl64(v1, 1) + _jb_rotl64(v2, 7) + _jb_rotl64(v3, 12) + _jb_rotl64(v4, 18);
+        h = _jb_xxh64_merge_round(h, v1);
+        h = _jb_xxh64_merge_round(h, v2);
+        h = _jb_xxh64_merge_round(h, v3);
+        h = _jb_xxh64_merge_round(h, v4);
+    }
+    else {
+        h = seed + _JB_XXH_PRIME64_5;
+    }
+
+    h += (uint64_t)len;
+
+    while (p + 8 <= end) {
+        h ^= _jb_xxh64_round(0, _jb_read64(p));
+        h = _jb_rotl64(h, 27) * _JB_XXH_PRIME64_1 + _JB_XXH_PRIME64_4;
+        p += 8;
+    }
+
+    if (p + 4 <= end) {
+        h ^= (uint64_t)_jb_read32(p) * _JB_XXH_PRIME64_1;
+        h = _jb_rotl64(h, 23) * _JB_XXH_PRIME64_2 + _JB_XXH_PRIME64_3;
+        p += 4;
+    }
+
+    while (p < end) {
+        h ^= (*p) * _JB_XXH_PRIME64_5;
+        h = _jb_rotl64(h, 11) * _JB_XXH_PRIME64_1;
+        p += 1;
+    }
+
+    h ^= h >> 33;
+    h *= _JB_XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= _JB_XXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+uint64_t _jb_hash_combine(uint64_t hash, uint64_t value) {
+    return _jb_hash_bytes(&value, sizeof(value), hash);
+}
+
+// SHA-256, for the digests the remote cache protocol is built on.
+typedef struct {
+    uint32_t state[8];
+    uint64_t length;
+    unsigned char block[64];
+    size_t used;
+} _JBSha256;
+
+static const uint32_t _jb_sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+uint32_t _jb_rotr32(uint32_t x, int r) {
+    return (x >> r) | (x << (32 - r));
+}
+
+void _jb_sha256_init(_JBSha256 *sha) {
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+
+    memset(sha, 0, sizeof(_JBSha256));
+    memcpy(sha->state, initial, sizeof(initial));
+}
+
+void _jb_sha256_block(_JBSha256 *sha, const unsigned char *block) {
+    uint32_t w[64];
+
+    for (int i = 0; i < 16; i++)
+        w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16 | (uint32_t)block[i * 4 + 2] << 8 | block[i * 4 + 3];
+
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = _jb_rotr32(w[i - 15], 7) ^ _jb_rotr32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = _jb_rotr32(w[i - 2], 17) ^ _jb_rotr32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = sha->state[0], b = sha->state[1], c = sha->state[2], d = sha->state[3];
+    uint32_t e = sha->state[4], f = sha->state[5], g = sha->state[6], h = sha->state[7];
+
+    for (int i = 0; i < 64; i++) {
+        uint32_t s1 = _jb_rotr32(e, 6) ^ _jb_rotr32(e, 11) ^ _jb_rotr32(e, 25);
+        uint32_t ch = (e & f) ^ (~e & g);
+        uint32_t t1 = h + s1 + ch + _jb_sha256_k[i] + w[i];
+        uint32_t s0 = _jb_rotr32(a, 2) ^ _jb_rotr32(a, 13) ^ _jb_rotr32(a, 22);
+        uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+        uint32_t t2 = s0 + maj;
+
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+
+    sha->state[0] += a; sha->state[1] += b; sha->state[2] += c; sha->state[3] += d;
+    sha->state[4] += e; sha->state[5] += f; sha->state[6] += g; sha->state[7] += h;
+}
+
+void _jb_sha256_update(_JBSha256 *sha, const void *data, size_t len) {
+    const unsigned char *p = data;
+    sha->length += len;
+
+    while (len) {
+        size_t n = 64 - sha->used < len ? 64 - sha->used : len;
+        memcpy(sha->block + sha->used, p, n);
+
+        sha->used += n;
+        p += n;
+        len -= n;
+
+        if (sha->used == 64) {
+            _jb_sha256_block(sha, sha->block);
+            sha->used = 0;
+        }
+    }
+}
+
+// Writes the digest as 64 lowercase hex digits plus a terminator to hex.
+void _jb_sha256_final(_JBSha256 *sha, char *hex) {
+    uint64_t bits = sha->length * 8;
+    unsigned char pad[72] = { 0x80 };
+    size_t pad_len = (sha->used < 56 ? 56 : 120) - sha->used;
+
+    for (int i = 0; i < 8; i++)
+        pad[pad_len + i] = (unsigned char)(bits >> (56 - i * 8));
+
+    _jb_sha256_update(sha, pad, pad_len + 8);
+
+    for (int i = 0; i < 32; i++)
+        sprintf(hex + i * 2, "%02x", (sha->state[i / 4] >> (24 - (i % 4) * 8)) & 0xff);
+}
+
+void _jb_sha256_hex(const void *data, size_t len, char *hex) {
+    _JBSha256 sha;
+    _jb_sha256_init(&sha);
+    _jb_sha256_update(&sha, data, len);
+    _jb_sha256_final(&sha, hex);
+}
+
+// Build database: <build_folder>/.josh_deps remembers the headers each object was
+// compiled from, so an up-to-date check is a lookup plus a stat per header rather than
+// reading and parsing a depfile per object. It also remembers a hash of the command line
+// each output (objects, executables and libraries) was last built with.
+//
+// On-disk layout, every section 8-byte aligned:
+//   _JBBuildDBHeader
+//   uint32_t string_offsets[string_count]   -- offset of each path in the string data
+//   _JBBuildDBRecord records[record_count]  -- one per output
+//   uint32_t edges[edge_count]              -- string ids; records[i] owns edges [first_edge, first_edge+edge_count)
+//   _JBBuildDBFile files[file_count]        -- content fingerprints of inputs, for content-hash mode
+//   char strings[string_bytes]              -- NUL-terminated paths
+#define _JB_BUILD_DB_MAGIC "JOSHDEPS"
+#define _JB_BUILD_DB_VERSION 3
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t string_count;
+    uint32_t record_count;
+    uint32_t edge_count;
+    uint64_t string_bytes;
+    uint32_t file_count;
+    uint32_t reserved;
+} _JBBuildDBHeader;
+
+typedef struct {
+    uint32_t output; // string id
+    uint32_t first_edge;
+    uint32_t edge_count;
+    uint32_t reserved;
+    uint64_t inputs_hash; // content hash of every input when output was built; 0 if unknown
+    uint64_t command_hash; // hash of the argv output was built with
+} _JBBuildDBRecord;
+
+typedef struct {
+    uint32_t path; // string id
+    uint32_t reserved;
+    uint64_t size;
+    uint64_t mtime;
+    uint64_t hash;
+} _JBBuildDBFile;
+
+typedef struct {
+    uint32_t output;
+    uint32_t dep_count;
+    uint32_t *deps; // string ids; points into the mapped file unless owned
+    int owned;
+    uint64_t inputs_hash;
+    uint64_t command_hash;
+} _JBDepRecord;
+
+typedef struct {
+    int valid;
+    uint64_t size;
+    uint64_t mtime;
+    uint64_t hash;
+} _JBFileHash;
+
+typedef struct {
+    char *build_folder;
+    char *path;
+
+    char *map;
+    size_t map_size;
+
+    JBVector(const char *) strings; // string id -> path; loaded paths point into map
+    _JBStringMap string_ids; // path -> string id + 1, only built once something is recorded
+
+    JBVector(_JBDepRecord) records;
+    _JBStringMap record_index; // output path -> record index + 1
+
+    JBVector(_JBFileHash) file_hashes; // string id -> last known content hash of that file
+
+    int dirty;
+    _JBMutex mutex;
+} _JBBuildDB;
+
+static _JBMutex _jb_build_db_mutex = _JB_MUTEX_INITIALIZER;
+static JBVector(_JBBuildDB *) _jb_build_dbs = {0};
+
+size_t _jb_align8(size_t value) {
+    return (value + 7) & ~(size_t)7;
+}
+
+void *_jb_map_file(const char *path, size_t *out_size) {
+#if JB_IS_WINDOWS
+    return _jb_read_file(path, out_size);
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED)
+        return NULL;
+
+    *out_size = st.st_size;
+    return map;
+#endif
+}
+
+// Byte offsets of each section of a build database file described by header
+typedef struct {
+    size_t offsets;
+    size_t records;
+    size_t edges;
+    size_t files;
+    size_t strings;
+    size_t size;
+} _JBBuildDBLayout;
+
+_JBBuildDBLayout _jb_build_db_layout(const _JBBuildDBHeader *header) {
+    _JBBuildDBLayout layout;
+    layout.offsets = _jb_align8(sizeof(_JBBuildDBHeader));
+    layout.records = _jb_align8(layout.offsets + sizeof(uint32_t) * (size_t)header->string_count);
+    layout.edges = _jb_align8(layout.records + sizeof(_JBBuildDBRecord) * (size_t)header->record_count);
+    layout.files = _jb_align8(layout.edges + sizeof(uint32_t) * (size_t)header->edge_count);
+    layout.strings = _jb_align8(layout.files + sizeof(_JBBuildDBFile) * (size_t)header->file_count);
+    layout.size = layout.strings + header->string_bytes;
+    return layout;
+}
+
+_JBFileHash *_jb_build_db_file_hash(_JBBuildDB *db, uint32_t id) {
+    // expects db->mutex to be held
+    while (db->file_hashes.count <= id) {
+        _JBFileHash empty = {0};
+        JBVectorPush(&db->file_hashes, empty);
+    }
+
+    return &db->file_hashes.data[id];
+}
+
+void _jb_build_db_load(_JBBuildDB *db) {
+    size_t size = 0;
+    char *map = _jb_map_file(db->path, &size);
+
+    if (!map)
+        return;
+
+    _JBBuildDBHeader *header = (_JBBuildDBHeader *)map;
+    _JBBuildDBLayout layout = {0};
+
+    int valid = size >= sizeof(_JBBuildDBHeader)
+        && memcmp(header->magic, _JB_BUILD_DB_MAGIC, sizeof(header->magic)) == 0
+        && header->version == _JB_BUILD_DB_VERSION;
+
+    if (valid) {
+        layout = _jb_build_db_layout(header);
+
+        valid = layout.size == size
+            && (header->string_bytes == 0 || map[size-1] == 0);
+    }
+
+    uint32_t *offsets = (uint32_t *)(map + layout.offsets);
+    _JBBuildDBRecord *records = (_JBBuildDBRecord *)(map + layout.records);
+    uint32_t *edges = (uint32_t *)(map + layout.edges);
+    _JBBuildDBFile *files = (_JBBuildDBFile *)(map + layout.files);
+
+    for (uint32_t i = 0; valid && i < header->string_count; i++)
+        valid = offsets[i] < header->string_bytes;
+
+    for (uint32_t i = 0; valid && i < header->record_count; i++) {
+        valid = records[i].output < header->string_count
+            && (uint64_t)records[i].first_edge + records[i].edge_count <= header->edge_count;
+    }
+
+    for (uint32_t i = 0; valid && i < header->edge_count; i++)
+        valid = edges[i] < header->string_count;
+
+    for (uint32_t i = 0; valid && i < header->file_count; i++)
+        valid = files[i].path < header->string_count;
+
+    if (!valid) {
+        jb_log("ignoring invalid build database %s\n", db->path);
+#if JB_IS_WINDOWS
+        free(map);
+#else
+        munmap(map, size);
+#endif
+        return;
+    }
+
+    db->map = map;
+    db->map_size = size;
+
+    for (uint32_t i = 0; i < header->string_count; i++) {
+        JBVectorPush(&db->strings, map + layout.strings + offsets[i]);
+    }
+
+    for (uint32_t i = 0; i < header->record_count; i++) {
+        _JBDepRecord record = { records[i].output, records[i].edge_count, edges + records[i].first_edge, 0, records[i].inputs_hash, records[i].command_hash };
+        JBVectorPush(&db->records, record);
+
+        _jb_string_map_put(&db->record_index, db->strings.data[record.output], (void *)(uintptr_t)db->records.count);
+    }
+
+    for (uint32_t i = 0; i < header->file_count; i++) {
+        _JBFileHash *hash = _jb_build_db_file_hash(db, files[i].path);
+        hash->valid = 1;
+        hash->size = files[i].size;
+        hash->mtime = files[i].mtime;
+        hash->hash = files[i].hash;
+    }
+}
+
+// Returns the build database for build_folder, loading it on first use.
+_JBBuildDB *_jb_build_db_for(const char *build_folder) {
+    _jb_mutex_lock(&_jb_build_db_mutex);
+
+    _JBBuildDB *db = NULL;
+
+    JBArrayForEach(&_jb_build_dbs) {
+        if (strcmp((*it)->build_folder, build_folder) == 0) {
+            db = *it;
+            break;
+        }
+    }
+
+    if (!db) {
+        db = malloc(sizeof(_JBBuildDB));
+        memset(db, 0, sizeof(_JBBuildDB));
+
+        db->build_folder = jb_copy_string(build_folder);
+        db->path = jb_format_string("%s/.josh_deps", build_folder);
+        _jb_mutex_init(&db->mutex);
+
+        _jb_build_db_load(db);
+
+        JBVectorPush(&_jb_build_dbs, db);
+    }
+
+    _jb_mutex_unlock(&_jb_build_db_mutex);
+    return db;
+}
+
+// Forgets what db loaded and loads its file again. Only for databases nothing was recorded
+// into, ie. in `josh daemon`, which keeps the databases its builds wrote.
+void _jb_build_db_reload(_JBBuildDB *db) {
+    _jb_mutex_lock(&db->mutex);
+
+    if (db->map) {
+#if JB_IS_WINDOWS
+        free(db->map);
+#else
+        munmap(db->map, db->map_size);
+#endif
+    }
+
+    db->map = NULL;
+    db->map_size = 0;
+
+    free(db->strings.data);
+    free(db->records.data);
+    free(db->file_hashes.data);
+    memset(&db->strings, 0, sizeof(db->strings));
+    memset(&db->records, 0, sizeof(db->records));
+    memset(&db->file_hashes, 0, sizeof(db->file_hashes));
+
+    _jb_string_map_free(&db->string_ids);
+    _jb_string_map_free(&db->record_index);
+
+    _jb_build_db_load(db);
+
+    _jb_mutex_unlock(&db->mutex);
+}
+
+// Returns a string-array (without copies of the strings) of the dependencies recorded for
+// output, or NULL if the database doesn't know output. Free with free().
+// inputs_hash, if given, receives the content hash of those dependencies at the time
+// output was built, or 0 if it wasn't recorded. command_hash, if given, receives the
+// signature of the command output was built with.
+const char **_jb_build_db_lookup(_JBBuildDB *db, const char *output, uint64_t *inputs_hash, uint64_t *command_hash) {
+    _jb_mutex_lock(&db->mutex);
+
+    const char **out = NULL;
+    size_t index = (uintptr_t)_jb_string_map_get(&db->record_index, output);
+
+    if (index) {
+        _JBDepRecord *record = &db->records.data[index - 1];
+
+        out = malloc(sizeof(char *) * (record->dep_count + 1));
+
+        for (uint32_t i = 0; i < record->dep_count; i++)
+            out[i] = db->strings.data[record->deps[i]];
+
+        out[record->dep_count] = NULL;
+
+        if (inputs_hash)
+            *inputs_hash = record->inputs_hash;
+
+        if (command_hash)
+            *command_hash = record->command_hash;
+    }
+
+    _jb_mutex_unlock(&db->mutex);
+    return out;
+}
+
+uint32_t _jb_build_db_string_id(_JBBuildDB *db, const char *path) {
+    // expects db->mutex to be held
+    if (!db->string_ids.count) {
+        JBVectorFor(&db->strings) {
+            _jb_string_map_put(&db->string_ids, db->strings.data[index], (void *)(uintptr_t)(index + 1));
+        }
+    }
+
+    size_t id = (uintptr_t)_jb_string_map_get(&db->string_ids, path);
+
+    if (!id) {
+        // strings are never freed; lookups hand out pointers to them
+        char *copy = jb_copy_string(path);
+        JBVectorPush(&db->strings, copy);
+
+        id = db->strings.count;
+        _jb_string_map_put(&db->string_ids, copy, (void *)(uintptr_t)id);
+    }
+
+    return (uint32_t)(id - 1);
+}
+
+uint64_t _jb_hash_file(const char *path, int *ok) {
+    size_t len = 0;
+    char *text = _jb_read_file(path, &len);
+
+    *ok = text != NULL;
+    if (!text)
+        return 0;
+
+    uint64_t hash = _jb_hash_bytes(text, len, 0);
+    free(text);
+    return hash;
+}
+
+// Content hash of a set of input files, in order. A file is only read and hashed again
+// if its size or mtime differ from when it was last hashed.
+// Returns 0 if any input can't be read.
+uint64_t _jb_build_db_inputs_hash(_JBBuildDB *db, const char **deps) {
+    uint64_t out = _JB_XXH_PRIME64_5;
+
+    JBNullArrayFor(deps) {
+        _JBFileStat st = _jb_file_stat(deps[index]);
+
+        if (!st.exists)
+            return 0;
+
+        _jb_mutex_lock(&db->mutex);
+        uint32_t id = _jb_build_db_string_id(db, deps[index]);
+        _JBFileHash known = *_jb_build_db_file_hash(db, id);
+        _jb_mutex_unlock(&db->mutex);
+
+        if (!known.valid || known.size != st.size || known.mtime != st.mtime) {
+            int ok = 0;
+            known.hash = _jb_hash_file(deps[index], &ok);
+
+            if (!ok)
+                return 0;
+
+            known.valid = 1;
+            known.size = st.size;
+            known.mtime = st.mtime;
+
+            _jb_mutex_lock(&db->mutex);
+            *_jb_build_db_file_hash(db, id) = known;
+            db->dirty = 1;
+            _jb_mutex_unlock(&db->mutex);
+        }
+
+        out = _jb_hash_combine(out, _jb_hash_string(deps[index]));
+        out = _jb_hash_combine(out, known.hash);
+    }
+
+    return out;
+}
+
+// Remembers that output was just built from deps by a command with the given signature
+// (see _jb_command_hash). inputs_hash is 0 unless content-hash mode computed it.
+void _jb_build_db_record(_JBBuildDB *db, const char *output, char **deps, uint64_t inputs_hash, uint64_t command_hash) {
+    _jb_mutex_lock(&db->mutex);
+
+    _JBDepRecord record = {0};
+    record.output = _jb_build_db_string_id(db, output);
+    record.dep_count = jb_string_array_count(deps);
+    record.deps = malloc(sizeof(uint32_t) * (record.dep_count + 1));
+    record.owned = 1;
+    record.inputs_hash = inputs_hash;
+    record.command_hash = command_hash;
+
+    for (uint32_t i = 0; i < record.dep_count; i++)
+        record.deps[i] = _jb_build_db_string_id(db, deps[i]);
+
+    const char *key = db->strings.data[record.output];
+    size_t index = (uintptr_t)_jb_string_map_get(&db->record_index, key);
+
+    if (index) {
+        _JBDepRecord *existing = &db->records.data[index - 1];
+
+        if (existing->owned)
+            free(existing->deps);
+
+        *existing = record;
+    }
+    else {
+        JBVectorPush(&db->records, record);
+        _jb_string_map_put(&db->record_index, key, (void *)(uintptr_t)db->records.count);
+    }
+
+    db->dirty = 1;
+
+    _jb_mutex_unlock(&db->mutex);
+}
+
+void _jb_build_db_save(_JBBuildDB *db) {
+    _jb_mutex_lock(&db->mutex);
+
+    if (!db->dirty) {
+        _jb_mutex_unlock(&db->mutex);
+        return;
+    }
+
+    // Only write the strings live records refer to, so paths of objects and headers
+    // that are gone don't pile up.
+    _JBStringMap ids = {0};
+    JBVector(const char *) strings = {0};
+    JBVector(uint32_t) edges = {0};
+    JBVector(_JBBuildDBRecord) records = {0};
+    JBVector(_JBBuildDBFile) files = {0};
+    uint64_t string_bytes = 0;
+
+#define _JB_BUILD_DB_REMAP(id, out) \
+    { \
+        const char *str = db->strings.data[id]; \
+        size_t new_id = (uintptr_t)_jb_string_map_get(&ids, str); \
+        if (!new_id) { \
+            JBVectorPush(&strings, str); \
+            new_id = strings.count; \
+            _jb_string_map_put(&ids, str, (void *)(uintptr_t)new_id); \
+            string_bytes += strlen(str) + 1; \
+        } \
+        out = (uint32_t)(new_id - 1); \
+    }
+
+    JBArrayForEach(&db->records) {
+        _JBBuildDBRecord record = {0};
+        _JB_BUILD_DB_REMAP(it->output, record.output);
+        record.first_edge = (uint32_t)edges.count;
+        record.edge_count = it->dep_count;
+        record.inputs_hash = it->inputs_hash;
+        record.command_hash = it->command_hash;
+
+        for (uint32_t i = 0; i < it->dep_count; i++) {
+            uint32_t edge;
+            _JB_BUILD_DB_REMAP(it->deps[i], edge);
+            JBVectorPush(&edges, edge);
+        }
+
+        JBVectorPush(&records, record);
+    }
+
+    // fingerprints of files no live record refers to are dropped with their strings
+    JBVectorFor(&db->file_hashes) {
+        _JBFileHash *hash = &db->file_hashes.data[index];
+
+        if (!hash->valid || !_jb_string_map_get(&ids, db->strings.data[index]))
+            continue;
+
+        _JBBuildDBFile file = {0};
+        _JB_BUILD_DB_REMAP(index, file.path);
+        file.size = hash->size;
+        file.mtime = hash->mtime;
+        file.hash = hash->hash;
+        JBVectorPush(&files, file);
+    }
+
+#undef _JB_BUILD_DB_REMAP
+
+    _JBBuildDBHeader header = {0};
+    memcpy(header.magic, _JB_BUILD_DB_MAGIC, sizeof(header.magic));
+    header.version = _JB_BUILD_DB_VERSION;
+    header.string_count = (uint32_t)strings.count;
+    header.record_count = (uint32_t)records.count;
+    header.edge_count = (uint32_t)edges.count;
+    header.string_bytes = string_bytes;
+    header.file_count = (uint32_t)files.count;
+
+    _JBBuildDBLayout layout = _jb_build_db_layout(&header);
+    size_t size = layout.size;
+
+    char *out = calloc(1, size);
+    memcpy(out, &header, sizeof(header));
+    memcpy(out + layout.records, records.data, sizeof(_JBBuildDBRecord) * records.count);
+    memcpy(out + layout.edges, edges.data, sizeof(uint32_t) * edges.count);
+    memcpy(out + layout.files, files.data, sizeof(_JBBuildDBFile) * files.count);
+
+    uint32_t *offsets = (uint32_t *)(out + layout.offsets);
+    size_t offset = 0;
+
+    JBVectorFor(&strings) {
+        size_t len = strlen(strings.data[index]) + 1;
+        offsets[index] = (uint32_t)offset;
+        memcpy(out + layout.strings + offset, strings.data[index], len);
+        offset += len;
+    }
+
+    // Write a new file and move it into place; the old one may still be mapped.
+    char *tmp_path = jb_format_string("%s.tmp", db->path);
+    FILE *file = fopen(tmp_path, "wb");
+
+    if (file) {
+        size_t written = fwrite(out, 1, size, file);
+        fclose(file);
+
+#if JB_IS_WINDOWS
+        remove(db->path);
+#endif
+        if (written != size || rename(tmp_path, db->path) != 0) {
+            jb_log("could not write build database %s\n", db->path);
+            remove(tmp_path);
+        }
+    }
+    else {
+        jb_log("could not write build database %s\n", db->path);
+    }
+
+    db->dirty = 0;
+
+    free(tmp_path);
+    free(out);
+    free(strings.data);
+    free(edges.data);
+    free(records.data);
+    free(files.data);
+    _jb_string_map_free(&ids);
+
+    _jb_mutex_unlock(&db->mutex);
+}
+
+void _jb_build_db_save_all() {
+    _jb_mutex_lock(&_jb_build_db_mutex);
+
+    JBArrayForEach(&_jb_build_dbs) {
+        _jb_build_db_save(*it);
+    }
+
+    _jb_mutex_unlock(&_jb_build_db_mutex);
+}
+
+// Signature of a NULL-terminated argv. Arguments are hashed with their terminators so
+// {"-DA", "B"} and {"-DAB"} don't collide. Never returns 0, which means "unknown".
+uint64_t _jb_command_hash(char **argv) {
+    uint64_t hash = 0;
+
+    JBNullArrayFor(argv) {
+        hash = _jb_hash_bytes(argv[index], strlen(argv[index]) + 1, hash);
+    }
+
+    return hash ? hash : 1;
+}
+
+// Returns 1 if output has no recorded command signature or was built with a different
+// command than argv.
+int _jb_command_changed(_JBBuildDB *db, const char *output, char **argv) {
+    uint64_t recorded_hash = 0;
+    const char **deps = _jb_build_db_lookup(db, output, NULL, &recorded_hash);
+
+    free(deps);
+
+    if (recorded_hash == _jb_command_hash(argv))
+        return 0;
+
+    jb_log("command line of %s changed, rebuilding...\n", output);
+    return 1;
+}
+
+// Compile cache: objects and their depfiles stored under a key that covers everything
+// the compile depends on, shared by every build folder, worktree and josh run on the
+// machine. See jb_set_compile_cache().
+//
+// <cache_dir>/index is a memory-mapped open-addressing table with the size and last use
+// of each cached object, so the cache can be kept under its size budget by evicting the
+// least recently used entries. Objects live in <cache_dir>/<xx>/<key>.o and .d.
+// Processes take flock() on the index around every access; threads also take the mutex.
+#define _JB_CACHE_MAGIC "JOSHCACH"
+#define _JB_CACHE_VERSION 1
+#define _JB_CACHE_SLOTS (1 << 16)
+#define _JB_CACHE_DEFAULT_SIZE_MB 5120
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t slot_count;
+    uint32_t live_count;
+    uint32_t used_count; // live entries plus deleted ones
+    uint64_t total_size;
+    uint64_t clock; // bumped on every use; orders entries for eviction
+} _JBCacheHeader;
+
+typedef struct {
+    uint64_t key; // 0: empty slot, 1: deleted entry
+    uint64_t key_check; // second half of the key, only used to name the files
+    uint64_t size;
+    uint64_t last_used;
+} _JBCacheEntry;
+
+typedef struct {
+    uint64_t key;
+    uint64_t key_check;
+    char remote_key[65]; // SHA-256 of the same inputs, when a remote cache is configured
+} _JBCacheKey;
+
+typedef struct _JBRemoteCache _JBRemoteCache;
+
+typedef struct {
+    char *dir;
+    uint64_t budget;
+
+    int fd;
+    _JBCacheHeader *header;
+    _JBCacheEntry *slots;
+
+    _JBMutex mutex;
+    _JBRemoteCache *remote;
+
+    int hits;
+    int remote_hits;
+    int misses;
+} _JBCompileCache;
+
+static _JBMutex _jb_compile_cache_mutex = _JB_MUTEX_INITIALIZER;
+static _JBCompileCache *_jb_compile_cache = NULL;
+static int _jb_compile_cache_opened = 0;
+
+void _jb_compile_cache_report() {
+    _JBCompileCache *cache = _jb_compile_cache;
+
+    if (cache->hits + cache->misses == 0)
+        return;
+
+    if (cache->remote)
+        JB_LOG("compile cache: %d hits (%d remote), %d misses (%d%%)\n", cache->hits, cache->remote_hits, cache->misses, cache->hits * 100 / (cache->hits + cache->misses));
+    else
+        JB_LOG("compile cache: %d hits, %d misses (%d%%)\n", cache->hits, cache->misses, cache->hits * 100 / (cache->hits + cache->misses));
+}
+
+// A temporary name next to path that no other process, or thread of this one, uses.
+char *_jb_temp_path(const char *path) {
+    static _JBMutex mutex = _JB_MUTEX_INITIALIZER;
+    static unsigned counter = 0;
+
+    _jb_mutex_lock(&mutex);
+    unsigned n = counter++;
+    _jb_mutex_unlock(&mutex);
+
+    return jb_format_string("%s.%d.%u.tmp", path, (int)getpid(), n);
+}
+
+// Copies the len bytes of in to the empty out without bringing them into userspace: a
+// reflink where the filesystem has them (btrfs, XFS), which shares the blocks until either
+// file changes but is still a new file with its own mtime, else copy_file_range(). Returns 0,
+// with both files back at offset 0 and out empty, when neither works.
+int _jb_copy_file_in_kernel(int in, int out, size_t len) {
+#if JB_IS_LINUX
+#ifdef FICLONE
+    if (ioctl(out, FICLONE, in) == 0)
+        return 1;
+#endif
+
+#ifdef SYS_copy_file_range
+    size_t copied = 0;
+
+    while (copied < len) {
+        ssize_t bytes = syscall(SYS_copy_file_range, in, NULL, out, NULL, len - copied, 0);
+
+        if (bytes <= 0)
+            break;
+
+        copied += bytes;
+    }
+
+    if (copied == len)
+        return 1;
+
+    // eg. across filesystems before Linux 5.3
+    lseek(in, 0, SEEK_SET);
+    lseek(out, 0, SEEK_SET);
+
+    if (ftruncate(out, 0) != 0)
+        return 0;
+#endif
+#else
+    (void)in;
+    (void)out;
+    (void)len;
+#endif
+
+    return 0;
+}
+
+// Copies src to dst through a temporary file so readers never see half a file. The copy is
+// a new file, so unlike a hardlink it gets a fresh mtime and changing one never changes the
+// other.
+int _jb_copy_file_contents(const char *src, const char *dst) {
+    FILE *in = fopen(src, "rb");
+
+    if (!in)
+        return 0;
+
+    char *tmp = _jb_temp_path(dst);
+    FILE *out = fopen(tmp, "wb");
+    int ok = 0;
+
+    if (out) {
+        struct stat st;
+        ok = fstat(fileno(in), &st) == 0;
+
+        if (ok && !_jb_copy_file_in_kernel(fileno(in), fileno(out), (size_t)st.st_size)) {
+            char buffer[65536];
+            size_t bytes;
+
+            while (ok && (bytes = fread(buffer, 1, sizeof(buffer), in)) > 0)
+                ok = fwrite(buffer, 1, bytes, out) == bytes;
+
+            ok = ok && !ferror(in);
+        }
+
+        ok = (fclose(out) == 0) && ok;
+        ok = ok && rename(tmp, dst) == 0;
+
+        if (!ok)
+            remove(tmp);
+    }
+
+    fclose(in);
+    free(tmp);
+    return ok;
+}
+
+// Hash of `tool --version`, so a compiler upgrade doesn't reuse objects from the old one
+// and workers only compile with the same compiler as the client.
+uint64_t _jb_compiler_identity(const char *tool) {
+    static _JBMutex mutex = _JB_MUTEX_INITIALIZER;
+    static _JBStringMap identities = {0}; // compiler -> uint64_t *
+
+    _jb_mutex_lock(&mutex);
+    uint64_t *identity = _jb_string_map_get(&identities, tool);
+    _jb_mutex_unlock(&mutex);
+
+    if (identity)
+        return *identity;
+
+    struct JBRunResult result = jb_run_get_output((char *[]){ (char *)tool, "--version", NULL }, __FILE__, __LINE__);
+
+    uint64_t hash = _jb_hash_bytes(result.output, strlen(result.output), 0);
+    free(result.output);
+
+    identity = malloc(sizeof(uint64_t));
+    *identity = hash;
+
+    _jb_mutex_lock(&mutex);
+    _jb_string_map_put(&identities, jb_copy_string(tool), identity);
+    _jb_mutex_unlock(&mutex);
+
+    return hash;
+}
+
+// Runs only the preprocessor over source and returns its output, or NULL if that fails
+// (the compile itself will report why). Also writes the depfile for output, so a compile
+// that happens elsewhere doesn't need to produce one.
+char *_jb_preprocess(JBToolchain *tc, const char *tool, const char **flags, const char **include_paths, const char *source, const char *output, const char *depfile, size_t *len) {
+    char *preprocessed = jb_format_string("%s.i", output);
+
+    _JBCommandVector cmd = {0};
+
+    JBVectorPush(&cmd, (char *)tool);
+    _jb_add_common_c_options(tc, &cmd, tool, flags, include_paths);
+    JBVectorPush(&cmd, "-E");
+    JBVectorPush(&cmd, "-w");
+    JBVectorPush(&cmd, "-MMD");
+    JBVectorPush(&cmd, "-MF");
+    JBVectorPush(&cmd, (char *)depfile);
+    JBVectorPush(&cmd, "-o");
+    JBVectorPush(&cmd, preprocessed);
+    JBVectorPush(&cmd, (char *)source);
+    JBVectorPush(&cmd, NULL);
+
+    int result = _jb_run_internal(cmd.data, NULL, _jb_pipe_drain_log_proxy, __FILE__, __LINE__);
+    free(cmd.data);
+
+    char *text = result == 0 ? _jb_read_file(preprocessed, len) : NULL;
+
+    remove(preprocessed);
+    free(preprocessed);
+
+    return text;
+}
+
+char **_jb_read_dependencies(const char *output, int is_msvc);
+void _jb_free_string_array(char **array);
+
+#if JB_IS_WINDOWS
+
+_JBCompileCache *_jb_compile_cache_get() {
+    if (_jb_use_compile_cache > 0 && !_jb_compile_cache_opened) {
+        _jb_compile_cache_opened = 1;
+        jb_log("compile cache is not supported on Windows yet\n");
+    }
+
+    return NULL;
+}
+
+int _jb_compile_cache_key(const char *tool, const char *text, size_t len, const char *output, const char *depfile, char **cmd, _JBCacheKey *key) {
+    return 0;
+}
+
+int _jb_compile_cache_fetch(_JBCacheKey *key, const char *output, const char *depfile) {
+    return 0;
+}
+
+void _jb_compile_cache_store(_JBCacheKey *key, const char *output, const char *depfile) {
+}
+
+#else
+
+typedef JBVector(char) _JBBuffer;
+
+void _jb_buffer_append(_JBBuffer *buffer, const void *data, size_t len) {
+    if (buffer->count + len > buffer->reserved) {
+        size_t reserved = buffer->reserved ? buffer->reserved : 256;
+
+        while (reserved < buffer->count + len)
+            reserved *= 2;
+
+        buffer->data = realloc(buffer->data, reserved);
+        buffer->reserved = reserved;
+    }
+
+    memcpy(buffer->data + buffer->count, data, len);
+    buffer->count += len;
+}
+
+// Remote compile cache, speaking bazel-remote's HTTP protocol: objects and depfiles are
+// content-addressed blobs under <url>/cas/<sha256>, and <url>/ac/<key> holds an
+// ActionResult message that names the blobs a compile produced. Lookups hold up the
+// compile for at most the timeout; uploads happen on a background thread. Blobs are
+// zstd-compressed when libzstd can be loaded.
+
+// libzstd is loaded at runtime so josh doesn't need its headers or a link dependency.
+typedef struct {
+    size_t (*compress_bound)(size_t src_size);
+    size_t (*compress)(void *dst, size_t dst_capacity, const void *src, size_t src_size, int level);
+    size_t (*decompress)(void *dst, size_t dst_capacity, const void *src, size_t src_size);
+    unsigned (*is_error)(size_t code);
+    unsigned long long (*frame_content_size)(const void *src, size_t src_size);
+} _JBZstd;
+
+_JBZstd *_jb_load_zstd() {
+    const char *names[] = { "libzstd.so.1", "libzstd.so", "libzstd.1.dylib", "libzstd.dylib" };
+    void *lib = NULL;
+
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]) && !lib; i++)
+        lib = dlopen(names[i], RTLD_NOW | RTLD_LOCAL);
+
+    if (!lib)
+        return NULL;
+
+    _JBZstd *zstd = malloc(sizeof(_JBZstd));
+    *(void **)&zstd->compress_bound = dlsym(lib, "ZSTD_compressBound");
+    *(void **)&zstd->compress = dlsym(lib, "ZSTD_compress");
+    *(void **)&zstd->decompress = dlsym(lib, "ZSTD_decompress");
+    *(void **)&zstd->is_error = dlsym(lib, "ZSTD_isError");
+    *(void **)&zstd->frame_content_size = dlsym(lib, "ZSTD_getFrameContentSize");
+
+    if (!zstd->compress_bound || !zstd->compress || !zstd->decompress || !zstd->is_error || !zstd->frame_content_size) {
+        free(zstd);
+        dlclose(lib);
+        return NULL;
+    }
+
+    return zstd;
+}
+
+typedef struct {
+    char key[65];
+    char *object;
+    size_t object_len;
+    char *depfile;
+    size_t depfile_len;
+} _JBRemoteUpload;
+
+struct _JBRemoteCache {
+    char *host;
+    char *port;
+    char *prefix; // path in front of /ac and /cas, without a trailing slash
+    int timeout_ms;
+    _JBZstd *zstd;
+
+    // set after the first request that couldn't reach the server; the rest of the build
+    // doesn't wait on it again
+    int unreachable;
+
+    _JBMutex mutex;
+    _JBCond cond; // signaled when an upload is queued or the queue drains
+    JBVector(_JBRemoteUpload) uploads;
+    size_t next_upload;
+    int uploading;
+    int uploaded;
+};
+
+// Parses http://host[:port][/prefix]. Returns NULL for anything else.
+_JBRemoteCache *_jb_remote_cache_open(const char *url) {
+    const char *scheme = "http://";
+
+    if (strncmp(url, scheme, strlen(scheme)) != 0) {
+        jb_log_print("remote cache %s: only http:// URLs are supported\n", url);
+        return NULL;
+    }
+
+    const char *host = url + strlen(scheme);
+    const char *path = strchr(host, '/');
+    const char *host_end = path ? path : host + strlen(host);
+    const char *colon = memchr(host, ':', host_end - host);
+
+    _JBRemoteCache *remote = malloc(sizeof(_JBRemoteCache));
+    memset(remote, 0, sizeof(_JBRemoteCache));
+
+    remote->host = jb_format_string("%.*s", (int)((colon ? colon : host_end) - host), host);
+    remote->port = colon ? jb_format_string("%.*s", (int)(host_end - colon - 1), colon + 1) : jb_copy_string("80");
+    remote->prefix = jb_copy_string(path ? path : "");
+
+    size_t prefix_len = strlen(remote->prefix);
+    if (prefix_len && remote->prefix[prefix_len - 1] == '/')
+        remote->prefix[prefix_len - 1] = 0;
+
+    const char *timeout = getenv("JOSH_REMOTE_CACHE_TIMEOUT");
+    remote->timeout_ms = (timeout && atoi(timeout) > 0) ? atoi(timeout) : 2000;
+
+    remote->zstd = _jb_load_zstd();
+
+    _jb_mutex_init(&remote->mutex);
+    _jb_cond_init(&remote->cond);
+
+    return remote;
+}
+
+void _jb_socket_set_timeout(int fd, int timeout_ms) {
+    struct timeval timeout = { timeout_ms / 1000, (timeout_ms % 1000) * 1000 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+// Connects to host:port, or to the unix socket at port if host is NULL. Gives up after
+// timeout_ms, which also bounds every send and receive on the socket.
+int _jb_socket_connect(const char *host, const char *port, int timeout_ms) {
+    struct addrinfo hints = {0};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    struct addrinfo *addrs = NULL;
+    struct addrinfo unix_addr = {0};
+    struct sockaddr_un un = {0};
+
+    if (!host) {
+        un.sun_family = AF_UNIX;
+        snprintf(un.sun_path, sizeof(un.sun_path), "%s", port);
+
+        unix_addr.ai_family = AF_UNIX;
+        unix_addr.ai_socktype = SOCK_STREAM;
+        unix_addr.ai_addr = (struct sockaddr *)&un;
+        unix_addr.ai_addrlen = sizeof(un);
+    }
+    else if (getaddrinfo(host, port, &hints, &addrs) != 0) {
+        return -1;
+    }
+
+    int fd = -1;
+
+    for (struct addrinfo *ai = host ? addrs : &unix_addr; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+
+        if (fd < 0)
+            continue;
+
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+        // connect without blocking so an unresponsive host costs at most the timeout
+        int flags = fcntl(fd, F_GETFL);
+        fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+
+        int connected = connect(fd, ai->ai_addr, ai->ai_addrlen) == 0;
+
+        if (!connected && errno == EINPROGRESS) {
+            struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+            int error = 0;
+            socklen_t error_len = sizeof(error);
+
+            connected = poll(&pfd, 1, timeout_ms) == 1
+                && getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_len) == 0
+                && error == 0;
+        }
+
+        if (connected) {
+            fcntl(fd, F_SETFL, flags);
+
+            _jb_socket_set_timeout(fd, timeout_ms);
+#ifdef SO_NOSIGPIPE
+            int one = 1;
+            setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+            break;
+        }
+
+        close(fd);
+        fd = -1;
+    }
+
+    if (addrs)
+        freeaddrinfo(addrs);
+
+    return fd;
+}
+
+int _jb_remote_connect(_JBRemoteCache *remote) {
+    return _jb_socket_connect(remote->host, remote->port, remote->timeout_ms);
+}
+
+int _jb_send_all(int fd, const char *data, size_t len) {
+#ifdef MSG_NOSIGNAL
+    int flags = MSG_NOSIGNAL;
+#else
+    int flags = 0;
+#endif
+
+    while (len) {
+        ssize_t sent = send(fd, data, len, flags);
+
+        if (sent <= 0)
+            return 0;
+
+        data += sent;
+        len -= sent;
+    }
+
+    return 1;
+}
+
+int _jb_recv_all(int fd, void *data, size_t len) {
+    char *p = data;
+
+    while (len) {
+        ssize_t bytes = recv(fd, p, len, 0);
+
+        if (bytes <= 0)
+            return 0;
+
+        p += bytes;
+        len -= bytes;
+    }
+
+    return 1;
+}
+
+uint64_t _jb_monotonic_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Waits up to timeout_ms for the non-blocking fd to be ready for events, and not past
+// deadline (a _jb_monotonic_ms() time) unless that's 0. Returns 0 on timeout.
+int _jb_poll_until(int fd, short events, int timeout_ms, uint64_t deadline) {
+    while (1) {
+        int wait = timeout_ms;
+
+        if (deadline) {
+            uint64_t now = _jb_monotonic_ms();
+
+            if (now >= deadline)
+                return 0;
+
+            if (deadline - now < (uint64_t)wait)
+                wait = (int)(deadline - now);
+        }
+
+        struct pollfd pfd = { .fd = fd, .events = events };
+        int result = poll(&pfd, 1, wait);
+
+        if (result > 0)
+            return 1;
+
+        if (result == 0 || errno != EINTR)
+            return 0;
+    }
+}
+
+int _jb_send_until(int fd, const char *data, size_t len, int timeout_ms, uint64_t deadline) {
+#ifdef MSG_NOSIGNAL
+    int flags = MSG_NOSIGNAL;
+#else
+    int flags = 0;
+#endif
+
+    while (len) {
+        if (!_jb_poll_until(fd, POLLOUT, timeout_ms, deadline))
+            return 0;
+
+        ssize_t sent = send(fd, data, len, flags);
+
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+            continue;
+
+        if (sent <= 0)
+            return 0;
+
+        data += sent;
+        len -= sent;
+    }
+
+    return 1;
+}
+
+// Sends one HTTP/1.0 request to the remote cache and reads the response body into
+// response (when given). zstd marks a compressed request body, and on return whether the
+// response body is compressed. Returns the HTTP status, or -1 if the server couldn't be
+// reached or didn't answer in time.
+// A lookup (GET, HEAD) has timeout_ms in all, however the server trickles its answer. An
+// upload runs in the background and may be large, so only each wait is bounded.
+int _jb_http_request(_JBRemoteCache *remote, const char *method, const char *path, const char *body, size_t body_len, _JBBuffer *response, int *zstd) {
+    int timeout_ms = remote->timeout_ms;
+    uint64_t deadline = strcmp(method, "PUT") != 0 ? _jb_monotonic_ms() + timeout_ms : 0;
+
+    int fd = _jb_remote_connect(remote);
+
+    if (fd < 0)
+        return -1;
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    int is_blob = strncmp(path, "/cas/", 5) == 0;
+
+    char *header = jb_format_string(
+        "%s %s%s HTTP/1.0\r\nHost: %s\r\nContent-Length: %zu\r\n%s%s\r\n",
+        method, remote->prefix, path, remote->host, body_len,
+        (body && *zstd) ? "Content-Encoding: zstd\r\n" : "",
+        (is_blob && remote->zstd) ? "Accept-Encoding: zstd\r\n" : "");
+
+    int ok = _jb_send_until(fd, header, strlen(header), timeout_ms, deadline)
+        && (!body_len || _jb_send_until(fd, body, body_len, timeout_ms, deadline));
+    free(header);
+
+    _JBBuffer received = {0};
+
+    while (ok) {
+        if (!_jb_poll_until(fd, POLLIN, timeout_ms, deadline)) {
+            ok = 0;
+            break;
+        }
+
+        char chunk[16384];
+        ssize_t bytes = recv(fd, chunk, sizeof(chunk), 0);
+
+        if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+            continue;
+
+        if (bytes == 0)
+            break;
+
+        if (bytes < 0) {
+            ok = 0;
+            break;
+        }
+
+        _jb_buffer_append(&received, chunk, bytes);
+    }
+
+    close(fd);
+
+    _jb_buffer_append(&received, "", 1);
+
+    char *headers_end = ok ? strstr(received.data, "\r\n\r\n") : NULL;
+    int status = -1;
+
+    if (headers_end && sscanf(received.data, "HTTP/%*d.%*d %d", &status) == 1) {
+        char *body_start = headers_end + 4;
+        size_t body_size = received.data + received.count - 1 - body_start;
+
+        *zstd = 0;
+
+        for (char *line = strstr(received.data, "\r\n"); line && line < headers_end; line = strstr(line + 2, "\r\n")) {
+            if (strncasecmp(line + 2, "Content-Encoding:", 17) == 0) {
+                char *value = line + 2 + 17;
+                *zstd = strncmp(value + strspn(value, " "), "zstd", 4) == 0;
+            }
+            else if (strncasecmp(line + 2, "Content-Length:", 15) == 0) {
+                size_t length = strtoull(line + 2 + 15, NULL, 10);
+
+                if (length < body_size)
+                    body_size = length;
+            }
+        }
+
+        if (response)
+            _jb_buffer_append(response, body_start, body_size);
+    }
+    else {
+        status = -1;
+    }
+
+    free(received.data);
+    return status;
+}
+
+// Stores a blob under /cas/<sha256 of data> unless the server already has it.
+int _jb_remote_put_blob(_JBRemoteCache *remote, const char *hex, const char *data, size_t len) {
+    char *path = jb_format_string("/cas/%s", hex);
+    int zstd = 0;
+
+    int status = _jb_http_request(remote, "HEAD", path, NULL, 0, NULL, &zstd);
+
+    if (status != 200) {
+        char *compressed = NULL;
+        size_t compressed_len = 0;
+
+        if (remote->zstd) {
+            compressed = malloc(remote->zstd->compress_bound(len));
+            compressed_len = remote->zstd->compress(compressed, remote->zstd->compress_bound(len), data, len, 3);
+
+            if (remote->zstd->is_error(compressed_len)) {
+                free(compressed);
+                compressed = NULL;
+            }
+        }
+
+        zstd = compressed != NULL;
+        status = compressed
+            ? _jb_http_request(remote, "PUT", path, compressed, compressed_len, NULL, &zstd)
+            : _jb_http_request(remote, "PUT", path, data, len, NULL, &zstd);
+
+        free(compressed);
+    }
+
+    free(path);
+    return status >= 200 && status < 300;
+}
+
+// Fetches /cas/<hex> and checks that it is what it claims to be.
+int _jb_remote_get_blob(_JBRemoteCache *remote, const char *hex, _JBBuffer *out) {
+    char *path = jb_format_string("/cas/%s", hex);
+    _JBBuffer body = {0};
+    int zstd = 0;
+
+    int ok = _jb_http_request(remote, "GET", path, NULL, 0, &body, &zstd) == 200;
+    free(path);
+
+    if (ok && zstd) {
+        unsigned long long size = remote->zstd ? remote->zstd->frame_content_size(body.data, body.count) : (unsigned long long)-1;
+
+        // unknown (-1) or invalid (-2) frame sizes, or more than any object we'd store (the
+        // same limit as a worker's reply); a broken server shouldn't make us allocate it
+        ok = size <= (1ull << 34);
+
+        _JBBuffer decompressed = {0};
+
+        if (ok) {
+            decompressed.data = malloc(size + 1);
+            ok = decompressed.data != NULL;
+        }
+
+        if (ok) {
+            decompressed.reserved = size + 1;
+            decompressed.count = remote->zstd->decompress(decompressed.data, size, body.data, body.count);
+
+            ok = !remote->zstd->is_error(decompressed.count) && decompressed.count == size;
+
+            free(body.data);
+            body = decompressed;
+        }
+    }
+
+    if (ok) {
+        char actual[65];
+        _jb_sha256_hex(body.data, body.count, actual);
+        ok = strcmp(actual, hex) == 0;
+    }
+
+    if (ok)
+        *out = body;
+    else
+        free(body.data);
+
+    return ok;
+}
+
+// The parts of the remote execution API's ActionResult josh reads and writes:
+//   ActionResult { repeated OutputFile output_files = 2; }
+//   OutputFile { string path = 1; Digest digest = 2; }
+//   Digest { string hash = 1; int64 size_bytes = 2; }
+void _jb_proto_varint(_JBBuffer *out, uint64_t value) {
+    do {
+        char byte = (value & 0x7f) | (value > 0x7f ? 0x80 : 0);
+        _jb_buffer_append(out, &byte, 1);
+        value >>= 7;
+    } while (value);
+}
+
+void _jb_proto_bytes(_JBBuffer *out, int field, const void *data, size_t len) {
+    _jb_proto_varint(out, (uint64_t)field << 3 | 2);
+    _jb_proto_varint(out, len);
+    _jb_buffer_append(out, data, len);
+}
+
+void _jb_proto_output_file(_JBBuffer *out, const char *name, const char *hex, size_t size) {
+    _JBBuffer digest = {0};
+    _jb_proto_bytes(&digest, 1, hex, 64);
+    _jb_proto_varint(&digest, 2 << 3 | 0);
+    _jb_proto_varint(&digest, size);
+
+    _JBBuffer file = {0};
+    _jb_proto_bytes(&file, 1, name, strlen(name));
+    _jb_proto_bytes(&file, 2, digest.data, digest.count);
+
+    _jb_proto_bytes(out, 2, file.data, file.count);
+
+    free(digest.data);
+    free(file.data);
+}
+
+int _jb_proto_read_varint(const unsigned char **p, const unsigned char *end, uint64_t *value) {
+    *value = 0;
+
+    for (int shift = 0; *p < end && shift < 64; shift += 7) {
+        unsigned char byte = *(*p)++;
+        *value |= (uint64_t)(byte & 0x7f) << shift;
+
+        if (!(byte & 0x80))
+            return 1;
+    }
+
+    return 0;
+}
+
+// Calls fn for every length-delimited field of the message in [p, end); skips the rest.
+// Returns 0 if the message is malformed.
+int _jb_proto_for_each(const unsigned char *p, const unsigned char *end, int (*fn)(void *ctx, int field, const unsigned char *data, size_t len), void *ctx) {
+    while (p < end) {
+        uint64_t tag, value;
+
+        if (!_jb_proto_read_varint(&p, end, &tag))
+            return 0;
+
+        switch (tag & 7) {
+        case 0:
+            if (!_jb_proto_read_varint(&p, end, &value))
+                return 0;
+            break;
+        case 1:
+            p += 8;
+            break;
+        case 2:
+            if (!_jb_proto_read_varint(&p, end, &value) || value > (uint64_t)(end - p))
+                return 0;
+
+            if (!fn(ctx, (int)(tag >> 3), p, value))
+                return 0;
+
+            p += value;
+            break;
+        case 5:
+            p += 4;
+            break;
+        default:
+            return 0;
+        }
+    }
+
+    return p == end;
+}
+
+typedef struct {
+    char name[16];
+    char hash[65];
+} _JBRemoteOutput;
+
+int _jb_proto_digest_field(void *ctx, int field, const unsigned char *data, size_t len) {
+    _JBRemoteOutput *output = ctx;
+
+    if (field == 1 && len == 64) {
+        memcpy(output->hash, data, 64);
+        output->hash[64] = 0;
+    }
+
+    return 1;
+}
+
+int _jb_proto_output_file_field(void *ctx, int field, const unsigned char *data, size_t len) {
+    _JBRemoteOutput *output = ctx;
+
+    if (field == 1 && len < sizeof(output->name)) {
+        memcpy(output->name, data, len);
+        output->name[len] = 0;
+    }
+    else if (field == 2) {
+        return _jb_proto_for_each(data, data + len, _jb_proto_digest_field, output);
+    }
+
+    return 1;
+}
+
+int _jb_proto_action_result_field(void *ctx, int field, const unsigned char *data, size_t len) {
+    _JBRemoteOutput *outputs = ctx; // [0] object, [1] depfile
+
+    if (field != 2)
+        return 1;
+
+    _JBRemoteOutput output = {0};
+
+    if (!_jb_proto_for_each(data, data + len, _jb_proto_output_file_field, &output))
+        return 0;
+
+    if (strcmp(output.name, "object") == 0)
+        outputs[0] = output;
+    else if (strcmp(output.name, "depfile") == 0)
+        outputs[1] = output;
+
+    return 1;
+}
+
+void _jb_remote_mark_unreachable(_JBRemoteCache *remote) {
+    _jb_mutex_lock(&remote->mutex);
+
+    if (!remote->unreachable)
+        jb_log_print("[jb] remote cache %s:%s is not responding; not using it for the rest of the build\n", remote->host, remote->port);
+
+    remote->unreachable = 1;
+    _jb_mutex_unlock(&remote->mutex);
+}
+
+// Looks up the compile with the given key. On a hit, fills object and depfile and
+// returns 1.
+int _jb_remote_cache_fetch(_JBRemoteCache *remote, const char *key, _JBBuffer *object, _JBBuffer *depfile) {
+    if (remote->unreachable)
+        return 0;
+
+    char *path = jb_format_string("/ac/%s", key);
+    _JBBuffer action_result = {0};
+    int zstd = 0;
+
+    int status = _jb_http_request(remote, "GET", path, NULL, 0, &action_result, &zstd);
+    free(path);
+
+    if (status < 0)
+        _jb_remote_mark_unreachable(remote);
+
+    _JBRemoteOutput outputs[2] = {0};
+
+    int hit = status == 200
+        && !zstd
+        && _jb_proto_for_each((unsigned char *)action_result.data, (unsigned char *)action_result.data + action_result.count, _jb_proto_action_result_field, outputs)
+        && outputs[0].hash[0] && outputs[1].hash[0];
+
+    free(action_result.data);
+
+    hit = hit && _jb_remote_get_blob(remote, outputs[0].hash, object);
+
+    if (hit && !_jb_remote_get_blob(remote, outputs[1].hash, depfile)) {
+        free(object->data);
+        hit = 0;
+    }
+
+    return hit;
+}
+
+void _jb_remote_upload(_JBRemoteCache *remote, _JBRemoteUpload *upload) {
+    char object_hash[65];
+    char depfile_hash[65];
+
+    _jb_sha256_hex(upload->object, upload->object_len, object_hash);
+    _jb_sha256_hex(upload->depfile, upload->depfile_len, depfile_hash);
+
+    // blobs first; bazel-remote checks that an action result's outputs exist
+    int ok = _jb_remote_put_blob(remote, object_hash, upload->object, upload->object_len)
+        && _jb_remote_put_blob(remote, depfile_hash, upload->depfile, upload->depfile_len);
+
+    if (ok) {
+        _JBBuffer action_result = {0};
+        _jb_proto_output_file(&action_result, "object", object_hash, upload->object_len);
+        _jb_proto_output_file(&action_result, "depfile", depfile_hash, upload->depfile_len);
+
+        char *path = jb_format_string("/ac/%s", upload->key);
+        int zstd = 0;
+        int status = _jb_http_request(remote, "PUT", path, action_result.data, action_result.count, NULL, &zstd);
+        ok = status >= 200 && status < 300;
+
+        if (status < 0)
+            _jb_remote_mark_unreachable(remote);
+
+        free(path);
+        free(action_result.data);
+    }
+
+    if (!ok)
+        jb_log("could not upload %s to the remote cache\n", upload->key);
+
+    free(upload->object);
+    free(upload->depfile);
+}
+
+_JB_THREAD_PROC(_jb_remote_upload_thread, arg) {
+    _JBRemoteCache *remote = arg;
+
+    _jb_mutex_lock(&remote->mutex);
+
+    while (1) {
+        while (remote->next_upload == remote->uploads.count)
+            _jb_cond_wait(&remote->cond, &remote->mutex);
+
+        _JBRemoteUpload upload = remote->uploads.data[remote->next_upload++];
+        remote->uploading = 1;
+
+        _jb_mutex_unlock(&remote->mutex);
+
+        if (!remote->unreachable)
+            _jb_remote_upload(remote, &upload);
+        else {
+            free(upload.object);
+            free(upload.depfile);
+        }
+
+        _jb_mutex_lock(&remote->mutex);
+
+        remote->uploading = 0;
+        remote->uploaded++;
+
+        _jb_cond_broadcast(&remote->cond);
+    }
+
+    _JB_THREAD_RETURN;
+}
+
+// Queues an upload of a compile's outputs; takes ownership of object and depfile.
+void _jb_remote_cache_store(_JBRemoteCache *remote, const char *key, _JBBuffer object, _JBBuffer depfile) {
+    _JBRemoteUpload upload = {0};
+    memcpy(upload.key, key, sizeof(upload.key));
+    upload.object = object.data;
+    upload.object_len = object.count;
+    upload.depfile = depfile.data;
+    upload.depfile_len = depfile.count;
+
+    _jb_mutex_lock(&remote->mutex);
+
+    if (remote->uploads.count == 0)
+        _jb_thread_start(_jb_remote_upload_thread, remote);
+
+    JBVectorPush(&remote->uploads, upload);
+    _jb_cond_broadcast(&remote->cond);
+
+    _jb_mutex_unlock(&remote->mutex);
+}
+
+// Waits for queued uploads before josh exits.
+void _jb_remote_cache_flush(_JBRemoteCache *remote) {
+    _jb_mutex_lock(&remote->mutex);
+
+    if (remote->next_upload < remote->uploads.count || remote->uploading)
+        jb_log_print("[jb] uploading %zu objects to the remote cache...\n", remote->uploads.count - remote->next_upload + remote->uploading);
+
+    while (remote->next_upload < remote->uploads.count || remote->uploading)
+        _jb_cond_wait(&remote->cond, &remote->mutex);
+
+    _jb_mutex_unlock(&remote->mutex);
+}
+
+void _jb_compile_cache_lock(_JBCompileCache *cache) {
+    _jb_mutex_lock(&cache->mutex);
+    flock(cache->fd, LOCK_EX);
+}
+
+void _jb_compile_cache_unlock(_JBCompileCache *cache) {
+    flock(cache->fd, LOCK_UN);
+    _jb_mutex_unlock(&cache->mutex);
+}
+
+_JBCompileCache *_jb_compile_cache_open() {
+    const char *env_dir = getenv("JOSH_CACHE_DIR");
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+
+    char *dir = NULL;
+
+    if (env_dir && *env_dir)
+        dir = jb_copy_string(env_dir);
+    else if (xdg && *xdg)
+        dir = jb_format_string("%s/josh", xdg);
+    else if (home && *home)
+        dir = jb_format_string("%s/.cache/josh", home);
+
+    if (!dir) {
+        jb_log("no directory for the compile cache (set JOSH_CACHE_DIR), disabling it\n");
+        return NULL;
+    }
+
+    jb_mkdir(dir);
+
+    char *index_path = jb_format_string("%s/index", dir);
+    int fd = open(index_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    free(index_path);
+
+    if (fd < 0) {
+        jb_log("could not open compile cache in %s, disabling it\n", dir);
+        free(dir);
+        return NULL;
+    }
+
+    size_t size = sizeof(_JBCacheHeader) + sizeof(_JBCacheEntry) * _JB_CACHE_SLOTS;
+
+    flock(fd, LOCK_EX);
+
+    struct stat st;
+    int fresh = fstat(fd, &st) == 0 && st.st_size == 0;
+
+    if (fresh && ftruncate(fd, size) != 0) {
+        flock(fd, LOCK_UN);
+        close(fd);
+        jb_log("could not size compile cache index in %s, disabling it\n", dir);
+        free(dir);
+        return NULL;
+    }
+
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if (map == MAP_FAILED) {
+        flock(fd, LOCK_UN);
+        close(fd);
+        jb_log("could not map compile cache index in %s, disabling it\n", dir);
+        free(dir);
+        return NULL;
+    }
+
+    _JBCacheHeader *header = map;
+
+    // Older or damaged indexes are thrown away; the objects they referenced are
+    // orphaned until the cache directory is cleared.
+    if (fresh || memcmp(header->magic, _JB_CACHE_MAGIC, 8) != 0 || header->version != _JB_CACHE_VERSION || header->slot_count != _JB_CACHE_SLOTS) {
+        memset(map, 0, size);
+        memcpy(header->magic, _JB_CACHE_MAGIC, 8);
+        header->version = _JB_CACHE_VERSION;
+        header->slot_count = _JB_CACHE_SLOTS;
+    }
+
+    flock(fd, LOCK_UN);
+
+    _JBCompileCache *cache = malloc(sizeof(_JBCompileCache));
+    memset(cache, 0, sizeof(_JBCompileCache));
+
+    const char *budget = getenv("JOSH_CACHE_SIZE");
+    uint64_t budget_mb = (budget && atoll(budget) > 0) ? (uint64_t)atoll(budget) : _JB_CACHE_DEFAULT_SIZE_MB;
+
+    cache->dir = dir;
+    cache->budget = budget_mb * 1024 * 1024;
+    cache->fd = fd;
+    cache->header = header;
+    cache->slots = (_JBCacheEntry *)(header + 1);
+    _jb_mutex_init(&cache->mutex);
+
+    const char *remote_url = _jb_remote_cache_url ? _jb_remote_cache_url : getenv("JOSH_REMOTE_CACHE");
+
+    if (remote_url && *remote_url)
+        cache->remote = _jb_remote_cache_open(remote_url);
+
+    return cache;
+}
+
+void _jb_compile_cache_exit();
+
+// Returns the compile cache, or NULL if it is disabled or unusable.
+_JBCompileCache *_jb_compile_cache_get() {
+    if (_jb_use_compile_cache < 0) {
+        const char *env = getenv("JOSH_CACHE");
+        const char *remote_env = getenv("JOSH_REMOTE_CACHE");
+        _jb_use_compile_cache = (env && atoi(env) > 0) || (remote_env && *remote_env);
+    }
+
+    if (!_jb_use_compile_cache)
+        return NULL;
+
+    _jb_mutex_lock(&_jb_compile_cache_mutex);
+
+    if (!_jb_compile_cache_opened) {
+        _jb_compile_cache_opened = 1;
+        _jb_compile_cache = _jb_compile_cache_open();
+
+        if (_jb_compile_cache)
+            atexit(_jb_compile_cache_exit);
+    }
+
+    _jb_mutex_unlock(&_jb_compile_cache_mutex);
+    return _jb_compile_cache;
+}
+
+char *_jb_compile_cache_path(_JBCompileCache *cache, _JBCacheKey *key, const char *ext) {
+    return jb_format_string("%s/%02x/%016llx%016llx%s", cache->dir, (unsigned)(key->key_check & 0xff), (unsigned long long)key->key, (unsigned long long)key->key_check, ext);
+}
+
+// Returns the slot holding key, or if insert is set and key isn't cached, the slot it
+// should go into. Expects the cache to be locked.
+_JBCacheEntry *_jb_compile_cache_slot(_JBCompileCache *cache, uint64_t key, int insert) {
+    uint32_t mask = cache->header->slot_count - 1;
+    _JBCacheEntry *free_slot = NULL;
+
+    for (uint32_t i = 0; i <= mask; i++) {
+        _JBCacheEntry *entry = &cache->slots[(key + i) & mask];
+
+        if (entry->key == key)
+            return entry;
+
+        if (entry->key == 1 && !free_slot)
+            free_slot = entry;
+
+        if (entry->key == 0)
+            return insert ? (free_slot ? free_slot : entry) : NULL;
+    }
+
+    return insert ? free_slot : NULL;
+}
+
+int _jb_compare_cache_entry_use(const void *lhs, const void *rhs) {
+    const _JBCacheEntry *a = lhs;
+    const _JBCacheEntry *b = rhs;
+    return (a->last_used > b->last_used) - (a->last_used < b->last_used);
+}
+
+// Drops least recently used entries until the cache is below 90% of its budget and the
+// table is at most half full, then rebuilds the table without deleted slots.
+// Expects the cache to be locked.
+void _jb_compile_cache_evict(_JBCompileCache *cache) {
+    _JBCacheHeader *header = cache->header;
+    JBVector(_JBCacheEntry) live = {0};
+
+    for (uint32_t i = 0; i < header->slot_count; i++) {
+        if (cache->slots[i].key > 1)
+            JBVectorPush(&live, cache->slots[i]);
+    }
+
+    qsort(live.data, live.count, sizeof(_JBCacheEntry), _jb_compare_cache_entry_use);
+
+    uint64_t total_size = header->total_size;
+    size_t first = 0;
+
+    while (first < live.count && (total_size > cache->budget / 10 * 9 || live.count - first > header->slot_count / 2)) {
+        _JBCacheKey key = { live.data[first].key, live.data[first].key_check };
+
+        char *object = _jb_compile_cache_path(cache, &key, ".o");
+        char *depfile = _jb_compile_cache_path(cache, &key, ".d");
+        remove(object);
+        remove(depfile);
+        free(object);
+        free(depfile);
+
+        total_size -= live.data[first].size;
+        first++;
+    }
+
+    jb_log("compile cache: evicted %zu objects\n", first);
+
+    memset(cache->slots, 0, sizeof(_JBCacheEntry) * header->slot_count);
+    header->live_count = 0;
+    header->used_count = 0;
+    header->total_size = total_size;
+
+    for (size_t i = first; i < live.count; i++) {
+        *_jb_compile_cache_slot(cache, live.data[i].key, 1) = live.data[i];
+        header->live_count++;
+        header->used_count++;
+    }
+
+    free(live.data);
+}
+
+// The key of a compile is the preprocessed source, the command line with the output
+// and depfile paths left out (they differ between build folders but not in what gets
+// compiled) and the compiler's identity.
+int _jb_compile_cache_key(const char *tool, const char *text, size_t len, const char *output, const char *depfile, char **cmd, _JBCacheKey *key) {
+    _JBCompileCache *cache = _jb_compile_cache_get();
+
+    if (!cache)
+        return 0;
+
+    uint64_t seeds[2] = { 0, 0x9E3779B97F4A7C15ull };
+    uint64_t hashes[2];
+    uint64_t identity = _jb_compiler_identity(tool);
+
+    // The remote key has to be a SHA-256 to fit the remote's /ac layout.
+    _JBSha256 sha;
+    _jb_sha256_init(&sha);
+
+    if (cache->remote)
+        _jb_sha256_update(&sha, text, len);
+
+    for (int i = 0; i < 2; i++) {
+        uint64_t hash = _jb_hash_bytes(text, len, seeds[i]);
+
+        JBNullArrayFor(cmd) {
+            const char *arg = cmd[index];
+
+            if (strcmp(arg, output) == 0)
+                arg = "<output>";
+            else if (strcmp(arg, depfile) == 0)
+                arg = "<depfile>";
+
+            hash = _jb_hash_bytes(arg, strlen(arg) + 1, hash);
+
+            if (cache->remote && i == 0)
+                _jb_sha256_update(&sha, arg, strlen(arg) + 1);
+        }
+
+        hashes[i] = _jb_hash_combine(hash, identity);
+    }
+
+    key->remote_key[0] = 0;
+
+    if (cache->remote) {
+        _jb_sha256_update(&sha, &identity, sizeof(identity));
+        _jb_sha256_final(&sha, key->remote_key);
+    }
+
+    // 0 and 1 mark empty and deleted slots in the index
+    key->key = hashes[0] > 1 ? hashes[0] : hashes[0] + 2;
+    key->key_check = hashes[1];
+    return 1;
+}
+
+int _jb_compile_cache_fetch_local(_JBCompileCache *cache, _JBCacheKey *key, const char *output, const char *depfile) {
+    char *cached_object = _jb_compile_cache_path(cache, key, ".o");
+    char *cached_depfile = _jb_compile_cache_path(cache, key, ".d");
+
+    _jb_compile_cache_lock(cache);
+
+    _JBCacheEntry *entry = _jb_compile_cache_slot(cache, key->key, 0);
+    int hit = entry && entry->key_check == key->key_check;
+
+    if (hit) {
+        remove(output);
+
+        hit = _jb_copy_file_contents(cached_depfile, depfile);
+
+        if (hit) {
+            // Always a copy (a reflink where the filesystem can), never a hardlink: the
+            // restored object must be newer than its inputs and than whatever was linked or
+            // archived from the object it replaces, or the executable (or an incremental
+            // archive) keeps the old code. A hardlink keeps the cached file's mtime, and
+            // touching the shared inode would make the objects of every other build folder
+            // that links it look changed.
+            hit = _jb_copy_file_contents(cached_object, output);
+        }
+
+        if (hit) {
+            entry->last_used = ++cache->header->clock;
+        }
+        else {
+            // Someone removed the files behind our back
+            remove(output);
+            cache->header->total_size -= entry->size;
+            cache->header->live_count--;
+            entry->key = 1;
+        }
+    }
+
+    _jb_compile_cache_unlock(cache);
+
+    free(cached_object);
+    free(cached_depfile);
+    return hit;
+}
+
+int _jb_write_buffer(const char *path, _JBBuffer *buffer) {
+    FILE *file = fopen(path, "wb");
+
+    if (!file)
+        return 0;
+
+    int ok = fwrite(buffer->data, 1, buffer->count, file) == buffer->count;
+    return (fclose(file) == 0) && ok;
+}
+
+void _jb_compile_cache_store_local(_JBCompileCache *cache, _JBCacheKey *key, const char *output, const char *depfile);
+
+// Puts the cached object and depfile for key in place of output and depfile, trying the
+// local cache and then the remote one. Returns 0 on a miss.
+int _jb_compile_cache_fetch(_JBCacheKey *key, const char *output, const char *depfile) {
+    _JBCompileCache *cache = _jb_compile_cache_get();
+
+    if (!cache)
+        return 0;
+
+    int hit = _jb_compile_cache_fetch_local(cache, key, output, depfile);
+    int remote_hit = 0;
+
+    if (!hit && cache->remote) {
+        _JBBuffer object = {0};
+        _JBBuffer depfile_data = {0};
+
+        if (_jb_remote_cache_fetch(cache->remote, key->remote_key, &object, &depfile_data)) {
+            remove(output);
+            remote_hit = hit = _jb_write_buffer(output, &object) && _jb_write_buffer(depfile, &depfile_data);
+
+            if (hit)
+                _jb_compile_cache_store_local(cache, key, output, depfile);
+            else
+                remove(output);
+
+            free(object.data);
+            free(depfile_data.data);
+        }
+    }
+
+    _jb_mutex_lock(&cache->mutex);
+
+    if (hit)
+        cache->hits++;
+    else
+        cache->misses++;
+
+    cache->remote_hits += remote_hit;
+
+    _jb_mutex_unlock(&cache->mutex);
+
+    return hit;
+}
+
+void _jb_compile_cache_store_local(_JBCompileCache *cache, _JBCacheKey *key, const char *output, const char *depfile) {
+    struct stat st;
+    if (stat(output, &st) != 0)
+        return;
+
+    char *folder = jb_format_string("%s/%02x", cache->dir, (unsigned)(key->key_check & 0xff));
+    mkdir(folder, 0755);
+    free(folder);
+
+    char *cached_object = _jb_compile_cache_path(cache, key, ".o");
+    char *cached_depfile = _jb_compile_cache_path(cache, key, ".d");
+    // a copy, not a hardlink: a later compile rewriting output in place mustn't change the
+    // cached object
+    int ok = _jb_copy_file_contents(depfile, cached_depfile) && _jb_copy_file_contents(output, cached_object);
+
+    if (ok) {
+        _jb_compile_cache_lock(cache);
+
+        _JBCacheHeader *header = cache->header;
+        _JBCacheEntry *entry = _jb_compile_cache_slot(cache, key->key, 1);
+
+        if (entry) {
+            if (entry->key == key->key) {
+                header->total_size -= entry->size;
+            }
+            else {
+                header->live_count++;
+
+                if (entry->key == 0)
+                    header->used_count++;
+            }
+
+            entry->key = key->key;
+            entry->key_check = key->key_check;
+            entry->size = (uint64_t)st.st_size;
+            entry->last_used = ++header->clock;
+            header->total_size += entry->size;
+        }
+
+        if (!entry || header->total_size > cache->budget || header->used_count > header->slot_count / 4 * 3)
+            _jb_compile_cache_evict(cache);
+
+        _jb_compile_cache_unlock(cache);
+    }
+    else {
+        jb_log("could not store %s in the compile cache\n", output);
+    }
+
+    free(cached_object);
+    free(cached_depfile);
+}
+
+// Stores a freshly compiled object in the local cache and queues it for the remote one.
+void _jb_compile_cache_store(_JBCacheKey *key, const char *output, const char *depfile) {
+    _JBCompileCache *cache = _jb_compile_cache_get();
+
+    if (!cache)
+        return;
+
+    _jb_compile_cache_store_local(cache, key, output, depfile);
+
+    if (cache->remote && !cache->remote->unreachable) {
+        _JBBuffer object = {0};
+        _JBBuffer depfile_data = {0};
+
+        object.data = _jb_read_file(output, &object.count);
+        depfile_data.data = _jb_read_file(depfile, &depfile_data.count);
+
+        if (object.data && depfile_data.data) {
+            _jb_remote_cache_store(cache->remote, key->remote_key, object, depfile_data);
+        }
+        else {
+            free(object.data);
+            free(depfile_data.data);
+        }
+    }
+}
+
+void _jb_compile_cache_exit() {
+    if (_jb_compile_cache->remote)
+        _jb_remote_cache_flush(_jb_compile_cache->remote);
+
+    _jb_compile_cache_report();
+}
+
+#endif // JB_IS_WINDOWS
+
+// Distributed compiles: with workers configured (see jb_set_workers()), compile jobs
+// preprocess locally and send the preprocessed source and command line to a
+// `josh worker`, which compiles it and replies with the object file and diagnostics.
+// Compiles are spread over the local job slots and the slots each worker offers; a worker
+// that fails, times out or has a different compiler is dropped for the rest of the build
+// and its compiles run locally.
+//
+// Every message starts with _JB_WORKER_MAGIC and a u32 request type; integers are little
+// endian and strings/blobs are prefixed with their length.
+//   hello:   -> (nothing)                               <- u32 slots
+//   compile: -> u64 compiler identity, u32 argc, argc * (u32 len, bytes), u64 len, source
+//            <- u32 status, u32 exit code, u64 len, diagnostics, u64 len, object
+// In a compile request the arguments "<input>" and "<output>" stand for the files the
+// worker picks.
+//
+// There is no authentication: anyone who can connect to a worker can have it compile. So it
+// only runs a known compiler with the arguments _jb_worker_allows_command() accepts, which
+// can change the code generated from the source it was sent but can't name another program,
+// plugin, spec or response file, input, or file to write.
+#define _JB_WORKER_MAGIC "JOSHWRK1"
+
+enum {
+    _JB_WORKER_HELLO = 1,
+    _JB_WORKER_COMPILE = 2,
+};
+
+enum {
+    _JB_WORKER_OK = 0,
+    _JB_WORKER_FAILED = 1, // the compiler reported errors
+    _JB_WORKER_REJECTED = 2, // different compiler, or not one the worker runs
+};
+
+// Runs a compile here. With diagnostics, its output is collected there and a failure is
+// returned instead of ending the build.
+int _jb_run_compile_locally(char **cmd, JBStringBuilder *diagnostics) {
+    if (!diagnostics) {
+        jb_run(cmd, __FILE__, __LINE__);
+        return 0;
+    }
+
+    return _jb_run_internal(cmd, diagnostics, _jb_pipe_drain_sb_proxy, __FILE__, __LINE__);
+}
+
+#if JB_IS_WINDOWS
+
+int _jb_worker_slots() {
+    if (_jb_workers || getenv("JOSH_WORKERS"))
+        jb_log("distributed compiles are not supported on Windows yet\n");
+
+    return 0;
+}
+
+int _jb_run_compile(const char *source, char **cmd, const char *preprocessed, size_t preprocessed_len, const char *output, JBStringBuilder *diagnostics) {
+    return _jb_run_compile_locally(cmd, diagnostics);
+}
+
+void jb_worker_serve(const char *address) {
+    JB_FAIL("josh worker is not supported on Windows yet");
+}
+
+#else
+
+void _jb_put_u32(_JBBuffer *buffer, uint32_t value) {
+    unsigned char bytes[4];
+
+    for (int i = 0; i < 4; i++)
+        bytes[i] = (unsigned char)(value >> (i * 8));
+
+    _jb_buffer_append(buffer, bytes, 4);
+}
+
+void _jb_put_u64(_JBBuffer *buffer, uint64_t value) {
+    _jb_put_u32(buffer, (uint32_t)value);
+    _jb_put_u32(buffer, (uint32_t)(value >> 32));
+}
+
+void _jb_put_blob(_JBBuffer *buffer, const void *data, uint64_t len) {
+    _jb_put_u64(buffer, len);
+    _jb_buffer_append(buffer, data, len);
+}
+
+// The protocol is little-endian whatever the host is.
+uint32_t _jb_get_u32(const unsigned char *bytes) {
+    uint32_t value = 0;
+
+    for (int i = 0; i < 4; i++)
+        value |= (uint32_t)bytes[i] << (i * 8);
+
+    return value;
+}
+
+uint64_t _jb_get_u64(const unsigned char *bytes) {
+    return _jb_get_u32(bytes) | ((uint64_t)_jb_get_u32(bytes + 4) << 32);
+}
+
+int _jb_recv_u32(int fd, uint32_t *value) {
+    unsigned char bytes[4];
+
+    if (!_jb_recv_all(fd, bytes, 4))
+        return 0;
+
+    *value = _jb_get_u32(bytes);
+    return 1;
+}
+
+int _jb_recv_u64(int fd, uint64_t *value) {
+    unsigned char bytes[8];
+
+    if (!_jb_recv_all(fd, bytes, 8))
+        return 0;
+
+    *value = _jb_get_u64(bytes);
+    return 1;
+}
+
+// Receives a length-prefixed blob into a NUL-terminated allocation.
+char *_jb_recv_blob(int fd, uint64_t *len, uint64_t limit) {
+    if (!_jb_recv_u64(fd, len) || *len > limit)
+        return NULL;
+
+    char *data = malloc(*len + 1);
+
+    if (!_jb_recv_all(fd, data, *len)) {
+        free(data);
+        return NULL;
+    }
+
+    data[*len] = 0;
+    return data;
+}
+
+// Splits "unix:/path" into a NULL host and the path, and "host:port" into its parts.
+void _jb_parse_socket_address(const char *address, char **host, char **port) {
+    const char *unix_prefix = "unix:";
+    const char *colon = strrchr(address, ':');
+
+    if (strncmp(address, unix_prefix, strlen(unix_prefix)) == 0) {
+        *host = NULL;
+        *port = jb_copy_string(address + strlen(unix_prefix));
+    }
+    else if (colon) {
+        *host = jb_format_string("%.*s", (int)(colon - address), address);
+        *port = jb_copy_string(colon + 1);
+    }
+    else {
+        JB_FAIL("invalid worker address %s; expected host:port or unix:/path", address);
+    }
+}
+
+typedef struct {
+    char *address;
+    char *host; // NULL for unix sockets
+    char *port; // port, or path of the unix socket
+    int slots;
+    int busy;
+    int dead;
+} _JBWorker;
+
+typedef struct {
+    _JBMutex mutex;
+    _JBCond cond; // signaled when a slot frees up
+
+    JBVector(_JBWorker) workers;
+    int local_slots;
+    int local_busy;
+    int timeout_ms;
+
+    int remote_compiles;
+    int local_compiles;
+} _JBWorkerPool;
+
+static _JBMutex _jb_worker_pool_mutex = _JB_MUTEX_INITIALIZER;
+static _JBWorkerPool *_jb_worker_pool = NULL;
+static int _jb_worker_pool_opened = 0;
+
+void _jb_worker_pool_report() {
+    _JBWorkerPool *pool = _jb_worker_pool;
+
+    if (pool->remote_compiles + pool->local_compiles)
+        JB_LOG("distributed: %d compiles on workers, %d local\n", pool->remote_compiles, pool->local_compiles);
+}
+
+// Asks a worker how many compiles it takes at once; 0 if it doesn't answer.
+int _jb_worker_hello(_JBWorker *worker) {
+    int fd = _jb_socket_connect(worker->host, worker->port, 2000);
+
+    if (fd < 0)
+        return 0;
+
+    _JBBuffer request = {0};
+    _jb_buffer_append(&request, _JB_WORKER_MAGIC, 8);
+    _jb_put_u32(&request, _JB_WORKER_HELLO);
+
+    uint32_t slots = 0;
+
+    if (!_jb_send_all(fd, request.data, request.count) || !_jb_recv_u32(fd, &slots))
+        slots = 0;
+
+    free(request.data);
+    close(fd);
+    return (int)slots;
+}
+
+// Returns the worker pool, or NULL if no (responsive) workers are configured.
+_JBWorkerPool *_jb_worker_pool_get() {
+    _jb_mutex_lock(&_jb_worker_pool_mutex);
+
+    if (!_jb_worker_pool_opened) {
+        _jb_worker_pool_opened = 1;
+
+        const char *list = _jb_workers ? _jb_workers : getenv("JOSH_WORKERS");
+        _JBWorkerPool *pool = malloc(sizeof(_JBWorkerPool));
+        memset(pool, 0, sizeof(_JBWorkerPool));
+
+        char *addresses = jb_copy_string(list ? list : "");
+
+        for (char *address = strtok(addresses, ","); address; address = strtok(NULL, ",")) {
+            _JBWorker worker = {0};
+            worker.address = jb_copy_string(address);
+            _jb_parse_socket_address(address, &worker.host, &worker.port);
+            worker.slots = _jb_worker_hello(&worker);
+
+            if (worker.slots > 0) {
+                JBVectorPush(&pool->workers, worker);
+            }
+            else {
+                jb_log_print("[jb] worker %s is not responding; compiling without it\n", address);
+            }
+        }
+
+        free(addresses);
+
+        if (pool->workers.count) {
+            const char *timeout = getenv("JOSH_WORKER_TIMEOUT");
+
+            pool->local_slots = jb_job_count();
+            pool->timeout_ms = (timeout && atoi(timeout) > 0) ? atoi(timeout) : 120000;
+            _jb_mutex_init(&pool->mutex);
+            _jb_cond_init(&pool->cond);
+
+            _jb_worker_pool = pool;
+            atexit(_jb_worker_pool_report);
+        }
+        else {
+            free(pool);
+        }
+    }
+
+    _jb_mutex_unlock(&_jb_worker_pool_mutex);
+    return _jb_worker_pool;
+}
+
+// Number of compiles the workers take on top of the local jobs.
+int _jb_worker_slots() {
+    _JBWorkerPool *pool = _jb_worker_pool_get();
+    int slots = 0;
+
+    if (pool) {
+        JBArrayForEach(&pool->workers) {
+            slots += it->slots;
+        }
+    }
+
+    return slots;
+}
+
+// Waits for a free compile slot. Local slots are used first since they skip the network;
+// returns the worker to compile on, or NULL for a local slot.
+_JBWorker *_jb_worker_acquire(_JBWorkerPool *pool, int local_only) {
+    _jb_mutex_lock(&pool->mutex);
+
+    _JBWorker *out = NULL;
+
+    while (1) {
+        if (pool->local_busy < pool->local_slots) {
+            pool->local_busy++;
+            break;
+        }
+
+        if (!local_only) {
+            JBArrayForEach(&pool->workers) {
+                if (!it->dead && it->busy < it->slots) {
+                    out = it;
+                    break;
+                }
+            }
+
+            if (out) {
+                out->busy++;
+                break;
+            }
+        }
+
+        _jb_cond_wait(&pool->cond, &pool->mutex);
+    }
+
+    _jb_mutex_unlock(&pool->mutex);
+    return out;
+}
+
+void _jb_worker_release(_JBWorkerPool *pool, _JBWorker *worker) {
+    _jb_mutex_lock(&pool->mutex);
+
+    if (worker)
+        worker->busy--;
+    else
+        pool->local_busy--;
+
+    _jb_cond_broadcast(&pool->cond);
+    _jb_mutex_unlock(&pool->mutex);
+}
+
+void _jb_worker_drop(_JBWorkerPool *pool, _JBWorker *worker, const char *reason) {
+    _jb_mutex_lock(&pool->mutex);
+
+    if (!worker->dead)
+        jb_log_print("[jb] worker %s %s; compiling without it\n", worker->address, reason);
+
+    worker->dead = 1;
+    _jb_mutex_unlock(&pool->mutex);
+}
+
+const char *_jb_preprocessed_language(const char *source) {
+    const char *ext = jb_extension(source);
+
+    if (ext && strcmp(ext, "c") == 0)
+        return "cpp-output";
+    if (ext && strcmp(ext, "m") == 0)
+        return "objective-c-cpp-output";
+    if (ext && strcmp(ext, "mm") == 0)
+        return "objective-c++-cpp-output";
+
+    return "c++-cpp-output";
+}
+
+// Only compilers are run for clients, not whatever they send as argv[0].
+int _jb_worker_runs_tool(const char *tool) {
+    const char *name = jb_filename(tool);
+    return strstr(name, "gcc") || strstr(name, "g++") || strstr(name, "clang") || strcmp(name, "cc") == 0 || strcmp(name, "c++") == 0;
+}
+
+int _jb_starts_with(const char *s, const char *prefix) {
+    return strncmp(s, prefix, strlen(prefix)) == 0;
+}
+
+// How many arguments (1 or 2) the worker's command uses up at arg, value being the next one
+// or NULL, or 0 if arg isn't allowed.
+int _jb_worker_argument_count(const char *arg, const char *value) {
+    const char *single[] = { "<input>", "-c", "-w", "-pedantic", "-pedantic-errors", "-ansi", "-pthread", "-pipe" };
+    const char *with_value[] = { "-D", "-U", "-I", "-isystem", "-iquote", "-idirafter", "-target", "-arch", "--sysroot", "--param" };
+    const char *prefixes[] = { "-D", "-U", "-I", "-O", "-g", "-std=", "--std=", "--target=", "--sysroot=" };
+
+    // options that load plugins, pass arguments on to other programs, or read or write files
+    // besides the input and output
+    const char *refused[] = {
+        "-fplugin", "-fmodule", "-fdump", "-fopt-info", "-ftime-trace", "-fsave-optimization-record", "-foptimization-record",
+        "-fcrash-diagnostics", "-fprofile-use", "-fprofile-instr-use", "-fprofile-sample-use", "-fauto-profile",
+        "-fsanitize-ignorelist", "-fsanitize-blacklist", "-gsplit-dwarf", "-mllvm", "-Wa,", "-Wl,", "-Wp,",
+    };
+
+    for (size_t i = 0; i < sizeof(refused)/sizeof(refused[0]); i++) {
+        if (_jb_starts_with(arg, refused[i]))
+            return 0;
+    }
+
+    for (size_t i = 0; i < sizeof(single)/sizeof(single[0]); i++) {
+        if (strcmp(arg, single[i]) == 0)
+            return 1;
+    }
+
+    for (size_t i = 0; i < sizeof(with_value)/sizeof(with_value[0]); i++) {
+        if (strcmp(arg, with_value[i]) == 0)
+            return value && value[0] != '@' ? 2 : 0;
+    }
+
+    if (strcmp(arg, "-o") == 0)
+        return value && strcmp(value, "<output>") == 0 ? 2 : 0;
+
+    if (strcmp(arg, "-x") == 0) {
+        const char *languages[] = { "cpp-output", "c++-cpp-output", "objective-c-cpp-output", "objective-c++-cpp-output" };
+
+        for (size_t i = 0; value && i < sizeof(languages)/sizeof(languages[0]); i++) {
+            if (strcmp(value, languages[i]) == 0)
+                return 2;
+        }
+
+        return 0;
+    }
+
+    for (size_t i = 0; i < sizeof(prefixes)/sizeof(prefixes[0]); i++) {
+        if (_jb_starts_with(arg, prefixes[i]))
+            return 1;
+    }
+
+    if (_jb_starts_with(arg, "-W") || _jb_starts_with(arg, "-m"))
+        return 1;
+
+    // a path in an -f option is a file to read or write, except for the ones that only
+    // rewrite the paths recorded in the object
+    if (_jb_starts_with(arg, "-f")) {
+        const char *equals = strchr(arg, '=');
+        int rewrites_paths = equals && (strstr(arg, "-prefix-map=") || _jb_starts_with(arg, "-fprofile-prefix-path="));
+
+        return !equals || !strchr(equals, '/') || rewrites_paths ? 1 : 0;
+    }
+
+    return 0;
+}
+
+// Whether a worker runs args, a compile command with "<input>" and "<output>" in it: a
+// compiler it runs and only arguments _jb_worker_argument_count() allows.
+int _jb_worker_allows_command(char **args, size_t count) {
+    if (count == 0 || !_jb_worker_runs_tool(args[0]))
+        return 0;
+
+    for (size_t i = 1; i < count;) {
+        int used = _jb_worker_argument_count(args[i], i + 1 < count ? args[i + 1] : NULL);
+
+        if (!used)
+            return 0;
+
+        i += used;
+    }
+
+    return 1;
+}
+
+// Compiles on worker. Returns 1 if output was written; 0 means compile locally instead.
+int _jb_worker_compile(_JBWorkerPool *pool, _JBWorker *worker, const char *source, char **cmd, const char *preprocessed, size_t preprocessed_len, const char *output) {
+    // The worker compiles the preprocessed source, so leave out the depfile (that was
+    // written when preprocessing) and stand-ins for the files.
+    _JBCommandVector args = {0};
+
+    JBNullArrayFor(cmd) {
+        if (strcmp(cmd[index], "-MMD") == 0)
+            continue;
+
+        // already expanded in the preprocessed source (eg. a precompiled header's stub)
+        if (strcmp(cmd[index], "-MF") == 0 || strcmp(cmd[index], "-include") == 0) {
+            index += 1;
+            continue;
+        }
+
+        if (strcmp(cmd[index], output) == 0) {
+            JBVectorPush(&args, "<output>");
+        }
+        else if (!cmd[index + 1] && strcmp(cmd[index], source) == 0) {
+            JBVectorPush(&args, "-x");
+            JBVectorPush(&args, (char *)_jb_preprocessed_language(source));
+            JBVectorPush(&args, "<input>");
+        }
+        else {
+            JBVectorPush(&args, cmd[index]);
+        }
+    }
+
+    // a flag the worker would refuse (a plugin, say) only keeps this compile here
+    if (!_jb_worker_allows_command(args.data, args.count)) {
+        jb_log("%s uses flags workers don't run; compiling it locally\n", source);
+        free(args.data);
+        return 0;
+    }
+
+    _JBBuffer request = {0};
+    _jb_buffer_append(&request, _JB_WORKER_MAGIC, 8);
+    _jb_put_u32(&request, _JB_WORKER_COMPILE);
+    _jb_put_u64(&request, _jb_compiler_identity(cmd[0]));
+    _jb_put_u32(&request, (uint32_t)args.count);
+
+    JBArrayForEach(&args) {
+        _jb_put_u32(&request, (uint32_t)strlen(*it));
+        _jb_buffer_append(&request, *it, strlen(*it));
+    }
+
+    _jb_put_blob(&request, preprocessed, preprocessed_len);
+    free(args.data);
+
+    int fd = _jb_socket_connect(worker->host, worker->port, 2000);
+    int ok = fd >= 0;
+
+    if (ok) {
+        _jb_socket_set_timeout(fd, pool->timeout_ms);
+        ok = _jb_send_all(fd, request.data, request.count);
+    }
+
+    free(request.data);
+
+    uint32_t status = 0, exit_code = 0;
+    uint64_t diagnostics_len = 0, object_len = 0;
+    char *diagnostics = NULL;
+    char *object = NULL;
+
+    ok = ok && _jb_recv_u32(fd, &status) && _jb_recv_u32(fd, &exit_code);
+    ok = ok && (diagnostics = _jb_recv_blob(fd, &diagnostics_len, 1ull << 30));
+    ok = ok && (object = _jb_recv_blob(fd, &object_len, 1ull << 34));
+
+    if (fd >= 0)
+        close(fd);
+
+    int written = 0;
+
+    if (!ok) {
+        _jb_worker_drop(pool, worker, "did not answer in time");
+    }
+    else if (status == _JB_WORKER_REJECTED) {
+        _jb_worker_drop(pool, worker, diagnostics);
+    }
+    else if (status == _JB_WORKER_OK) {
+        // warnings
+        if (diagnostics_len)
+            jb_log_print("%s", diagnostics);
+
+        _JBBuffer buffer = { { object, object_len, object_len } };
+        written = _jb_write_buffer(output, &buffer);
+    }
+
+    // On _JB_WORKER_FAILED the local compile that follows reports the errors.
+
+    free(diagnostics);
+    free(object);
+    return written;
+}
+
+// Compiles with cmd, on a worker if there are any and the source could be preprocessed.
+int _jb_run_compile(const char *source, char **cmd, const char *preprocessed, size_t preprocessed_len, const char *output, JBStringBuilder *diagnostics) {
+    _JBWorkerPool *pool = preprocessed ? _jb_worker_pool_get() : NULL;
+
+    if (!pool)
+        return _jb_run_compile_locally(cmd, diagnostics);
+
+    _JBWorker *worker = _jb_worker_acquire(pool, 0);
+
+    if (worker) {
+        int compiled = _jb_worker_compile(pool, worker, source, cmd, preprocessed, preprocessed_len, output);
+        _jb_worker_release(pool, worker);
+
+        if (compiled) {
+            _jb_mutex_lock(&pool->mutex);
+            pool->remote_compiles++;
+            _jb_mutex_unlock(&pool->mutex);
+            return 0;
+        }
+
+        worker = _jb_worker_acquire(pool, 1);
+    }
+
+    _jb_mutex_lock(&pool->mutex);
+    pool->local_compiles++;
+    _jb_mutex_unlock(&pool->mutex);
+
+    remove(output);
+    int result = _jb_run_compile_locally(cmd, diagnostics);
+
+    _jb_worker_release(pool, NULL);
+    return result;
+}
+
+typedef struct {
+    int fd;
+    const char *folder;
+
+    _JBMutex *mutex;
+    _JBCond *cond;
+    int *busy;
+    int slots;
+} _JBWorkerConnection;
+
+void _jb_worker_reply(int fd, uint32_t status, uint32_t exit_code, const char *diagnostics, const char *object, size_t object_len) {
+    _JBBuffer reply = {0};
+    _jb_put_u32(&reply, status);
+    _jb_put_u32(&reply, exit_code);
+    _jb_put_blob(&reply, diagnostics, strlen(diagnostics));
+    _jb_put_blob(&reply, object, object_len);
+
+    _jb_send_all(fd, reply.data, reply.count);
+    free(reply.data);
+}
+
+void _jb_worker_handle_compile(_JBWorkerConnection *conn) {
+    static _JBMutex counter_mutex = _JB_MUTEX_INITIALIZER;
+    static int counter = 0;
+
+    int fd = conn->fd;
+    uint64_t identity = 0;
+    uint32_t argc = 0;
+
+    if (!_jb_recv_u64(fd, &identity) || !_jb_recv_u32(fd, &argc) || argc == 0 || argc > 65536)
+        return;
+
+    JBVector(char *) args = {0};
+    int ok = 1;
+
+    for (uint32_t i = 0; i < argc && ok; i++) {
+        uint32_t len = 0;
+        char *arg = NULL;
+
+        ok = _jb_recv_u32(fd, &len) && len < (1 << 20);
+
+        if (ok) {
+            arg = malloc(len + 1);
+            ok = _jb_recv_all(fd, arg, len);
+            arg[len] = 0;
+            JBVectorPush(&args, arg);
+        }
+    }
+
+    uint64_t source_len = 0;
+    char *source = ok ? _jb_recv_blob(fd, &source_len, 1ull << 32) : NULL;
+
+    if (source) {
+        if (!_jb_worker_allows_command(args.data, args.count)) {
+            _jb_worker_reply(fd, _JB_WORKER_REJECTED, 0, "does not run that command", "", 0);
+        }
+        else if (_jb_compiler_identity(args.data[0]) != identity) {
+            _jb_worker_reply(fd, _JB_WORKER_REJECTED, 0, "has a different compiler version", "", 0);
+        }
+        else {
+            _jb_mutex_lock(&counter_mutex);
+            int id = counter++;
+            _jb_mutex_unlock(&counter_mutex);
+
+            char *input = jb_format_string("%s/%d.i", conn->folder, id);
+            char *output = jb_format_string("%s/%d.o", conn->folder, id);
+
+            _JBBuffer buffer = { { source, source_len, source_len } };
+            int written = _jb_write_buffer(input, &buffer);
+
+            JBArrayForEach(&args) {
+                if (strcmp(*it, "<input>") == 0) {
+                    free(*it);
+                    *it = jb_copy_string(input);
+                }
+                else if (strcmp(*it, "<output>") == 0) {
+                    free(*it);
+                    *it = jb_copy_string(output);
+                }
+            }
+
+            JBVectorPush(&args, NULL);
+
+            _jb_mutex_lock(conn->mutex);
+
+            while (*conn->busy >= conn->slots)
+                _jb_cond_wait(conn->cond, conn->mutex);
+
+            *conn->busy += 1;
+            _jb_mutex_unlock(conn->mutex);
+
+            struct JBRunResult result = { 1, NULL };
+
+            if (written)
+                result = jb_run_get_output(args.data, __FILE__, __LINE__);
+
+            _jb_mutex_lock(conn->mutex);
+            *conn->busy -= 1;
+            _jb_cond_broadcast(conn->cond);
+            _jb_mutex_unlock(conn->mutex);
+
+            size_t object_len = 0;
+            char *object = result.exit_code == 0 ? _jb_read_file(output, &object_len) : NULL;
+
+            _jb_worker_reply(fd, object ? _JB_WORKER_OK : _JB_WORKER_FAILED, result.exit_code, result.output ? result.output : "", object ? object : "", object_len);
+
+            remove(input);
+            remove(output);
+
+            free(object);
+            free(result.output);
+            free(input);
+            free(output);
+
+            args.count -= 1;
+        }
+    }
+
+    JBArrayForEach(&args) {
+        free(*it);
+    }
+
+    free(args.data);
+    free(source);
+}
+
+_JB_THREAD_PROC(_jb_worker_connection_thread, arg) {
+    _JBWorkerConnection *conn = arg;
+
+    char magic[8];
+    uint32_t type = 0;
+
+    if (_jb_recv_all(conn->fd, magic, 8) && memcmp(magic, _JB_WORKER_MAGIC, 8) == 0 && _jb_recv_u32(conn->fd, &type)) {
+        if (type == _JB_WORKER_HELLO) {
+            _JBBuffer reply = {0};
+            _jb_put_u32(&reply, (uint32_t)conn->slots);
+            _jb_send_all(conn->fd, reply.data, reply.count);
+            free(reply.data);
+        }
+        else if (type == _JB_WORKER_COMPILE) {
+            _jb_worker_handle_compile(conn);
+        }
+    }
+
+    close(conn->fd);
+    free(conn);
+
+    _JB_THREAD_RETURN;
+}
+
+void jb_worker_serve(const char *address) {
+    char *host, *port;
+    _jb_parse_socket_address(address, &host, &port);
+
+    int fd = -1;
+
+    if (!host) {
+        struct sockaddr_un un = {0};
+        un.sun_family = AF_UNIX;
+        snprintf(un.sun_path, sizeof(un.sun_path), "%s", port);
+
+        unlink(port);
+
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        JB_ASSERT(fd >= 0 && bind(fd, (struct sockaddr *)&un, sizeof(un)) == 0, "could not listen on %s: %s", address, strerror(errno));
+    }
+    else {
+        struct addrinfo hints = {0};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+
+        struct addrinfo *addrs = NULL;
+        JB_ASSERT(getaddrinfo(*host ? host : NULL, port, &hints, &addrs) == 0, "could not resolve %s", address);
+
+        fd = socket(addrs->ai_family, addrs->ai_socktype, addrs->ai_protocol);
+
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+        JB_ASSERT(fd >= 0 && bind(fd, addrs->ai_addr, addrs->ai_addrlen) == 0, "could not listen on %s: %s", address, strerror(errno));
+        freeaddrinfo(addrs);
+    }
+
+    JB_ASSERT(listen(fd, 64) == 0, "could not listen on %s: %s", address, strerror(errno));
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    const char *tmp = getenv("TMPDIR");
+    char *folder = jb_format_string("%s/josh-worker-XXXXXX", tmp && *tmp ? tmp : "/tmp");
+    JB_ASSERT(mkdtemp(folder), "could not create a temporary directory in %s", tmp && *tmp ? tmp : "/tmp");
+
+    static _JBMutex mutex = _JB_MUTEX_INITIALIZER;
+    static _JBCond cond;
+    static int busy = 0;
+
+    _jb_cond_init(&cond);
+
+    int slots = jb_job_count();
+
+    JB_LOG("worker listening on %s, compiling %d at a time\n", address, slots);
+
+    while (1) {
+        int client = accept(fd, NULL, NULL);
+
+        if (client < 0) {
+            if (errno == EINTR)
+                continue;
+
+            JB_FAIL("accept failed on %s: %s", address, strerror(errno));
+        }
+
+        fcntl(client, F_SETFD, FD_CLOEXEC);
+
+        _JBWorkerConnection *conn = malloc(sizeof(_JBWorkerConnection));
+        conn->fd = client;
+        conn->folder = folder;
+        conn->mutex = &mutex;
+        conn->cond = &cond;
+        conn->busy = &busy;
+        conn->slots = slots;
+
+        pthread_detach(_jb_thread_start(_jb_worker_connection_thread, conn));
+    }
+}
+
+#endif // JB_IS_WINDOWS
+
+// `josh daemon`: the runner of a build.josh stays up and serves `josh build` for its
+// workspace over a unix socket in build/. Between builds it keeps the stat cache and the
+// build databases its builds wrote; an inotify watch on the directory of every path it
+// caches keeps those entries current. Each build runs in a forked child that starts from
+// this state, so the build file runs just as it would in a fresh runner and can fail or
+// exit without taking the daemon down. The daemon exits once the build file changes.
+//
+// Integers and blobs are encoded like in the worker protocol.
+//   -> _JB_DAEMON_MAGIC, u64 len, cwd, u32 argc, argc * blob, u32 envc, envc * blob
+//   <- any number of u32 _JB_DAEMON_OUTPUT, blob; then u32 _JB_DAEMON_EXIT, u32 exit code
+//      or u32 _JB_DAEMON_REJECTED when this daemon can't serve the request
+// The child and the daemon share a socket pair: before building a target the child sends
+// 'S' and receives u32 count, count * blob naming the cached paths that changed since it
+// started (or _JB_DAEMON_RESET to drop its whole cache). On exit the child sends 'D' and a
+// blob for each build folder whose database it used.
+#define _JB_DAEMON_MAGIC "JOSHDMN1"
+#define _JB_DAEMON_RESET 0xFFFFFFFFu
+
+enum {
+    _JB_DAEMON_OUTPUT = 1,
+    _JB_DAEMON_EXIT = 2,
+    _JB_DAEMON_REJECTED = 3,
+};
+
+#if JB_IS_LINUX
+
+// In a build served by the daemon, the child's end of its socket pair; -1 otherwise.
+static int _jb_daemon_fd = -1;
+
+// Without IN_MODIFY: writers are seen when they close the file, which keeps a build writing
+// thousands of objects from overflowing the event queue.
+#define _JB_DAEMON_WATCH_MASK (IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE \
+    | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+typedef struct {
+    int wd;
+    char *folder; // a directory reached through several paths has an entry for each
+} _JBDaemonWatch;
+
+typedef struct {
+    int (*build_main)(int, char **);
+    const char *build_file;
+
+    int inotify_fd;
+    JBVector(_JBDaemonWatch) watches;
+    _JBStringMap watched; // folder -> non-NULL once watched
+    _JBStringMap tracked; // canonical path -> non-NULL once kept in the stat cache
+    _JBStringMap outputs; // canonical path -> non-NULL for files the databases list as outputs
+
+    JBVector(char *) changed; // tracked paths refreshed since the child started or synced
+    int reset; // the stat cache was dropped since the child started or synced
+
+    JBVector(char *) inputs_changed; // changed tracked paths that aren't outputs, since the last build started
+    int lost_events; // the stat cache was dropped since the last build started
+
+    JBVector(char *) folders; // build folders the child used
+} _JBDaemon;
+
+void _jb_daemon_sync() {
+    if (_jb_daemon_fd < 0)
+        return;
+
+    char request = 'S';
+    uint32_t count = 0;
+
+    if (!_jb_send_all(_jb_daemon_fd, &request, 1) || !_jb_recv_u32(_jb_daemon_fd, &count))
+        JB_FAIL("lost connection to josh daemon");
+
+    if (count == _JB_DAEMON_RESET) {
+        _jb_stat_cache_clear();
+        return;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t len = 0;
+        char *path = _jb_recv_blob(_jb_daemon_fd, &len, PATH_MAX);
+
+        if (!path)
+            JB_FAIL("lost connection to josh daemon");
+
+        _jb_stat_refresh(path);
+        free(path);
+    }
+}
+
+void _jb_daemon_child_exit() {
+    _JBBuffer message = {0};
+
+    _jb_mutex_lock(&_jb_build_db_mutex);
+
+    JBArrayForEach(&_jb_build_dbs) {
+        _jb_buffer_append(&message, "D", 1);
+        _jb_put_blob(&message, (*it)->build_folder, strlen((*it)->build_folder));
+    }
+
+    _jb_mutex_unlock(&_jb_build_db_mutex);
+
+    _jb_send_all(_jb_daemon_fd, message.data, message.count);
+    free(message.data);
+}
+
+void _jb_daemon_free_strings(char **strings, size_t count) {
+    for (size_t i = 0; i < count; i++)
+        free(strings[i]);
+}
+
+void _jb_daemon_free_map_keys(_JBStringMap *map) {
+    for (size_t i = 0; i < map->capacity; i++)
+        free((char *)map->keys[i]);
+
+    _jb_string_map_free(map);
+}
+
+// Drops every watch along with the whole stat cache; _jb_daemon_track starts over.
+void _jb_daemon_reset(_JBDaemon *daemon) {
+    if (daemon->inotify_fd >= 0)
+        close(daemon->inotify_fd);
+
+    daemon->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    JB_ASSERT(daemon->inotify_fd >= 0, "could not initialize inotify: %s", strerror(errno));
+
+    JBArrayForEach(&daemon->watches) {
+        free(it->folder);
+    }
+
+    daemon->watches.count = 0;
+
+    // the folders are owned by watches
+    _jb_string_map_free(&daemon->watched);
+    _jb_daemon_free_map_keys(&daemon->tracked);
+
+    _jb_daemon_free_map_keys(&daemon->outputs);
+
+    _jb_daemon_free_strings(daemon->changed.data, daemon->changed.count);
+    daemon->changed.count = 0;
+
+    _jb_stat_cache_clear();
+    daemon->reset = 1;
+    daemon->lost_events = 1;
+}
+
+// Keeps path in the stat cache, watching its directory first so no change is missed.
+void _jb_daemon_track(_JBDaemon *daemon, const char *path) {
+    char *key = malloc(strlen(path) + 1);
+    _jb_canonical_path(path, key);
+
+    if (_jb_string_map_get(&daemon->tracked, key)) {
+        free(key);
+        return;
+    }
+
+    const char *slash = strrchr(key, JB_PATH_SEPARATOR);
+    char *folder = !slash ? jb_copy_string(".") : jb_format_string("%.*s", slash == key ? 1 : (int)(slash - key), key);
+
+    int watched = _jb_string_map_get(&daemon->watched, folder) != NULL;
+
+    if (!watched) {
+        int wd = inotify_add_watch(daemon->inotify_fd, folder, _JB_DAEMON_WATCH_MASK);
+
+        if (wd >= 0) {
+            _JBDaemonWatch watch = { wd, folder };
+            JBVectorPush(&daemon->watches, watch);
+            _jb_string_map_put(&daemon->watched, folder, folder);
+
+            watched = 1;
+            folder = NULL;
+        }
+    }
+
+    free(folder);
+
+    // changes to the target of a symlink don't show up in the link's directory
+    struct stat st;
+    int is_link = lstat(key, &st) == 0 && S_ISLNK(st.st_mode);
+
+    if (!watched || is_link) {
+        free(key);
+        return;
+    }
+
+    _jb_string_map_put(&daemon->tracked, key, key);
+    _jb_file_stat(key);
+}
+
+// Tracks every path the loaded build databases mention.
+void _jb_daemon_track_databases(_JBDaemon *daemon) {
+    _jb_daemon_track(daemon, daemon->build_file);
+
+    _jb_mutex_lock(&_jb_build_db_mutex);
+
+    JBArrayForEach(&_jb_build_dbs) {
+        _JBBuildDB *db = *it;
+
+        for (size_t i = 0; i < db->strings.count; i++)
+            _jb_daemon_track(daemon, db->strings.data[i]);
+
+        for (size_t i = 0; i < db->records.count; i++) {
+            const char *output = db->strings.data[db->records.data[i].output];
+            char *key = malloc(strlen(output) + 1);
+            _jb_canonical_path(output, key);
+
+            if (_jb_string_map_get(&daemon->outputs, key)) {
+                free(key);
+            }
+            else {
+                _jb_string_map_put(&daemon->outputs, key, key);
+            }
+        }
+    }
+
+    _jb_mutex_unlock(&_jb_build_db_mutex);
+}
+
+// Applies pending inotify events to the stat cache.
+void _jb_daemon_read_events(_JBDaemon *daemon) {
+    char buffer[65536] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while (1) {
+        ssize_t len = read(daemon->inotify_fd, buffer, sizeof(buffer));
+
+        if (len <= 0)
+            return;
+
+        for (char *p = buffer; p < buffer + len; ) {
+            struct inotify_event *event = (struct inotify_event *)p;
+            p += sizeof(struct inotify_event) + event->len;
+
+            if (event->mask & (IN_Q_OVERFLOW | IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED | IN_UNMOUNT)) {
+                // events were lost or a watched directory went away; start over
+                _jb_daemon_reset(daemon);
+                return;
+            }
+
+            if (!event->len)
+                continue;
+
+            JBArrayForEach(&daemon->watches) {
+                if (it->wd != event->wd)
+                    continue;
+
+                char *path = jb_format_string("%s/%s", it->folder, event->name);
+                _jb_canonical_path(path, path);
+
+                if (!_jb_stat_refresh(path)) {
+                    free(path);
+                    continue;
+                }
+
+                if (_jb_string_map_get(&daemon->outputs, path)) {
+                    // written by a build
+                }
+                else if (daemon->inputs_changed.count < 65536) {
+                    JBVectorPush(&daemon->inputs_changed, jb_copy_string(path));
+                }
+                else {
+                    daemon->lost_events = 1;
+                }
+
+                JBVectorPush(&daemon->changed, path);
+            }
+        }
+    }
+}
+
+// Handles one message from the child; returns 0 once it closed its end.
+int _jb_daemon_child_message(_JBDaemon *daemon, int fd) {
+    char type = 0;
+
+    if (recv(fd, &type, 1, 0) != 1)
+        return 0;
+
+    if (type == 'S') {
+        _jb_daemon_read_events(daemon);
+
+        _JBBuffer reply = {0};
+
+        if (daemon->reset) {
+            _jb_put_u32(&reply, _JB_DAEMON_RESET);
+        }
+        else {
+            _jb_put_u32(&reply, (uint32_t)daemon->changed.count);
+
+            JBArrayForEach(&daemon->changed) {
+                _jb_put_blob(&reply, *it, strlen(*it));
+            }
+        }
+
+        _jb_daemon_free_strings(daemon->changed.data, daemon->changed.count);
+        daemon->changed.count = 0;
+        daemon->reset = 0;
+
+        int sent = _jb_send_all(fd, reply.data, reply.count);
+        free(reply.data);
+        return sent;
+    }
+
+    if (type == 'D') {
+        uint64_t len = 0;
+        char *folder = _jb_recv_blob(fd, &len, PATH_MAX);
+
+        if (!folder)
+            return 0;
+
+        JBVectorPush(&daemon->folders, folder);
+        return 1;
+    }
+
+    return 0;
+}
+
+int _jb_daemon_send_u32(int fd, uint32_t type, uint32_t value) {
+    _JBBuffer message = {0};
+    _jb_put_u32(&message, type);
+    _jb_put_u32(&message, value);
+
+    int sent = _jb_send_all(fd, message.data, message.count);
+    free(message.data);
+    return sent;
+}
+
+// The build running in a child, for _jb_daemon_signal.
+static pid_t _jb_daemon_child = 0;
+
+// Runs the build file's main with argv (NULL-terminated) in a child that starts from the
+// daemon's stat cache and build databases; env, if given, replaces its environment. The
+// child's output is forwarded to client when it's >= 0 and otherwise goes to our stdout.
+// With cancel_on_change, the build is stopped as soon as one of its inputs changes.
+// Returns the build's exit code, or -1 if it was cancelled or client went away.
+int _jb_daemon_build(_JBDaemon *daemon, char **argv, char **env, int client, int cancel_on_change) {
+    _jb_daemon_read_events(daemon);
+    _jb_daemon_track_databases(daemon);
+
+    // the child starts from the cache as it is now
+    _jb_daemon_free_strings(daemon->changed.data, daemon->changed.count);
+    daemon->changed.count = 0;
+    daemon->reset = 0;
+
+    _jb_daemon_free_strings(daemon->inputs_changed.data, daemon->inputs_changed.count);
+    daemon->inputs_changed.count = 0;
+    daemon->lost_events = 0;
+
+    int out[2] = { -1, -1 };
+    int channel[2];
+
+    if (client >= 0) {
+        JB_ASSERT(_jb_pipe(out) == 0, "could not create a pipe: %s", strerror(errno));
+    }
+
+    JB_ASSERT(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, channel) == 0, "could not create a socket pair: %s", strerror(errno));
+
+    fflush(stdout);
+    pid_t pid = fork();
+    JB_ASSERT(pid >= 0, "fork failed: %s", strerror(errno));
+
+    if (pid == 0) {
+        // child; its own process group so a cancelled build can be stopped as a whole
+        setpgid(0, 0);
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+
+        if (client >= 0) {
+            dup2(out[1], STDOUT_FILENO);
+            dup2(out[1], STDERR_FILENO);
+        }
+
+        _jb_daemon_fd = channel[1];
+        atexit(_jb_daemon_child_exit);
+
+        if (env) {
+            clearenv();
+
+            JBNullArrayFor(env) {
+                putenv(env[index]);
+            }
+        }
+
+        // logs to josh.log as a fresh runner would, and the first target built starts
+        // from the daemon's stat cache
+        _jb_log_print_only = 0;
+        _jb_stat_cache_depth = 0;
+        _jb_terminal = -1; // stdout may have changed
+        _jb_job_outputs.status_line = -1;
+        _jb_log_sink.writer = 0; // threads don't survive fork()
+
+        exit(daemon->build_main(jb_string_array_count(argv), argv));
+    }
+
+    setpgid(pid, pid);
+    _jb_daemon_child = pid;
+
+    if (client >= 0)
+        close(out[1]);
+
+    close(channel[1]);
+
+    struct pollfd fds[4] = {
+        { .fd = out[0], .events = POLLIN },
+        { .fd = channel[0], .events = POLLIN },
+        { .fd = daemon->inotify_fd, .events = POLLIN },
+        { .fd = client, .events = POLLIN },
+    };
+
+    int cancelled = 0;
+
+    while (fds[0].fd >= 0 || fds[1].fd >= 0) {
+        fds[2].fd = daemon->inotify_fd; // _jb_daemon_reset replaces it
+
+        if (poll(fds, 4, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+
+            break;
+        }
+
+        if (fds[0].revents) {
+            char buffer[65536];
+            ssize_t bytes = read(out[0], buffer, sizeof(buffer));
+
+            if (bytes > 0) {
+                _JBBuffer message = {0};
+                _jb_put_u32(&message, _JB_DAEMON_OUTPUT);
+                _jb_put_blob(&message, buffer, bytes);
+
+                if (fds[3].fd >= 0 && !_jb_send_all(client, message.data, message.count)) {
+                    kill(-pid, SIGTERM);
+                    fds[3].fd = -1;
+                    cancelled = 1;
+                }
+
+                free(message.data);
+            }
+            else if (bytes == 0 || errno != EINTR) {
+                fds[0].fd = -1;
+            }
+        }
+
+        if (fds[1].revents && !_jb_daemon_child_message(daemon, channel[0]))
+            fds[1].fd = -1;
+
+        if (fds[2].revents) {
+            _jb_daemon_read_events(daemon);
+
+            if (cancel_on_change && !cancelled && daemon->inputs_changed.count) {
+                kill(-pid, SIGTERM);
+                cancelled = 1;
+            }
+        }
+
+        if (fds[3].fd >= 0 && fds[3].revents) {
+            // `josh build` only ever writes its request, so this is it going away
+            char byte;
+
+            if (recv(client, &byte, 1, MSG_PEEK | MSG_DONTWAIT) <= 0) {
+                kill(-pid, SIGTERM);
+                fds[3].fd = -1;
+                cancelled = 1;
+            }
+        }
+    }
+
+    int wstatus = 0;
+
+    while (waitpid(pid, &wstatus, 0) < 0 && errno == EINTR)
+        ;
+
+    _jb_daemon_child = 0;
+
+    if (client >= 0)
+        close(out[0]);
+
+    close(channel[0]);
+
+    // pick up what the build wrote
+    JBArrayForEach(&daemon->folders) {
+        size_t known = _jb_build_dbs.count;
+        _JBBuildDB *db = _jb_build_db_for(*it);
+
+        if (_jb_build_dbs.count == known)
+            _jb_build_db_reload(db);
+    }
+
+    _jb_daemon_free_strings(daemon->folders.data, daemon->folders.count);
+    daemon->folders.count = 0;
+
+    _jb_daemon_read_events(daemon);
+    _jb_daemon_track_databases(daemon);
+
+    if (cancelled)
+        return -1;
+
+    return WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : 128 + WTERMSIG(wstatus);
+}
+
+// Reads the request on client and runs it. Returns 0 if the daemon should stop because
+// the build file changed.
+int _jb_daemon_handle(_JBDaemon *daemon, int client, const char *build_file, uint64_t build_file_mtime, const char *runner) {
+    char magic[8];
+    uint64_t len = 0;
+    uint32_t argc = 0, envc = 0;
+    char *cwd = NULL;
+    JBVector(char *) argv = {0};
+    JBVector(char *) env = {0};
+
+    int valid = _jb_recv_all(client, magic, sizeof(magic))
+        && memcmp(magic, _JB_DAEMON_MAGIC, sizeof(magic)) == 0
+        && (cwd = _jb_recv_blob(client, &len, PATH_MAX))
+        && _jb_recv_u32(client, &argc) && argc < 4096;
+
+    JBVectorPush(&argv, (char *)runner);
+
+    for (uint32_t i = 0; valid && i < argc; i++) {
+        char *arg = _jb_recv_blob(client, &len, 1 << 20);
+        valid = arg != NULL;
+        JBVectorPush(&argv, arg);
+    }
+
+    JBVectorPush(&argv, NULL);
+
+    valid = valid && _jb_recv_u32(client, &envc) && envc < 65536;
+
+    for (uint32_t i = 0; valid && i < envc; i++) {
+        char *var = _jb_recv_blob(client, &len, 1 << 20);
+        valid = var != NULL;
+        JBVectorPush(&env, var);
+    }
+
+    JBVectorPush(&env, NULL);
+
+    char here[PATH_MAX];
+    int same_folder = cwd && getcwd(here, sizeof(here)) && strcmp(cwd, here) == 0;
+    int build_file_changed = _jb_stat_uncached(build_file).mtime != build_file_mtime;
+
+    if (valid && (!same_folder || build_file_changed)) {
+        _jb_daemon_send_u32(client, _JB_DAEMON_REJECTED, 0);
+    }
+    else if (valid) {
+        int exit_code = _jb_daemon_build(daemon, argv.data, env.data, client, 0);
+
+        if (exit_code >= 0) {
+            _jb_daemon_send_u32(client, _JB_DAEMON_EXIT, exit_code);
+            JB_LOG("served build, exit code %d\n", exit_code);
+        }
+    }
+
+    free(cwd);
+    _jb_daemon_free_strings(argv.data + 1, argv.count - 1);
+    free(argv.data);
+    _jb_daemon_free_strings(env.data, env.count);
+    free(env.data);
+
+    return !build_file_changed;
+}
+
+static const char *_jb_daemon_socket_path = NULL;
+
+// Stops the build in flight along with the daemon.
+void _jb_daemon_signal(int sig) {
+    if (_jb_daemon_child > 0)
+        kill(-_jb_daemon_child, SIGTERM);
+
+    if (_jb_daemon_socket_path)
+        unlink(_jb_daemon_socket_path);
+
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+void _jb_daemon_init(_JBDaemon *daemon, const char *build_file, int (*build_main)(int, char **)) {
+    memset(daemon, 0, sizeof(_JBDaemon));
+    daemon->build_main = build_main;
+    daemon->build_file = build_file;
+    daemon->inotify_fd = -1;
+    _jb_daemon_reset(daemon);
+
+    // builds log to josh.log; the daemon only prints
+    _jb_log_print_only = 1;
+
+    _jb_stat_cache_begin();
+
+    signal(SIGINT, _jb_daemon_signal);
+    signal(SIGTERM, _jb_daemon_signal);
+}
+
+void _jb_daemon_serve(const char *socket_path, const char *build_file, const char *runner, int (*build_main)(int, char **)) {
+    struct sockaddr_un un = {0};
+    un.sun_family = AF_UNIX;
+    snprintf(un.sun_path, sizeof(un.sun_path), "%s", socket_path);
+
+    unlink(socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    JB_ASSERT(fd >= 0 && bind(fd, (struct sockaddr *)&un, sizeof(un)) == 0, "could not listen on %s: %s", socket_path, strerror(errno));
+    JB_ASSERT(listen(fd, 16) == 0, "could not listen on %s: %s", socket_path, strerror(errno));
+
+    _jb_daemon_socket_path = socket_path;
+
+    _JBDaemon daemon;
+    _jb_daemon_init(&daemon, build_file, build_main);
+
+    uint64_t build_file_mtime = _jb_stat_uncached(build_file).mtime;
+
+    JB_LOG("daemon for %s listening on %s\n", build_file, socket_path);
+
+    int serving = 1;
+
+    while (serving) {
+        struct pollfd fds[2] = {
+            { .fd = fd, .events = POLLIN },
+            { .fd = daemon.inotify_fd, .events = POLLIN },
+        };
+
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+
+            JB_FAIL("poll failed: %s", strerror(errno));
+        }
+
+        if (fds[1].revents)
+            _jb_daemon_read_events(&daemon);
+
+        if (fds[0].revents) {
+            int client = accept(fd, NULL, NULL);
+
+            if (client < 0)
+                continue;
+
+            fcntl(client, F_SETFD, FD_CLOEXEC);
+
+            serving = _jb_daemon_handle(&daemon, client, build_file, build_file_mtime, runner);
+            close(client);
+        }
+    }
+
+    JB_LOG("%s changed; daemon exiting\n", build_file);
+
+    unlink(socket_path);
+    exit(0);
+}
+
+// Waits until no tracked file changed for debounce_ms, so a burst of saves or a checkout
+// starts one build.
+void _jb_watch_debounce(_JBDaemon *daemon, int debounce_ms) {
+    while (1) {
+        struct pollfd pfd = { .fd = daemon->inotify_fd, .events = POLLIN };
+        int ready = poll(&pfd, 1, debounce_ms);
+
+        if (ready < 0 && errno == EINTR)
+            continue;
+
+        if (ready <= 0)
+            return;
+
+        _jb_daemon_read_events(daemon);
+    }
+}
+
+// Removes the outputs recorded as built from a changed input. An object whose compile
+// finished after its source changed is newer than the source but stale; a cancelled build
+// can leave those behind.
+void _jb_watch_forget_outputs(_JBDaemon *daemon) {
+    _JBStringMap changed = {0};
+
+    JBArrayForEach(&daemon->inputs_changed) {
+        _jb_string_map_put(&changed, *it, *it);
+    }
+
+    char key[PATH_MAX];
+
+    JBArrayForEach(&_jb_build_dbs) {
+        _JBBuildDB *db = *it;
+
+        for (size_t i = 0; i < db->records.count; i++) {
+            _JBDepRecord *record = &db->records.data[i];
+
+            for (uint32_t d = 0; d < record->dep_count; d++) {
+                const char *dep = db->strings.data[record->deps[d]];
+
+                if (strlen(dep) >= sizeof(key))
+                    continue;
+
+                _jb_canonical_path(dep, key);
+
+                if (_jb_string_map_get(&changed, key)) {
+                    remove(db->strings.data[record->output]);
+                    break;
+                }
+            }
+        }
+    }
+
+    _jb_string_map_free(&changed);
+}
+
+void _jb_watch(const char *build_file, char **argv, int (*build_main)(int, char **)) {
+    _JBDaemon daemon;
+    _jb_daemon_init(&daemon, build_file, build_main);
+
+    uint64_t build_file_mtime = _jb_stat_uncached(build_file).mtime;
+
+    const char *debounce = getenv("JOSH_WATCH_DEBOUNCE");
+    int debounce_ms = (debounce && atoi(debounce) > 0) ? atoi(debounce) : 100;
+
+    while (1) {
+        int exit_code = _jb_daemon_build(&daemon, argv, NULL, -1, 1);
+
+        if (exit_code < 0) {
+            JB_LOG("inputs changed; restarting build\n");
+        }
+        else {
+            JB_LOG("build %s; watching for changes\n", exit_code ? "failed" : "finished");
+
+            // events lost while building may hide changes, so that also rebuilds
+            while (!daemon.inputs_changed.count && !daemon.lost_events) {
+                struct pollfd pfd = { .fd = daemon.inotify_fd, .events = POLLIN };
+
+                if (poll(&pfd, 1, -1) > 0)
+                    _jb_daemon_read_events(&daemon);
+            }
+        }
+
+        _jb_watch_debounce(&daemon, debounce_ms);
+
+        if (_jb_stat_uncached(build_file).mtime != build_file_mtime)
+            exit(_JB_RUNNER_RESTART);
+
+        _jb_watch_forget_outputs(&daemon);
+    }
+}
+
+int _jb_daemon_request(const char *socket_path, char *args[]) {
+    if (!jb_file_exists(socket_path))
+        return -1;
+
+    int fd = _jb_socket_connect(NULL, socket_path, 1000);
+
+    if (fd < 0)
+        return -1;
+
+    _JBBuffer request = {0};
+    _jb_buffer_append(&request, _JB_DAEMON_MAGIC, strlen(_JB_DAEMON_MAGIC));
+
+    char cwd[PATH_MAX];
+    if (!getcwd(cwd, sizeof(cwd)))
+        cwd[0] = 0;
+
+    _jb_put_blob(&request, cwd, strlen(cwd));
+
+    _jb_put_u32(&request, (uint32_t)jb_string_array_count(args));
+
+    JBNullArrayFor(args) {
+        _jb_put_blob(&request, args[index], strlen(args[index]));
+    }
+
+    _jb_put_u32(&request, (uint32_t)jb_string_array_count(environ));
+
+    JBNullArrayFor(environ) {
+        _jb_put_blob(&request, environ[index], strlen(environ[index]));
+    }
+
+    int sent = _jb_send_all(fd, request.data, request.count);
+    free(request.data);
+
+    // builds take as long as they take
+    _jb_socket_set_timeout(fd, 0);
+
+    int result = -1;
+    int forwarded = 0;
+    uint32_t type = 0;
+
+    while (sent && _jb_recv_u32(fd, &type)) {
+        if (type == _JB_DAEMON_OUTPUT) {
+            uint64_t len = 0;
+            char *output = _jb_recv_blob(fd, &len, 1 << 20);
+
+            if (!output)
+                break;
+
+            jb_log_print("%s", output);
+            forwarded = 1;
+            free(output);
+        }
+        else {
+            uint32_t exit_code = 0;
+
+            if (type == _JB_DAEMON_EXIT && _jb_recv_u32(fd, &exit_code))
+                result = (int)exit_code;
+
+            break;
+        }
+    }
+
+    close(fd);
+
+    if (result < 0 && forwarded)
+        JB_FAIL("lost connection to josh daemon");
+
+    return result;
+}
+
+#else
+
+void _jb_daemon_sync() {
+}
+
+void _jb_daemon_serve(const char *socket_path, const char *build_file, const char *runner, int (*build_main)(int, char **)) {
+    JB_FAIL("josh daemon needs inotify and is only supported on Linux");
+}
+
+void _jb_watch(const char *build_file, char **argv, int (*build_main)(int, char **)) {
+    JB_FAIL("josh watch needs inotify and is only supported on Linux");
+}
+
+int _jb_daemon_request(const char *socket_path, char *args[]) {
+    return -1;
+}
+
+#endif // JB_IS_LINUX
+
+// main() of a generated runner: serves builds when started by `josh daemon`, otherwise
+// runs the build file's main once.
+int _jb_runner_main(int argc, char *argv[], int (*build_main)(int, char **)) {
+#ifdef JB_BUILD_JOSH_PATH
+    const char *daemon_switch = "--josh-daemon=";
+    const char *watch_switch = "--josh-watch";
+
+    if (argc > 1 && strncmp(argv[1], daemon_switch, strlen(daemon_switch)) == 0)
+        _jb_daemon_serve(argv[1] + strlen(daemon_switch), JB_BUILD_JOSH_PATH, argv[0], build_main);
+
+    if (argc > 1 && strcmp(argv[1], watch_switch) == 0) {
+        // builds see the arguments after the switch
+        argv[1] = argv[0];
+        _jb_watch(JB_BUILD_JOSH_PATH, argv + 1, build_main);
+    }
+#endif
+
+    return build_main(argc, argv);
+}
+
+// Parses the dependency file written by the compiler alongside an object file;
+// Make-style rules from -MMD -MF, or JSON from MSVC's /sourceDependencies.
+// Consumes result. Returns a string-array of the source and each header it includes.
+char **_jb_parse_dependencies(char *result, int is_msvc) {
+    JBVector(char *) out = {0};
+
+    if (is_msvc) {
+        // TODO implement proper JSON parsing of /sourceDependencies
+        // Here's a hacky solution: search for __"Includes": [__ string in result
+        // then for each line following, search for first " and ending ",
+
+        const char *SOURCE_TOKEN = "\"Source\":";
+        char *source = strstr(result, SOURCE_TOKEN);
+        if (!source)
+            return NULL;
+
+        {
+            source += strlen(SOURCE_TOKEN);
+            source = strchr(source, '\"');
+
+            if (!source)
+                return NULL;
+
+            source += 1;
+
+            char *end = strstr(source, "\",");
+            if (!end)
+                return NULL;
+
+            char *entry = jb_format_string("%.*s", end-source, source);
+            JBVectorPush(&out, entry);
+        }
+
+        const char *INCLUDES_TOKEN = "\"Includes\": [";
+        char *includes = strstr(result, INCLUDES_TOKEN);
+
+        if (!includes)
+            return NULL;
+
+        includes += strlen(INCLUDES_TOKEN);
+
+        while (1) {
+            includes = strchr(includes, '\"');
+
+            if (!includes)
+                break;
+
+            includes += 1;
+
+            char *end = strstr(includes, "\"");
+            if (!end)
+                break;
+
+            char *entry = jb_format_string("%.*s", end-includes, includes);
+            JBVectorPush(&out, entry);
+
+            includes = end + 2;
+        }
+    }
+    else {
+        for (int i = 0; result[i]; i++) {
+            char n = result[i+1];
+            if (result[i] == '\\' && (n == '\r' || n == '\n')) {
+                result[i] = ' ';
+
+                // join the continued line so the rule's end is the first newline left
+                int j = i + 1;
+
+                if (result[j] == '\r')
+                    result[j++] = ' ';
+
+                if (result[j] == '\n')
+                    result[j] = ' ';
+            }
+        }
+
+        char *start = strchr(result, ':');
+
+        if (!start) {
+            free(result);
+            free(out.data);
+            return NULL;
+        }
+
+        start += 1;
+
+        // Only the first rule lists the inputs of the object; with C++ modules gcc adds
+        // rules for the module interfaces after it.
+        char *rule_end = strchr(start, '\n');
+
+        if (rule_end)
+            *rule_end = 0;
+
+        while (*start) {
+            while (*start && jb_iswhitespace(*start))
+                start += 1;
+
+            if (*start) {
+                char *end = start;
+
+                while (*end) {
+
+                    {
+                        if (*end == '\\' && *(end + 1) != 0) {
+                            end += 2;
+                            continue;
+                        }
+                    }
+
+                    if (jb_iswhitespace(*end))
+                        break;
+
+                    end += 1;
+                }
+
+                char *entry = jb_format_string("%.*s", end-start, start);
+                JBVectorPush(&out, entry);
+
+                start = end;
+            }
+        }
+    }
+
+    free(result);
+
+    JBVectorPush(&out, NULL);
+
+    return out.data;
+}
+
+char *_jb_depfile_path(const char *output, int is_msvc) {
+    const char *ext = jb_extension(output);
+    size_t len = ext ? (size_t)(ext - output - 1) : strlen(output);
+
+    return jb_format_string("%.*s.%s", (int)len, output, is_msvc ? "json" : "d");
+}
+
+// Returns the dependencies recorded by the last compile of output, or NULL if there are none.
+char **_jb_read_dependencies(const char *output, int is_msvc) {
+    if (!_jb_file_stat(output).exists)
+        return NULL;
+
+    char *depfile = _jb_depfile_path(output, is_msvc);
+    char *text = _jb_read_file(depfile, NULL);
+    free(depfile);
+
+    if (!text)
+        return NULL;
+
+    return _jb_parse_dependencies(text, is_msvc);
+}
+
+void _jb_free_string_array(char **array) {
+    JBNullArrayFor(array) {
+        free(array[index]);
+    }
+
+    free(array);
+}
+
+char **_jb_get_dependencies_asm(JBToolchain *tc, const char *tool, const char *source, const char **asflags, const char **include_paths) {
+    // TODO dependency tracking for assembler sources
+    JBVector(char *) out = {0};
+    JBVectorPush(&out, (char *)source);
+    JBVectorPush(&out, NULL);
+
+    return out.data;
+}
+
+int _jb_dependencies_changed(const char **deps, const char *output) {
+    _JBFileStat out = _jb_file_stat(output);
+
+    JBNullArrayFor(deps) {
+        _JBFileStat dep = _jb_file_stat(deps[index]);
+
+        // a header that no longer exists was removed or renamed; the compile has to find out
+        if (!dep.exists || dep.mtime > out.mtime)
+            return 1;
+    }
+
+    return 0;
+}
+
+// The option that makes tool compile for target's LTO setting, or NULL.
+const char *_jb_lto_compile_flag(JBTarget *target, const char *tool) {
+    if (target->lto == JB_ENUM(NoLTO))
+        return NULL;
+
+    if (target->lto == JB_ENUM(ThinLTO) && strstr(tool, "clang"))
+        return "-flto=thin";
+
+    return "-flto";
+}
+
+int _jb_target_uses_lto(JBTarget *target) {
+    if (target->lto != JB_ENUM(NoLTO))
+        return 1;
+
+    JBNullArrayFor(target->libraries) {
+        if (_jb_target_uses_lto((JBTarget *)target->libraries[index]))
+            return 1;
+    }
+
+    return 0;
+}
+
+// The LLVM tool name from the same installation as clang if it's there, otherwise from PATH
+char *_jb_llvm_tool(const char *clang, const char *name) {
+    char *dir = jb_drop_last_path_component(clang);
+    char *tool = dir && *dir ? jb_format_string("%s/%s", dir, name) : NULL;
+
+    if (!tool || !jb_file_exists(tool)) {
+        free(tool);
+        tool = jb_copy_string(name);
+    }
+
+    free(dir);
+    return tool;
+}
+
+// The binutils tool name from the same toolchain as the gcc driver (eg. aarch64-linux-gnu-dwp
+// next to aarch64-linux-gnu-gcc) if it's there, otherwise from PATH
+char *_jb_binutils_tool(const char *driver, const char *name) {
+    const char *suffixes[] = { "gcc", "g++" };
+
+    for (int i = 0; i < 2; i++) {
+        size_t len = strlen(driver);
+        size_t suffix_len = strlen(suffixes[i]);
+
+        if (len < suffix_len || strcmp(driver + len - suffix_len, suffixes[i]) != 0)
+            continue;
+
+        char *tool = jb_format_string("%.*s%s", (int)(len - suffix_len), driver, name);
+
+        if (jb_file_exists(tool))
+            return tool;
+
+        free(tool);
+    }
+
+    return jb_copy_string(name);
+}
+
+static _JBMutex _jb_debug_compression_mutex = _JB_MUTEX_INITIALIZER;
+static _JBStringMap _jb_debug_compression = {0}; // probe command -> -gz option
+
+// The -gz option that compresses debug sections with tool: zstd, or zlib where tool or its
+// assembler can't do zstd (eg. gcc before 13). With use_linker (a -fuse-ld option, or ""
+// for the default linker) the probe also links, since the linker writes the output's
+// sections. Probed once per tool and linker, in folder.
+const char *_jb_debug_compression_flag(const char *tool, const char *use_linker, const char *folder) {
+    char *key = jb_format_string("%s %s", tool, use_linker ? use_linker : "-c");
+
+    _jb_mutex_lock(&_jb_debug_compression_mutex);
+
+    const char *flag = _jb_string_map_get(&_jb_debug_compression, key);
+
+    if (!flag) {
+        char *source = jb_format_string("%s/debug-probe.c", folder);
+        char *output = jb_format_string("%s/debug-probe%s", folder, use_linker ? "" : ".o");
+
+        _jb_write_file_if_changed(source, "int main(void) { return 0; }\n");
+
+        flag = "-gz=zlib";
+
+        _JBCommandVector cmd = {0};
+        JBVectorPush(&cmd, (char *)tool);
+        JBVectorPush(&cmd, "-g");
+        JBVectorPush(&cmd, "-gz=zstd");
+
+        if (!use_linker) {
+            JBVectorPush(&cmd, "-c");
+        }
+        else if (*use_linker) {
+            JBVectorPush(&cmd, (char *)use_linker);
+        }
+
+        JBVectorPush(&cmd, source);
+        JBVectorPush(&cmd, "-o");
+        JBVectorPush(&cmd, output);
+        JBVectorPush(&cmd, NULL);
+
+        JBStringBuilder sb;
+        jb_sb_init(&sb);
+
+        if (_jb_run_internal(cmd.data, &sb, _jb_pipe_drain_sb_proxy, __FILE__, __LINE__) == 0)
+            flag = "-gz=zstd";
+
+        char *probe_output = jb_sb_to_string(&sb);
+        jb_log("%s%s compresses debug info with %s\n", probe_output, key, flag);
+
+        free(probe_output);
+        jb_sb_free(&sb);
+
+        _jb_string_map_put(&_jb_debug_compression, key, (void *)flag);
+        key = NULL;
+
+        remove(output);
+        remove(source);
+        _jb_stat_invalidate(source);
+
+        free(cmd.data);
+        free(output);
+        free(source);
+    }
+
+    _jb_mutex_unlock(&_jb_debug_compression_mutex);
+
+    free(key);
+    return flag;
+}
+
+// Where the compile of output writes its split DWARF when target uses JB_DEBUG_SPLIT_DWARF,
+// or NULL: next to the object, with a .dwo extension. Precompiled headers don't get one.
+char *_jb_dwo_file(JBTarget *target, JBToolchain *tc, const char *output) {
+    const char *ext = jb_extension(output);
+
+    if (tc->triple.vendor == JB_ENUM(Windows) || !(target->debug_info & JB_DEBUG_SPLIT_DWARF) || !ext || strcmp(ext, "o") != 0)
+        return NULL;
+
+    return jb_format_string("%.*sdwo", (int)(strlen(output) - strlen(ext)), output);
+}
+
+// Where gcc reads or writes the .gcda files of the objects in object_folder. A relative
+// object's is named after its path below the object folder (see -fprofile-prefix-path), but
+// gcc ignores the prefix for an absolute one (an absolute build_folder) and uses its whole
+// path below profile_folder instead.
+char *_jb_gcc_profile_folder(const char *profile_folder, const char *object_folder) {
+    if (object_folder[0] == '/')
+        return jb_concat(profile_folder, object_folder);
+
+    return jb_copy_string(profile_folder);
+}
+
+char *_jb_gcc_profile_file(const char *profile_folder, const char *object) {
+    char *object_folder = jb_drop_last_path_component(object);
+    char *folder = _jb_gcc_profile_folder(profile_folder, object_folder);
+
+    const char *filename = jb_filename(object);
+    const char *ext = jb_extension(filename);
+    int len = (int)(ext ? strlen(filename) - strlen(ext) - 1 : strlen(filename));
+
+    char *profile = jb_format_string("%s/%.*s.gcda", folder, len, filename);
+
+    free(folder);
+    free(object_folder);
+    return profile;
+}
+
+// The profile target's output is optimized with, or NULL if target has no profile_folder or
+// the profile doesn't have output in it yet. gcc keeps a .gcda per object (see
+// _jb_gcc_profile_file); clang merges the whole profile into <name>.profdata.
+char *_jb_profile_for(JBTarget *target, const char *tool, const char *output) {
+    if (!target->profile_folder)
+        return NULL;
+
+    char *profile = NULL;
+
+    if (strstr(tool, "clang")) {
+        profile = jb_format_string("%s/%s.profdata", target->profile_folder, target->name);
+    }
+    else {
+        profile = _jb_gcc_profile_file(target->profile_folder, output);
+    }
+
+    if (!_jb_file_stat(profile).exists) {
+        free(profile);
+        return NULL;
+    }
+
+    return profile;
+}
+
+#if !JB_IS_WINDOWS
+// gcc's -flto=auto runs the LTO backend through make, which takes job slots from the
+// jobserver named in MAKEFLAGS. Unless josh already runs under a make jobserver, this
+// offers jb_job_count() slots (each link holds one itself) that all LTO links share.
+// Changes the environment, so it must run while no other thread starts processes.
+void _jb_lto_jobserver_start() {
+    static int started = 0;
+
+    if (started)
+        return;
+
+    started = 1;
+
+    const char *makeflags = getenv("MAKEFLAGS");
+
+    if (makeflags && (strstr(makeflags, "--jobserver-auth=") || strstr(makeflags, "--jobserver-fds=")))
+        return;
+
+    int fds[2];
+
+    if (pipe(fds) != 0)
+        return;
+
+    for (int i = 1; i < jb_job_count(); i++) {
+        if (write(fds[1], "+", 1) != 1)
+            break;
+    }
+
+    char *flags = jb_format_string("-j%d --jobserver-auth=%d,%d", jb_job_count(), fds[0], fds[1]);
+    setenv("MAKEFLAGS", flags, 1);
+    free(flags);
+}
+#endif
+
+int _jb_supported_source_ext(const char *ext) {
+    return strcmp(ext, "c") == 0 || strcmp(ext, "cpp") == 0
+        || strcmp(ext, "m") == 0 || strcmp(ext, "mm") == 0
+        || strcmp(ext, "s") == 0;
+}
+
+// Where a target's precompiled_header is built for one language. Each flag set gets its own
+// folder. gcc and clang sources -include stub_header and the compiler picks up the .gch/.pch
+// next to it, or just reads the stub (which includes the real header) if that's unusable.
+// MSVC compiles stub_source with /Yc into output and an object that must be linked too.
+typedef struct {
+    char *folder;
+    char *stub_header;
+    char *stub_source; // MSVC only
+    char *output;
+    char *object; // MSVC only
+    const char *tool;
+    const char **flags;
+} _JBPrecompiledHeader;
+
+// Returns 0 if the target has no precompiled header.
+int _jb_precompiled_header_for(JBTarget *target, JBToolchain *tc, int is_cxx, _JBPrecompiledHeader *pch) {
+    if (!target->precompiled_header)
+        return 0;
+
+    int is_msvc = (tc->triple.vendor == JB_ENUM(Windows));
+
+    pch->tool = is_cxx ? tc->cxx : tc->cc;
+    pch->flags = is_cxx ? target->cxxflags : target->cflags;
+
+    JB_ASSERT(pch->tool, "Toolchain missing %s compiler", is_cxx ? "C++" : "C");
+
+    _JBCommandVector cmd = {0};
+    JBVectorPush(&cmd, (char *)pch->tool);
+    JBVectorPush(&cmd, (char *)target->precompiled_header);
+    _jb_add_common_c_options(tc, &cmd, pch->tool, pch->flags, target->include_paths);
+    JBVectorPush(&cmd, NULL);
+
+    pch->folder = jb_format_string("%s/object/pch-%s-%016llx/", target->build_folder, is_cxx ? "cpp" : "c", (unsigned long long)_jb_command_hash(cmd.data));
+    pch->stub_header = jb_concat(pch->folder, jb_filename(target->precompiled_header));
+    pch->stub_source = is_msvc ? jb_concat(pch->folder, is_cxx ? "pch.cpp" : "pch.c") : NULL;
+    pch->output = jb_concat(pch->stub_header, strstr(pch->tool, "clang") ? ".pch" : ".gch");
+    pch->object = is_msvc ? jb_concat(pch->folder, "pch.obj") : NULL;
+
+    if (is_msvc) {
+        free(pch->output);
+        pch->output = jb_concat(pch->folder, "pch.pch");
+    }
+
+    free(cmd.data);
+    return 1;
+}
+
+void _jb_precompiled_header_free(_JBPrecompiledHeader *pch) {
+    free(pch->folder);
+    free(pch->stub_header);
+    free(pch->stub_source);
+    free(pch->output);
+    free(pch->object);
+}
+
+// Bit 0 set if the target has C sources, bit 1 for C++; those are the languages that use
+// its precompiled header.
+int _jb_precompiled_header_languages(JBTarget *target) {
+    int languages = 0;
+
+    if (!target->precompiled_header)
+        return 0;
+
+    JBNullArrayFor(target->sources) {
+        const char *ext = jb_extension(target->sources[index]);
+
+        if (ext && strcmp(ext, "c") == 0)
+            languages |= 1;
+        else if (ext && strcmp(ext, "cpp") == 0)
+            languages |= 2;
+    }
+
+    return languages;
+}
+
+int _jb_compile_c_family(JBTarget *target, JBToolchain *tc, const char *tool, const char **flags, const char *source, const char *output, int may_fail, const char **implicit_deps);
+
+void _jb_build_precompiled_header(JBTarget *target, JBToolchain *tc, int is_cxx) {
+    _JBPrecompiledHeader pch;
+
+    if (!_jb_precompiled_header_for(target, tc, is_cxx, &pch))
+        return;
+
+    int is_msvc = (tc->triple.vendor == JB_ENUM(Windows));
+
+    jb_mkdir(pch.folder);
+
+    char *header = jb_file_fullpath(target->precompiled_header);
+    JB_ASSERT(header, "precompiled header %s not found", target->precompiled_header);
+
+    char *stub = jb_format_string("#include \"%s\"\n", header);
+    _jb_write_file_if_changed(pch.stub_header, stub);
+
+    JBVector(const char *) flags = {0};
+    JBVector(char *) owned = {0};
+
+    JBNullArrayFor(pch.flags) {
+        JBVectorPush(&flags, pch.flags[index]);
+    }
+
+    if (is_msvc) {
+        char *source = jb_format_string("#include \"%s\"\n", pch.stub_header);
+        _jb_write_file_if_changed(pch.stub_source, source);
+        free(source);
+
+        JBVectorPush(&owned, jb_format_string("/Yc%s", pch.stub_header));
+        JBVectorPush(&owned, jb_format_string("/Fp%s", pch.output));
+
+        JBArrayForEach(&owned) {
+            JBVectorPush(&flags, *it);
+        }
+
+        JBVectorPush(&flags, NULL);
+
+        _jb_compile_c_family(target, tc, pch.tool, flags.data, pch.stub_source, pch.object, 0, NULL);
+    }
+    else {
+        JBVectorPush(&flags, "-x");
+        JBVectorPush(&flags, is_cxx ? "c++-header" : "c-header");
+        JBVectorPush(&flags, NULL);
+
+        _jb_compile_c_family(target, tc, pch.tool, flags.data, target->precompiled_header, pch.output, 0, NULL);
+    }
+
+    JBArrayForEach(&owned) {
+        free(*it);
+    }
+
+    free(owned.data);
+    free(flags.data);
+    free(stub);
+    free(header);
+    _jb_precompiled_header_free(&pch);
+}
+
+// Shared by jb_compile_c and jb_compile_cxx; tool is the compiler driver and flags are the
+// target's cflags or cxxflags.
+// Compiles source into output if it's out of date. A failed compile ends the build, unless
+// may_fail is set: then its errors only go to the log, and the exit code is returned.
+// implicit_deps are inputs the compiler doesn't report, like module interfaces. The
+// preprocessed source doesn't capture them, so with implicit_deps (even an empty array)
+// the compile cache and workers aren't used.
+int _jb_compile_c_family(JBTarget *target, JBToolchain *tc, const char *tool, const char **flags, const char *source, const char *output, int may_fail, const char **implicit_deps) {
+    const char **include_paths = target->include_paths;
+    int is_msvc = (tc->triple.vendor == JB_ENUM(Windows));
+
+    _JBBuildDB *db = _jb_build_db_for(target->build_folder);
+
+    char *depfile = _jb_depfile_path(output, is_msvc);
+
+    // C and C++ sources include the target's precompiled header (never the generated
+    // source MSVC builds it from), and depend on it.
+    const char *ext = jb_extension(source);
+    int is_cxx = ext && strcmp(ext, "cpp") == 0;
+
+    _JBPrecompiledHeader pch;
+    int uses_pch = ext && (is_cxx || strcmp(ext, "c") == 0) && _jb_precompiled_header_for(target, tc, is_cxx, &pch);
+
+    if (uses_pch && pch.stub_source && strcmp(source, pch.stub_source) == 0) {
+        _jb_precompiled_header_free(&pch);
+        uses_pch = 0;
+    }
+
+    const char *lto_flag = _jb_lto_compile_flag(target, tool);
+
+    char *profile = is_msvc ? NULL : _jb_profile_for(target, tool, output);
+
+    int debug_info = is_msvc ? 0 : target->debug_info;
+
+    // the compile writes this too, so it's rebuilt when it's missing
+    char *dwo = _jb_dwo_file(target, tc, output);
+
+    // flags, plus what the precompiled header, LTO, debug info and profile settings add
+    JBVector(const char *) extra_flags = {0};
+    JBVector(char *) extra_owned = {0};
+
+    if (uses_pch || lto_flag || profile || debug_info) {
+        JBNullArrayFor(flags) {
+            JBVectorPush(&extra_flags, flags[index]);
+        }
+
+        if (lto_flag) {
+            JBVectorPush(&extra_flags, lto_flag);
+        }
+    }
+
+    if (debug_info) {
+        JBVectorPush(&extra_flags, "-g");
+
+        if (debug_info & JB_DEBUG_SPLIT_DWARF) {
+            JBVectorPush(&extra_flags, "-gsplit-dwarf");
+        }
+
+        // -gz doesn't compress .dwo files, and compressing just the skeletons left in the
+        // objects saves little (and leaves outputs that some llvm-dwp versions can't read)
+        if ((debug_info & JB_DEBUG_COMPRESS) && !(debug_info & JB_DEBUG_SPLIT_DWARF)) {
+            JBVectorPush(&extra_flags, _jb_debug_compression_flag(tool, NULL, target->build_folder));
+        }
+    }
+
+    if (profile) {
+        if (strstr(tool, "clang")) {
+            JBVectorPush(&extra_owned, jb_format_string("-fprofile-instr-use=%s", profile));
+        }
+        else {
+            // gcc looks for the .gcda named after output's path below its folder, which is
+            // where the instrumented build's object of the same name wrote it
+            char *folder = jb_drop_last_path_component(output);
+            char *full_folder = jb_file_fullpath(*folder ? folder : ".");
+
+            JBVectorPush(&extra_owned, jb_format_string("-fprofile-use=%s", target->profile_folder));
+            JBVectorPush(&extra_owned, jb_format_string("-fprofile-prefix-path=%s", full_folder));
+
+            free(full_folder);
+            free(folder);
+        }
+    }
+
+    if (uses_pch) {
+        if (is_msvc) {
+            JBVectorPush(&extra_owned, jb_format_string("/Yu%s", pch.stub_header));
+            JBVectorPush(&extra_owned, jb_format_string("/FI%s", pch.stub_header));
+            JBVectorPush(&extra_owned, jb_format_string("/Fp%s", pch.output));
+        }
+        else {
+            JBVectorPush(&extra_flags, "-include");
+            JBVectorPush(&extra_flags, pch.stub_header);
+        }
+    }
+
+    JBArrayForEach(&extra_owned) {
+        JBVectorPush(&extra_flags, *it);
+    }
+
+    if (extra_flags.count) {
+        JBVectorPush(&extra_flags, NULL);
+        flags = extra_flags.data;
+    }
+
+    _JBCommandVector cmd = {0};
+
+    JBVectorPush(&cmd, (char *)tool);
+
+    _jb_add_common_c_options(tc, &cmd, tool, flags, include_paths);
+
+    // Have the compile itself record which headers it read so the next build
+    // doesn't need to run the preprocessor to find out.
+    if (is_msvc) {
+        JBVectorPush(&cmd, "/sourceDependencies");
+        JBVectorPush(&cmd, depfile);
+    }
+    else {
+        JBVectorPush(&cmd, "-MMD");
+        JBVectorPush(&cmd, "-MF");
+        JBVectorPush(&cmd, depfile);
+    }
+
+    if (is_msvc) {
+        JBVectorPush(&cmd, "/Fo:");
+    }
+    else {
+        JBVectorPush(&cmd, "-o");
+    }
+    JBVectorPush(&cmd, (char *)output);
+
+    JBVectorPush(&cmd, "-c");
+    JBVectorPush(&cmd, (char *)source);
+
+    JBVectorPush(&cmd, NULL);
+
+    uint64_t command_hash = _jb_command_hash(cmd.data);
+
+    int needs_build = 0;
+    int result = 0;
+
+    uint64_t recorded_hash = 0;
+    uint64_t recorded_command = 0;
+    const char **known_deps = _jb_file_stat(output).exists ? _jb_build_db_lookup(db, output, &recorded_hash, &recorded_command) : NULL;
+
+    if (known_deps) {
+        if (recorded_command != command_hash) {
+            jb_log("command line of %s changed, rebuilding...\n", output);
+            needs_build = 1;
+        }
+        else {
+            needs_build = _jb_dependencies_changed(known_deps, output);
+
+            // In content-hash mode a newer mtime isn't enough, the bytes have to differ too.
+            if (needs_build && _jb_content_hashing && recorded_hash) {
+                needs_build = _jb_build_db_inputs_hash(db, known_deps) != recorded_hash;
+
+                if (!needs_build)
+                    jb_log("inputs of %s changed timestamps but not contents, skipping\n", output);
+            }
+        }
+
+        free(known_deps);
+
+        if (!needs_build && dwo && !_jb_file_stat(dwo).exists) {
+            jb_log("%s is missing, rebuilding...\n", dwo);
+            needs_build = 1;
+        }
+    }
+    else {
+        // Without a record we can't tell which command produced output, so the depfile
+        // left by the last compile isn't enough to call it up to date.
+        jb_log("no build record for %s, rebuilding...\n", source);
+        needs_build = 1;
+    }
+
+    if (needs_build) {
+        // The compile cache and workers both start from the preprocessed source.
+        size_t preprocessed_len = 0;
+        char *preprocessed = NULL;
+
+        // (a precompiled header itself is only ever compiled locally, and so is anything
+        // optimized with a profile, which the preprocessed source doesn't capture, or
+        // writing a .dwo, which neither brings back)
+        if (!is_msvc && !implicit_deps && !profile && !dwo && ext && _jb_supported_source_ext(ext) && (_jb_compile_cache_get() || _jb_worker_slots()))
+            preprocessed = _jb_preprocess(tc, tool, flags, include_paths, source, output, depfile, &preprocessed_len);
+
+        _JBCacheKey cache_key;
+        int cacheable = preprocessed && _jb_compile_cache_key(tool, preprocessed, preprocessed_len, output, depfile, cmd.data, &cache_key);
+
+        if (cacheable && _jb_compile_cache_fetch(&cache_key, output, depfile)) {
+            JB_LOG("compile %s (cached)\n", source);
+        }
+        else {
+            JB_LOG("compile %s\n", source);
+
+            // The old object may be hardlinked into the compile cache; make sure the
+            // compiler writes a new file instead of overwriting the cached one.
+            remove(output);
+
+            if (dwo)
+                remove(dwo);
+
+            JBStringBuilder diagnostics;
+
+            if (may_fail)
+                jb_sb_init(&diagnostics);
+
+            char **run_cmd = _jb_color_command(cmd.data, is_msvc);
+            result = _jb_run_compile(source, run_cmd, preprocessed, preprocessed_len, output, may_fail ? &diagnostics : NULL);
+            free(run_cmd);
+
+            if (may_fail) {
+                char *text = jb_sb_to_string(&diagnostics);
+
+                if (result)
+                    jb_log("%s", text);
+                else
+                    jb_log_print("%s", text);
+
+                free(text);
+                jb_sb_free(&diagnostics);
+            }
+
+            if (result) {
+                remove(output);
+
+                if (dwo)
+                    remove(dwo);
+            }
+            else if (cacheable) {
+                _jb_compile_cache_store(&cache_key, output, depfile);
+            }
+        }
+
+        free(preprocessed);
+
+        _jb_stat_invalidate(output);
+
+        if (dwo)
+            _jb_stat_invalidate(dwo);
+
+        char **deps = result ? NULL : _jb_read_dependencies(output, is_msvc);
+
+        // The compiler doesn't list the precompiled header or what's in it.
+        if (deps && uses_pch) {
+            int count = jb_string_array_count(deps);
+            deps = realloc(deps, sizeof(char *) * (count + 2));
+            deps[count] = jb_copy_string(pch.output);
+            deps[count + 1] = NULL;
+        }
+
+        if (deps && profile) {
+            int count = jb_string_array_count(deps);
+            deps = realloc(deps, sizeof(char *) * (count + 2));
+            deps[count] = jb_copy_string(profile);
+            deps[count + 1] = NULL;
+        }
+
+        if (deps && implicit_deps) {
+            int count = jb_string_array_count(deps);
+            int extra = jb_string_array_count((char **)implicit_deps);
+            deps = realloc(deps, sizeof(char *) * (count + extra + 1));
+
+            JBNullArrayFor(implicit_deps) {
+                deps[count + index] = jb_copy_string(implicit_deps[index]);
+            }
+
+            deps[count + extra] = NULL;
+        }
+
+        if (deps) {
+            uint64_t inputs_hash = _jb_content_hashing ? _jb_build_db_inputs_hash(db, (const char **)deps) : 0;
+            _jb_build_db_record(db, output, deps, inputs_hash, command_hash);
+        }
+
+        _jb_free_string_array(deps);
+    }
+
+    free(cmd.data);
+    free(depfile);
+
+    if (uses_pch)
+        _jb_precompiled_header_free(&pch);
+
+    free(profile);
+    free(dwo);
+
+    JBArrayForEach(&extra_owned) {
+        free(*it);
+    }
+
+    free(extra_owned.data);
+    free(extra_flags.data);
+
+    return result;
+}
+
+void jb_compile_c(JBTarget *target, JBToolchain *tc, const char *source, const char *output) {
+    char *triplet = jb_get_triple(tc);
+
+    JB_ASSERT(tc->cc, "Toolchain (%s) missing C compiler", triplet);
+
+    _jb_compile_c_family(target, tc, tc->cc, target->cflags, source, output, 0, NULL);
+
+    free(triplet);
+}
+
+void jb_compile_cxx(JBTarget *target, JBToolchain *tc, const char *source, const char *output) {
+    char *triplet = jb_get_triple(tc);
+
+    JB_ASSERT(tc->cxx, "Toolchain (%s) missing C++ compiler", triplet);
+
+    _jb_compile_c_family(target, tc, tc->cxx, target->cxxflags, source, output, 0, NULL);
+
+    free(triplet);
+}
+
+void jb_compile_asm(JBTarget *target, JBToolchain *tc, const char *source, const char *output) {
+    const char **asflags = target->asflags;
+    const char **include_paths = target->include_paths;
+
+    char *triplet = jb_get_triple(tc);
+
+    JB_ASSERT(tc->cc, "Toolchain (%s) missing assembler", triplet);
+
+    char **deps = _jb_get_dependencies_asm(tc, tc->cc, source, asflags, include_paths);
+
+    JB_ASSERT(deps, "couldn't compute dependenices for %s", source);
+
+    JBVector(char *) cmd = {0};
+
+    JBVectorPush(&cmd, tc->cc);
+
+    if (triplet && strstr(tc->cc, "clang") != NULL) {
+        JBVectorPush(&cmd, "-target");
+        JBVectorPush(&cmd, triplet);
+
+        // JBVectorPush(&cmd, "--rtlib=compiler-rt");
+    }
+
+    if (tc->sysroot) {
+        // TODO check if Apple LD or GNU LD
+        // JBVectorPush(&cmd, "-syslibroot");
+        JBVectorPush(&cmd, "--sysroot");
+        JBVectorPush(&cmd, tc->sysroot);
+    }
+
+    JBNullArrayFor(asflags) {
+        JBVectorPush(&cmd, (char *)asflags[index]);
+    }
+
+    JBNullArrayFor(include_paths) {
+        JBVectorPush(&cmd, "-I");
+        JBVectorPush(&cmd, (char *)include_paths[index]);
+    }
+
+    JBVectorPush(&cmd, "-o");
+    JBVectorPush(&cmd, (char *)output);
+    JBVectorPush(&cmd, "-c");
+    JBVectorPush(&cmd, (char *)source);
+
+    JBVectorPush(&cmd, NULL);
+
+    _JBBuildDB *db = _jb_build_db_for(target->build_folder);
+
+    int needs_build = _jb_command_changed(db, output, cmd.data);
+
+    JBNullArrayFor(deps) {
+        if (needs_build)
+            break;
+
+        needs_build = jb_file_is_newer(deps[index], output);
+    }
+
+    if (needs_build) {
+        JB_LOG("compile %s\n", source);
+
+        char **run_cmd = _jb_color_command(cmd.data, 0);
+        jb_run(run_cmd, __FILE__, __LINE__);
+        free(run_cmd);
+
+        _jb_stat_invalidate(output);
+
+        _jb_build_db_record(db, output, deps, 0, _jb_command_hash(cmd.data));
+    }
+
+    free(deps);
+    free(cmd.data);
+
+    free(triplet);
+}
+
+void _jb_init_build(const char *build_folder, const char *object_folder)  {
+    jb_mkdir(build_folder);
+    jb_mkdir(object_folder);
+}
+
+typedef struct {
+    JBTarget *target;
+    JBToolchain *tc;
+    const char *source;
+    const char *object;
+} _JBCompileJob;
+
+void _jb_compile_source(JBTarget *target, JBToolchain *tc, const char *source, const char *object) {
+    const char *ext = jb_extension(source);
+
+    if (strcmp(ext, "c") == 0 || strcmp(ext, "m") == 0)
+        jb_compile_c(target, tc, source, object);
+    else if (strcmp(ext, "cpp") == 0 || strcmp(ext, "mm") == 0)
+        jb_compile_cxx(target, tc, source, object);
+    else if (strcmp(ext, "s") == 0)
+        jb_compile_asm(target, tc, source, object);
+}
+
+void _jb_compile_job(void *ctx) {
+    _JBCompileJob *job = (_JBCompileJob *)ctx;
+    _jb_compile_source(job->target, job->tc, job->source, job->object);
+}
+
+char *_jb_object_file(JBToolchain *tc, const char *source, const char *object_folder) {
+    int is_msvc = (tc->triple.vendor == JB_ENUM(Windows));
+
+    const char *filename = jb_filename(source);
+
+    const char *ext = jb_extension(source);
+
+    JB_ASSERT(ext && _jb_supported_source_ext(ext), "unsupported file type: %s", ext ? ext : "unknown");
+
+    const char *o_ext = "o";
+    if (is_msvc)
+        o_ext = "obj";
+
+    return jb_format_string("%s%.*s%s", object_folder, strlen(filename)-strlen(ext), filename, o_ext);
+}
+
+int _jb_unity_enabled(JBTarget *target) {
+    return target->unity_batch_size > 0 || target->unity_batch_bytes > 0;
+}
+
+typedef struct {
+    char *source; // generated translation unit that includes each member
+    char *object;
+    const char **members; // string-array
+} _JBUnityBatch;
+
+typedef struct {
+    JBVector(const char *) singles; // sources compiled on their own
+    JBVector(_JBUnityBatch) batches;
+} _JBUnityPlan;
+
+static _JBMutex _jb_unity_mutex = _JB_MUTEX_INITIALIZER;
+
+// Sources whose batch only compiled one file at a time, one per line; see _jb_unity_compile_job.
+char *_jb_unity_exclude_file(const char *object_folder) {
+    return jb_format_string("%sunity-exclude.txt", object_folder);
+}
+
+// The translation unit of a unity batch: an #include of each member, relative ones made
+// absolute with cwd.
+char *_jb_unity_source_text(const char **members, const char *cwd) {
+    JBStringBuilder sb;
+    jb_sb_init(&sb);
+
+    jb_sb_puts(&sb, "// Generated by josh for a unity build; do not edit.\n");
+
+    JBNullArrayFor(members) {
+        const char *member = members[index];
+        int is_absolute = member[0] == '/' || (member[0] && member[1] == ':');
+
+        jb_sb_puts(&sb, "#include \"");
+
+        if (!is_absolute) {
+            jb_sb_puts(&sb, cwd);
+            jb_sb_puts(&sb, "/");
+        }
+
+        jb_sb_puts(&sb, member);
+        jb_sb_puts(&sb, "\"\n");
+    }
+
+    char *text = jb_sb_to_string(&sb);
+    jb_sb_free(&sb);
+    return text;
+}
+
+// Splits the sources of a unity build into batches. Each language's sources are hashed by
+// path into a power-of-two number of batches sized by unity_batch_size/unity_batch_bytes,
+// so adding, removing or editing a source leaves the other batches alone until the count
+// doubles. Assembly and Objective-C sources, excluded sources and batches of one are
+// compiled on their own. With write_sources, the batches' translation units are generated.
+_JBUnityPlan _jb_unity_plan(JBTarget *target, JBToolchain *tc, const char *object_folder, int write_sources) {
+    _JBUnityPlan plan = {0};
+    int is_msvc = (tc->triple.vendor == JB_ENUM(Windows));
+
+    _JBStringMap excluded = {0};
+
+    JBNullArrayFor(target->unity_exclude) {
+        _jb_string_map_put(&excluded, target->unity_exclude[index], (void *)1);
+    }
+
+    char *exclude_file = _jb_unity_exclude_file(object_folder);
+
+    _jb_mutex_lock(&_jb_unity_mutex);
+    char *exclude_text = _jb_read_file(exclude_file, NULL);
+    _jb_mutex_unlock(&_jb_unity_mutex);
+
+    for (char *line = exclude_text; line && *line; ) {
+        char *end = strchr(line, '\n');
+
+        if (end)
+            *end = 0;
+
+        if (*line)
+            _jb_string_map_put(&excluded, line, (void *)1);
+
+        line = end ? end + 1 : line + strlen(line);
+    }
+
+    char cwd[4096] = {0};
+
+    if (write_sources)
+        JB_ASSERT(getcwd(cwd, sizeof(cwd)), "could not get the current directory");
+
+    _JBStringMap batched = {0};
+    const char *languages[] = { "c", "cpp" };
+
+    // module units can't share a translation unit
+    int language_count = target->cxx_modules ? 1 : 2;
+
+    for (int l = 0; l < language_count; l++) {
+        _JBCommandVector eligible = {0};
+        size_t count = 0;
+        uint64_t bytes = 0;
+
+        JBNullArrayFor(target->sources) {
+            const char *source = target->sources[index];
+            const char *ext = jb_extension(source);
+
+            if (!ext || strcmp(ext, languages[l]) != 0)
+                continue;
+
+            // excluded sources still count so excluding some doesn't reshuffle the rest
+            count += 1;
+
+            if (target->unity_batch_bytes)
+                bytes += _jb_file_stat(source).size;
+
+            if (!_jb_string_map_get(&excluded, source)) {
+                JBVectorPush(&eligible, (char *)source);
+            }
+        }
+
+        size_t buckets = 1;
+
+        while (target->unity_batch_size > 0 && buckets * target->unity_batch_size < count)
+            buckets *= 2;
+
+        while (target->unity_batch_bytes > 0 && buckets * target->unity_batch_bytes < bytes)
+            buckets *= 2;
+
+        _JBCommandVector *members = calloc(buckets, sizeof(_JBCommandVector));
+
+        JBArrayForEach(&eligible) {
+            uint64_t hash = _jb_hash_string(*it);
+            JBVectorPush(&members[(hash ^ (hash >> 32)) & (buckets - 1)], *it);
+        }
+
+        for (size_t b = 0; b < buckets; b++) {
+            if (members[b].count < 2) {
+                free(members[b].data);
+                continue;
+            }
+
+            JBVectorPush(&members[b], NULL);
+
+            _JBUnityBatch batch;
+            batch.source = jb_format_string("%sunity-%s-%zu.%s", object_folder, languages[l], b, languages[l]);
+            batch.object = jb_format_string("%sunity-%s-%zu.%s", object_folder, languages[l], b, is_msvc ? "obj" : "o");
+            batch.members = (const char **)members[b].data;
+
+            JBNullArrayFor(batch.members) {
+                _jb_string_map_put(&batched, batch.members[index], (void *)1);
+            }
+
+            if (write_sources) {
+                char *text = _jb_unity_source_text(batch.members, cwd);
+                _jb_write_file_if_changed(batch.source, text);
+                free(text);
+            }
+
+            JBVectorPush(&plan.batches, batch);
+        }
+
+        free(members);
+        free(eligible.data);
+    }
+
+    JBNullArrayFor(target->sources) {
+        if (!_jb_string_map_get(&batched, target->sources[index])) {
+            JBVectorPush(&plan.singles, target->sources[index]);
+        }
+    }
+
+    _jb_string_map_free(&batched);
+    _jb_string_map_free(&excluded);
+    free(exclude_text);
+    free(exclude_file);
+
+    return plan;
+}
+
+void _jb_unity_plan_free(_JBUnityPlan *plan) {
+    JBArrayForEach(&plan->batches) {
+        free(it->source);
+        free(it->object);
+        free(it->members);
+    }
+
+    free(plan->batches.data);
+    free(plan->singles.data);
+}
+
+typedef struct {
+    _JBCompileJob compile; // the batch's translation unit and object
+    const char **members;
+    const char *object_folder;
+    int fell_back; // compiled one source at a time; link the members' objects instead
+} _JBUnityJob;
+
+// Whether the unity translation unit source compiles, only checking it (no object is
+// written). Its diagnostics go to the log.
+int _jb_unity_source_compiles(JBTarget *target, JBToolchain *tc, const char *tool, const char **flags, const char *source) {
+    int is_msvc = (tc->triple.vendor == JB_ENUM(Windows));
+    int is_cxx = strcmp(jb_extension(source), "cpp") == 0;
+
+    _JBPrecompiledHeader pch;
+    int uses_pch = _jb_precompiled_header_for(target, tc, is_cxx, &pch);
+
+    _JBCommandVector cmd = {0};
+    char *force_include = NULL;
+
+    JBVectorPush(&cmd, (char *)tool);
+    _jb_add_common_c_options(tc, &cmd, tool, flags, target->include_paths);
+
+    // members may rely on the precompiled header being included first
+    if (uses_pch && is_msvc) {
+        force_include = jb_format_string("/FI%s", pch.stub_header);
+        JBVectorPush(&cmd, force_include);
+    }
+    else if (uses_pch) {
+        JBVectorPush(&cmd, "-include");
+        JBVectorPush(&cmd, pch.stub_header);
+    }
+
+    JBVectorPush(&cmd, is_msvc ? "/Zs" : "-fsyntax-only");
+    JBVectorPush(&cmd, (char *)source);
+    JBVectorPush(&cmd, NULL);
+
+    JBStringBuilder sb;
+    jb_sb_init(&sb);
+
+    int result = _jb_run_internal(cmd.data, &sb, _jb_pipe_drain_sb_proxy, __FILE__, __LINE__);
+
+    char *output = jb_sb_to_string(&sb);
+    jb_log("%s", output);
+
+    free(output);
+    jb_sb_free(&sb);
+    free(force_include);
+    free(cmd.data);
+
+    if (uses_pch)
+        _jb_precompiled_header_free(&pch);
+
+    return result == 0;
+}
+
+void _jb_unity_compile_job(void *ctx) {
+    _JBUnityJob *job = (_JBUnityJob *)ctx;
+    JBTarget *target = job->compile.target;
+    JBToolchain *tc = job->compile.tc;
+
+    int is_cxx = strcmp(jb_extension(job->compile.source), "cpp") == 0;
+    const char *tool = is_cxx ? tc->cxx : tc->cc;
+    const char **flags = is_cxx ? target->cxxflags : target->cflags;
+
+    JB_ASSERT(tool, "Toolchain missing %s compiler", is_cxx ? "C++" : "C");
+
+    if (_jb_compile_c_family(target, tc, tool, flags, job->compile.source, job->compile.object, 1, NULL) == 0)
+        return;
+
+    // Compiling the members one at a time reports real errors against the right file and
+    // ends the build. If they all compile, some of them clash when sharing a translation
+    // unit (eg. statics with the same name).
+    JB_LOG("%s failed; compiling its sources separately\n", job->compile.source);
+
+    JBNullArrayFor(job->members) {
+        char *object = _jb_object_file(tc, job->members[index], job->object_folder);
+        _jb_compile_source(target, tc, job->members[index], object);
+        free(object);
+    }
+
+    // Find which: members are added to a trial translation unit one at a time, and the
+    // ones it no longer compiles with stay out of batches from now on. A single clash
+    // excludes one source, not the whole batch.
+    char cwd[4096] = {0};
+    JB_ASSERT(getcwd(cwd, sizeof(cwd)), "could not get the current directory");
+
+    const char *source = job->compile.source;
+    const char *ext = jb_extension(source);
+    char *probe = jb_format_string("%.*sprobe.%s", (int)(strlen(source) - strlen(ext)), source, ext);
+
+    _JBCommandVector kept = {0};
+    _JBCommandVector clashing = {0};
+
+    JBNullArrayFor(job->members) {
+        const char *member = job->members[index];
+
+        JBVectorPush(&kept, (char *)member);
+
+        if (kept.count == 1)
+            continue;
+
+        JBVectorPush(&kept, NULL);
+        char *text = _jb_unity_source_text((const char **)kept.data, cwd);
+        kept.count -= 1;
+
+        _jb_write_file_if_changed(probe, text);
+        free(text);
+
+        if (!_jb_unity_source_compiles(target, tc, tool, flags, probe)) {
+            kept.count -= 1;
+            JBVectorPush(&clashing, (char *)member);
+        }
+    }
+
+    remove(probe);
+    free(probe);
+
+    char *exclude_file = _jb_unity_exclude_file(job->object_folder);
+
+    _jb_mutex_lock(&_jb_unity_mutex);
+
+    FILE *file = fopen(exclude_file, "ab");
+
+    if (file) {
+        JBArrayForEach(&clashing) {
+            fprintf(file, "%s\n", *it);
+        }
+
+        fclose(file);
+    }
+
+    _jb_mutex_unlock(&_jb_unity_mutex);
+
+    job->fell_back = 1;
+
+    JBArrayForEach(&clashing) {
+        jb_log("%s clashes with other sources of %s; it's compiled on its own from now on\n", *it, source);
+    }
+
+    free(exclude_file);
+    free(kept.data);
+    free(clashing.data);
+}
+
+// C++20 named modules. Each C++ source of a cxx_modules target is scanned for the module
+// it provides and the modules it imports, then compiled once the sources providing those
+// have been, with the interfaces (BMIs) they produced. Not available with MSVC.
+typedef struct {
+    char *provides; // module or partition this source's interface provides, or NULL
+    _JBCommandVector requires;
+} _JBModuleScan;
+
+void _jb_module_scan_free(_JBModuleScan *scan) {
+    free(scan->provides);
+
+    JBArrayForEach(&scan->requires) {
+        free(*it);
+    }
+
+    free(scan->requires.data);
+}
+
+// Copies the module name at text up to the ';', leaving out whitespace.
+char *_jb_module_name(const char *text) {
+    JBStringBuilder sb;
+    jb_sb_init(&sb);
+
+    for (; *text && *text != ';' && *text != '\n' && *text != '['; text++) {
+        if (!jb_iswhitespace(*text))
+            jb_sb_putchar(&sb, *text);
+    }
+
+    char *name = jb_sb_to_string(&sb);
+    jb_sb_free(&sb);
+
+    return name;
+}
+
+// Used when the compiler can't scan for us: finds `[export] module` and `[export] import`
+// declarations at the start of lines, outside of comments. Unlike a P1689 scan it doesn't
+// see through the preprocessor, and header units (`import <header>;`) are not supported.
+void _jb_scan_modules_text(const char *source, _JBModuleScan *scan) {
+    char *text = _jb_read_file(source, NULL);
+    JB_ASSERT(text, "could not read %s", source);
+
+    char *module = NULL; // name of the module this unit belongs to, without a partition
+    int in_comment = 0;
+
+    for (char *line = text; *line; ) {
+        char *end = strchr(line, '\n');
+
+        if (end)
+            *end = 0;
+
+        char *at = line;
+
+        if (in_comment) {
+            char *close = strstr(at, "*/");
+            at = close ? close + 2 : at + strlen(at);
+            in_comment = !close;
+        }
+
+        while (jb_iswhitespace(*at))
+            at += 1;
+
+        if (strncmp(at, "/*", 2) == 0 && !strstr(at + 2, "*/"))
+            in_comment = 1;
+
+        int exported = strncmp(at, "export", 6) == 0 && jb_iswhitespace(at[6]);
+
+        if (exported) {
+            at += 6;
+
+            while (jb_iswhitespace(*at))
+                at += 1;
+        }
+
+        if (strncmp(at, "module", 6) == 0 && jb_iswhitespace(at[6])) {
+            char *name = _jb_module_name(at + 7);
+
+            if (!*name || strcmp(name, ":private") == 0) {
+                free(name);
+            }
+            else {
+                free(module);
+                module = jb_format_string("%.*s", (int)strcspn(name, ":"), name);
+
+                // an interface or partition has a BMI; an implementation unit uses its interface's
+                if (exported || strchr(name, ':')) {
+                    free(scan->provides);
+                    scan->provides = name;
+                }
+                else {
+                    JBVectorPush(&scan->requires, name);
+                }
+            }
+        }
+        else if (strncmp(at, "import", 6) == 0 && (jb_iswhitespace(at[6]) || at[6] == ':')) {
+            char *name = _jb_module_name(at + 6);
+
+            if (name[0] == '<' || name[0] == '"' || !name[0]) {
+                free(name);
+            }
+            else if (name[0] == ':') {
+                JBVectorPush(&scan->requires, jb_format_string("%s%s", module ? module : "", name));
+                free(name);
+            }
+            else {
+                JBVectorPush(&scan->requires, name);
+            }
+        }
+
+        line = end ? end + 1 : line + strlen(line);
+    }
+
+    free(module);
+    free(text);
+}
+
+// Collects the "logical-name"s in the array that follows key in a P1689 document.
+void _jb_p1689_names(const char *json, const char *key, _JBCommandVector *out) {
+    const char *array = strstr(json, key);
+
+    if (!array || !(array = strchr(array, '[')))
+        return;
+
+    const char *array_end = strchr(array, ']');
+
+    while (1) {
+        const char *name = strstr(array, "\"logical-name\"");
+
+        if (!name || (array_end && name > array_end))
+            break;
+
+        name = strchr(name + strlen("\"logical-name\""), '"');
+
+        if (!name)
+            break;
+
+        name += 1;
+
+        const char *name_end = strchr(name, '"');
+
+        if (!name_end)
+            break;
+
+        JBVectorPush(out, jb_format_string("%.*s", (int)(name_end - name), name));
+        array = name_end + 1;
+    }
+}
+
+void _jb_scan_modules_p1689(const char *json, _JBModuleScan *scan) {
+    _JBCommandVector provides = {0};
+    _jb_p1689_names(json, "\"provides\"", &provides);
+
+    if (provides.count) {
+        scan->provides = provides.data[0];
+
+        for (size_t i = 1; i < provides.count; i++)
+            free(provides.data[i]);
+    }
+
+    free(provides.data);
+
+    _jb_p1689_names(json, "\"requires\"", &scan->requires);
+}
+
+static _JBMutex _jb_p1689_mutex = _JB_MUTEX_INITIALIZER;
+static _JBStringMap _jb_p1689_support = {0}; // gcc driver -> 1 if it scans, 2 if not
+
+// gcc writes P1689 from version 14 on; older ones fall back to _jb_scan_modules_text.
+int _jb_gcc_scans_modules(const char *tool, const char *folder) {
+    _jb_mutex_lock(&_jb_p1689_mutex);
+
+    uintptr_t support = (uintptr_t)_jb_string_map_get(&_jb_p1689_support, tool);
+
+    if (!support) {
+        char *source = jb_concat(folder, "p1689-probe.cpp");
+        char *ddi = jb_concat(folder, "p1689-probe.ddi");
+        char *output = jb_concat(folder, "p1689-probe.ii");
+
+        _jb_write_file_if_changed(source, "export module probe;\n");
+
+        char *deps_file = jb_concat("-fdeps-file=", ddi);
+        char *cmd[] = { (char *)tool, "-std=c++20", "-fmodules-ts", "-fdeps-format=p1689r5", deps_file, "-fdeps-target=p1689-probe.o", "-E", source, "-o", output, NULL };
+
+        JBStringBuilder sb;
+        jb_sb_init(&sb);
+
+        support = _jb_run_internal(cmd, &sb, _jb_pipe_drain_sb_proxy, __FILE__, __LINE__) == 0 && jb_file_exists(ddi) ? 1 : 2;
+
+        char *probe_output = jb_sb_to_string(&sb);
+        jb_log("%s%s %s P1689 module scanning\n", probe_output, tool, support == 1 ? "supports" : "doesn't support");
+
+        free(probe_output);
+        jb_sb_free(&sb);
+
+        _jb_string_map_put(&_jb_p1689_support, jb_copy_string(tool), (void *)support);
+
+        remove(ddi);
+        remove(output);
+        remove(source);
+        _jb_stat_invalidate(source);
+
+        free(deps_file);
+        free(output);
+        free(ddi);
+        free(source);
+    }
+
+    _jb_mutex_unlock(&_jb_p1689_mutex);
+
+    return support == 1;
+}
+
+// Finds the modules source provides and requires, with clang-scan-deps or gcc's P1689
+// output when available. Results are kept in <object>.modules until the source or the
+// command line changes; imports that only change with a header aren't noticed.
+void _jb_scan_module_source(JBTarget *target, JBToolchain *tc, const char *source, const char *object, const char *folder, _JBModuleScan *scan) {
+    memset(scan, 0, sizeof(_JBModuleScan));
+
+    const char *tool = tc->cxx;
+
+    _JBCommandVector cmd = {0};
+    JBVectorPush(&cmd, (char *)tool);
+    _jb_add_common_c_options(tc, &cmd, tool, target->cxxflags, target->include_paths);
+    JBVectorPush(&cmd, (char *)source);
+    JBVectorPush(&cmd, NULL);
+
+    uint64_t command_hash = _jb_command_hash(cmd.data);
+    cmd.count -= 2;
+
+    const char *ext = jb_extension(object);
+    char *cache = jb_format_string("%.*s.modules", (int)(ext ? (size_t)(ext - object - 1) : strlen(object)), object);
+
+    _JBFileStat source_stat = _jb_file_stat(source);
+    _JBFileStat cache_stat = _jb_file_stat(cache);
+
+    char *text = cache_stat.exists && cache_stat.mtime >= source_stat.mtime ? _jb_read_file(cache, NULL) : NULL;
+    char *expected = jb_format_string("josh-modules %016llx\n", (unsigned long long)command_hash);
+
+    if (text && strncmp(text, expected, strlen(expected)) == 0) {
+        for (char *line = text + strlen(expected); *line; ) {
+            char *end = strchr(line, '\n');
+
+            if (end)
+                *end = 0;
+
+            if (strncmp(line, "provides ", 9) == 0)
+                scan->provides = jb_copy_string(line + 9);
+            else if (strncmp(line, "requires ", 9) == 0)
+                JBVectorPush(&scan->requires, jb_copy_string(line + 9));
+
+            line = end ? end + 1 : line + strlen(line);
+        }
+    }
+    else {
+        char *scan_deps = NULL;
+
+        if (strstr(tool, "clang")) {
+            char *dir = jb_drop_last_path_component(tool);
+            scan_deps = dir && *dir ? jb_format_string("%s/clang-scan-deps", dir) : NULL;
+
+            if (scan_deps && !jb_file_exists(scan_deps)) {
+                free(scan_deps);
+                scan_deps = NULL;
+            }
+
+            free(dir);
+        }
+
+        if (scan_deps) {
+            _JBCommandVector scan_cmd = {0};
+            JBVectorPush(&scan_cmd, scan_deps);
+            JBVectorPush(&scan_cmd, "-format=p1689");
+            JBVectorPush(&scan_cmd, "--");
+
+            JBArrayForEach(&cmd) {
+                JBVectorPush(&scan_cmd, *it);
+            }
+
+            JBVectorPush(&scan_cmd, "-c");
+            JBVectorPush(&scan_cmd, (char *)source);
+            JBVectorPush(&scan_cmd, "-o");
+            JBVectorPush(&scan_cmd, (char *)object);
+            JBVectorPush(&scan_cmd, NULL);
+
+            JBStringBuilder sb;
+            jb_sb_init(&sb);
+
+            int result = _jb_run_internal(scan_cmd.data, &sb, _jb_pipe_drain_sb_proxy, __FILE__, __LINE__);
+            char *json = jb_sb_to_string(&sb);
+
+            JB_ASSERT(result == 0, "scanning %s for modules failed:\n%s", source, json);
+            _jb_scan_modules_p1689(json, scan);
+
+            free(json);
+            jb_sb_free(&sb);
+            free(scan_cmd.data);
+            free(scan_deps);
+        }
+        else if (!strstr(tool, "clang") && _jb_gcc_scans_modules(tool, folder)) {
+            char *ddi = jb_format_string("%s.ddi", cache);
+            char *preprocessed = jb_format_string("%s.ii", cache);
+            char *deps_file = jb_concat("-fdeps-file=", ddi);
+            char *deps_target = jb_concat("-fdeps-target=", object);
+
+            _JBCommandVector scan_cmd = {0};
+
+            JBArrayForEach(&cmd) {
+                JBVectorPush(&scan_cmd, *it);
+            }
+
+            JBVectorPush(&scan_cmd, "-fmodules-ts");
+            JBVectorPush(&scan_cmd, "-fdeps-format=p1689r5");
+            JBVectorPush(&scan_cmd, deps_file);
+            JBVectorPush(&scan_cmd, deps_target);
+            JBVectorPush(&scan_cmd, "-E");
+            JBVectorPush(&scan_cmd, (char *)source);
+            JBVectorPush(&scan_cmd, "-o");
+            JBVectorPush(&scan_cmd, preprocessed);
+            JBVectorPush(&scan_cmd, NULL);
+
+            JB_ASSERT(_jb_run_internal(scan_cmd.data, NULL, _jb_pipe_drain_log_proxy, __FILE__, __LINE__) == 0, "scanning %s for modules failed", source);
+
+            char *json = _jb_read_file(ddi, NULL);
+            JB_ASSERT(json, "%s did not write %s", tool, ddi);
+
+            _jb_scan_modules_p1689(json, scan);
+
+            remove(ddi);
+            remove(preprocessed);
+
+            free(json);
+            free(scan_cmd.data);
+            free(deps_target);
+            free(deps_file);
+            free(preprocessed);
+            free(ddi);
+        }
+        else {
+            _jb_scan_modules_text(source, scan);
+        }
+
+        JBStringBuilder sb;
+        jb_sb_init(&sb);
+        jb_sb_puts(&sb, expected);
+
+        if (scan->provides) {
+            jb_sb_puts(&sb, "provides ");
+            jb_sb_puts(&sb, scan->provides);
+            jb_sb_putchar(&sb, '\n');
+        }
+
+        JBArrayForEach(&scan->requires) {
+            jb_sb_puts(&sb, "requires ");
+            jb_sb_puts(&sb, *it);
+            jb_sb_putchar(&sb, '\n');
+        }
+
+        char *result = jb_sb_to_string(&sb);
+
+        FILE *file = fopen(cache, "wb");
+
+        if (file) {
+            fwrite(result, 1, strlen(result), file);
+            fclose(file);
+        }
+
+        _jb_stat_invalidate(cache);
+
+        free(result);
+        jb_sb_free(&sb);
+    }
+
+    free(expected);
+    free(text);
+    free(cache);
+    free(cmd.data);
+}
+
+// Where a module's interface goes; partitions (M:P) become M-P.
+char *_jb_module_bmi_path(const char *folder, const char *name, const char *tool) {
+    char *bmi = jb_format_string("%s%s.%s", folder, name, strstr(tool, "clang") ? "pcm" : "gcm");
+
+    for (char *c = bmi + strlen(folder); *c; c++) {
+        if (*c == ':')
+            *c = '-';
+    }
+
+    return bmi;
+}
+
+char **_jb_target_object_files(JBTarget *target, JBToolchain *tc, const char *object_folder) {
+    JBVector(char *) object_files = {0};
+
+    if (_jb_unity_enabled(target)) {
+        _JBUnityPlan plan = _jb_unity_plan(target, tc, object_folder, 0);
+
+        JBArrayForEach(&plan.singles) {
+            JBVectorPush(&object_files, _jb_object_file(tc, *it, object_folder));
+        }
+
+        JBArrayForEach(&plan.batches) {
+            JBVectorPush(&object_files, jb_copy_string(it->object));
+        }
+
+        _jb_unity_plan_free(&plan);
+    }
+    else {
+        JBNullArrayFor(target->sources) {
+            JBVectorPush(&object_files, _jb_object_file(tc, target->sources[index], object_folder));
+        }
+    }
+
+    // MSVC's /Yc also produces an object that every object using the .pch refers to
+    int pch_languages = _jb_precompiled_header_languages(target);
+
+    for (int is_cxx = 0; is_cxx < 2; is_cxx++) {
+        _JBPrecompiledHeader pch;
+
+        if (!(pch_languages & (1 << is_cxx)) || !_jb_precompiled_header_for(target, tc, is_cxx, &pch))
+            continue;
+
+        if (pch.object) {
+            JBVectorPush(&object_files, jb_copy_string(pch.object));
+        }
+
+        _jb_precompiled_header_free(&pch);
+    }
+
+    JBVectorPush(&object_files, NULL);
+
+    return object_files.data;
+}
+
+int _jb_target_has_cpp_source(JBTarget *target) {
+    const char **sources = target->sources;
+
+    JBNullArrayFor(sources) {
+        const char *ext = jb_extension(sources[index]);
+
+        JB_ASSERT(ext && _jb_supported_source_ext(ext), "unsupported file type: %s", ext ? ext : "unknown");
+
+        if (strcmp(ext, "cpp") == 0 || strcmp(ext, "mm") == 0) {
+            return 1;
+        }
+    }
+
+    JBNullArrayFor(target->libraries) {
+        JBLibrary *lib = target->libraries[index];
+
+        if (_jb_target_has_cpp_source((JBTarget *)lib))
+            return 1;
+    }
+
+    return 0;
+}
+
+char *_jb_get_link_command(JBToolchain *tc, JBTarget *target) {
+    int is_msvc = (tc->triple.vendor == JB_ENUM(Windows));
+
+    if (is_msvc)
+        return tc->ld;
+
+    char *link_command = tc->cc;
+
+    if (_jb_target_has_cpp_source(target))
+        link_command = tc->cxx;
+
+    return link_command;
+}
+
+int _jb_need_to_build_target(const char *target, char **object_files) {
+    JBNullArrayFor(object_files) {
+        if (jb_file_is_newer(object_files[index], target)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+const char *_jb_linker_name(enum JBLinker linker) {
+    switch (linker) {
+        case JB_ENUM(BFD): return "bfd";
+        case JB_ENUM(Gold): return "gold";
+        case JB_ENUM(LLD): return "lld";
+        case JB_ENUM(Mold): return "mold";
+        default: return NULL;
+    }
+}
+
+static _JBMutex _jb_linker_mutex = _JB_MUTEX_INITIALIZER;
+static _JBStringMap _jb_auto_linkers = {0}; // link command -> linker picked by AutoLinker + 1
+
+// The linker target is linked with through link_command; DefaultLinker means passing no
+// -fuse-ld at all. AutoLinker tries each candidate once per link command.
+enum JBLinker _jb_choose_linker(JBToolchain *tc, JBTarget *target, const char *link_command) {
+    if (tc->triple.vendor == JB_ENUM(Windows))
+        return JB_ENUM(DefaultLinker);
+
+    enum JBLinker linker = target->linker != JB_ENUM(DefaultLinker) ? target->linker : tc->linker;
+
+    // Apple's own linker is already fast
+    if (linker == JB_ENUM(AutoLinker) && tc->triple.vendor == JB_ENUM(Apple))
+        linker = JB_ENUM(DefaultLinker);
+
+    if (linker == JB_ENUM(DefaultLinker))
+        return strstr(link_command, "clang") ? JB_ENUM(LLD) : JB_ENUM(DefaultLinker);
+
+    if (linker != JB_ENUM(AutoLinker))
+        return linker;
+
+    _jb_mutex_lock(&_jb_linker_mutex);
+
+    uintptr_t known = (uintptr_t)_jb_string_map_get(&_jb_auto_linkers, link_command);
+
+    if (!known) {
+        enum JBLinker candidates[] = { JB_ENUM(Mold), JB_ENUM(LLD), JB_ENUM(Gold) };
+        linker = JB_ENUM(DefaultLinker);
+
+        for (int i = 0; i < 3 && linker == JB_ENUM(DefaultLinker); i++) {
+            char *use = jb_concat("-fuse-ld=", _jb_linker_name(candidates[i]));
+            char *cmd[] = { (char *)link_command, use, "-Wl,--version", NULL };
+
+            JBStringBuilder sb;
+            jb_sb_init(&sb);
+
+            if (_jb_run_internal(cmd, &sb, _jb_pipe_drain_sb_proxy, __FILE__, __LINE__) == 0)
+                linker = candidates[i];
+
+            jb_sb_free(&sb);
+            free(use);
+        }
+
+        JB_LOG("linking with %s\n", linker == JB_ENUM(DefaultLinker) ? "the default linker" : _jb_linker_name(linker));
+
+        known = linker + 1;
+        _jb_string_map_put(&_jb_auto_linkers, jb_copy_string(link_command), (void *)known);
+    }
+
+    _jb_mutex_unlock(&_jb_linker_mutex);
+
+    return (enum JBLinker)(known - 1);
+}
+
+// Options for linking target beyond the ones _jb_link_shared_command adds: its ldflags and
+// LTO options, and the ones that only set how many threads the linker or LTO backend use
+// (as many as josh runs jobs) or color diagnostics. Those don't change the output, so they
+// go to _jb_run_link as run_only, outside of the command's signature.
+typedef struct {
+    _JBCommandVector ldflags;
+    _JBCommandVector run_only;
+    _JBCommandVector owned;
+} _JBLinkOptions;
+
+void _jb_link_options(JBTarget *target, JBToolchain *tc, const char *link_command, enum JBLinker linker, _JBLinkOptions *options) {
+    memset(options, 0, sizeof(_JBLinkOptions));
+
+    int is_msvc = (tc->triple.vendor == JB_ENUM(Windows));
+    int is_clang = strstr(link_command, "clang") != NULL || strstr(link_command, "lld-link") != NULL;
+    int threads = jb_job_count();
+
+    JBNullArrayFor(target->ldflags) {
+        JBVectorPush(&options->ldflags, (char *)target->ldflags[index]);
+    }
+
+    if (linker == JB_ENUM(LLD)) {
+        JBVectorPush(&options->owned, jb_format_string("-Wl,--threads=%d", threads));
+        JBVectorPush(&options->run_only, options->owned.data[options->owned.count - 1]);
+    }
+    else if (linker == JB_ENUM(Mold)) {
+        JBVectorPush(&options->owned, jb_format_string("-Wl,--thread-count=%d", threads));
+        JBVectorPush(&options->run_only, options->owned.data[options->owned.count - 1]);
+    }
+    else if (linker == JB_ENUM(Gold) && threads > 1) {
+        JBVectorPush(&options->run_only, "-Wl,--threads");
+        JBVectorPush(&options->owned, jb_format_string("-Wl,--thread-count=%d", threads));
+        JBVectorPush(&options->run_only, options->owned.data[options->owned.count - 1]);
+    }
+
+    if (!is_msvc && _jb_color_diagnostics()) {
+        // (also covers code generated at link time with LTO)
+        JBVectorPush(&options->run_only, "-fdiagnostics-color=always");
+
+        if (linker == JB_ENUM(LLD) || linker == JB_ENUM(Mold)) {
+            JBVectorPush(&options->run_only, "-Wl,--color-diagnostics");
+        }
+    }
+
+    if (target->lto != JB_ENUM(NoLTO)) {
+        // ThinLTO keeps the code generated for each module under the build folder, so a
+        // relink only regenerates the modules affected by what changed.
+        char *cache = jb_format_string("%s/lto-cache", target->build_folder);
+
+        if (!is_clang) {
+            // spreads the LTO backend over the jobserver from _jb_lto_jobserver_start()
+            JBVectorPush(&options->ldflags, "-flto=auto");
+        }
+        else if (target->lto == JB_ENUM(FullLTO)) {
+            if (!is_msvc) {
+                JBVectorPush(&options->ldflags, "-flto");
+            }
+        }
+        else if (is_msvc) {
+            JBVectorPush(&options->owned, jb_format_string("/lldltocache:%s", cache));
+            JBVectorPush(&options->ldflags, options->owned.data[options->owned.count - 1]);
+
+            JBVectorPush(&options->owned, jb_format_string("/opt:lldltojobs=%d", threads));
+            JBVectorPush(&options->run_only, options->owned.data[options->owned.count - 1]);
+        }
+        else {
+            JBVectorPush(&options->ldflags, "-flto=thin");
+
+            // lld has its own options; gold and mold take them through the LLVM plugin's
+            const char *cache_option = linker == JB_ENUM(LLD) ? "-Wl,--thinlto-cache-dir=%s" : "-Wl,-plugin-opt,cache-dir=%s";
+            const char *jobs_option = linker == JB_ENUM(LLD) ? "-Wl,--thinlto-jobs=%d" : "-Wl,-plugin-opt,jobs=%d";
+
+            JBVectorPush(&options->owned, jb_format_string(cache_option, cache));
+            JBVectorPush(&options->ldflags, options->owned.data[options->owned.count - 1]);
+
+            JBVectorPush(&options->owned, jb_format_string(jobs_option, threads));
+            JBVectorPush(&options->run_only, options->owned.data[options->owned.count - 1]);
+        }
+
+        free(cache);
+    }
+
+    if (target->debug_info && !is_msvc) {
+        // with LTO, code (and its debug info) is generated at link time
+        if (target->lto != JB_ENUM(NoLTO)) {
+            JBVectorPush(&options->ldflags, "-g");
+        }
+
+        if (target->debug_info & JB_DEBUG_COMPRESS) {
+            const char *name = _jb_linker_name(linker);
+            char *use_linker = name ? jb_concat("-fuse-ld=", name) : jb_copy_string("");
+
+            JBVectorPush(&options->ldflags, (char *)_jb_debug_compression_flag(link_command, use_linker, target->build_folder));
+            free(use_linker);
+        }
+    }
+
+    JBVectorPush(&options->ldflags, NULL);
+    JBVectorPush(&options->run_only, NULL);
+}
+
+void _jb_link_options_free(_JBLinkOptions *options) {
+    JBArrayForEach(&options->owned) {
+        free(*it);
+    }
+
+    free(options->owned.data);
+    free(options->ldflags.data);
+    free(options->run_only.data);
+}
+
+char **_jb_get_library_objects(JBLibrary *target);
+
+// Builds the NULL-terminated argv that links object_files (and libs) into output_exec.
+char **_jb_link_shared_command(JBToolchain *tc, const char *link_command, enum JBLinker linker, const char **ldflags, const char **frameworks, char *output_exec, char **object_files, JBLibrary **libs, const char **system_libs, int is_lib) {
+
+    char *triplet = jb_get_triple(tc);
+    int is_msvc = (tc->triple.vendor == JB_ENUM(Windows));
+
+    JBVector(char *) cmd = {0};
+
+    JBVectorPush(&cmd, (char *)link_command);
+
+    if (is_msvc) {
+        JBVectorPush(&cmd, "/nologo");
+    }
+
+    if (linker != JB_ENUM(DefaultLinker)) {
+        JBVectorPush(&cmd, jb_concat("-fuse-ld=", _jb_linker_name(linker))); // Leak
+    }
+
+    // TODO triplet is always non-NULL here now. Either we always specify the target triple, or we get smarter about
+    // wether toolchain is the system toolchain, or a cross-toolchain.
+    if (triplet && strstr(link_command, "clang") != NULL) {
+        JBVectorPush(&cmd, "-target");
+        JBVectorPush(&cmd, triplet);
+
+        JBVectorPush(&cmd, "--rtlib=compiler-rt");
+    }
+
+    if (tc->sysroot) {
+        // TODO check if Apple LD or GNU LD
+        // JBVectorPush(&cmd, "-syslibroot");
+        JBVectorPush(&cmd, "--sysroot");
+        JBVectorPush(&cmd, tc->sysroot);
+    }
+
+    if (is_lib) {
+        JBVectorPush(&cmd, "-shared");
+    }
+
+    if (is_msvc) {
+        // TODO check if cl.exe or link.exe is linker
+
+        // cl.exe
+        // JBVectorPush(&cmd, "/Fe:");
+        // JBVectorPush(&cmd, output_exec); // Leak
+
+        // link.exe
+        JBVectorPush(&cmd, jb_format_string("/OUT:%s", output_exec)); // Leak
+    }
+    else {
+        JBVectorPush(&cmd, "-o");
+        JBVectorPush(&cmd, output_exec); // Leak
+    }
+
+    JBNullArrayFor(object_files) {
+        JBVectorPush(&cmd, object_files[index]);
+    }
+
+    // JBVectorPush(&cmd, "-L/usr/local/lib");
+
+    // if (tc->triple.runtime == JB_ENUM(Darwin)) {
+    //     JBVectorPush(&cmd, "-lSystem");
+    // }
+    // else if (tc->triple.runtime == JB_ENUM(GNU)) {
+    //     JBVectorPush(&cmd, "-lc");
+    // }
+
+#if JB_IS_LINUX
+    // TODO more robust detection for gnu-ld and target-triple + toolchain
+    if (strstr(link_command, "gcc")) {
+        JBVectorPush(&cmd, "-Wl,--start-group");
+    }
+    else if(strstr(link_command, "ld")) {
+        JBVectorPush(&cmd, "---start-group");
+    }
+#endif
+
+    JBNullArrayFor(ldflags) {
+        JBVectorPush(&cmd, (char *)ldflags[index]);
+    }
+
+    JBNullArrayFor(libs) {
+        JBLibrary *lib = libs[index];
+
+        // Leak
+        if (lib->flags & JB_LIBRARY_USE_OBJECTS) {
+            char **object_files = _jb_get_library_objects(lib); // Leak
+
+            JBNullArrayFor(object_files) {
+                char *obj = object_files[index];
+
+                JBVectorPush(&cmd, obj);
+            }
+        }
+        else {
+            if (is_msvc) {
+                JBVectorPush(&cmd, jb_format_string("/LIBPATH:%s", lib->build_folder));
+                JBVectorPush(&cmd, jb_format_string("%s.lib", lib->name));
+            }
+            else {
+                JBVectorPush(&cmd, jb_format_string("-L%s", lib->build_folder));
+                JBVectorPush(&cmd, jb_format_string("-l%s", lib->name));
+            }
+        }
+    }
+
+    JBNullArrayFor(system_libs) {
+        const char *lib = system_libs[index];
+
+        // Leak
+        if (is_msvc) {
+            JBVectorPush(&cmd, jb_format_string("%s.lib", lib));
+        }
+        else {
+            JBVectorPush(&cmd, jb_format_string("-l%s", lib));
+        }
+    }
+
+#if JB_IS_LINUX
+    // TODO more robust detection for gnu-ld and target-triple + toolchain
+    if (strstr(link_command, "gcc")) {
+        JBVectorPush(&cmd, "-Wl,--end-group");
+    }
+    else if(strstr(link_command, "ld")) {
+        JBVectorPush(&cmd, "---end-group");
+    }
+#endif
+
+    if (tc->triple.vendor == JB_ENUM(Apple)) {
+        JBNullArrayFor(frameworks) {
+            JBVectorPush(&cmd, "-framework");
+            JBVectorPush(&cmd, (char *)frameworks[index]);
+        }
+    }
+
+    JBVectorPush(&cmd, NULL);
+
+    return cmd.data;
+}
+
+// Runs the link or archive command for output unless it is up to date and was built with
+// the same command line, and records the command's signature. run_only (may be NULL) is
+// appended to the command but left out of the signature.
+void _jb_run_link(const char *build_folder, char *output, char **cmd, char **run_only, int needs_build, const char *verb) {
+    _JBBuildDB *db = _jb_build_db_for(build_folder);
+
+    if (!needs_build)
+        needs_build = _jb_command_changed(db, output, cmd);
+
+    if (!needs_build)
+        return;
 
-        if (WEXITSTATUS(wstatus) != 0) {
-            jb_log("%s:%d: %s: exit %d\n", file, line, argv[0], WEXITSTATUS(wstatus));
-            return WEXITSTATUS(wstatus);
-        }
+    JB_LOG("%s %s\n", verb, output);
 
-        return WEXITSTATUS(wstatus);
-    }
-    else {
-        // child
+    // ar only adds and replaces members, so start from scratch or objects that were
+    // dropped from the target would stay in the archive.
+    remove(output);
 
-        if (!pty) {
-            // close read pipe
-            close(pipefd[0]);
+    _JBCommandVector argv = {0};
 
-            // Map stdout and stderr to the pipe
-            dup2(pipefd[1], STDOUT_FILENO);
-            dup2(pipefd[1], STDERR_FILENO);
-        }
+    JBNullArrayFor(cmd) {
+        JBVectorPush(&argv, cmd[index]);
+    }
 
-        execvp(argv[0], argv);
-        jb_log_print("Could not run %s\n", argv[0]);
-        exit(1);
+    JBNullArrayFor(run_only) {
+        JBVectorPush(&argv, run_only[index]);
     }
-}
 
-#endif // JB_IS_WINDOWS
+    JBVectorPush(&argv, NULL);
 
-void jb_run(char *const argv[], const char *file, int line) {
-    int result = _jb_run_internal(argv, NULL, _jb_pipe_drain_log_proxy, file, line);
+    jb_run(argv.data, __FILE__, __LINE__);
+    _jb_stat_invalidate(output);
 
-    if (result)
-        exit(1);
-}
+    free(argv.data);
 
-struct JBRunResult jb_run_get_output(char *const argv[], const char *file, int line) {
-    JBStringBuilder sb;
-    jb_sb_init(&sb);
+    char *no_deps[] = { NULL };
+    _jb_build_db_record(db, output, no_deps, 0, _jb_command_hash(cmd));
+}
 
-    int result = _jb_run_internal(argv, &sb, _jb_pipe_drain_sb_proxy, file, line);
+// Replaces the members of archive whose objects are newer than it. ar still writes the
+// whole archive and its symbol table (member offsets move), but only reads the changed
+// objects.
+void _jb_update_archive(JBToolchain *tc, const char *archive, const char *operation, char **object_files) {
+    _JBCommandVector cmd = {0};
 
-    char *output = jb_sb_to_string(&sb);
+    JBVectorPush(&cmd, tc->ar);
+    JBVectorPush(&cmd, (char *)operation);
+    JBVectorPush(&cmd, (char *)archive);
 
-    jb_sb_free(&sb);
+    JBNullArrayFor(object_files) {
+        if (jb_file_is_newer(object_files[index], archive)) {
+            JBVectorPush(&cmd, object_files[index]);
+        }
+    }
 
-    jb_log("%s", output);
+    size_t changed = cmd.count - 3;
+    JBVectorPush(&cmd, NULL);
 
-    struct JBRunResult out;
-    out.exit_code = result;
-    out.output = output;
+    if (changed) {
+        JB_LOG("update %s (%zu of %d members)\n", archive, changed, jb_string_array_count(object_files));
 
-    return out;
-}
+        jb_run(cmd.data, __FILE__, __LINE__);
+        _jb_stat_invalidate(archive);
+    }
 
-int jb_iswhitespace(int c) {
-    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v';
+    free(cmd.data);
 }
 
-int jb_isalpha(int c) {
-    c |= 0x20;
-    return c >= 'a' && c <= 'z';
-}
+char *_jb_library_output_file(JBLibrary *target);
 
-int jb_isnumber(int c) {
-    return c >= '0' && c <= '9';
-}
+// Packaging split DWARF into a .dwp runs on a background thread after the link, one output
+// at a time, and is finished before josh exits.
+typedef struct {
+    char *tools[3]; // tried in order until one succeeds
+    char *output;
+    char *dwp;
+} _JBDebugPackage;
 
-int jb_isalphanumeric(int c) {
-    return jb_isalpha(c) || jb_isnumber(c);
-}
+static _JBMutex _jb_debug_package_mutex = _JB_MUTEX_INITIALIZER;
+static _JBCond _jb_debug_package_cond;
+static JBVector(_JBDebugPackage) _jb_debug_packages = {0};
+static size_t _jb_debug_packages_done = 0;
 
-void jb_run_string(const char *cmd, char *const extra[], const char *file, int line) {
-    JBVector(char *) args = {0};
+_JB_THREAD_PROC(_jb_debug_package_thread, arg) {
+    _jb_mutex_lock(&_jb_debug_package_mutex);
 
-    const char *start = cmd;
+    while (1) {
+        while (_jb_debug_packages_done == _jb_debug_packages.count)
+            _jb_cond_wait(&_jb_debug_package_cond, &_jb_debug_package_mutex);
 
-    while (*start && jb_iswhitespace(*start))
-        start += 1;
+        _JBDebugPackage package = _jb_debug_packages.data[_jb_debug_packages_done];
 
-    const char *end = start;
+        _jb_mutex_unlock(&_jb_debug_package_mutex);
 
-    while (*start) {
-        end += 1;
+        JB_LOG("package %s\n", package.dwp);
 
-        if ((jb_iswhitespace(*end) || *end == 0) && start != end) {
-            size_t len = end-start;
-            char *out = malloc(len+1);
+        JBStringBuilder sb;
+        jb_sb_init(&sb);
 
-            memcpy(out, start, len);
-            out[len] = 0;
+        int result = 1;
 
-            JBVectorPush(&args, out);
+        for (int i = 0; package.tools[i] && result != 0; i++) {
+            char *cmd[] = { package.tools[i], "-e", package.output, "-o", package.dwp, NULL };
+            result = _jb_run_internal(cmd, &sb, _jb_pipe_drain_sb_proxy, __FILE__, __LINE__);
+        }
 
-            while (*end && jb_iswhitespace(*end))
-                end += 1;
+        char *output = jb_sb_to_string(&sb);
 
-            start = end;
+        if (result != 0) {
+            jb_log_print("%s[jb] could not package the debug info of %s\n", output, package.output);
+            remove(package.dwp);
+        }
+        else {
+            jb_log("%s", output);
         }
-    }
-
-    JBStringBuilder sb;
-    jb_sb_init(&sb);
 
-    JBArrayFor(&args) {
-        char *start = args.data[index];
-        char *input = start;
+        free(output);
+        jb_sb_free(&sb);
 
-        while (*input) {
-            if (*input == '$') {
-                input += 1;
-                char *env_start = input;
+        for (int i = 0; package.tools[i]; i++)
+            free(package.tools[i]);
 
-                while (*input && jb_isalphanumeric(*input)) {
-                    input += 1;
-                }
+        free(package.output);
+        free(package.dwp);
 
-                char *env = jb_format_string("%.*s", input-env_start, env_start);
+        _jb_mutex_lock(&_jb_debug_package_mutex);
 
-                char *value = getenv(env);
+        _jb_debug_packages_done++;
+        _jb_cond_broadcast(&_jb_debug_package_cond);
+    }
 
-                while (value && *value) {
-                    jb_sb_putchar(&sb, *value);
-                    value += 1;
-                }
+    _JB_THREAD_RETURN;
+}
 
-                free(env);
-                continue;
-            }
+// Waits for queued packaging before josh exits.
+void _jb_debug_package_flush() {
+    _jb_mutex_lock(&_jb_debug_package_mutex);
 
-            jb_sb_putchar(&sb, *input);
-            input += 1;
-        }
+    while (_jb_debug_packages_done < _jb_debug_packages.count)
+        _jb_cond_wait(&_jb_debug_package_cond, &_jb_debug_package_mutex);
 
-        free(start);
-        args.data[index] = jb_sb_to_string(&sb);
+    _jb_mutex_unlock(&_jb_debug_package_mutex);
+}
 
-        jb_sb_free(&sb);
-        jb_sb_init(&sb);
-    }
+// Queues packaging the .dwo files of target's output into <output>.dwp, if target asks for
+// it and output was linked since the last one.
+void _jb_package_debug_info(JBTarget *target, JBToolchain *tc, const char *link_command, const char *output) {
+    int wanted = JB_DEBUG_SPLIT_DWARF | JB_DEBUG_PACKAGE;
 
-    jb_sb_free(&sb);
+    if (tc->triple.vendor == JB_ENUM(Windows) || (target->debug_info & wanted) != wanted)
+        return;
 
-    size_t allocated_end = args.count;
+    char *dwp = jb_concat(output, ".dwp");
 
-    JBNullArrayFor(extra) {
-        JBVectorPush(&args, extra[index]);
+    if (!jb_file_is_newer(output, dwp)) {
+        free(dwp);
+        return;
     }
 
-    JBVectorPush(&args, NULL);
-    jb_run(args.data, file, line);
+    // binutils' dwp only reads DWARF 4, while gcc 11 and later default to DWARF 5
+    _JBDebugPackage package = {0};
 
-    for (size_t i = 0; i < allocated_end; i++) {
-        free(args.data[i]);
+    if (strstr(link_command, "clang")) {
+        package.tools[0] = _jb_llvm_tool(link_command, "llvm-dwp");
+    }
+    else {
+        package.tools[0] = jb_copy_string("llvm-dwp");
+        package.tools[1] = _jb_binutils_tool(link_command, "dwp");
     }
 
-    free(args.data);
-}
-
-int jb_string_array_count(char **array) {
-    int i = 0;
-    while (array && array[i])
-        i += 1;
-
-    return i;
-}
+    package.output = jb_copy_string(output);
+    package.dwp = dwp;
 
-char *jb_concat(const char *lhs, const char *rhs) {
-    size_t l = strlen(lhs);
-    size_t r = strlen(rhs);
+    _jb_mutex_lock(&_jb_debug_package_mutex);
 
-    char *out = malloc(l+r+1);
-    memcpy(out, lhs, l);
-    memcpy(out+l, rhs, r);
-    out[l+r] = 0;
-    return out;
-}
+    if (_jb_debug_packages.count == 0) {
+        _jb_cond_init(&_jb_debug_package_cond);
+        _jb_thread_start(_jb_debug_package_thread, NULL);
+        atexit(_jb_debug_package_flush);
+    }
 
-char *jb_copy_string(const char *str) {
-    size_t l = strlen(str);
+    JBVectorPush(&_jb_debug_packages, package);
+    _jb_cond_broadcast(&_jb_debug_package_cond);
 
-    char *out = malloc(l+1);
-    memcpy(out, str, l+1);
-    return out;
+    _jb_mutex_unlock(&_jb_debug_package_mutex);
 }
 
-char *jb_va_format_string(const char *fmt, va_list args) {
-    size_t size = 4096;
+void _jb_link_exe(JBExecutable *exec, JBToolchain *tc, char **object_files) {
+    char *link_command = _jb_get_link_command(tc, (JBTarget *)exec);
 
-    char *buf = malloc(size);
+    int is_msvc = (tc->triple.vendor == JB_ENUM(Windows));
+    char *output_exec = jb_format_string("%s/%s%s", exec->build_folder, exec->name, is_msvc ? ".exe" : "");
 
-    int result;
+    int needs_build = 0;
 
-    {
-        va_list args_copy;
-        va_copy(args_copy, args);
+    JBNullArrayFor(exec->libraries) {
+        JBLibrary *lib = exec->libraries[index];
+        char *lib_output_exe = _jb_library_output_file(lib);
 
-        result = vsnprintf(buf, size, fmt, args_copy);
+        if (jb_file_is_newer(lib_output_exe, output_exec)) {
+            free(lib_output_exe);
+            needs_build = 1;
+            break;
+        }
 
-        va_end(args_copy);
+        free(lib_output_exe);
     }
 
-    if (result < 0) {
-        free(buf);
-        return NULL;
-    }
+    if (!needs_build)
+        needs_build = _jb_need_to_build_target(output_exec, object_files);
 
-    if (result < size)
-        return buf;
+    enum JBLinker linker = _jb_choose_linker(tc, (JBTarget *)exec, link_command);
 
-    size = result+1;
-    buf = realloc(buf, size);
+    _JBLinkOptions options;
+    _jb_link_options((JBTarget *)exec, tc, link_command, linker, &options);
 
-    {
-        va_list args_copy;
-        va_copy(args_copy, args);
+    char **cmd = _jb_link_shared_command(tc, link_command, linker, (const char **)options.ldflags.data, exec->frameworks, output_exec, object_files, exec->libraries, exec->system_libraries, 0);
+    _jb_run_link(exec->build_folder, output_exec, cmd, options.run_only.data, needs_build, "link");
+    _jb_package_debug_info((JBTarget *)exec, tc, link_command, output_exec);
 
-        result = vsnprintf(buf, size, fmt, args_copy);
+    _jb_link_options_free(&options);
+    free(cmd);
+    free(output_exec);
+}
 
-        va_end(args_copy);
+const char *_jb_lib_prefix(JBTriple triple) {
+    switch (triple.vendor) {
+    case JB_ENUM(Apple):
+    case JB_ENUM(Linux):
+        return "lib";
+    case JB_ENUM(Windows):
+    default:
+        return "";
     }
 
-    if (result < 0) {
-        free(buf);
-        return NULL;
+    return "";
+}
+
+const char *_jb_lib_suffix(JBTriple triple, int flags) {
+    if (flags & JB_LIBRARY_SHARED) {
+        switch (triple.vendor) {
+            case JB_ENUM(Apple):
+                return "dylib";
+            case JB_ENUM(Linux):
+                return "so";
+            case JB_ENUM(Windows):
+                return "dll";
+            default:
+                return "";
+        }
+    }
+    else {
+        switch (triple.vendor) {
+            case JB_ENUM(Apple):
+            case JB_ENUM(Linux):
+                return "a";
+            case JB_ENUM(Windows):
+                return "lib";
+            default:
+                return "";
+        }
     }
 
-    return buf;
+    return "";
 }
 
-char *jb_format_string(const char *fmt, ...) {
-    va_list args;
-    va_start(args, fmt);
-    char *out = jb_va_format_string(fmt, args);
-    va_end(args);
-    return out;
+char *_jb_library_output_file(JBLibrary *target) {
+    JBToolchain *tc = target->toolchain ? target->toolchain : jb_native_toolchain();
+    char *output_exec = jb_format_string("%s/%s%s.%s", target->build_folder, _jb_lib_prefix(tc->triple), target->name, _jb_lib_suffix(tc->triple, target->flags));
+    return output_exec;
 }
 
-const char *jb_filename(const char *path) {
-    char *slash = strrchr(path, JB_PATH_SEPARATOR);
+char **_jb_get_library_objects(JBLibrary *target) {
+    char *object_folder = jb_concat(target->build_folder, "/object/");
 
-    if (slash) {
-        char *out = slash+1;
+    JBToolchain *tc = target->toolchain ? target->toolchain : jb_native_toolchain();
+    char **object_files = _jb_target_object_files((JBTarget *)target, tc, object_folder);
 
-        if (strlen(out) == 0)
-            return NULL;
+    free(object_folder);
+    return object_files;
+}
 
-        return out;
-    }
+void _jb_link_lib(JBLibrary *target, JBToolchain *tc, char **object_files) {
+    char *link_command = _jb_get_link_command(tc, (JBTarget *)target);
 
-    return path;
-}
+    char *output_exec = _jb_library_output_file(target);
+
+    int needs_build = 0;
 
-const char *jb_extension(const char *path) {
-    const char *filename = jb_filename(path);
+    JBNullArrayFor(target->libraries) {
+        JBLibrary *lib = target->libraries[index];
+        char *lib_output_exe = _jb_library_output_file(lib);
 
-    const char *ext = strrchr(filename, '.');
+        if (jb_file_is_newer(lib_output_exe, output_exec)) {
+            free(lib_output_exe);
+            needs_build = 1;
+            break;
+        }
 
-    if (ext)
-        ext += 1;
+        free(lib_output_exe);
+    }
 
-    return ext;
-}
+    if (!needs_build)
+        needs_build = _jb_need_to_build_target(output_exec, object_files);
 
-char *jb_drop_last_path_component(const char *path) {
-    char *slash = strrchr(path, JB_PATH_SEPARATOR);
+    if (target->flags & JB_LIBRARY_SHARED) {
+        enum JBLinker linker = _jb_choose_linker(tc, (JBTarget *)target, link_command);
 
-    if (slash) {
-        char *end = slash;
+        _JBLinkOptions options;
+        _jb_link_options((JBTarget *)target, tc, link_command, linker, &options);
 
-        if (strlen(end) == 0)
-            return jb_copy_string(path);
+        char **cmd = _jb_link_shared_command(tc, link_command, linker, (const char **)options.ldflags.data, target->frameworks, output_exec, object_files, target->libraries, target->system_libraries, 1);
+        _jb_run_link(target->build_folder, output_exec, cmd, options.run_only.data, needs_build, "link");
+        _jb_package_debug_info((JBTarget *)target, tc, link_command, output_exec);
 
-        size_t len = end-path;
-        char *out = malloc(len+1);
-        memcpy(out, path, len);
-        out[len] = 0;
-        return out;
+        _jb_link_options_free(&options);
+        free(cmd);
     }
+    else {
+        char *triplet = jb_get_triple(tc);
+        int is_msvc = (tc->triple.vendor == JB_ENUM(Windows));
 
-    return jb_copy_string(path);
-}
+        JB_ASSERT(tc->ar, "Toolchain (%s) missing AR", triplet);
 
-const char *_jb_arch_string(enum JBArch arch) {
-    switch (arch) {
-    case JB_ENUM(X86_64):
-        return "x86_64";
-    case JB_ENUM(X86):
-        return "x86";
-    case JB_ENUM(ARM64):
-        return "arm64";
-    case JB_ENUM(INVALID_ARCH):
-    default:
-        return NULL;
-    }
-}
+        JBVector(char *) cmd = {0};
 
-enum JBArch _jb_arch(const char *str) {
-    if (strcmp(str, "x86_64") == 0)
-        return JB_ENUM(X86_64);
-    if (strcmp(str, "x86") == 0 || strcmp(str, "i386") == 0 || strcmp(str, "i686") == 0)
-        return JB_ENUM(X86);
-    if (strcmp(str, "arm64") == 0)
-        return JB_ENUM(ARM64);
-    if (strcmp(str, "aarch64") == 0)
-        return JB_ENUM(ARM64);
+        JBVectorPush(&cmd, tc->ar);
 
-    return JB_ENUM(INVALID_ARCH);
-}
+        if (is_msvc) {
+            JBVectorPush(&cmd, "/nologo");
+            JBVectorPush(&cmd, jb_format_string("/OUT:%s", output_exec)); // Leak
+        }
+        else {
+            JBVectorPush(&cmd, (target->flags & JB_LIBRARY_THIN_ARCHIVE) ? "rcsT" : "rcs");
+            JBVectorPush(&cmd, output_exec);
+        }
 
-const char *_jb_vendor_string(enum JBVendor vendor) {
-    switch (vendor) {
-    case JB_ENUM(Apple):
-        return "apple";
-    case JB_ENUM(Linux):
-        return "linux";
-    case JB_ENUM(Windows):
-        return "windows";
-    case JB_ENUM(UNKNOWN_VENDOR):
-        return "unknown";
-    case JB_ENUM(INVALID_VENDOR):
-    default:
-        return NULL;
-    }
-}
+        JBNullArrayFor(object_files) {
+            JBVectorPush(&cmd, object_files[index]);
+        }
 
-enum JBVendor _jb_vendor(const char *str) {
-    if (!str)
-        return JB_ENUM(UNKNOWN_VENDOR);
+        JBVectorPush(&cmd, NULL);
 
-    if (strcmp(str, "apple") == 0)
-        return JB_ENUM(Apple);
-    if (strcmp(str, "linux") == 0)
-        return JB_ENUM(Linux);
-    if (strcmp(str, "windows") == 0)
-        return JB_ENUM(Windows);
+        // The signature covers the list of objects, so an archive that lost or gained
+        // members is still rebuilt from scratch.
+        int incremental = !is_msvc && (target->flags & JB_LIBRARY_INCREMENTAL_ARCHIVE);
+        _JBBuildDB *db = _jb_build_db_for(target->build_folder);
 
-    return JB_ENUM(UNKNOWN_VENDOR);
-}
+        if (incremental && needs_build && _jb_file_stat(output_exec).exists && !_jb_command_changed(db, output_exec, cmd.data))
+            _jb_update_archive(tc, output_exec, cmd.data[1], object_files);
+        else
+            _jb_run_link(target->build_folder, output_exec, cmd.data, NULL, needs_build, "built");
 
-const char *_jb_runtime_string(enum JBRuntime runtime) {
-    switch (runtime) {
-    case JB_ENUM(Darwin):
-        return "darwin";
-    case JB_ENUM(GNU):
-        return "gnu";
-    case JB_ENUM(MSVC):
-        return "msvc";
-    case JB_ENUM(ELF):
-        return "elf";
-    case JB_ENUM(INVALID_RUNTIME):
-    default:
-        return NULL;
-    }
-}
+        free(cmd.data);
 
-enum JBRuntime _jb_runtime(const char *str) {
-    if (strcmp(str, "darwin") == 0)
-        return JB_ENUM(Darwin);
-    if (strcmp(str, "gnu") == 0)
-        return JB_ENUM(GNU);
-    if (strcmp(str, "msvc") == 0)
-        return JB_ENUM(MSVC);
-    if (strcmp(str, "elf") == 0)
-        return JB_ENUM(ELF);
+        free(triplet);
+    }
 
-    return JB_ENUM(INVALID_RUNTIME);
+    free(output_exec);
 }
 
-int _jb_is_objc_ext(const char *ext) {
-    return strcmp(ext, "m") == 0 || strcmp(ext, "mm") == 0;
-}
+typedef struct {
+    JBTarget *target;
+    JBToolchain *tc;
+    int is_cxx;
+} _JBPrecompiledHeaderJob;
 
-typedef JBVector(char *) _JBCommandVector;
-void _jb_add_common_c_options(JBToolchain *tc, _JBCommandVector *cmd, const char *tool, const char **cflags, const char **include_paths) {
-    char *triplet = jb_get_triple(tc);
-    int is_msvc = (tc->triple.vendor == JB_ENUM(Windows));
+typedef struct {
+    _JBCompileJob *compile;
+    const char *folder; // where the target's interfaces go
+    _JBModuleScan scan;
+
+    char *bmi; // interface this source produces, if it provides a module
+    _JBCommandVector flags; // cxxflags, then module options
+    _JBCommandVector owned; // strings in flags made for this source
+    _JBCommandVector bmis; // interfaces of every module it imports, directly or not
+
+    _JBJob *job;
+    int visit; // 1 while checking its imports for cycles, 2 once done
+} _JBModuleUnit;
+
+void _jb_module_scan_job(void *ctx) {
+    _JBModuleUnit *unit = (_JBModuleUnit *)ctx;
+    _jb_scan_module_source(unit->compile->target, unit->compile->tc, unit->compile->source, unit->compile->object, unit->folder, &unit->scan);
+}
 
-    if (is_msvc) {
-        JBVectorPush(cmd, "/nologo");
-    }
+void _jb_module_compile_job(void *ctx) {
+    _JBModuleUnit *unit = (_JBModuleUnit *)ctx;
+    JBTarget *target = unit->compile->target;
+    JBToolchain *tc = unit->compile->tc;
 
-    if (triplet && strstr(tool, "clang") != NULL) {
-        JBVectorPush(cmd, "-target");
-        JBVectorPush(cmd, triplet);
+    char *previous = NULL;
 
-        // JBVectorPush(cmd, "--rtlib=compiler-rt");
+    if (unit->bmi) {
+        if (!jb_file_exists(unit->bmi)) {
+            remove(unit->compile->object);
+            _jb_stat_invalidate(unit->compile->object);
+        }
+        else {
+            previous = jb_concat(unit->bmi, ".previous");
+            rename(unit->bmi, previous);
+        }
     }
 
+    _jb_compile_c_family(target, tc, tc->cxx, (const char **)unit->flags.data, unit->compile->source, unit->compile->object, 0, (const char **)unit->bmis.data);
 
-    if (tc->sysroot) {
-        // TODO check if Apple LD or GNU LD
-        // JBVectorPush(cmd, "-syslibroot");
-        JBVectorPush(cmd, "--sysroot");
-        JBVectorPush(cmd, tc->sysroot);
-    }
-
-    JBNullArrayFor(cflags) {
-        JBVectorPush(cmd, (char *)cflags[index]);
-    }
+    // Importers depend on the interface, so keep the old one (and its timestamp) if the
+    // new one is identical, eg. when only a function body changed. gcc's interfaces
+    // always differ.
+    if (previous) {
+        int previous_ok = 0;
+        int bmi_ok = 0;
 
-    JBNullArrayFor(include_paths) {
-        if (is_msvc) {
-            JBVectorPush(cmd, "/I");
+        if (!jb_file_exists(unit->bmi) || _jb_hash_file(previous, &previous_ok) == _jb_hash_file(unit->bmi, &bmi_ok)) {
+            remove(unit->bmi);
+            rename(previous, unit->bmi);
         }
         else {
-            JBVectorPush(cmd, "-I");
+            remove(previous);
         }
-        JBVectorPush(cmd, (char *)include_paths[index]);
-    }
 
-    if (is_msvc) {
-        JBVectorPush(cmd, "/c");
-    }
-    else {
-        JBVectorPush(cmd, "-c");
+        _jb_stat_invalidate(unit->bmi);
+        free(previous);
     }
 }
 
-char **_jb_get_dependencies_c(JBToolchain *tc, const char *tool, const char *source, const char **cflags, const char **include_paths) {
-    int is_msvc = (tc->triple.vendor == JB_ENUM(Windows));
+// Fails the build if a module imports itself through the modules it imports.
+void _jb_module_check_cycles(_JBModuleUnit *units, _JBStringMap *providers, size_t index) {
+    _JBModuleUnit *unit = &units[index];
 
-    _JBCommandVector cmd = {0};
+    if (unit->visit == 2)
+        return;
 
-    JBVectorPush(&cmd, (char *)tool);
+    JB_ASSERT(unit->visit != 1, "C++ modules import each other in a cycle through %s", unit->compile->source);
+    unit->visit = 1;
 
-    if (is_msvc) {
-        JBVectorPush(&cmd, "/sourceDependencies-"); // '-' at the end dumps to stdout
-        // tells compiler to do syntax check only (prevents generating .obj file)
-        // Thankfully, as of 19.50 toolchain, this option still enables /sourceDependencies to generate output
-        JBVectorPush(&cmd, "/Zs");
-    }
-    else {
-        JBVectorPush(&cmd, "-MM");
+    JBArrayForEach(&unit->scan.requires) {
+        size_t provider = (uintptr_t)_jb_string_map_get(providers, *it);
+
+        if (provider)
+            _jb_module_check_cycles(units, providers, provider - 1);
     }
 
-    _jb_add_common_c_options(tc, &cmd, tool, cflags, include_paths);
+    unit->visit = 2;
+}
 
-    JBVectorPush(&cmd, (char *)source);
+typedef JBVector(size_t) _JBModuleIndexVector;
 
-    JBVectorPush(&cmd, NULL);
+// Appends the units providing what units[index] imports, directly or through other
+// modules, that aren't seen yet.
+void _jb_module_imports(_JBModuleUnit *units, _JBStringMap *providers, size_t index, char *seen, _JBModuleIndexVector *out) {
+    JBArrayForEach(&units[index].scan.requires) {
+        size_t provider = (uintptr_t)_jb_string_map_get(providers, *it);
 
-    struct JBRunResult run_result = jb_run_get_output(cmd.data, __FILE__, __LINE__);
-    char *result = NULL;
+        if (!provider || seen[provider - 1])
+            continue;
 
-    if (run_result.exit_code)
-        free(run_result.output);
-    else
-        result = run_result.output;
+        seen[provider - 1] = 1;
+        JBVectorPush(out, provider - 1);
 
+        _jb_module_imports(units, providers, provider - 1, seen, out);
+    }
+}
 
-    free(cmd.data);
+void _jb_precompiled_header_job(void *ctx) {
+    _JBPrecompiledHeaderJob *job = (_JBPrecompiledHeaderJob *)ctx;
+    _jb_build_precompiled_header(job->target, job->tc, job->is_cxx);
+}
 
-    if (!result)
-        return NULL;
+// A target in the build graph: one compile job per source, plus a link (or archive)
+// job that runs once those compiles and the link jobs of its direct libraries are done.
+// With a precompiled header, the compiles wait for it to be built first.
+typedef struct {
+    JBTarget *target;
+    int is_lib;
+    JBToolchain *tc;
 
-    JBVector(char *) out = {0};
+    char *object_folder;
+    char **object_files;
+    _JBCompileJob *compiles;
+    _JBJob *link;
 
-    if (is_msvc) {
-        // TODO implement proper JSON parsing of /sourceDependencies
-        // Here's a hacky solution: search for __"Includes": [__ string in result
-        // then for each line following, search for first " and ending ",
+    _JBPrecompiledHeaderJob pch[2]; // C, C++
+    _JBJob *pch_jobs[2];
 
-        const char *SOURCE_TOKEN = "\"Source\":";
-        char *source = strstr(result, SOURCE_TOKEN);
-        if (!source)
-            return NULL;
+    _JBUnityPlan unity;
+    _JBUnityJob *unity_jobs;
 
-        {
-            source += strlen(SOURCE_TOKEN);
-            source = strchr(source, '\"');
+    JBVector(_JBModuleUnit) modules; // C++ sources of a cxx_modules target
+    char *modules_folder;
+} _JBTargetNode;
 
-            if (!source)
-                return NULL;
+typedef JBVector(_JBTargetNode *) _JBTargetGraph;
 
-            source += 1;
+void _jb_schedule_compile(_JBJobPool *pool, _JBTargetNode *node, _JBJobFn fn, void *ctx) {
+    _JBJob *job = _jb_job_create(pool, fn, ctx);
 
-            char *end = strstr(source, "\",");
-            if (!end)
-                return NULL;
+    _jb_job_depends_on(pool, job, node->pch_jobs[0]);
+    _jb_job_depends_on(pool, job, node->pch_jobs[1]);
+    _jb_job_submit(pool, job);
 
-            char *entry = jb_format_string("%.*s", end-source, source);
-            JBVectorPush(&out, entry);
-        }
+    _jb_job_depends_on(pool, node->link, job);
+}
 
-        const char *INCLUDES_TOKEN = "\"Includes\": [";
-        char *includes = strstr(result, INCLUDES_TOKEN);
+// Runs once every C++ source of node has been scanned: matches imports to the sources
+// that provide them, then submits the compiles (each after the ones it imports) and the
+// link. Imports provided by no source, like the standard library's, are left to the
+// compiler.
+void _jb_module_plan_job(void *ctx) {
+    _JBTargetNode *node = (_JBTargetNode *)ctx;
+    _JBJobPool *pool = _jb_get_job_pool();
 
-        if (!includes)
-            return NULL;
+    _JBModuleUnit *units = node->modules.data;
+    size_t count = node->modules.count;
 
-        includes += strlen(INCLUDES_TOKEN);
+    const char *tool = node->tc->cxx;
+    int is_clang = strstr(tool, "clang") != NULL;
 
-        while (1) {
-            includes = strchr(includes, '\"');
+    _JBStringMap providers = {0}; // module name -> index in units + 1
+    JBStringBuilder mapper;
+    jb_sb_init(&mapper);
 
-            if (!includes)
-                break;
+    for (size_t i = 0; i < count; i++) {
+        const char *name = units[i].scan.provides;
 
-            includes += 1;
+        if (!name)
+            continue;
 
-            char *end = strstr(includes, "\"");
-            if (!end)
-                break;
+        size_t other = (uintptr_t)_jb_string_map_get(&providers, name);
+        JB_ASSERT(!other, "module %s is provided by both %s and %s", name, units[other ? other - 1 : 0].compile->source, units[i].compile->source);
 
-            char *entry = jb_format_string("%.*s", end-includes, includes);
-            JBVectorPush(&out, entry);
+        _jb_string_map_put(&providers, name, (void *)(uintptr_t)(i + 1));
+        units[i].bmi = _jb_module_bmi_path(node->modules_folder, name, tool);
 
-            includes = end + 2;
-        }
+        jb_sb_puts(&mapper, name);
+        jb_sb_putchar(&mapper, ' ');
+        jb_sb_puts(&mapper, units[i].bmi);
+        jb_sb_putchar(&mapper, '\n');
     }
-    else {
-        for (int i = 0; result[i]; i++) {
-            char n = result[i+1];
-            if (result[i] == '\\' && (n == '\r' || n == '\n')) {
-                result[i] = ' ';
-            }
-        }
-
-        char *start = strchr(result, ':')+1;
-
-        while (*start) {
-            while (*start && jb_iswhitespace(*start))
-                start += 1;
 
-            if (*start) {
-                char *end = start;
+    // gcc finds every interface, to write or to read, through a mapper file
+    char *mapper_path = jb_concat(node->modules_folder, "modules.map");
+    char *mapper_text = jb_sb_to_string(&mapper);
 
-                while (*end) {
+    if (!is_clang)
+        _jb_write_file_if_changed(mapper_path, mapper_text);
 
-                    {
-                        if (*end == '\\' && *(end + 1) != 0) {
-                            end += 2;
-                            continue;
-                        }
-                    }
+    for (size_t i = 0; i < count; i++)
+        _jb_module_check_cycles(units, &providers, i);
 
-                    if (jb_iswhitespace(*end))
-                        break;
+    char *seen = malloc(count + 1);
 
-                    end += 1;
-                }
+    for (size_t i = 0; i < count; i++) {
+        _JBModuleUnit *unit = &units[i];
 
-                char *entry = jb_format_string("%.*s", end-start, start);
-                JBVectorPush(&out, entry);
+        JBNullArrayFor(node->target->cxxflags) {
+            JBVectorPush(&unit->flags, (char *)node->target->cxxflags[index]);
+        }
 
-                start = end;
+        if (is_clang) {
+            if (unit->bmi) {
+                JBVectorPush(&unit->flags, "-x");
+                JBVectorPush(&unit->flags, "c++-module");
+                JBVectorPush(&unit->owned, jb_concat("-fmodule-output=", unit->bmi));
             }
         }
-    }
-
-    JBVectorPush(&out, NULL);
-
-    return out.data;
-}
-
-char **_jb_get_dependencies_asm(JBToolchain *tc, const char *tool, const char *source, const char **asflags, const char **include_paths) {
-    // TODO dependency tracking for assembler sources
-    JBVector(char *) out = {0};
-    JBVectorPush(&out, (char *)source);
-    JBVectorPush(&out, NULL);
+        else {
+            JBVectorPush(&unit->flags, "-fmodules-ts");
+            JBVectorPush(&unit->owned, jb_concat("-fmodule-mapper=", mapper_path));
+        }
 
-    return out.data;
-}
+        memset(seen, 0, count);
+        _JBModuleIndexVector imports = {0};
+        _jb_module_imports(units, &providers, i, seen, &imports);
 
-void jb_compile_c(JBTarget *target, JBToolchain *tc, const char *source, const char *output) {
-    const char **cflags = target->cflags;
-    const char **include_paths = target->include_paths;
+        JBArrayForEach(&imports) {
+            _JBModuleUnit *import = &units[*it];
 
-    char *triplet = jb_get_triple(tc);
+            JBVectorPush(&unit->bmis, import->bmi);
 
-    JB_ASSERT(tc->cc, "Toolchain (%s) missing C compiler", triplet);
+            if (is_clang) {
+                JBVectorPush(&unit->owned, jb_format_string("-fmodule-file=%s=%s", import->scan.provides, import->bmi));
+            }
+        }
 
-    char **deps = _jb_get_dependencies_c(tc, tc->cc, source, cflags, include_paths);
+        JBVectorPush(&unit->bmis, NULL);
 
-    int needs_build = 0;
+        JBArrayForEach(&unit->owned) {
+            JBVectorPush(&unit->flags, *it);
+        }
 
-    if (!deps) {
-        jb_log("couldn't compute dependenices for %s, rebuilding...\n", source);
-        needs_build = 1;
+        JBVectorPush(&unit->flags, NULL);
+
+        unit->job = _jb_job_create(pool, _jb_module_compile_job, unit);
+
+        _jb_job_depends_on(pool, unit->job, node->pch_jobs[0]);
+        _jb_job_depends_on(pool, unit->job, node->pch_jobs[1]);
+
+        free(imports.data);
     }
 
-    if (!needs_build) {
-        JBNullArrayFor(deps) {
-            if (jb_file_is_newer(deps[index], output)) {
-                needs_build = 1;
-                break;
-            }
+    for (size_t i = 0; i < count; i++) {
+        _JBModuleUnit *unit = &units[i];
+
+        JBArrayForEach(&unit->scan.requires) {
+            size_t provider = (uintptr_t)_jb_string_map_get(&providers, *it);
+
+            if (provider)
+                _jb_job_depends_on(pool, unit->job, units[provider - 1].job);
         }
     }
 
-    free(deps);
-
-    if (!needs_build)
-        return;
+    for (size_t i = 0; i < count; i++) {
+        _jb_job_submit(pool, units[i].job);
+        _jb_job_depends_on(pool, node->link, units[i].job);
+    }
 
-    JB_LOG("compile %s\n", source);
+    _jb_job_submit(pool, node->link);
 
-    _JBCommandVector cmd = {0};
+    free(seen);
+    free(mapper_text);
+    free(mapper_path);
+    jb_sb_free(&mapper);
+    _jb_string_map_free(&providers);
+}
 
-    JBVectorPush(&cmd, tc->cc);
+// C++ sources of a cxx_modules target are compiled by _jb_module_plan_job; the rest
+// right away.
+void _jb_schedule_source(_JBJobPool *pool, _JBTargetNode *node, _JBCompileJob *compile) {
+    const char *ext = jb_extension(compile->source);
 
-    _jb_add_common_c_options(tc, &cmd, tc->cc, cflags, include_paths);
-    int is_msvc = (tc->triple.vendor == JB_ENUM(Windows));
+    if (node->target->cxx_modules && ext && strcmp(ext, "cpp") == 0) {
+        _JBModuleUnit unit = {0};
+        unit.compile = compile;
 
-    if (is_msvc) {
-        JBVectorPush(&cmd, "/Fo:");
+        JBVectorPush(&node->modules, unit);
     }
     else {
-        JBVectorPush(&cmd, "-o");
+        _jb_schedule_compile(pool, node, _jb_compile_job, compile);
     }
-    JBVectorPush(&cmd, (char *)output);
+}
 
-    JBVectorPush(&cmd, "-c");
-    JBVectorPush(&cmd, (char *)source);
+// Submits the link of node, after scanning and planning its modules if it has any.
+void _jb_schedule_link(_JBJobPool *pool, _JBTargetNode *node) {
+    if (!node->modules.count) {
+        _jb_job_submit(pool, node->link);
+        return;
+    }
 
-    JBVectorPush(&cmd, NULL);
-    jb_run(cmd.data, __FILE__, __LINE__);
+    JB_ASSERT(node->tc->triple.vendor != JB_ENUM(Windows), "C++ modules are not supported with MSVC");
+    JB_ASSERT(node->tc->cxx, "Toolchain missing C++ compiler");
 
-    free(cmd.data);
+    node->modules_folder = jb_concat(node->object_folder, "modules/");
+    jb_mkdir(node->modules_folder);
 
-    free(triplet);
+    _JBJob *plan = _jb_job_create(pool, _jb_module_plan_job, node);
+
+    JBArrayForEach(&node->modules) {
+        it->folder = node->modules_folder;
+        _jb_job_depends_on(pool, plan, _jb_job_pool_submit(pool, _jb_module_scan_job, it));
+    }
+
+    _jb_job_submit(pool, plan);
 }
 
-void jb_compile_cxx(JBTarget *target, JBToolchain *tc, const char *source, const char *output) {
-    const char **cxxflags = target->cxxflags;
-    const char **include_paths = target->include_paths;
+void _jb_link_target_job(void *ctx) {
+    _JBTargetNode *node = (_JBTargetNode *)ctx;
 
-    char *triplet = jb_get_triple(tc);
+    // a batch that fell back has no object; its members' objects stand in for it this time,
+    // and the next build batches the ones that didn't clash again
+    for (size_t i = 0; i < node->unity.batches.count; i++) {
+        if (!node->unity_jobs[i].fell_back)
+            continue;
 
-    JB_ASSERT(tc->cxx, "Toolchain (%s) missing C++ compiler", triplet);
+        JBVector(char *) object_files = {0};
+        size_t single_count = node->unity.singles.count;
 
-    char **deps = _jb_get_dependencies_c(tc, tc->cxx, source, cxxflags, include_paths);
+        for (size_t o = 0; o < single_count; o++)
+            JBVectorPush(&object_files, node->object_files[o]);
 
-    int needs_build = 0;
+        for (size_t b = 0; b < node->unity.batches.count; b++) {
+            _JBUnityBatch *batch = &node->unity.batches.data[b];
 
-    if (!deps) {
-        jb_log("couldn't compute dependenices for %s, rebuilding...\n", source);
-        needs_build = 1;
-    }
+            if (!node->unity_jobs[b].fell_back) {
+                JBVectorPush(&object_files, node->object_files[single_count + b]);
+                continue;
+            }
 
-    if (!needs_build) {
-        JBNullArrayFor(deps) {
-            if (jb_file_is_newer(deps[index], output)) {
-                needs_build = 1;
-                break;
+            free(node->object_files[single_count + b]);
+
+            JBNullArrayFor(batch->members) {
+                JBVectorPush(&object_files, _jb_object_file(node->tc, batch->members[index], node->object_folder));
             }
         }
-    }
-
-    free(deps);
 
-    if (!needs_build)
-        return;
+        // and whatever follows the batches (MSVC's precompiled header object)
+        for (size_t o = single_count + node->unity.batches.count; node->object_files[o]; o++)
+            JBVectorPush(&object_files, node->object_files[o]);
 
-    JB_LOG("compile %s\n", source);
+        JBVectorPush(&object_files, NULL);
 
-    _JBCommandVector cmd = {0};
+        free(node->object_files);
+        node->object_files = object_files.data;
+        break;
+    }
 
-    JBVectorPush(&cmd, tc->cxx);
+    if (node->is_lib)
+        _jb_link_lib((JBLibrary *)node->target, node->tc, node->object_files);
+    else
+        _jb_link_exe((JBExecutable *)node->target, node->tc, node->object_files);
+}
 
-    _jb_add_common_c_options(tc, &cmd, tc->cxx, cxxflags, include_paths);
+// Adds target and, depth-first, every library it uses to graph; returns the job that
+// produces target's output, or NULL if there is nothing to wait on.
+_JBJob *_jb_schedule_target(_JBJobPool *pool, _JBTargetGraph *graph, JBTarget *target, int is_lib) {
+    if (is_lib && (((JBLibrary *)target)->flags & _JB_LIBRARY_JUST_BUILT))
+        return NULL;
 
-    int is_msvc = (tc->triple.vendor == JB_ENUM(Windows));
-    if (is_msvc) {
-        JBVectorPush(&cmd, "/Fo:");
-    }
-    else {
-        JBVectorPush(&cmd, "-o");
+    JBArrayForEach(graph) {
+        if ((*it)->target == target)
+            return (*it)->link;
     }
-    JBVectorPush(&cmd, (char *)output);
-
-    JBVectorPush(&cmd, "-c");
-    JBVectorPush(&cmd, (char *)source);
 
-    JBVectorPush(&cmd, NULL);
-    jb_run(cmd.data, __FILE__, __LINE__);
+    _JBTargetNode *node = malloc(sizeof(_JBTargetNode));
+    memset(node, 0, sizeof(_JBTargetNode));
+    node->target = target;
+    node->is_lib = is_lib;
+    node->tc = target->toolchain ? target->toolchain : jb_native_toolchain();
+    node->object_folder = jb_concat(target->build_folder, "/object/");
 
-    free(cmd.data);
+    JBVectorPush(graph, node);
 
-    free(triplet);
-}
+    // Schedule libraries first so their compiles are queued ahead of ours; their link
+    // jobs tend to be on the critical path.
+    JBVector(_JBJob *) library_jobs = {0};
 
-void jb_compile_asm(JBTarget *target, JBToolchain *tc, const char *source, const char *output) {
-    const char **asflags = target->asflags;
-    const char **include_paths = target->include_paths;
+    JBNullArrayFor(target->libraries) {
+        JBLibrary *lib = target->libraries[index];
 
-    char *triplet = jb_get_triple(tc);
+        JB_ASSERT(lib->toolchain == target->toolchain, "mismatch in toolchains used to build library %s and target %s", lib->name, target->name);
 
-    JB_ASSERT(tc->cc, "Toolchain (%s) missing assembler", triplet);
+        JBVectorPush(&library_jobs, _jb_schedule_target(pool, graph, (JBTarget *)lib, 1));
+    }
 
-    char **deps = _jb_get_dependencies_asm(tc, tc->cc, source, asflags, include_paths);
+    _jb_init_build(target->build_folder, node->object_folder);
 
-    JB_ASSERT(deps, "couldn't compute dependenices for %s", source);
+    node->object_files = _jb_target_object_files(target, node->tc, node->object_folder);
+    node->link = _jb_job_create(pool, _jb_link_target_job, node);
 
-    int needs_build = 0;
-    JBNullArrayFor(deps) {
-        if (jb_file_is_newer(deps[index], output)) {
-            needs_build = 1;
-            break;
-        }
+    JBArrayForEach(&library_jobs) {
+        _jb_job_depends_on(pool, node->link, *it);
     }
 
-    free(deps);
-
-    if (!needs_build)
-        return;
-
-    JB_LOG("compile %s\n", source);
+    free(library_jobs.data);
 
-    JBVector(char *) cmd = {0};
+    int pch_languages = _jb_precompiled_header_languages(target);
 
-    JBVectorPush(&cmd, tc->cc);
+    for (int is_cxx = 0; is_cxx < 2; is_cxx++) {
+        if (!(pch_languages & (1 << is_cxx)))
+            continue;
 
-    if (triplet && strstr(tc->cc, "clang") != NULL) {
-        JBVectorPush(&cmd, "-target");
-        JBVectorPush(&cmd, triplet);
+        _JBPrecompiledHeaderJob *pch = &node->pch[is_cxx];
+        pch->target = target;
+        pch->tc = node->tc;
+        pch->is_cxx = is_cxx;
 
-        // JBVectorPush(&cmd, "--rtlib=compiler-rt");
+        node->pch_jobs[is_cxx] = _jb_job_pool_submit(pool, _jb_precompiled_header_job, pch);
+        _jb_job_depends_on(pool, node->link, node->pch_jobs[is_cxx]);
     }
 
-    if (tc->sysroot) {
-        // TODO check if Apple LD or GNU LD
-        // JBVectorPush(&cmd, "-syslibroot");
-        JBVectorPush(&cmd, "--sysroot");
-        JBVectorPush(&cmd, tc->sysroot);
-    }
+    if (_jb_unity_enabled(target)) {
+        node->unity = _jb_unity_plan(target, node->tc, node->object_folder, 1);
 
-    JBNullArrayFor(asflags) {
-        JBVectorPush(&cmd, (char *)asflags[index]);
-    }
+        // object_files lists the singles' objects first, then one per batch
+        size_t single_count = node->unity.singles.count;
+        node->compiles = malloc(sizeof(_JBCompileJob) * (single_count + 1));
+        node->unity_jobs = malloc(sizeof(_JBUnityJob) * (node->unity.batches.count + 1));
 
-    JBNullArrayFor(include_paths) {
-        JBVectorPush(&cmd, "-I");
-        JBVectorPush(&cmd, (char *)include_paths[index]);
-    }
+        for (size_t i = 0; i < single_count; i++) {
+            _JBCompileJob *compile = &node->compiles[i];
+            compile->target = target;
+            compile->tc = node->tc;
+            compile->source = node->unity.singles.data[i];
+            compile->object = node->object_files[i];
 
-    JBVectorPush(&cmd, "-o");
-    JBVectorPush(&cmd, (char *)output);
-    JBVectorPush(&cmd, "-c");
-    JBVectorPush(&cmd, (char *)source);
+            _jb_schedule_source(pool, node, compile);
+        }
 
-    JBVectorPush(&cmd, NULL);
-    jb_run(cmd.data, __FILE__, __LINE__);
+        for (size_t i = 0; i < node->unity.batches.count; i++) {
+            _JBUnityBatch *batch = &node->unity.batches.data[i];
+            _JBUnityJob *job = &node->unity_jobs[i];
+            job->compile.target = target;
+            job->compile.tc = node->tc;
+            job->compile.source = batch->source;
+            job->compile.object = batch->object;
+            job->members = batch->members;
+            job->object_folder = node->object_folder;
+            job->fell_back = 0;
+
+            _jb_schedule_compile(pool, node, _jb_unity_compile_job, job);
+        }
+    }
+    else {
+        int object_count = jb_string_array_count((char **)target->sources);
+        node->compiles = malloc(sizeof(_JBCompileJob) * (object_count + 1));
 
-    free(cmd.data);
+        for (int i = 0; i < object_count; i++) {
+            _JBCompileJob *compile = &node->compiles[i];
+            compile->target = target;
+            compile->tc = node->tc;
+            compile->source = target->sources[i];
+            compile->object = node->object_files[i];
 
-    free(triplet);
-}
+            _jb_schedule_source(pool, node, compile);
+        }
+    }
 
-int _jb_supported_source_ext(const char *ext) {
-    return strcmp(ext, "c") == 0 || strcmp(ext, "cpp") == 0
-        || strcmp(ext, "m") == 0 || strcmp(ext, "mm") == 0
-        || strcmp(ext, "s") == 0;
+    _jb_schedule_link(pool, node);
+    return node->link;
 }
 
-void _jb_init_build(const char *build_folder, const char *object_folder)  {
-    jb_mkdir(build_folder);
-    jb_mkdir(object_folder);
-}
+typedef struct {
+    const char *header;
+    int objects; // how many of the target's objects include it
+    uint64_t size;
+} _JBHeaderUse;
 
-char **_jb_collect_objects(JBTarget *target, JBToolchain *tc, const char *object_folder) {
-    const char **sources = target->sources;
-    int is_msvc = (tc->triple.vendor == JB_ENUM(Windows));
+int _jb_header_use_compare(const void *a, const void *b) {
+    const _JBHeaderUse *lhs = (const _JBHeaderUse *)a;
+    const _JBHeaderUse *rhs = (const _JBHeaderUse *)b;
 
-    JBVector(char *) object_files = {0};
+    // parsing saved by precompiling: every object that includes it reads all of it
+    uint64_t lhs_saved = lhs->size * lhs->objects;
+    uint64_t rhs_saved = rhs->size * rhs->objects;
 
-    JBNullArrayFor(sources) {
-        const char *filename = jb_filename(sources[index]);
+    if (lhs_saved != rhs_saved)
+        return lhs_saved < rhs_saved ? 1 : -1;
 
-        const char *ext = jb_extension(sources[index]);
+    return strcmp(lhs->header, rhs->header);
+}
 
-        JB_ASSERT(ext && _jb_supported_source_ext(ext), "unsupported file type: %s", ext ? ext : "unknown");
+// Prints the headers that at least half of node's objects were recorded to include.
+void _jb_suggest_precompiled_header(_JBTargetNode *node) {
+    _JBBuildDB *db = _jb_build_db_for(node->target->build_folder);
 
-        const char *o_ext = "o";
-        if (is_msvc)
-            o_ext = "obj";
+    JBVector(_JBHeaderUse) uses = {0};
+    _JBStringMap index_of = {0}; // header -> index in uses + 1
+    int object_count = 0;
 
-        char *object = jb_format_string("%s%.*s%s", object_folder, strlen(filename)-strlen(ext), filename, o_ext);
+    JBNullArrayFor(node->object_files) {
+        const char **deps = _jb_build_db_lookup(db, node->object_files[index], NULL, NULL);
 
-        if (strcmp(ext, "c") == 0 || strcmp(ext, "m") == 0)
-            jb_compile_c(target, tc, sources[index], object);
-        else if (strcmp(ext, "cpp") == 0 || strcmp(ext, "mm") == 0)
-            jb_compile_cxx(target, tc, sources[index], object);
-        else if (strcmp(ext, "s") == 0)
-            jb_compile_asm(target, tc, sources[index], object);
+        if (!deps)
+            continue;
 
-        JBVectorPush(&object_files, object);
-    }
+        object_count += 1;
 
-    JBVectorPush(&object_files, NULL);
+        for (int i = 0; deps[i]; i++) {
+            const char *ext = jb_extension(deps[i]);
 
-    return object_files.data;
-}
+            // sources, generated unity sources and precompiled headers themselves
+            if (ext && (_jb_supported_source_ext(ext) || strcmp(ext, "gch") == 0 || strcmp(ext, "pch") == 0))
+                continue;
 
-int _jb_target_has_cpp_source(JBTarget *target) {
-    const char **sources = target->sources;
+            size_t use = (uintptr_t)_jb_string_map_get(&index_of, deps[i]);
 
-    JBNullArrayFor(sources) {
-        const char *ext = jb_extension(sources[index]);
+            if (!use) {
+                _JBHeaderUse header = { deps[i], 0, _jb_file_stat(deps[i]).size };
+                JBVectorPush(&uses, header);
 
-        JB_ASSERT(ext && _jb_supported_source_ext(ext), "unsupported file type: %s", ext ? ext : "unknown");
+                use = uses.count;
+                _jb_string_map_put(&index_of, deps[i], (void *)(uintptr_t)use);
+            }
 
-        if (strcmp(ext, "cpp") == 0 || strcmp(ext, "mm") == 0) {
-            return 1;
+            uses.data[use - 1].objects += 1;
         }
-    }
-
-    JBNullArrayFor(target->libraries) {
-        JBLibrary *lib = target->libraries[index];
 
-        if (_jb_target_has_cpp_source((JBTarget *)lib))
-            return 1;
+        free(deps);
     }
 
-    return 0;
-}
-
-char *_jb_get_link_command(JBToolchain *tc, JBTarget *target) {
-    int is_msvc = (tc->triple.vendor == JB_ENUM(Windows));
-
-    if (is_msvc)
-        return tc->ld;
+    if (uses.count)
+        qsort(uses.data, uses.count, sizeof(_JBHeaderUse), _jb_header_use_compare);
 
-    char *link_command = tc->cc;
+    JB_LOG("precompiled header candidates for %s (%d objects):\n", node->target->name, object_count);
 
-    if (_jb_target_has_cpp_source(target))
-        link_command = tc->cxx;
+    int shown = 0;
 
-    return link_command;
-}
+    JBArrayForEach(&uses) {
+        if (it->objects * 2 < object_count || shown == 20)
+            continue;
 
-int _jb_need_to_build_target(const char *target, char **object_files) {
-    JBNullArrayFor(object_files) {
-        if (jb_file_is_newer(object_files[index], target)) {
-            return 1;
-        }
+        jb_log_print("#include \"%s\" // %d objects, %llu bytes\n", it->header, it->objects, (unsigned long long)it->size);
+        shown += 1;
     }
 
-    return 0;
-}
+    if (!shown)
+        jb_log_print("(none: no header is included by half of the objects)\n");
 
-char **_jb_get_library_objects(JBLibrary *target);
+    _jb_string_map_free(&index_of);
+    free(uses.data);
+}
 
-void _jb_link_shared(JBToolchain *tc, const char *link_command, const char **ldflags, const char **frameworks, char *output_exec, char **object_files, JBLibrary **libs, const char **system_libs, int is_lib) {
+void _jb_build_target(JBTarget *target, int is_lib) {
+    _JBJobPool *pool = _jb_get_job_pool();
+    _JBTargetGraph graph = {0};
 
-    char *triplet = jb_get_triple(tc);
-    int is_msvc = (tc->triple.vendor == JB_ENUM(Windows));
+    _jb_stat_cache_begin();
 
-    JB_LOG("link %s\n", output_exec);
+#if !JB_IS_WINDOWS
+    // the pool's threads are idle between builds
+    if (_jb_target_uses_lto(target))
+        _jb_lto_jobserver_start();
+#endif
 
-    JBVector(char *) cmd = {0};
+    _jb_schedule_target(pool, &graph, target, is_lib);
+    _jb_job_pool_wait(pool);
 
-    JBVectorPush(&cmd, (char *)link_command);
+    _jb_build_db_save_all();
 
-    if (is_msvc) {
-        JBVectorPush(&cmd, "/nologo");
+    JBArrayForEach(&graph) {
+        if (_jb_suggest_pch)
+            _jb_suggest_precompiled_header(*it);
     }
 
-    if (strstr(link_command, "clang") != NULL) {
-        JBVectorPush(&cmd, "-fuse-ld=lld");
-    }
+    _jb_stat_cache_end();
 
-    // TODO triplet is always non-NULL here now. Either we always specify the target triple, or we get smarter about
-    // wether toolchain is the system toolchain, or a cross-toolchain.
-    if (triplet && strstr(link_command, "clang") != NULL) {
-        JBVectorPush(&cmd, "-target");
-        JBVectorPush(&cmd, triplet);
+    JBArrayForEach(&graph) {
+        _JBTargetNode *node = *it;
 
-        JBVectorPush(&cmd, "--rtlib=compiler-rt");
-    }
+        if (node->is_lib)
+            ((JBLibrary *)node->target)->flags |= _JB_LIBRARY_JUST_BUILT;
 
-    if (tc->sysroot) {
-        // TODO check if Apple LD or GNU LD
-        // JBVectorPush(&cmd, "-syslibroot");
-        JBVectorPush(&cmd, "--sysroot");
-        JBVectorPush(&cmd, tc->sysroot);
-    }
+        JBNullArrayFor(node->object_files) {
+            free(node->object_files[index]);
+        }
 
-    if (is_lib) {
-        JBVectorPush(&cmd, "-shared");
-    }
+        free(node->object_files);
+        free(node->object_folder);
+        free(node->compiles);
+        free(node->unity_jobs);
+        _jb_unity_plan_free(&node->unity);
 
-    if (is_msvc) {
-        // TODO check if cl.exe or link.exe is linker
+        JBArrayForEach(&node->modules) {
+            _jb_module_scan_free(&it->scan);
+            free(it->bmi);
+            free(it->flags.data);
+            free(it->bmis.data);
 
-        // cl.exe
-        // JBVectorPush(&cmd, "/Fe:");
-        // JBVectorPush(&cmd, output_exec); // Leak
+            for (size_t i = 0; i < it->owned.count; i++)
+                free(it->owned.data[i]);
 
-        // link.exe
-        JBVectorPush(&cmd, jb_format_string("/OUT:%s", output_exec)); // Leak
-    }
-    else {
-        JBVectorPush(&cmd, "-o");
-        JBVectorPush(&cmd, output_exec); // Leak
-    }
+            free(it->owned.data);
+        }
 
-    JBNullArrayFor(object_files) {
-        JBVectorPush(&cmd, object_files[index]);
+        free(node->modules.data);
+        free(node->modules_folder);
+        free(node);
     }
 
-    // JBVectorPush(&cmd, "-L/usr/local/lib");
+    free(graph.data);
+}
 
-    // if (tc->triple.runtime == JB_ENUM(Darwin)) {
-    //     JBVectorPush(&cmd, "-lSystem");
-    // }
-    // else if (tc->triple.runtime == JB_ENUM(GNU)) {
-    //     JBVectorPush(&cmd, "-lc");
-    // }
+void jb_build_exe(JBExecutable *exec) {
+    _jb_build_target((JBTarget *)exec, 0);
+}
 
-#if JB_IS_LINUX
-    // TODO more robust detection for gnu-ld and target-triple + toolchain
-    if (strstr(link_command, "gcc")) {
-        JBVectorPush(&cmd, "-Wl,--start-group");
-    }
-    else if(strstr(link_command, "ld")) {
-        JBVectorPush(&cmd, "---start-group");
-    }
-#endif
+void jb_build_lib(JBLibrary *target) {
+    _jb_build_target((JBTarget *)target, 1);
+}
 
-    JBNullArrayFor(ldflags) {
-        JBVectorPush(&cmd, (char *)ldflags[index]);
-    }
+#if JB_IS_WINDOWS
+
+void jb_build_exe_pgo(JBExecutable *exec, const char *train) {
+    JB_LOG("profile-guided optimization isn't available on Windows, building %s without a profile\n", exec->name);
+    jb_build_exe(exec);
+}
+
+#else
 
-    JBNullArrayFor(libs) {
-        JBLibrary *lib = libs[index];
+// Paths of the files in folder whose names end in suffix
+char **_jb_list_files(const char *folder, const char *suffix) {
+    JBVector(char *) paths = {0};
 
-        // Leak
-        if (lib->flags & JB_LIBRARY_USE_OBJECTS) {
-            char **object_files = _jb_get_library_objects(lib); // Leak
+    DIR *dir = opendir(folder);
 
-            JBNullArrayFor(object_files) {
-                char *obj = object_files[index];
+    if (dir) {
+        struct dirent *entry;
 
-                JBVectorPush(&cmd, obj);
-            }
-        }
-        else {
-            if (is_msvc) {
-                JBVectorPush(&cmd, jb_format_string("/LIBPATH:%s", lib->build_folder));
-                JBVectorPush(&cmd, jb_format_string("%s.lib", lib->name));
-            }
-            else {
-                JBVectorPush(&cmd, jb_format_string("-L%s", lib->build_folder));
-                JBVectorPush(&cmd, jb_format_string("-l%s", lib->name));
+        while ((entry = readdir(dir))) {
+            size_t len = strlen(entry->d_name);
+
+            if (len > strlen(suffix) && strcmp(entry->d_name + len - strlen(suffix), suffix) == 0) {
+                JBVectorPush(&paths, jb_format_string("%s/%s", folder, entry->d_name));
             }
         }
+
+        closedir(dir);
     }
 
-    JBNullArrayFor(system_libs) {
-        const char *lib = system_libs[index];
+    JBVectorPush(&paths, NULL);
+    return paths.data;
+}
 
-        // Leak
-        if (is_msvc) {
-            JBVectorPush(&cmd, jb_format_string("%s.lib", lib));
-        }
-        else {
-            JBVectorPush(&cmd, jb_format_string("-l%s", lib));
-        }
-    }
+// flags followed by extra, in a new array
+const char **_jb_flags_with(const char **flags, const char **extra) {
+    JBVector(const char *) out = {0};
 
-#if JB_IS_LINUX
-    // TODO more robust detection for gnu-ld and target-triple + toolchain
-    if (strstr(link_command, "gcc")) {
-        JBVectorPush(&cmd, "-Wl,--end-group");
+    JBNullArrayFor(flags) {
+        JBVectorPush(&out, flags[index]);
     }
-    else if(strstr(link_command, "ld")) {
-        JBVectorPush(&cmd, "---end-group");
+
+    JBNullArrayFor(extra) {
+        JBVectorPush(&out, extra[index]);
     }
-#endif
 
-    if (tc->triple.vendor == JB_ENUM(Apple)) {
-        JBNullArrayFor(frameworks) {
-            JBVectorPush(&cmd, "-framework");
-            JBVectorPush(&cmd, (char *)frameworks[index]);
+    JBVectorPush(&out, NULL);
+    return out.data;
+}
+
+// What a profile collected from exec depends on: the compiler, flags and list of sources,
+// and the contents of inputs (the sources and headers the instrumented objects were
+// compiled from).
+uint64_t _jb_profile_inputs_hash(JBExecutable *exec, const char *tool, char **inputs) {
+    uint64_t hash = _jb_hash_string(tool);
+
+    const char **lists[] = { exec->sources, exec->cflags, exec->cxxflags, exec->include_paths };
+
+    for (size_t i = 0; i < sizeof(lists) / sizeof(lists[0]); i++) {
+        JBNullArrayFor(lists[i]) {
+            hash = _jb_hash_combine(hash, _jb_hash_string(lists[i][index]));
         }
+
+        hash = _jb_hash_combine(hash, i);
     }
 
-    JBVectorPush(&cmd, NULL);
-    jb_run(cmd.data, __FILE__, __LINE__);
+    JBNullArrayFor(inputs) {
+        int ok = 0;
+        uint64_t contents = _jb_hash_file(inputs[index], &ok);
 
-    free(cmd.data);
+        hash = _jb_hash_combine(hash, _jb_hash_string(inputs[index]));
+        hash = _jb_hash_combine(hash, ok ? contents : 0);
+    }
+
+    return hash;
 }
 
-char *_jb_library_output_file(JBLibrary *target);
+// The sources and headers instrumented's objects were compiled from, leaving out the
+// files generated in build_folder.
+char **_jb_profile_inputs(JBExecutable *instrumented, JBToolchain *tc, const char *build_folder) {
+    char *object_folder = jb_concat(instrumented->build_folder, "/object/");
+    char **objects = _jb_target_object_files((JBTarget *)instrumented, tc, object_folder);
 
-void jb_build_exe(JBExecutable *exec) {
-    char *object_folder = jb_concat(exec->build_folder, "/object/");
+    _JBBuildDB *db = _jb_build_db_for(instrumented->build_folder);
 
-    JBToolchain *tc = exec->toolchain ? exec->toolchain : jb_native_toolchain();
+    size_t build_folder_len = strlen(build_folder);
 
-    JBNullArrayFor(exec->libraries) {
-        JBLibrary *lib = exec->libraries[index];
+    _JBStringMap seen = {0};
+    JBVector(char *) inputs = {0};
+
+    JBNullArrayFor(objects) {
+        const char **deps = _jb_build_db_lookup(db, objects[index], NULL, NULL);
+
+        for (size_t i = 0; deps && deps[i]; i++) {
+            if (strncmp(deps[i], build_folder, build_folder_len) == 0 && deps[i][build_folder_len] == JB_PATH_SEPARATOR)
+                continue;
 
-        JB_ASSERT(lib->toolchain == exec->toolchain, "mismatch in toolchains used to build library %s and target %s", lib->name, exec->name);
+            if (_jb_string_map_get(&seen, deps[i]))
+                continue;
+
+            char *input = jb_copy_string(deps[i]);
+            _jb_string_map_put(&seen, input, input);
+            JBVectorPush(&inputs, input);
+        }
 
-        // TODO link directly against library objects to save some steps
-        jb_build_lib(lib);
+        free(deps);
     }
 
-    _jb_init_build(exec->build_folder, object_folder);
+    _jb_string_map_free(&seen);
+    _jb_free_string_array(objects);
+    free(object_folder);
 
-    char **object_files = _jb_collect_objects((JBTarget *)exec, tc, object_folder);
+    JBVectorPush(&inputs, NULL);
+    return inputs.data;
+}
 
-    char *link_command = _jb_get_link_command(tc, (JBTarget *)exec);
+// Whether the profile stamp describes was collected from exec as it is now: 0 when there's
+// no profile, 1 when it's out of date and 2 when it's current.
+// The stamp is "josh-pgo <hash>" followed by the inputs the hash covers, one per line.
+int _jb_profile_state(JBExecutable *exec, const char *tool, const char *stamp) {
+    size_t len = 0;
+    char *text = _jb_read_file(stamp, &len);
 
-    int is_msvc = (tc->triple.vendor == JB_ENUM(Windows));
-    char *output_exec = jb_format_string("%s/%s%s", exec->build_folder, exec->name, is_msvc ? ".exe" : "");
+    if (!text)
+        return 0;
 
-    int needs_build = 0;
+    unsigned long long recorded = 0;
+    char *line = strchr(text, '\n');
 
-    JBNullArrayFor(exec->libraries) {
-        JBLibrary *lib = exec->libraries[index];
-        char *lib_output_exe = _jb_library_output_file(lib);
+    if (!line || sscanf(text, "josh-pgo %llx", &recorded) != 1) {
+        free(text);
+        return 0;
+    }
 
-        if (jb_file_is_newer(lib_output_exe, output_exec)) {
-            free(lib_output_exe);
-            needs_build = 1;
-            break;
+    JBVector(char *) inputs = {0};
+
+    for (line += 1; *line;) {
+        char *end = strchr(line, '\n');
+
+        if (end)
+            *end = 0;
+
+        if (*line) {
+            JBVectorPush(&inputs, line);
         }
 
-        free(lib_output_exe);
+        line = end ? end + 1 : line + strlen(line);
     }
 
-    if (!needs_build)
-        needs_build = _jb_need_to_build_target(output_exec, object_files);
+    JBVectorPush(&inputs, NULL);
 
-    if (needs_build) {
-        _jb_link_shared(tc, link_command, exec->ldflags, exec->frameworks, output_exec, object_files, exec->libraries, exec->system_libraries, 0);
-    }
+    int state = _jb_profile_inputs_hash(exec, tool, inputs.data) == recorded ? 2 : 1;
 
-    JBNullArrayFor(object_files)
-        free(object_files[index]);
+    free(inputs.data);
+    free(text);
 
-    free(object_files);
-    free(object_folder);
-    free(output_exec);
+    return state;
 }
 
-const char *_jb_lib_prefix(JBTriple triple) {
-    switch (triple.vendor) {
-    case JB_ENUM(Apple):
-    case JB_ENUM(Linux):
-        return "lib";
-    case JB_ENUM(Windows):
-    default:
-        return "";
+// Moves from over to, unless to already has the same contents; then from is removed.
+void _jb_replace_if_changed(const char *from, const char *to) {
+    int from_ok = 0;
+    int to_ok = 0;
+    uint64_t from_hash = _jb_hash_file(from, &from_ok);
+    uint64_t to_hash = _jb_hash_file(to, &to_ok);
+
+    if (from_ok && to_ok && from_hash == to_hash) {
+        remove(from);
+        return;
     }
 
-    return "";
+    JB_ASSERT(rename(from, to) == 0, "could not replace %s", to);
+    _jb_stat_invalidate(to);
 }
 
-const char *_jb_lib_suffix(JBTriple triple, int flags) {
-    if (flags & JB_LIBRARY_SHARED) {
-        switch (triple.vendor) {
-            case JB_ENUM(Apple):
-                return "dylib";
-            case JB_ENUM(Linux):
-                return "so";
-            case JB_ENUM(Windows):
-                return "dll";
-            default:
-                return "";
-        }
+// Builds exec instrumented, runs train and leaves what it recorded in profile_folder, then
+// writes stamp.
+void _jb_collect_profile(JBExecutable *exec, JBToolchain *tc, const char *tool, const char *train, const char *profile_folder, const char *stamp) {
+    int is_clang = strstr(tool, "clang") != NULL;
+    const char *raw_ext = is_clang ? ".profraw" : ".gcda";
+
+    char *folder = jb_format_string("%s/pgo-instrumented", exec->build_folder);
+    char *object_folder = jb_concat(folder, "/object/");
+    char *raw_folder = jb_concat(folder, "/profile");
+
+    jb_mkdir(object_folder);
+    jb_mkdir(raw_folder);
+
+    char *full_object_folder = jb_file_fullpath(object_folder);
+    char *full_raw_folder = jb_file_fullpath(raw_folder);
+
+    // where the training run writes its counters
+    char *raw_profile_folder = is_clang ? jb_copy_string(raw_folder) : _jb_gcc_profile_folder(raw_folder, object_folder);
+
+    // counters are added to what an earlier training run left
+    char **stale = _jb_list_files(raw_profile_folder, raw_ext);
+
+    JBNullArrayFor(stale) {
+        remove(stale[index]);
+    }
+
+    _jb_free_string_array(stale);
+
+    JBVector(char *) owned = {0};
+    JBVector(const char *) compile_flags = {0};
+    JBVector(const char *) link_flags = {0};
+
+    if (is_clang) {
+        // %m: every run of the executable adds up its counters in the same file
+        char *generate = jb_format_string("-fprofile-instr-generate=%s/%%m.profraw", full_raw_folder);
+
+        JBVectorPush(&owned, generate);
+        JBVectorPush(&compile_flags, generate);
+        JBVectorPush(&link_flags, generate);
     }
     else {
-        switch (triple.vendor) {
-            case JB_ENUM(Apple):
-            case JB_ENUM(Linux):
-                return "a";
-            case JB_ENUM(Windows):
-                return "lib";
-            default:
-                return "";
-        }
+        char *generate = jb_format_string("-fprofile-generate=%s", full_raw_folder);
+
+        // names each .gcda after its object's path below the object folder, which is the
+        // name the optimized build of the same object looks for
+        char *prefix = jb_format_string("-fprofile-prefix-path=%s", full_object_folder);
+
+        JBVectorPush(&owned, generate);
+        JBVectorPush(&owned, prefix);
+        JBVectorPush(&compile_flags, generate);
+        JBVectorPush(&compile_flags, prefix);
+        JBVectorPush(&compile_flags, "-fprofile-update=prefer-atomic");
+        JBVectorPush(&link_flags, generate);
     }
 
-    return "";
-}
+    JBVectorPush(&compile_flags, NULL);
+    JBVectorPush(&link_flags, NULL);
 
-char *_jb_library_output_file(JBLibrary *target) {
-    JBToolchain *tc = target->toolchain ? target->toolchain : jb_native_toolchain();
-    char *output_exec = jb_format_string("%s/%s%s.%s", target->build_folder, _jb_lib_prefix(tc->triple), target->name, _jb_lib_suffix(tc->triple, target->flags));
-    return output_exec;
-}
+    JBExecutable instrumented = *exec;
+    instrumented.build_folder = folder;
+    instrumented.cflags = _jb_flags_with(exec->cflags, compile_flags.data);
+    instrumented.cxxflags = _jb_flags_with(exec->cxxflags, compile_flags.data);
+    instrumented.ldflags = _jb_flags_with(exec->ldflags, link_flags.data);
+    instrumented.lto = JB_ENUM(NoLTO); // the profile doesn't depend on it
+    instrumented.profile_folder = NULL;
 
-char **_jb_get_library_objects(JBLibrary *target) {
-    char *object_folder = jb_concat(target->build_folder, "/object/");
+    jb_build_exe(&instrumented);
 
-    JBToolchain *tc = target->toolchain ? target->toolchain : jb_native_toolchain();
-    char **object_files = _jb_collect_objects((JBTarget *)target, tc, object_folder);
+    char *exe = jb_format_string("%s/%s", folder, exec->name);
+    char *full_exe = jb_file_fullpath(exe);
 
-    free(object_folder);
-    return object_files;
-}
+    JB_LOG("train %s\n", exec->name);
 
-void jb_build_lib(JBLibrary *target) {
-    if (target->flags & _JB_LIBRARY_JUST_BUILT)
-        return;
+    setenv("JOSH_PGO_EXE", full_exe, 1);
+    jb_run_string(train, NULL, __FILE__, __LINE__);
+    unsetenv("JOSH_PGO_EXE");
 
-    char *object_folder = jb_concat(target->build_folder, "/object/");
+    char **raw = _jb_list_files(raw_profile_folder, raw_ext);
+    JB_ASSERT(raw[0], "training %s didn't write a profile to %s", exec->name, raw_profile_folder);
 
-    JBToolchain *tc = target->toolchain ? target->toolchain : jb_native_toolchain();
+    jb_mkdir(profile_folder);
 
-    JBNullArrayFor(target->libraries) {
-        JBLibrary *lib = target->libraries[index];
+    // Objects depend on their profile, so it's only replaced when it changed.
+    if (is_clang) {
+        char *profdata = jb_format_string("%s/%s.profdata", profile_folder, exec->name);
+        char *merged = jb_format_string("%s.tmp", profdata);
+        char *profdata_tool = _jb_llvm_tool(tool, "llvm-profdata");
 
-        JB_ASSERT(lib->toolchain == target->toolchain, "mismatch in toolchains used to build library %s and target %s", lib->name, target->name);
+        _JBCommandVector cmd = {0};
+        JBVectorPush(&cmd, profdata_tool);
+        JBVectorPush(&cmd, "merge");
+        JBVectorPush(&cmd, "-o");
+        JBVectorPush(&cmd, merged);
+
+        JBNullArrayFor(raw) {
+            JBVectorPush(&cmd, raw[index]);
+        }
+
+        JBVectorPush(&cmd, NULL);
+
+        JB_LOG("merge profile %s\n", profdata);
+        jb_run(cmd.data, __FILE__, __LINE__);
+
+        _jb_replace_if_changed(merged, profdata);
 
-        // TODO link directly against library objects to save some steps
-        jb_build_lib(lib);
+        free(cmd.data);
+        free(profdata_tool);
+        free(merged);
+        free(profdata);
     }
+    else {
+        // each .gcda goes where the optimized build's object of the same name looks for it
+        char *optimized_object_folder = jb_concat(exec->build_folder, "/object/");
+        char *optimized_profile_folder = _jb_gcc_profile_folder(profile_folder, optimized_object_folder);
 
-    _jb_init_build(target->build_folder, object_folder);
+        jb_mkdir(optimized_profile_folder);
 
-    char **object_files = _jb_collect_objects((JBTarget *)target, tc, object_folder);
+        // libgcov already added up the counters of every run; objects that are no longer
+        // built shouldn't keep their old profile
+        char **old = _jb_list_files(optimized_profile_folder, ".gcda");
 
-    char *link_command = _jb_get_link_command(tc, (JBTarget *)target);
+        JBNullArrayFor(old) {
+            int kept = 0;
 
-    char *output_exec = _jb_library_output_file(target);
+            for (size_t i = 0; raw[i] && !kept; i++)
+                kept = strcmp(jb_filename(raw[i]), jb_filename(old[index])) == 0;
 
-    int needs_build = 0;
+            if (!kept) {
+                remove(old[index]);
+                _jb_stat_invalidate(old[index]);
+            }
+        }
 
-    JBNullArrayFor(target->libraries) {
-        JBLibrary *lib = target->libraries[index];
-        char *lib_output_exe = _jb_library_output_file(lib);
+        _jb_free_string_array(old);
 
-        if (jb_file_is_newer(lib_output_exe, output_exec)) {
-            free(lib_output_exe);
-            needs_build = 1;
-            break;
+        JBNullArrayFor(raw) {
+            char *profile = jb_format_string("%s/%s", optimized_profile_folder, jb_filename(raw[index]));
+            char *copy = jb_format_string("%s.tmp", profile);
+
+            jb_copy_file(raw[index], copy);
+            _jb_replace_if_changed(copy, profile);
+
+            free(copy);
+            free(profile);
         }
 
-        free(lib_output_exe);
+        free(optimized_profile_folder);
+        free(optimized_object_folder);
     }
 
-    if (!needs_build)
-        needs_build = _jb_need_to_build_target(output_exec, object_files);
+    char **inputs = _jb_profile_inputs(&instrumented, tc, exec->build_folder);
 
-    if (needs_build) {
-        if (target->flags & JB_LIBRARY_SHARED) {
-            _jb_link_shared(tc, link_command, target->ldflags, target->frameworks, output_exec, object_files, target->libraries, target->system_libraries, 1);
-        }
-        else {
-            char *triplet = jb_get_triple(tc);
-            int is_msvc = (tc->triple.vendor == JB_ENUM(Windows));
+    JBStringBuilder sb;
+    jb_sb_init(&sb);
 
-            JB_ASSERT(tc->ar, "Toolchain (%s) missing AR", triplet);
+    char *header = jb_format_string("josh-pgo %016llx\n", (unsigned long long)_jb_profile_inputs_hash(exec, tool, inputs));
+    jb_sb_puts(&sb, header);
 
-            JB_LOG("built %s\n", output_exec);
+    JBNullArrayFor(inputs) {
+        jb_sb_puts(&sb, inputs[index]);
+        jb_sb_putchar(&sb, '\n');
+    }
 
-            JBVector(char *) cmd = {0};
+    char *text = jb_sb_to_string(&sb);
+    _jb_write_file_if_changed(stamp, text);
 
-            JBVectorPush(&cmd, tc->ar);
+    free(text);
+    free(header);
+    jb_sb_free(&sb);
+    _jb_free_string_array(inputs);
+    _jb_free_string_array(raw);
 
-            if (is_msvc) {
-                JBVectorPush(&cmd, "/nologo");
-                JBVectorPush(&cmd, jb_format_string("/OUT:%s", output_exec)); // Leak
-            }
-            else {
-                JBVectorPush(&cmd, "rcs");
-                JBVectorPush(&cmd, output_exec);
-            }
+    JBArrayForEach(&owned) {
+        free(*it);
+    }
 
-            JBNullArrayFor(object_files) {
-                JBVectorPush(&cmd, object_files[index]);
-            }
+    free(owned.data);
+    free(compile_flags.data);
+    free(link_flags.data);
+    free((void *)instrumented.cflags);
+    free((void *)instrumented.cxxflags);
+    free((void *)instrumented.ldflags);
+    free(full_exe);
+    free(exe);
+    free(full_raw_folder);
+    free(raw_profile_folder);
+    free(full_object_folder);
+    free(raw_folder);
+    free(object_folder);
+    free(folder);
+}
 
-            JBVectorPush(&cmd, NULL);
-            jb_run(cmd.data, __FILE__, __LINE__);
-            free(cmd.data);
+void jb_build_exe_pgo(JBExecutable *exec, const char *train) {
+    JBToolchain *tc = exec->toolchain ? exec->toolchain : jb_native_toolchain();
 
-            free(triplet);
-        }
+    if (tc->triple.vendor == JB_ENUM(Windows)) {
+        JB_LOG("profile-guided optimization isn't available with MSVC, building %s without a profile\n", exec->name);
+        jb_build_exe(exec);
+        return;
     }
 
-    target->flags |= _JB_LIBRARY_JUST_BUILT;
+    const char *tool = _jb_get_link_command(tc, (JBTarget *)exec);
 
-    JBNullArrayFor(object_files) {
-        free(object_files[index]);
+    char *profile_folder = exec->profile_folder ? jb_copy_string(exec->profile_folder) : jb_format_string("%s/pgo-profile", exec->build_folder);
+    char *stamp = jb_format_string("%s/%s.josh-pgo", profile_folder, exec->name);
+
+    int state = _jb_profile_state(exec, tool, stamp);
+
+    if (state && strstr(tool, "clang")) {
+        char *profdata = jb_format_string("%s/%s.profdata", profile_folder, exec->name);
+
+        if (!jb_file_exists(profdata))
+            state = 0;
+
+        free(profdata);
     }
 
-    free(object_files);
-    free(object_folder);
-    free(output_exec);
+    enum JBProfileMode mode = _jb_profile_mode_get();
+
+    if (state == 1 && mode == JB_ENUM(ProfileReuse)) {
+        JB_LOG("reusing the out of date profile of %s\n", exec->name);
+    }
+    else if (state != 2 || mode == JB_ENUM(ProfileTrain)) {
+        if (state == 1)
+            JB_LOG("profile of %s is out of date\n", exec->name);
+
+        _jb_collect_profile(exec, tc, tool, train, profile_folder, stamp);
+    }
+
+    JBExecutable optimized = *exec;
+    optimized.profile_folder = profile_folder;
+
+    jb_build_exe(&optimized);
+
+    free(stamp);
+    free(profile_folder);
 }
 
+#endif
+
 #if JB_IS_WINDOWS
 
 char *_jb_convert_path_slashes(const char *path) {
@@ -2254,37 +10689,20 @@ char *jb_getcwd() {
     return output;
 }
 
-FILETIME _jb_get_last_mod_time(const char *path) {
-    if (!jb_file_exists(path))
-        return (FILETIME){0};
+_JBFileStat _jb_stat_uncached(const char *path) {
+    _JBFileStat out = {0};
 
     path = _jb_unconvert_path_slashes(path);
-    HANDLE file = CreateFileA(path, 0, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
-    free((char *)path);
-
-    if (file == INVALID_HANDLE_VALUE) {
-        return (FILETIME){0};
-    }
 
-    FILETIME last_write = {};
-    if (!GetFileTime(file, NULL, NULL, &last_write)) {
-        jb_log("GetFileTime failed\n");
-        CloseHandle(file);
-        return (FILETIME){0};
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (GetFileAttributesExA(path, GetFileExInfoStandard, &data)) {
+        out.exists = 1;
+        out.mtime = ((uint64_t)data.ftLastWriteTime.dwHighDateTime << 32) | data.ftLastWriteTime.dwLowDateTime;
+        out.size = ((uint64_t)data.nFileSizeHigh << 32) | data.nFileSizeLow;
     }
 
-    CloseHandle(file);
-
-    return last_write;
-}
-
-int jb_file_is_newer(const char *source, const char *dest) {
-    JB_ASSERT(jb_file_exists(source), "file not found: %s", source);
-
-    FILETIME s = _jb_get_last_mod_time(source);
-    FILETIME d = _jb_get_last_mod_time(dest);
-
-    return CompareFileTime(&s, &d) > 0;
+    free((char *)path);
+    return out;
 }
 
 void jb_mkdir(const char *path) {
@@ -2337,37 +10755,56 @@ char *jb_getcwd() {
     return NULL;
 }
 
-struct timespec _jb_get_last_mod_time(const char *path) {
-    if (!jb_file_exists(path))
-        return (struct timespec){0};
+_JBFileStat _jb_stat_uncached(const char *path) {
+    _JBFileStat out = {0};
 
-    // TODO maybe JB_FAIL on failure ?
     struct stat st;
-    stat(path, &st);
+    if (stat(path, &st) != 0)
+        return out;
 
 #if JB_IS_MACOS
-    return st.st_mtimespec;
+    struct timespec mtime = st.st_mtimespec;
 #else
-    return st.st_mtim;
+    struct timespec mtime = st.st_mtim;
 #endif
+
+    out.exists = 1;
+    out.mtime = (uint64_t)mtime.tv_sec * 1000000000ull + (uint64_t)mtime.tv_nsec;
+    out.size = (uint64_t)st.st_size;
+    return out;
 }
 
-int jb_file_is_newer(const char *source, const char *dest) {
+void jb_mkdir(const char *path) {
+    struct stat st;
 
-    JB_ASSERT(jb_file_exists(source), "file not found: %s", source);
+    // build folders almost always exist already
+    if (stat(path, &st) == 0 && S_ISDIR(st.st_mode))
+        return;
 
-    struct timespec s = _jb_get_last_mod_time(source);
-    struct timespec d = _jb_get_last_mod_time(dest);
+    char *copy = jb_copy_string(path);
 
-    if (s.tv_sec == d.tv_sec) {
-        return s.tv_nsec > d.tv_nsec;
-    }
+    JBVector(char *) paths = {};
 
-    return s.tv_sec > d.tv_sec;
-}
+    do {
+        JBVectorPush(&paths, copy);
+        char *newstr = jb_drop_last_path_component(copy);
+        copy = newstr;
+    } while (strrchr(copy, JB_PATH_SEPARATOR));
 
-void jb_mkdir(const char *path) {
-    JB_RUN_CMD("mkdir", "-p", path);
+    JBVectorPush(&paths, copy);
+
+    jb_log("mkdir with %zu sub directories\n", paths.count);
+
+    JBVectorForReverse(&paths) {
+        char *p = paths.data[index];
+
+        if (*p && mkdir(p, 0777) != 0)
+            JB_ASSERT(errno == EEXIST, "could not create directory %s: %s", p, strerror(errno));
+
+        free(p);
+    }
+
+    free(paths.data);
 }
 
 #endif // JB_IS_WINDOWS
@@ -2526,6 +10963,10 @@ JBToolchain *jb_find_toolchain(enum JBArch arch, enum JBVendor vendor, enum JBRu
 static JBToolchain __jb_native_toolchain;
 
 JBToolchain *jb_native_toolchain() {
+    // Filled in once; link jobs running on the job pool's threads look this up too.
+    if (__jb_native_toolchain.cc)
+        return &__jb_native_toolchain;
+
     JBToolchain tc = {0};
     tc.triple.arch = JB_DEFAULT_ARCH;
     tc.triple.vendor = JB_DEFAULT_VENDOR;
@@ -10,11 +10,14 @@ void usage() {
     printf("tool:\n");
     printf("    build                  : build build.josh file in current directory\n");
     printf("    build-file             : specify file path to josh build file to build\n");
+    printf("    daemon                 : serve `josh build` in current directory from memory until build.josh changes (Linux)\n");
+    printf("    watch <args>           : build build.josh in current directory, then rebuild whenever its sources change (Linux)\n");
     printf("    cc                     : invoke C compiler; use -target <triple> to use cross compiler\n");
     printf("    init                   : generate project template in current working directory\n");
     printf("    init-freestanding      : generate a free-standing project template that can be built without the josh command.\n");
     printf("    library                : dump josh build header library\n");
     printf("    toolchain [triple] ... : download and build a toolchain in PWD/toolchains. Specify llvm to build clang+llvm tools.\n");
+    printf("    worker [address]       : compile for builds run with --workers; address is host:port or unix:/path (default 127.0.0.1:3633)\n");
 
     printf("\noption:\n");
     printf("    -d                     : make josh_runner debuggable\n");
@@ -126,6 +129,45 @@ int main(int argc, char *argv[]) {
         return 0;
     }
 
+    if (strcmp(argv[index], "daemon") == 0) {
+        const char *name = "build.josh";
+
+        if (!jb_file_exists(name)) {
+            JB_FAIL("file not found: %s", name);
+        }
+
+        char *fullpath = jb_file_fullpath(name);
+        if (fullpath) {
+            name = fullpath; // @Leak
+        }
+
+        josh_daemon(name, "josh_builder");
+        return 0;
+    }
+
+    if (strcmp(argv[index], "watch") == 0) {
+        const char *name = "build.josh";
+
+        if (!jb_file_exists(name)) {
+            JB_FAIL("file not found: %s", name);
+        }
+
+        char *fullpath = jb_file_fullpath(name);
+        if (fullpath) {
+            name = fullpath; // @Leak
+        }
+
+        JBVector(char *) args = {0};
+
+        for (int i = index+1; i < argc; i++)
+            JBVectorPush(&args, argv[i]);
+
+        JBVectorPush(&args, NULL);
+
+        josh_watch(name, "josh_builder", args.data);
+        return 0;
+    }
+
     if (strcmp(argv[index], "build-file") == 0 && argc > 2) {
         index += 1;
         const char *name = argv[index];
@@ -197,7 +239,7 @@ int main(int argc, char *argv[]) {
         }
 
         {
-            write_file("build.sh", "mkdir -p build && gcc -o build/josh_builder -x c build.josh && ./build/josh_builder\n");
+            write_file("build.sh", "mkdir -p build && gcc -o build/josh_builder -x c build.josh -lpthread -ldl && ./build/josh_builder\n");
             write_file("build.bat", "mkdir build\ncl -o build/josh_builder /Tc build.josh || exit /b\n .\\build\\josh_builder\n");
 #if !JB_IS_WINDOWS
             JB_RUN(chmod +x build.sh);
@@ -252,6 +294,14 @@ int main(int argc, char *argv[]) {
         return TOOLCHAIN_BUILDER_MAIN(argc - 1, argv + 1);
     }
 
+    if (strcmp(argv[index], "worker") == 0) {
+        // accepts -j N to limit concurrent compiles
+        char **args = josh_parse_arguments(argc - index - 1, argv + index + 1);
+
+        jb_worker_serve(args[0] ? args[0] : "127.0.0.1:3633");
+        return 0;
+    }
+
     usage();
     return 0;
 }